@@ -37,6 +37,8 @@
 #include <sys/param.h>
 #include <stdbool.h>
 #include <dirent.h>
+#include <poll.h>
+#include <sys/socket.h>
 
 #include <nih/macros.h>
 #include <nih/alloc.h>
@@ -51,6 +53,7 @@
 #include <nih-dbus/dbus_proxy.h>
 
 #include "fs.h"
+#include "access_checks.h"
 
 extern bool setns_pid_supported, setns_user_supported;
 extern unsigned long mypidns, myuserns;
@@ -62,6 +65,14 @@ bool get_nih_io_creds(void *parent, NihIo *io, struct ucred *ucred)
 		nih_error("failed reading msg for ucred");
 		return false;
 	}
+	return get_nih_io_msg_creds(msg, ucred);
+}
+
+/*
+ * Extract the SCM credentials from an already read message.
+ */
+bool get_nih_io_msg_creds(NihIoMessage *msg, struct ucred *ucred)
+{
 	struct cmsghdr *cmsg = msg->control[0];
 	if (!cmsg) {
 		nih_error("cmsg null");
@@ -184,6 +195,140 @@ void get_scm_creds_sync(int sock, struct ucred *cred)
 	}
 }
 
+/*
+ * Send up to @nr pids as SCM_CREDENTIALS, one message per pid so that
+ * the kernel still translates each pid into the receiver's pid
+ * namespace, but with a single sendmmsg() for as many messages as the
+ * receiver's queue will take.  If the queue is full, wait up to
+ * @timeout ms for it to drain.  Each message carries the @taglen bytes
+ * at @tag as its payload.
+ *
+ * Returns the number of credentials sent, which may be less than @nr,
+ * -2 if the queue stayed full, -3 if creds[0] could not be sent because
+ * the task no longer exists, or -1 on any other error.
+ */
+int send_creds_batch(int sock, struct ucred *creds, int nr,
+		const void *tag, size_t taglen, int timeout)
+{
+	struct mmsghdr msgs[SCM_CREDS_BATCH];
+	struct iovec iov[SCM_CREDS_BATCH];
+	char cmsgbuf[SCM_CREDS_BATCH][CMSG_SPACE(sizeof(struct ucred))];
+	int i, ret;
+
+	if (nr > SCM_CREDS_BATCH)
+		nr = SCM_CREDS_BATCH;
+
+	memset(msgs, 0, nr * sizeof(struct mmsghdr));
+	for (i = 0; i < nr; i++) {
+		struct msghdr *msg = &msgs[i].msg_hdr;
+		struct cmsghdr *cmsg;
+
+		msg->msg_control = cmsgbuf[i];
+		msg->msg_controllen = sizeof(cmsgbuf[i]);
+		cmsg = CMSG_FIRSTHDR(msg);
+		cmsg->cmsg_len = CMSG_LEN(sizeof(struct ucred));
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_CREDENTIALS;
+		memcpy(CMSG_DATA(cmsg), &creds[i], sizeof(struct ucred));
+
+		iov[i].iov_base = (void *)tag;
+		iov[i].iov_len = taglen;
+		msg->msg_iov = &iov[i];
+		msg->msg_iovlen = 1;
+	}
+
+	for (;;) {
+		struct pollfd pfd = { .fd = sock, .events = POLLOUT };
+
+		ret = sendmmsg(sock, msgs, nr, MSG_DONTWAIT);
+		if (ret > 0)
+			return ret;
+		if (ret == 0 || errno == EINTR)
+			continue;
+		if (errno == ESRCH)
+			return -3;
+		if (errno != EAGAIN) {
+			nih_error("%s: failed at sendmmsg: %s", __func__,
+				  strerror(errno));
+			return -1;
+		}
+		if (timeout == 0)
+			return -2;
+		ret = poll(&pfd, 1, timeout);
+		if (ret < 0 && errno != EINTR) {
+			nih_error("%s: poll: %s", __func__, strerror(errno));
+			return -1;
+		}
+		if (ret == 0) {
+			nih_error("%s: timed out waiting for client", __func__);
+			return -2;
+		}
+	}
+}
+
+/*
+ * Batched counterpart of get_scm_creds_sync: wait up to a second for
+ * pids sent by send_creds_batch, and receive up to @nr of them with a
+ * single recvmmsg().  @sock must already have SO_PASSCRED set.  Any
+ * message which did not carry credentials is returned with pid -1.
+ * If @tags is not NULL, the 32-bit payload of each message is stored
+ * there, or -1 if the payload was of any other size.
+ *
+ * Returns the number of credentials received, or -1 on error.
+ */
+int get_scm_creds_batch_sync(int sock, struct ucred *creds, uint32_t *tags,
+		int nr)
+{
+	struct mmsghdr msgs[SCM_CREDS_BATCH];
+	struct iovec iov[SCM_CREDS_BATCH];
+	char cmsgbuf[SCM_CREDS_BATCH][CMSG_SPACE(sizeof(struct ucred))];
+	uint32_t buf[SCM_CREDS_BATCH];
+	struct timeval tv;
+	fd_set rfds;
+	int i, ret;
+
+	if (nr > SCM_CREDS_BATCH)
+		nr = SCM_CREDS_BATCH;
+
+	memset(msgs, 0, nr * sizeof(struct mmsghdr));
+	for (i = 0; i < nr; i++) {
+		iov[i].iov_base = &buf[i];
+		iov[i].iov_len = sizeof(buf[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = cmsgbuf[i];
+		msgs[i].msg_hdr.msg_controllen = sizeof(cmsgbuf[i]);
+	}
+
+	FD_ZERO(&rfds);
+	FD_SET(sock, &rfds);
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	if (select(sock+1, &rfds, NULL, NULL, &tv) <= 0)
+		return -1;
+
+	ret = recvmmsg(sock, msgs, nr, MSG_DONTWAIT, NULL);
+	if (ret < 0) {
+		nih_error("Failed to receive scm_creds: %s", strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < ret; i++) {
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+
+		creds[i].pid = -1;
+		creds[i].uid = -1;
+		creds[i].gid = -1;
+		if (tags)
+			tags[i] = msgs[i].msg_len == sizeof(uint32_t) ? buf[i] : (uint32_t)-1;
+		if (cmsg && cmsg->cmsg_len == CMSG_LEN(sizeof(struct ucred)) &&
+				cmsg->cmsg_level == SOL_SOCKET &&
+				cmsg->cmsg_type == SCM_CREDENTIALS)
+			memcpy(&creds[i], CMSG_DATA(cmsg), sizeof(struct ucred));
+	}
+	return ret;
+}
+
 int send_pid(int sock, int pid)
 {
 	struct msghdr msg = { 0 };
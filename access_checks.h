@@ -24,9 +24,17 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+/* max number of pids sent or received per sendmmsg/recvmmsg */
+#define SCM_CREDS_BATCH 64
+
 bool get_nih_io_creds(void *parent, NihIo *io, struct ucred *ucred);
+bool get_nih_io_msg_creds(NihIoMessage *msg, struct ucred *ucred);
 int send_creds(int sock, struct ucred *cred);
 void get_scm_creds_sync(int sock, struct ucred *cred);
+int send_creds_batch(int sock, struct ucred *creds, int nr,
+		const void *tag, size_t taglen, int timeout);
+int get_scm_creds_batch_sync(int sock, struct ucred *creds, uint32_t *tags,
+		int nr);
 bool is_same_pidns(int pid);
 bool is_same_userns(int pid);
 bool may_move_pid(pid_t r, uid_t r_uid, pid_t v);
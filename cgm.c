@@ -27,6 +27,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "cgmanager.h"
 #include "cgmanager-client.h"
 #include "config.h"
@@ -54,6 +57,8 @@ void usage(const char *me)
 	printf("\n");
 	printf("%s create <controller> <cgroup>\n", me);
 	printf("\n");
+	printf("%s claim <controller> <cgroup>\n", me);
+	printf("\n");
 	printf("%s chown <controller> <cgroup> uid gid\n", me);
 	printf("\n");
 	printf("%s chmod <controller> <cgroup> mode\n", me);
@@ -62,6 +67,8 @@ void usage(const char *me)
 	printf("\n");
 	printf("%s remove <controller> <cgroup> [0|1]\n", me);
 	printf("\n");
+	printf("%s removedeferred <controller> <cgroup> [0|1]\n", me);
+	printf("\n");
 	printf("%s getpidcgroup <controller> pid\n", me);
 	printf("\n");
 	printf("%s getpidcgroupabs <controller> pid\n", me);
@@ -72,16 +79,30 @@ void usage(const char *me)
 	printf("\n");
 	printf("%s getvalue <controller> <cgroup> file\n", me);
 	printf("\n");
+	printf("%s getvalues <controller> <cgroup> file [<controller> <cgroup> file ...]\n", me);
+	printf("\n");
 	printf("%s setvalue <controller> <cgroup> file value\n", me);
 	printf("\n");
+	printf("%s setvalues <controller> <cgroup> file value [<controller> <cgroup> file value ...]\n", me);
+	printf("\n");
 	printf("%s gettasks <controller> <cgroup>\n", me);
 	printf("\n");
+	printf("%s gettasksfd <controller> <cgroup>\n", me);
+	printf("\n");
 	printf("%s gettasksrecursive <controller> <cgroup>\n", me);
 	printf("\n");
 	printf("%s listchildren <controller> <cgroup>\n", me);
 	printf("\n");
 	printf("%s removeonempty <controller> <cgroup>\n", me);
 	printf("\n");
+	printf("%s waitempty <controller> <cgroup> [timeout]\n", me);
+	printf("\n");
+	printf("%s watchpopulated <controller> <cgroup>\n", me);
+	printf("\n");
+	printf("%s watch <controller> <cgroup> <key> [args]\n", me);
+	printf("\n");
+	printf("%s watchpressure <controller> <cgroup> <resource> <trigger>\n", me);
+	printf("\n");
 	printf("%s prune <controller> <cgroup>\n", me);
 	printf("\n");
 	printf("%s listcontrollers\n", me);
@@ -90,6 +111,12 @@ void usage(const char *me)
 	printf("\n");
 	printf("%s apiversion\n", me);
 	printf("\n");
+	printf("%s stats\n", me);
+	printf("\n");
+	printf("%s mirrorresync\n", me);
+	printf("\n");
+	printf("%s batch <command> <controller> <cgroup> [args] [-- <command> ...]\n", me);
+	printf("\n");
 	printf(" Replace '<controller>' with the desired controller, i.e.\n");
 	printf(" memory, and '<cgroup>' with the desired cgroup, i.e. x1.\n");
 	printf(" For create, chown, chmod, remove, prune, remove_on_empty,\n");
@@ -99,7 +126,35 @@ void usage(const char *me)
 	printf(" will perforn non-recursive deletion.  Adding '1' is supported\n");
 	printf(" for legacy reasons.\n");
 	printf("\n");
+	printf(" claim is create, but takes the cgroup from cgmanager's pool of\n");
+	printf(" spare cgroups where it can.\n");
+	printf("\n");
+	printf(" removedeferred returns at once, and cgmanager keeps trying to\n");
+	printf(" remove the cgroup while it is busy, e.g. while its exited tasks\n");
+	printf(" have yet to be reaped.\n");
+	printf("\n");
 	printf(" To refer to the current cgroup, use ''.\n");
+	printf("\n");
+	printf(" batch sends a list of create, chown, chmod, chmodfile, setvalue,\n");
+	printf(" movepid, remove, removeonempty and prune commands, separated by\n");
+	printf(" '--', in one request.  They are run in order, stopping at the\n");
+	printf(" first failure.\n");
+	printf("\n");
+	printf(" getvalues reads several files in one request, printing one\n");
+	printf(" value per line, or an empty line for each it could not read.\n");
+	printf(" setvalues writes several files in one request; a failure does\n");
+	printf(" not stop the others.\n");
+	printf("\n");
+	printf(" waitempty waits until a cgroup on the unified hierarchy is\n");
+	printf(" empty, or for timeout seconds, and exits 1 if it is not.\n");
+	printf(" watchpopulated prints a line each time it becomes empty or\n");
+	printf(" populated.\n");
+	printf("\n");
+	printf(" watch prints the value of a file each time it changes.  On\n");
+	printf(" cgroup v1, args are passed to cgroup.event_control, e.g. a\n");
+	printf(" memory.pressure_level level.\n");
+	printf(" watchpressure prints the pressure of cpu, memory or io each\n");
+	printf(" time a PSI trigger such as \"some 150000 1000000\" fires.\n");
 	exit(1);
 }
 
@@ -162,6 +217,22 @@ void do_create(const char *controller, const char *cgroup_path)
 	exit(0);
 }
 
+void do_claim(const char *controller, const char *cgroup_path)
+{
+	int32_t existed = 0;
+	if ( cgmanager_claim_sync(NULL, cgroup_manager, controller,
+				       cgroup_path, &existed) != 0) {
+		NihError *nerr;
+		nerr = nih_error_get();
+		fprintf(stderr, "call to cgmanager_claim_sync failed: %s\n", nerr->message);
+		nih_free(nerr);
+		exit(1);
+	}
+	if (existed == 1)
+		printf("Path existed\n");
+	exit(0);
+}
+
 #define CG_REMOVE_NONRECURSIVE 0
 #define CG_REMOVE_RECURSIVE 1
 void do_remove(const char *controller, const char *cgroup_path, bool recursive)
@@ -182,6 +253,26 @@ void do_remove(const char *controller, const char *cgroup_path, bool recursive)
 	exit(0);
 }
 
+void do_remove_deferred(const char *controller, const char *cgroup_path,
+		bool recursive)
+{
+	int32_t existed = 0;
+	if ( cgmanager_remove_deferred_sync(NULL, cgroup_manager, controller,
+				cgroup_path,
+				recursive ? CG_REMOVE_RECURSIVE : CG_REMOVE_NONRECURSIVE,
+				&existed) != 0) {
+		NihError *nerr;
+		nerr = nih_error_get();
+		fprintf(stderr, "call to cgmanager_remove_deferred_sync failed: %s\n",
+			nerr->message);
+		nih_free(nerr);
+		exit(1);
+	}
+	if (existed == -1)
+		printf("Path did not exist\n");
+	exit(0);
+}
+
 void do_remove_on_empty(const char *controller, const char *cgroup_path)
 {
 	if ( cgmanager_remove_on_empty_sync(NULL, cgroup_manager, controller,
@@ -336,6 +427,97 @@ void do_getvalue(const char *controller, const char *cgroup_path, const char *fi
 	exit(0);
 }
 
+void do_getvalues(int argc, const char *argv[], const char *me)
+{
+	CgmanagerGetValuesItemsElement **items;
+	int32_t *results = NULL;
+	size_t nresults = 0, j;
+	char **values = NULL;
+	bool failed = false;
+	int i, n = 0;
+
+	if (argc == 0 || argc % 3 != 0)
+		usage(me);
+
+	items = NIH_MUST( nih_alloc(NULL, (argc / 3 + 1) * sizeof(*items)) );
+	for (i = 0; i < argc; i += 3) {
+		CgmanagerGetValuesItemsElement *item;
+
+		item = items[n++] = NIH_MUST( nih_new(items, CgmanagerGetValuesItemsElement) );
+		item->item0 = (char *)argv[i];
+		item->item1 = (char *)argv[i + 1];
+		item->item2 = (char *)argv[i + 2];
+	}
+	items[n] = NULL;
+
+	if (cgmanager_get_values_sync(NULL, cgroup_manager, items, &results,
+				&nresults, &values) != 0) {
+		NihError *nerr;
+		nerr = nih_error_get();
+		fprintf(stderr, "call to cgmanager_get_values_sync failed: %s\n", nerr->message);
+		nih_free(nerr);
+		exit(1);
+	}
+
+	for (j = 0; j < nresults && values[j]; j++) {
+		if (results[j] == 0) {
+			fprintf(stderr, "failed to read %s:%s %s\n",
+				items[j]->item0, items[j]->item1, items[j]->item2);
+			failed = true;
+		}
+		printf("%s\n", values[j]);
+	}
+	nih_free(results);
+	nih_free(values);
+	nih_free(items);
+	exit(failed ? 1 : 0);
+}
+
+void do_setvalues(int argc, const char *argv[], const char *me)
+{
+	CgmanagerSetValuesEntriesElement **entries;
+	int32_t *results = NULL;
+	size_t nresults = 0, j;
+	bool failed = false;
+	int i, n = 0;
+
+	if (argc == 0 || argc % 4 != 0)
+		usage(me);
+
+	entries = NIH_MUST( nih_alloc(NULL, (argc / 4 + 1) * sizeof(*entries)) );
+	for (i = 0; i < argc; i += 4) {
+		CgmanagerSetValuesEntriesElement *entry;
+
+		entry = entries[n++] = NIH_MUST( nih_new(entries, CgmanagerSetValuesEntriesElement) );
+		entry->item0 = (char *)argv[i];
+		entry->item1 = (char *)argv[i + 1];
+		entry->item2 = (char *)argv[i + 2];
+		entry->item3 = (char *)argv[i + 3];
+	}
+	entries[n] = NULL;
+
+	if (cgmanager_set_values_sync(NULL, cgroup_manager, entries, &results,
+				&nresults) != 0) {
+		NihError *nerr;
+		nerr = nih_error_get();
+		fprintf(stderr, "call to cgmanager_set_values_sync failed: %s\n", nerr->message);
+		nih_free(nerr);
+		exit(1);
+	}
+
+	for (j = 0; j < nresults; j++) {
+		if (results[j] == 0) {
+			fprintf(stderr, "failed to set %s:%s %s\n",
+				entries[j]->item0, entries[j]->item1,
+				entries[j]->item2);
+			failed = true;
+		}
+	}
+	nih_free(results);
+	nih_free(entries);
+	exit(failed ? 1 : 0);
+}
+
 void do_setvalue(const char *controller, const char *cgroup_path, const char *file,
 		const char *value)
 {
@@ -374,6 +556,40 @@ void do_gettasks(const char *controller, const char *cgroup_path)
 	exit(0);
 }
 
+void do_gettasksfd(const char *controller, const char *cgroup_path)
+{
+	struct stat sb;
+	int32_t *pids;
+	size_t i, n;
+	int fd = -1;
+
+	if (cgmanager_get_tasks_fd_sync(NULL, cgroup_manager, controller,
+				     cgroup_path, &fd) != 0) {
+		NihError *nerr;
+		nerr = nih_error_get();
+		fprintf(stderr, "call to cgmanager_get_tasks_fd_sync failed: %s\n", nerr->message);
+		nih_free(nerr);
+		exit(1);
+	}
+	if (fstat(fd, &sb) < 0) {
+		perror("fstat");
+		exit(1);
+	}
+	n = sb.st_size / sizeof(int32_t);
+	if (n) {
+		pids = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (pids == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+		for (i = 0;  i < n;  i++)
+			printf("%d\n", pids[i]);
+		munmap(pids, sb.st_size);
+	}
+	close(fd);
+	exit(0);
+}
+
 void do_gettasks_recursive(const char *controller, const char *cgroup_path)
 {
 	int32_t *pids = NULL;
@@ -489,6 +705,270 @@ void do_apiversion(void)
 	exit(0);
 }
 
+void do_mirrorresync(void)
+{
+	int32_t differences;
+
+	if (cgmanager_mirror_resync_sync(NULL, cgroup_manager, &differences) != 0) {
+		NihError *nerr;
+		nerr = nih_error_get();
+		fprintf(stderr, "call to cgmanager_mirror_resync_sync failed: %s\n", nerr->message);
+		nih_free(nerr);
+		exit(1);
+	}
+	printf("%d\n", differences);
+	exit(0);
+}
+
+void do_waitempty(const char *controller, const char *cgroup_path,
+		int32_t timeout)
+{
+	int32_t empty = 0;
+
+	if (cgmanager_wait_empty_sync(NULL, cgroup_manager, controller,
+				cgroup_path, timeout, &empty) != 0) {
+		NihError *nerr;
+		nerr = nih_error_get();
+		fprintf(stderr, "call to cgmanager_wait_empty_sync failed: %s\n", nerr->message);
+		nih_free(nerr);
+		exit(1);
+	}
+	exit(empty ? 0 : 1);
+}
+
+static DBusHandlerResult populated_filter(DBusConnection *connection,
+		DBusMessage *message, void *data)
+{
+	const char *controller, *cgroup;
+	int32_t populated;
+
+	if (!dbus_message_is_signal(message, "org.linuxcontainers.cgmanager0_0",
+				"PopulatedChanged"))
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	if (dbus_message_get_args(message, NULL,
+				DBUS_TYPE_STRING, &controller,
+				DBUS_TYPE_STRING, &cgroup,
+				DBUS_TYPE_INT32, &populated,
+				DBUS_TYPE_INVALID)) {
+		printf("%s %s %s\n", controller, cgroup,
+			populated ? "populated" : "empty");
+		fflush(stdout);
+	}
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+void do_watchpopulated(const char *controller, const char *cgroup_path)
+{
+	DBusConnection *connection = cgroup_manager->connection;
+	int32_t populated;
+
+	dbus_connection_add_filter(connection, populated_filter, NULL, NULL);
+	if (cgmanager_subscribe_populated_sync(NULL, cgroup_manager, controller,
+				cgroup_path, &populated) != 0) {
+		NihError *nerr;
+		nerr = nih_error_get();
+		fprintf(stderr, "call to cgmanager_subscribe_populated_sync failed: %s\n", nerr->message);
+		nih_free(nerr);
+		exit(1);
+	}
+	printf("%s %s %s\n", controller, cgroup_path,
+		populated ? "populated" : "empty");
+	fflush(stdout);
+
+	while (dbus_connection_read_write_dispatch(connection, -1))
+		;
+	exit(0);
+}
+
+/* prints KeyChanged, or PressureChanged, which has the same arguments */
+static DBusHandlerResult key_filter(DBusConnection *connection,
+		DBusMessage *message, void *data)
+{
+	const char *signal = data;
+	const char *controller, *cgroup, *key, *args, *value;
+	size_t len;
+
+	if (!dbus_message_is_signal(message, "org.linuxcontainers.cgmanager0_0",
+				signal))
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	if (dbus_message_get_args(message, NULL,
+				DBUS_TYPE_STRING, &controller,
+				DBUS_TYPE_STRING, &cgroup,
+				DBUS_TYPE_STRING, &key,
+				DBUS_TYPE_STRING, &args,
+				DBUS_TYPE_STRING, &value,
+				DBUS_TYPE_INVALID)) {
+		len = strlen(value);
+		printf("%s %s %s%s%s:\n%s%s", controller, cgroup, key,
+			*args ? " " : "", args, value,
+			len && value[len-1] == '\n' ? "" : "\n");
+		fflush(stdout);
+	}
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+void do_watch(const char *controller, const char *cgroup_path,
+		const char *key, const char *args)
+{
+	DBusConnection *connection = cgroup_manager->connection;
+
+	dbus_connection_add_filter(connection, key_filter, (void *)"KeyChanged",
+			NULL);
+	if (cgmanager_watch_sync(NULL, cgroup_manager, controller,
+				cgroup_path, key, args) != 0) {
+		NihError *nerr;
+		nerr = nih_error_get();
+		fprintf(stderr, "call to cgmanager_watch_sync failed: %s\n", nerr->message);
+		nih_free(nerr);
+		exit(1);
+	}
+
+	while (dbus_connection_read_write_dispatch(connection, -1))
+		;
+	exit(0);
+}
+
+void do_watchpressure(const char *controller, const char *cgroup_path,
+		const char *resource, const char *trigger)
+{
+	DBusConnection *connection = cgroup_manager->connection;
+
+	dbus_connection_add_filter(connection, key_filter,
+			(void *)"PressureChanged", NULL);
+	if (cgmanager_watch_pressure_sync(NULL, cgroup_manager, controller,
+				cgroup_path, resource, trigger) != 0) {
+		NihError *nerr;
+		nerr = nih_error_get();
+		fprintf(stderr, "call to cgmanager_watch_pressure_sync failed: %s\n", nerr->message);
+		nih_free(nerr);
+		exit(1);
+	}
+
+	while (dbus_connection_read_write_dispatch(connection, -1))
+		;
+	exit(0);
+}
+
+void do_stats(void)
+{
+	char **stats = NULL;
+	int i = 0;
+
+	if (cgmanager_get_stats_sync(NULL, cgroup_manager, &stats) != 0) {
+		NihError *nerr;
+		nerr = nih_error_get();
+		fprintf(stderr, "call to cgmanager_get_stats_sync failed: %s\n", nerr->message);
+		nih_free(nerr);
+		exit(1);
+	}
+
+	while (stats[i]) {
+		printf("%s\n", stats[i++]);
+	}
+	nih_free(stats);
+	exit(0);
+}
+
+/*
+ * The commands which may be batched, and the least and most arguments
+ * each takes after <controller> <cgroup>.
+ */
+static const struct {
+	const char *cmd;
+	const char *op;
+	int min_args, max_args;
+} batch_cmds[] = {
+	{ "create", "Create", 0, 0 },
+	{ "chown", "Chown", 2, 2 },
+	{ "chmod", "Chmod", 1, 1 },
+	{ "chmodfile", "Chmod", 2, 2 },
+	{ "setvalue", "SetValue", 2, 2 },
+	{ "movepid", "MovePid", 1, 1 },
+	{ "remove", "Remove", 0, 1 },
+	{ "removeonempty", "RemoveOnEmpty", 0, 0 },
+	{ "prune", "Prune", 0, 0 },
+};
+#define NR_BATCH_CMDS (sizeof(batch_cmds) / sizeof(batch_cmds[0]))
+
+void do_batch(int argc, const char *argv[], const char *me)
+{
+	CgmanagerBatchOpsElement **ops;
+	int32_t *results = NULL;
+	size_t nresults = 0, j, k;
+	int i, n = 0, nops = 1;
+	bool failed = false;
+
+	for (i = 0; i < argc; i++)
+		if (strcmp(argv[i], "--") == 0)
+			nops++;
+	ops = NIH_MUST( nih_alloc(NULL, (nops + 1) * sizeof(*ops)) );
+
+	i = 0;
+	while (i < argc) {
+		CgmanagerBatchOpsElement *op;
+		int nargs;
+
+		for (nargs = 0; i + nargs < argc && strcmp(argv[i + nargs], "--") != 0; nargs++)
+			;
+		for (k = 0; k < NR_BATCH_CMDS; k++)
+			if (strcmp(argv[i], batch_cmds[k].cmd) == 0)
+				break;
+		if (k == NR_BATCH_CMDS || nargs - 3 < batch_cmds[k].min_args ||
+				nargs - 3 > batch_cmds[k].max_args)
+			usage(me);
+
+		op = ops[n++] = NIH_MUST( nih_new(ops, CgmanagerBatchOpsElement) );
+		memset(op, 0, sizeof(*op));
+		op->item0 = (char *)batch_cmds[k].op;
+		op->item1 = (char *)argv[i + 1];
+		op->item2 = (char *)argv[i + 2];
+		op->item3 = "";
+		op->item4 = "";
+		if (strcmp(argv[i], "chown") == 0) {
+			op->item5 = strtol(argv[i + 3], NULL, 10);
+			op->item6 = strtol(argv[i + 4], NULL, 10);
+		} else if (strcmp(argv[i], "chmod") == 0) {
+			op->item5 = strtol(argv[i + 3], NULL, 8);
+		} else if (strcmp(argv[i], "chmodfile") == 0) {
+			op->item3 = (char *)argv[i + 3];
+			op->item5 = strtol(argv[i + 4], NULL, 8);
+		} else if (strcmp(argv[i], "setvalue") == 0) {
+			op->item3 = (char *)argv[i + 3];
+			op->item4 = (char *)argv[i + 4];
+		} else if (strcmp(argv[i], "movepid") == 0) {
+			op->item5 = atoi(argv[i + 3]);
+		} else if (strcmp(argv[i], "remove") == 0) {
+			op->item5 = !(nargs == 4 && strcmp(argv[i + 3], "0") == 0);
+		}
+		i += nargs + 1;
+	}
+	ops[n] = NULL;
+	if (n == 0)
+		usage(me);
+
+	if (cgmanager_batch_sync(NULL, cgroup_manager, ops, &results,
+				&nresults) != 0) {
+		NihError *nerr;
+		nerr = nih_error_get();
+		fprintf(stderr, "call to cgmanager_batch_sync failed: %s\n", nerr->message);
+		nih_free(nerr);
+		exit(1);
+	}
+
+	for (j = 0; j < nresults; j++) {
+		if (results[j] == 0) {
+			fprintf(stderr, "operation %zu (%s) failed\n", j + 1,
+				ops[j]->item0);
+			failed = true;
+		} else if (results[j] == -1)
+			fprintf(stderr, "operation %zu (%s) not run\n", j + 1,
+				ops[j]->item0);
+	}
+	nih_free(results);
+	nih_free(ops);
+	exit(failed ? 1 : 0);
+}
+
 void print_version(void)
 {
 	printf("%s", VERSION);
@@ -524,6 +1004,10 @@ int main(int argc, const char *argv[])
 		if (argc != 4)
 			usage(me);
 		do_create(argv[2], argv[3]);
+	} else if (strcmp(argv[1], "claim") == 0) {
+		if (argc != 4)
+			usage(me);
+		do_claim(argv[2], argv[3]);
 	} else if (strcmp(argv[1], "chown") == 0) { 
 		if (argc != 6)
 			usage(me);
@@ -543,6 +1027,13 @@ int main(int argc, const char *argv[])
 		if (argc == 5 && strcmp(argv[4], "0") == 0)
 			recursive = false;
 		do_remove(argv[2], argv[3], recursive);
+	} else if (strcmp(argv[1], "removedeferred") == 0) {
+		bool recursive = true;
+		if (argc != 4 && argc != 5)
+			usage(me);
+		if (argc == 5 && strcmp(argv[4], "0") == 0)
+			recursive = false;
+		do_remove_deferred(argv[2], argv[3], recursive);
 	} else if (strcmp(argv[1], "removeonempty") == 0) { 
 		if (argc != 4)
 			usage(me);
@@ -567,14 +1058,22 @@ int main(int argc, const char *argv[])
 		if (argc != 5)
 			usage(me);
 		do_getvalue(argv[2], argv[3], argv[4]);
+	} else if (strcmp(argv[1], "getvalues") == 0) { 
+		do_getvalues(argc - 2, argv + 2, me);
 	} else if (strcmp(argv[1], "setvalue") == 0) { 
 		if (argc != 6)
 			usage(me);
 		do_setvalue(argv[2], argv[3], argv[4], argv[5]);
+	} else if (strcmp(argv[1], "setvalues") == 0) { 
+		do_setvalues(argc - 2, argv + 2, me);
 	} else if (strcmp(argv[1], "gettasksrecursive") == 0) { 
 		if (argc != 3 && argc != 4)
 			usage(me);
 		do_gettasks_recursive(argv[2], argc == 3 ? "" : argv[3]);
+	} else if (strcmp(argv[1], "gettasksfd") == 0) { 
+		if (argc != 3 && argc != 4)
+			usage(me);
+		do_gettasksfd(argv[2], argc == 3 ? "" : argv[3]);
 	} else if (strcmp(argv[1], "gettasks") == 0) { 
 		if (argc != 3 && argc != 4)
 			usage(me);
@@ -583,6 +1082,22 @@ int main(int argc, const char *argv[])
 		if (argc != 3 && argc != 4)
 			usage(me);
 		do_listchildren(argv[2], argc == 3 ? "" : argv[3]);
+	} else if (strcmp(argv[1], "waitempty") == 0) { 
+		if (argc != 4 && argc != 5)
+			usage(me);
+		do_waitempty(argv[2], argv[3], argc == 5 ? atoi(argv[4]) : -1);
+	} else if (strcmp(argv[1], "watchpopulated") == 0) { 
+		if (argc != 4)
+			usage(me);
+		do_watchpopulated(argv[2], argv[3]);
+	} else if (strcmp(argv[1], "watch") == 0) { 
+		if (argc != 5 && argc != 6)
+			usage(me);
+		do_watch(argv[2], argv[3], argv[4], argc == 6 ? argv[5] : "");
+	} else if (strcmp(argv[1], "watchpressure") == 0) { 
+		if (argc != 6)
+			usage(me);
+		do_watchpressure(argv[2], argv[3], argv[4], argv[5]);
 	} else if (strcmp(argv[1], "prune") == 0) { 
 		if (argc != 3 && argc != 4)
 			usage(me);
@@ -595,6 +1110,14 @@ int main(int argc, const char *argv[])
 		do_listkeys(argv[2], argc == 3 ? "" : argv[3]);
 	} else if (strcmp(argv[1], "apiversion") == 0) { 
 		do_apiversion();
+	} else if (strcmp(argv[1], "mirrorresync") == 0) {
+		do_mirrorresync();
+	} else if (strcmp(argv[1], "stats") == 0) { 
+		do_stats();
+	} else if (strcmp(argv[1], "batch") == 0) { 
+		if (argc < 3)
+			usage(me);
+		do_batch(argc - 2, argv + 2, me);
 	} else {
 		printf("Unknown command: %s\n", argv[1]);
 		usage(me);
@@ -18,6 +18,9 @@
  */
 
 #include <frontend.h>
+#include <nih/list.h>
+#include <nih/timer.h>
+#include <sys/ioctl.h>
 
 DBusConnection *server_conn;
 
@@ -62,6 +65,8 @@ static int proxyrecv(int sockfd, void *buf, size_t len)
 }
 
 static void cgm_dbus_disconnected(DBusConnection *connection);
+bool send_dummy_msg(DBusConnection *conn);
+static void open_proxy_channel(void);
 
 int setup_proxy(void)
 {
@@ -148,8 +153,11 @@ static void cgm_dbus_disconnected(DBusConnection *connection)
 	dbus_connection_unref(connection);
 	while (1) {
 		server_conn = nih_dbus_connect(CGPROXY_DBUS_PATH, cgm_dbus_disconnected);
-		if (server_conn)
+		if (server_conn) {
+			if (send_dummy_msg(server_conn))
+				open_proxy_channel();
 			return;
+		}
 		err = nih_error_get();
 		nih_error("Failed to re-open connection to %s: %s",
 				CGPROXY_DBUS_PATH, err->message);
@@ -259,44 +267,109 @@ static bool complete_dbus_request(DBusMessage *message,
 	return true;
 }
 
-int get_pid_cgroup_main (void *parent, char *controller,
-		struct ucred p, struct ucred r, struct ucred v, char **output)
+/*
+ * A request forwarded synchronously by one of the *_main functions
+ * below, over a new socketpair with the request's *Scm method.  These
+ * are only used when cgmanager has no proxy channel (see
+ * proxy_forward()).  Callers fill in the request; unused strings are
+ * left NULL.
+ */
+struct proxy_req {
+	const char *method;
+	enum req_type type;
+	const char *controller;
+	const char *cgroup;
+	const char *key;
+	const char *value;
+	const char *file;
+	int32_t recursive;
+	int32_t mode;
+
+	int sv[2];
+};
+
+/*
+ * Forward @req to cgmanager with requestor credential @rcred and, for
+ * requests which need one, victim credential @vcred.
+ */
+static bool send_request(struct proxy_req *req, struct ucred *rcred,
+		struct ucred *vcred)
 {
 	DBusMessage *message;
 	DBusMessageIter iter;
-	int sv[2], ret = -1;
-	char s[MAXPATHLEN] = { 0 };
-
-	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
-		nih_error("%s: proxy != requestor", __func__);
-		return -1;
-	}
+	const char *strs[] = { req->controller, req->cgroup, req->file,
+		req->key, req->value };
+	int i;
 
-	if (!(message = start_dbus_request("GetPidCgroupScm", sv))) {
+	if (!(message = start_dbus_request(req->method, req->sv))) {
 		nih_error("%s: error starting dbus request", __func__);
-		return -1;
+		req->sv[0] = req->sv[1] = -1;
+		return false;
 	}
 
 	dbus_message_iter_init_append(message, &iter);
-	if (!dbus_message_iter_append_basic (&iter,
-			DBUS_TYPE_STRING,
-			&controller)) {
-		dbus_message_unref(message);
-		nih_error("%s: out of memory", __func__);
-		goto out;
+	for (i = 0; i < 5; i++) {
+		if (!strs[i])
+			continue;
+		if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &strs[i]))
+			goto oom;
+	}
+	if (req->type == REQ_TYPE_CHMOD &&
+			! dbus_message_iter_append_basic (&iter, DBUS_TYPE_INT32, &req->mode))
+		goto oom;
+	if (req->type == REQ_TYPE_REMOVE &&
+			! dbus_message_iter_append_basic (&iter, DBUS_TYPE_INT32, &req->recursive))
+		goto oom;
+	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &req->sv[1]))
+		goto oom;
+
+	if (!complete_dbus_request(message, req->sv, rcred, vcred)) {
+		nih_error("%s: error completing dbus request", __func__);
+		return false;
 	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1])) {
-		dbus_message_unref(message);
-		nih_error("%s: out of memory", __func__);
-		goto out;
+	return true;
+
+oom:
+	nih_error("%s: out of memory", __func__);
+	dbus_message_unref(message);
+	return false;
+}
+
+static int recv_reply(struct proxy_req *req, void *buf, size_t len)
+{
+	return proxyrecv(req->sv[0], buf, len);
+}
+
+static void end_request(struct proxy_req *req)
+{
+	if (req->sv[0] == -1)
+		return;
+	close(req->sv[0]);
+	close(req->sv[1]);
+}
+
+int get_pid_cgroup_main (void *parent, char *controller,
+		struct ucred p, struct ucred r, struct ucred v, char **output)
+{
+	struct proxy_req req = {
+		.method = "GetPidCgroupScm",
+		.type = REQ_TYPE_GET_PID,
+		.controller = controller,
+	};
+	int ret = -1;
+	char s[MAXPATHLEN] = { 0 };
+
+	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
+		nih_error("%s: proxy != requestor", __func__);
+		return -1;
 	}
 
-	if (!complete_dbus_request(message, sv, &r, &v)) {
-		nih_error("%s: error completing dbus request", __func__);
+	if (!send_request(&req, &r, &v)) {
+		nih_error("%s: error sending request", __func__);
 		goto out;
 	}
 
-	if (proxyrecv(sv[0], s, MAXPATHLEN-1) <= 0)
+	if (recv_reply(&req, s, MAXPATHLEN-1) <= 0)
 		nih_error("%s: Error reading result from cgmanager",
 			__func__);
 	else {
@@ -304,17 +377,19 @@ int get_pid_cgroup_main (void *parent, char *controller,
 		ret = 0;
 	}
 out:
-	close(sv[0]);
-	close(sv[1]);
+	end_request(&req);
 	return ret;
 }
 
 int get_pid_cgroup_abs_main (void *parent, char *controller,
 		struct ucred p, struct ucred r, struct ucred v, char **output)
 {
-	DBusMessage *message;
-	DBusMessageIter iter;
-	int sv[2], ret = -1;
+	struct proxy_req req = {
+		.method = "GetPidCgroupAbsScm",
+		.type = REQ_TYPE_GET_PID_ABS,
+		.controller = controller,
+	};
+	int ret = -1;
 	char s[MAXPATHLEN] = { 0 };
 
 	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
@@ -322,31 +397,12 @@ int get_pid_cgroup_abs_main (void *parent, char *controller,
 		return -1;
 	}
 
-	if (!(message = start_dbus_request("GetPidCgroupAbsScm", sv))) {
-		nih_error("%s: error starting dbus request", __func__);
-		return -1;
-	}
-
-	dbus_message_iter_init_append(message, &iter);
-	if (!dbus_message_iter_append_basic (&iter,
-			DBUS_TYPE_STRING,
-			&controller)) {
-		dbus_message_unref(message);
-		nih_error("%s: out of memory", __func__);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1])) {
-		dbus_message_unref(message);
-		nih_error("%s: out of memory", __func__);
-		goto out;
-	}
-
-	if (!complete_dbus_request(message, sv, &r, &v)) {
-		nih_error("%s: error completing dbus request", __func__);
+	if (!send_request(&req, &r, &v)) {
+		nih_error("%s: error sending request", __func__);
 		goto out;
 	}
 
-	if (proxyrecv(sv[0], s, MAXPATHLEN-1) <= 0)
+	if (recv_reply(&req, s, MAXPATHLEN-1) <= 0)
 		nih_error("%s: Error reading result from cgmanager",
 			__func__);
 	else {
@@ -354,18 +410,21 @@ int get_pid_cgroup_abs_main (void *parent, char *controller,
 		ret = 0;
 	}
 out:
-	close(sv[0]);
-	close(sv[1]);
+	end_request(&req);
 	return ret;
 }
 
 int do_move_pid_main (const char *controller, const char *cgroup,
 		struct ucred p, struct ucred r, struct ucred v,
-		const char *cmd)
+		const char *cmd, enum req_type type)
 {
-	DBusMessage *message;
-	DBusMessageIter iter;
-	int sv[2], ret = -1;
+	struct proxy_req req = {
+		.method = cmd,
+		.type = type,
+		.controller = controller,
+		.cgroup = cgroup,
+	};
+	int ret = -1;
 	char buf[1];
 
 	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
@@ -378,39 +437,15 @@ int do_move_pid_main (const char *controller, const char *cgroup,
 		return -1;
 	}
 
-	if (!(message = start_dbus_request(cmd, sv))) {
-		nih_error("%s: error starting dbus request", __func__);
-		return -1;
-	}
-
-	dbus_message_iter_init_append(message, &iter);
-	if (!dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING,
-				&controller)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &cgroup)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1])) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-
-	if (!complete_dbus_request(message, sv, &r, &v)) {
-		nih_error("%s: error completing dbus request", __func__);
+	if (!send_request(&req, &r, &v)) {
+		nih_error("%s: error sending request", __func__);
 		goto out;
 	}
 
-	if (proxyrecv(sv[0], buf, 1) == 1 && *buf == '1')
+	if (recv_reply(&req, buf, 1) == 1 && *buf == '1')
 		ret = 0;
 out:
-	close(sv[0]);
-	close(sv[1]);
+	end_request(&req);
 	return ret;
 }
 
@@ -426,7 +461,8 @@ int move_pid_main (const char *controller, const char *cgroup,
 		return -1;
 	}
 
-	return do_move_pid_main(controller, cgroup, p, r, v, "MovePidScm");
+	return do_move_pid_main(controller, cgroup, p, r, v, "MovePidScm",
+			REQ_TYPE_MOVE_PID);
 }
 
 int move_pid_abs_main (const char *controller, const char *cgroup,
@@ -451,15 +487,20 @@ int move_pid_abs_main (const char *controller, const char *cgroup,
 		nih_error("%s: unsafe cgroup", __func__);
 		return -1;
 	}
-	return do_move_pid_main(controller, cgroup, p, r, v, "MovePidAbsScm");
+	return do_move_pid_main(controller, cgroup, p, r, v, "MovePidAbsScm",
+			REQ_TYPE_MOVE_PID_ABS);
 }
 
 int create_main (const char *controller, const char *cgroup, struct ucred p,
 		struct ucred r, int32_t *existed)
 {
-	DBusMessage *message;
-	DBusMessageIter iter;
-	int sv[2], ret = -1;
+	struct proxy_req req = {
+		.method = "CreateScm",
+		.type = REQ_TYPE_CREATE,
+		.controller = controller,
+		.cgroup = cgroup,
+	};
+	int ret = -1;
 	char buf[1];
 
 	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
@@ -472,48 +513,29 @@ int create_main (const char *controller, const char *cgroup, struct ucred p,
 		return -1;
 	}
 
-	if (!(message = start_dbus_request("CreateScm", sv))) {
-		nih_error("%s: error starting dbus request", __func__);
-		return -1;
-	}
-
-	dbus_message_iter_init_append(message, &iter);
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &controller)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &cgroup)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1])) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-
-	if (!complete_dbus_request(message, sv, &r, NULL)) {
-		nih_error("%s: error completing dbus request", __func__);
+	if (!send_request(&req, &r, NULL)) {
+		nih_error("%s: error sending request", __func__);
 		goto out;
 	}
 
-	if (proxyrecv(sv[0], buf, 1) == 1 && (*buf == '1' || *buf == '2'))
+	if (recv_reply(&req, buf, 1) == 1 && (*buf == '1' || *buf == '2'))
 		ret = 0;
 	*existed = *buf == '2' ? 1 : -1;
 out:
-	close(sv[0]);
-	close(sv[1]);
+	end_request(&req);
 	return ret;
 }
 
 int chown_main (const char *controller, const char *cgroup,
 		struct ucred p, struct ucred r, struct ucred v)
 {
-	DBusMessage *message;
-	DBusMessageIter iter;
-	int sv[2], ret = -1;
+	struct proxy_req req = {
+		.method = "ChownScm",
+		.type = REQ_TYPE_CHOWN,
+		.controller = controller,
+		.cgroup = cgroup,
+	};
+	int ret = -1;
 	char buf[1];
 
 	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
@@ -526,47 +548,30 @@ int chown_main (const char *controller, const char *cgroup,
 		return -1;
 	}
 
-	if (!(message = start_dbus_request("ChownScm", sv))) {
-		nih_error("%s: error starting dbus request", __func__);
-		return -1;
-	}
-
-	dbus_message_iter_init_append(message, &iter);
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &controller)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &cgroup)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1])) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-
-	if (!complete_dbus_request(message, sv, &r, &v)) {
-		nih_error("%s: error completing dbus request", __func__);
+	if (!send_request(&req, &r, &v)) {
+		nih_error("%s: error sending request", __func__);
 		goto out;
 	}
 
-	if (proxyrecv(sv[0], buf, 1) == 1 && *buf == '1')
+	if (recv_reply(&req, buf, 1) == 1 && *buf == '1')
 		ret = 0;
 out:
-	close(sv[0]);
-	close(sv[1]);
+	end_request(&req);
 	return ret;
 }
 
 int chmod_main (const char *controller, const char *cgroup, const char *file,
 		struct ucred p, struct ucred r, int mode)
 {
-	DBusMessage *message;
-	DBusMessageIter iter;
-	int sv[2], ret = -1;
+	struct proxy_req req = {
+		.method = "ChmodScm",
+		.type = REQ_TYPE_CHMOD,
+		.controller = controller,
+		.cgroup = cgroup,
+		.file = file,
+		.mode = mode,
+	};
+	int ret = -1;
 	char buf[1];
 
 	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
@@ -579,57 +584,29 @@ int chmod_main (const char *controller, const char *cgroup, const char *file,
 		return -1;
 	}
 
-	if (!(message = start_dbus_request("ChmodScm", sv))) {
-		nih_error("%s: error starting dbus request", __func__);
-		return -1;
-	}
-
-	dbus_message_iter_init_append(message, &iter);
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &controller)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &cgroup)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &file)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_INT32, &mode)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1])) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-
-	if (!complete_dbus_request(message, sv, &r, NULL)) {
-		nih_error("%s: error completing dbus request", __func__);
+	if (!send_request(&req, &r, NULL)) {
+		nih_error("%s: error sending request", __func__);
 		goto out;
 	}
 
-	if (proxyrecv(sv[0], buf, 1) == 1 && *buf == '1')
+	if (recv_reply(&req, buf, 1) == 1 && *buf == '1')
 		ret = 0;
 out:
-	close(sv[0]);
-	close(sv[1]);
+	end_request(&req);
 	return ret;
 }
 
 int get_value_main (void *parent, char *controller, const char *cgroup,
 		 const char *key, struct ucred p, struct ucred r, char **value)
 {
-	DBusMessage *message;
-	DBusMessageIter iter;
-	int sv[2], ret = -1;
+	struct proxy_req req = {
+		.method = "GetValueScm",
+		.type = REQ_TYPE_GET_VALUE,
+		.controller = controller,
+		.cgroup = cgroup,
+		.key = key,
+	};
+	int ret = -1;
 	char output[MAXPATHLEN] = { 0 };
 
 	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
@@ -642,39 +619,12 @@ int get_value_main (void *parent, char *controller, const char *cgroup,
 		return -1;
 	}
 
-	if (!(message = start_dbus_request("GetValueScm", sv))) {
-		nih_error("%s: error starting dbus request", __func__);
-		return -1;
-	}
-
-	dbus_message_iter_init_append(message, &iter);
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &controller)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &cgroup)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &key)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1])) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-
-	if (!complete_dbus_request(message, sv, &r, NULL)) {
-		nih_error("%s: error completing dbus request", __func__);
+	if (!send_request(&req, &r, NULL)) {
+		nih_error("%s: error sending request", __func__);
 		goto out;
 	}
 
-	if (proxyrecv(sv[0], output, MAXPATHLEN) <= 0) {
+	if (recv_reply(&req, output, MAXPATHLEN) <= 0) {
 		nih_error("%s: Failed reading string from cgmanager: %s",
 			__func__, strerror(errno));
 	} else {
@@ -682,8 +632,7 @@ int get_value_main (void *parent, char *controller, const char *cgroup,
 		ret = 0;
 	}
 out:
-	close(sv[0]);
-	close(sv[1]);
+	end_request(&req);
 	return ret;
 }
 
@@ -691,9 +640,15 @@ int set_value_main (char *controller, const char *cgroup,
 		 const char *key, const char *value, struct ucred p,
 		 struct ucred r)
 {
-	DBusMessage *message;
-	DBusMessageIter iter;
-	int sv[2], ret = -1;
+	struct proxy_req req = {
+		.method = "SetValueScm",
+		.type = REQ_TYPE_SET_VALUE,
+		.controller = controller,
+		.cgroup = cgroup,
+		.key = key,
+		.value = value,
+	};
+	int ret = -1;
 	char buf[1];
 
 	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
@@ -706,57 +661,29 @@ int set_value_main (char *controller, const char *cgroup,
 		return -1;
 	}
 
-	if (!(message = start_dbus_request("SetValueScm", sv))) {
-		nih_error("%s: error starting dbus request", __func__);
-		return -1;
-	}
-
-	dbus_message_iter_init_append(message, &iter);
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &controller)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &cgroup)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &key)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &value)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1])) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-
-	if (!complete_dbus_request(message, sv, &r, NULL)) {
-		nih_error("%s: error completing dbus request", __func__);
+	if (!send_request(&req, &r, NULL)) {
+		nih_error("%s: error sending request", __func__);
 		goto out;
 	}
 
-	if (proxyrecv(sv[0], buf, 1) == 1 && *buf == '1')
+	if (recv_reply(&req, buf, 1) == 1 && *buf == '1')
 		ret = 0;
 out:
-	close(sv[0]);
-	close(sv[1]);
+	end_request(&req);
 	return ret;
 }
 
 int remove_main (const char *controller, const char *cgroup, struct ucred p,
 		struct ucred r, int recursive, int32_t *existed)
 {
-	DBusMessage *message;
-	DBusMessageIter iter;
-	int sv[2], ret = -1;
+	struct proxy_req req = {
+		.method = "RemoveScm",
+		.type = REQ_TYPE_REMOVE,
+		.controller = controller,
+		.cgroup = cgroup,
+		.recursive = recursive,
+	};
+	int ret = -1;
 	char buf[1];
 
 	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
@@ -769,56 +696,55 @@ int remove_main (const char *controller, const char *cgroup, struct ucred p,
 		return -1;
 	}
 
-	if (!(message = start_dbus_request("RemoveScm", sv))) {
-		nih_error("%s: error starting dbus request", __func__);
-		return -1;
-	}
-
-	dbus_message_iter_init_append(message, &iter);
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &controller)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &cgroup)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_INT32, &recursive)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1])) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-
-	if (!complete_dbus_request(message, sv, &r, NULL)) {
-		nih_error("%s: error completing dbus request", __func__);
+	if (!send_request(&req, &r, NULL)) {
+		nih_error("%s: error sending request", __func__);
 		goto out;
 	}
 
-	if (proxyrecv(sv[0], buf, 1) == 1 && (*buf == '1' || *buf == '2'))
+	if (recv_reply(&req, buf, 1) == 1 && (*buf == '1' || *buf == '2'))
 		ret = 0;
 	*existed = *buf == '2' ? 1 : -1;
 out:
-	close(sv[0]);
-	close(sv[1]);
+	end_request(&req);
 	return ret;
 }
 
+/*
+ * Receive the @nrpids pids which cgmanager sends over @req's socket in reply to
+ * GetTasksScm or GetTasksRecursiveScm.  They arrive as SCM_CREDENTIALS,
+ * so the kernel has translated them into our pid namespace.
+ */
+static bool recv_task_pids(struct proxy_req *req, int32_t *pids, uint32_t nrpids)
+{
+	struct ucred tcreds[SCM_CREDS_BATCH];
+	uint32_t i = 0;
+	int j, n;
+
+	while (i < nrpids) {
+		n = nrpids - i < SCM_CREDS_BATCH ? nrpids - i : SCM_CREDS_BATCH;
+		n = get_scm_creds_batch_sync(req->sv[0], tcreds, NULL, n);
+		if (n <= 0)
+			return false;
+		for (j = 0; j < n; j++) {
+			if (tcreds[j].pid == -1)
+				return false;
+			pids[i++] = tcreds[j].pid;
+		}
+	}
+	return true;
+}
+
 int get_tasks_main (void *parent, char *controller, const char *cgroup,
 		    struct ucred p, struct ucred r, int32_t **pids)
 {
-	DBusMessage *message;
-	DBusMessageIter iter;
-	int sv[2], ret = -1;
+	struct proxy_req req = {
+		.method = "GetTasksScm",
+		.type = REQ_TYPE_GET_TASKS,
+		.controller = controller,
+		.cgroup = cgroup,
+	};
+	int ret = -1;
 	uint32_t nrpids;
-	struct ucred tcred;
-	int i;
 
 	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
 		nih_error("%s: proxy != requestor", __func__);
@@ -830,33 +756,11 @@ int get_tasks_main (void *parent, char *controller, const char *cgroup,
 		return -1;
 	}
 
-	if (!(message = start_dbus_request("GetTasksScm", sv))) {
-		nih_error("%s: error starting dbus request", __func__);
-		return -1;
-	}
-
-	dbus_message_iter_init_append(message, &iter);
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &controller)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &cgroup)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1])) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-
-	if (!complete_dbus_request(message, sv, &r, NULL)) {
-		nih_error("%s: error completing dbus request", __func__);
+	if (!send_request(&req, &r, NULL)) {
+		nih_error("%s: error sending request", __func__);
 		goto out;
 	}
-	if (proxyrecv(sv[0], &nrpids, sizeof(uint32_t)) != sizeof(uint32_t))
+	if (recv_reply(&req, &nrpids, sizeof(uint32_t)) != sizeof(uint32_t))
 		goto out;
 	if (nrpids == -1) {
 		nih_error("%s: bad cgroup: %s:%s", __func__, controller, cgroup);
@@ -869,19 +773,13 @@ int get_tasks_main (void *parent, char *controller, const char *cgroup,
 	}
 
 	*pids = NIH_MUST( nih_alloc(parent, nrpids * sizeof(uint32_t)) );
-	for (i=0; i<nrpids; i++) {
-		get_scm_creds_sync(sv[0], &tcred);
-		if (tcred.pid == -1) {
-			nih_warn("%s: Failed getting pid from server",
-				__func__);
-			goto out;
-		}
-		(*pids)[i] = tcred.pid;
+	if (!recv_task_pids(&req, *pids, nrpids)) {
+		nih_warn("%s: Failed getting pids from server", __func__);
+		goto out;
 	}
 	ret = nrpids;
 out:
-	close(sv[0]);
-	close(sv[1]);
+	end_request(&req);
 	return ret;
 }
 
@@ -889,12 +787,14 @@ int get_tasks_recursive_main (void *parent, const char *controller,
 		const char *cgroup, struct ucred p, struct ucred r,
 		int32_t **pids)
 {
-	DBusMessage *message;
-	DBusMessageIter iter;
-	int sv[2], ret = -1;
+	struct proxy_req req = {
+		.method = "GetTasksRecursiveScm",
+		.type = REQ_TYPE_GET_TASKS_RECURSIVE,
+		.controller = controller,
+		.cgroup = cgroup,
+	};
+	int ret = -1;
 	uint32_t nrpids;
-	struct ucred tcred;
-	int i;
 
 	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
 		nih_error("%s: proxy != requestor", __func__);
@@ -906,33 +806,11 @@ int get_tasks_recursive_main (void *parent, const char *controller,
 		return -1;
 	}
 
-	if (!(message = start_dbus_request("GetTasksRecursiveScm", sv))) {
-		nih_error("%s: error starting dbus request", __func__);
-		return -1;
-	}
-
-	dbus_message_iter_init_append(message, &iter);
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &controller)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &cgroup)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1])) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-
-	if (!complete_dbus_request(message, sv, &r, NULL)) {
-		nih_error("%s: error completing dbus request", __func__);
+	if (!send_request(&req, &r, NULL)) {
+		nih_error("%s: error sending request", __func__);
 		goto out;
 	}
-	if (proxyrecv(sv[0], &nrpids, sizeof(uint32_t)) != sizeof(uint32_t))
+	if (recv_reply(&req, &nrpids, sizeof(uint32_t)) != sizeof(uint32_t))
 		goto out;
 	if (nrpids == -1) {
 		nih_error("%s: bad cgroup: %s:%s", __func__, controller, cgroup);
@@ -945,33 +823,56 @@ int get_tasks_recursive_main (void *parent, const char *controller,
 	}
 
 	*pids = NIH_MUST( nih_alloc(parent, nrpids * sizeof(uint32_t)) );
-	for (i=0; i<nrpids; i++) {
-		get_scm_creds_sync(sv[0], &tcred);
-		if (tcred.pid == -1) {
-			nih_warn("%s: Failed getting pid from server",
-				__func__);
-			goto out;
-		}
-		(*pids)[i] = tcred.pid;
+	if (!recv_task_pids(&req, *pids, nrpids)) {
+		nih_warn("%s: Failed getting pids from server", __func__);
+		goto out;
 	}
 	ret = nrpids;
 out:
-	close(sv[0]);
-	close(sv[1]);
+	end_request(&req);
 	return ret;
 }
 
+/*
+ * Split the @len bytes of NUL-separated cgroup names in @paths, as
+ * sent by cgmanager for ListChildrenScm, into a NULL-terminated array.
+ * @paths must be NUL-terminated at @len.
+ */
+static int parse_children(void *parent, char *paths, uint32_t len,
+		int32_t nrkids, char ***output)
+{
+	char *s;
+	int i;
+
+	*output = NIH_MUST( nih_alloc(parent, sizeof( char*)*(nrkids+1)) );
+	memset(*output, 0, (nrkids + 1) * sizeof(char *));
+
+	s = paths;
+	for (i=0; i<nrkids; i++) {
+		if (s > paths + len) {
+			nih_error("%s: corrupted result from cgmanager",
+					__func__);
+			return -1;
+		}
+		(*output)[i] = NIH_MUST( nih_strdup(parent, s) );
+		s += strlen(s) + 1;
+	}
+	return nrkids;
+}
+
 int list_children_main (void *parent, char *controller, const char *cgroup,
 		    struct ucred p, struct ucred r, char ***output)
 {
-	DBusMessage *message;
-	DBusMessageIter iter;
-	int sv[2], ret = -1;
+	struct proxy_req req = {
+		.method = "ListChildrenScm",
+		.type = REQ_TYPE_LIST_CHILDREN,
+		.controller = controller,
+		.cgroup = cgroup,
+	};
+	int ret = -1;
 	uint32_t len;
 	int32_t nrkids;
 	nih_local char * paths = NULL;
-	char *s;
-	int i;
 
 	*output = NULL;
 	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
@@ -984,34 +885,12 @@ int list_children_main (void *parent, char *controller, const char *cgroup,
 		return -1;
 	}
 
-	if (!(message = start_dbus_request("ListChildrenScm", sv))) {
-		nih_error("%s: error starting dbus request", __func__);
-		return -1;
-	}
-
-	dbus_message_iter_init_append(message, &iter);
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &controller)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &cgroup)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1])) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-
-	if (!complete_dbus_request(message, sv, &r, NULL)) {
-		nih_error("%s: error completing dbus request", __func__);
+	if (!send_request(&req, &r, NULL)) {
+		nih_error("%s: error sending request", __func__);
 		goto out;
 	}
 
-	if (proxyrecv(sv[0], &nrkids, sizeof(int32_t)) != sizeof(int32_t))
+	if (recv_reply(&req, &nrkids, sizeof(int32_t)) != sizeof(int32_t))
 		goto out;
 	if (nrkids == 0) {
 		ret = 0;
@@ -1022,43 +901,46 @@ int list_children_main (void *parent, char *controller, const char *cgroup,
 		ret = -1;
 		goto out;
 	}
-	if (proxyrecv(sv[0], &len, sizeof(uint32_t)) != sizeof(uint32_t))
+	if (recv_reply(&req, &len, sizeof(uint32_t)) != sizeof(uint32_t))
 		goto out;
 
 	paths = nih_alloc(NULL, len+1);
 	paths[len] = '\0';
-	if (read(sv[0], paths, len) != len) {
+	if (recv_reply(&req, paths, len) != len) {
 		nih_error("%s: Failed getting paths from server", __func__);
 		goto out;
 	}
 
-	*output = NIH_MUST( nih_alloc(parent, sizeof( char*)*(nrkids+1)) );
-	memset(*output, 0, (nrkids + 1) * sizeof(char *));
-
-	s = paths;
-	for (i=0; i<nrkids; i++) {
-		if (s > paths + len) {
-			ret = -1;
-			nih_error("%s: corrupted result from cgmanager",
-					__func__);
-			goto out;
-		}
-		(*output)[i] = NIH_MUST( nih_strdup(parent, s) );
-		s += strlen(s) + 1;
-	}
-	ret = nrkids;
+	ret = parse_children(parent, paths, len, nrkids, output);
 out:
-	close(sv[0]);
-	close(sv[1]);
+	end_request(&req);
 	return ret;
 }
 
+int claim_main(const char *controller, const char *cgroup,
+		struct ucred p, struct ucred r, int32_t *existed)
+{
+	nih_error("%s: not supported through cgproxy", __func__);
+	return -1;
+}
+
+int remove_deferred_main(const char *controller, const char *cgroup,
+		struct ucred p, struct ucred r, int recursive, int32_t *existed)
+{
+	nih_error("%s: not supported through cgproxy", __func__);
+	return -1;
+}
+
 int remove_on_empty_main (const char *controller, const char *cgroup,
 		struct ucred p, struct ucred r)
 {
-	DBusMessage *message;
-	DBusMessageIter iter;
-	int sv[2], ret = -1;
+	struct proxy_req req = {
+		.method = "RemoveOnEmptyScm",
+		.type = REQ_TYPE_REMOVE_ON_EMPTY,
+		.controller = controller,
+		.cgroup = cgroup,
+	};
+	int ret = -1;
 	char buf[1];
 
 	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
@@ -1071,127 +953,398 @@ int remove_on_empty_main (const char *controller, const char *cgroup,
 		return -1;
 	}
 
-	if (!(message = start_dbus_request("RemoveOnEmptyScm", sv))) {
-		nih_error("%s: error starting dbus request", __func__);
+	if (!send_request(&req, &r, NULL)) {
+		nih_error("%s: error sending request", __func__);
+		goto out;
+	}
+
+	if (recv_reply(&req, buf, 1) == 1 && (*buf == '1'))
+		ret = 0;
+out:
+	end_request(&req);
+	return ret;
+}
+
+int prune_main (const char *controller, const char *cgroup,
+		struct ucred p, struct ucred r)
+{
+	struct proxy_req req = {
+		.method = "PruneScm",
+		.type = REQ_TYPE_PRUNE,
+		.controller = controller,
+		.cgroup = cgroup,
+	};
+	int ret = -1;
+	char buf[1];
+
+	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
+		nih_error("%s: proxy != requestor", __func__);
 		return -1;
 	}
 
-	dbus_message_iter_init_append(message, &iter);
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &controller)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
+	if (!sane_cgroup(cgroup)) {
+		nih_error("%s: unsafe cgroup", __func__);
+		return -1;
 	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &cgroup)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
+
+	if (!send_request(&req, &r, NULL)) {
+		nih_error("%s: error sending request", __func__);
 		goto out;
 	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1])) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
+
+	if (recv_reply(&req, buf, 1) == 1 && (*buf == '1'))
+		ret = 0;
+out:
+	end_request(&req);
+	return ret;
+}
+
+/*
+ * Forward a batch to cgmanager as a single BatchScm request.  BatchScm
+ * takes one victim credential, which supplies the pid for every MovePid
+ * and the uid and gid for every Chown.  If the operations name
+ * different victims, or one of them would be refused, the batch is run
+ * an operation at a time instead.
+ */
+int batch_main (struct batch_op **ops, int32_t nops, struct ucred p,
+		struct ucred r, int32_t *results)
+{
+	struct ucred v = { .pid = getpid(), .uid = 0, .gid = 0 };
+	bool have_pid = false, have_ids = false;
+	DBusMessage *message;
+	DBusMessageIter iter, array, entry;
+	int sv[2];
+	int32_t i, gid;
+	int ret = -1;
+
+	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
+		nih_error("%s: proxy != requestor", __func__);
+		return -1;
 	}
 
-	if (!complete_dbus_request(message, sv, &r, NULL)) {
+	for (i = 0; i < nops; i++) {
+		struct batch_op *op = ops[i];
+
+		if (!sane_cgroup(op->cgroup))
+			return batch_run(ops, nops, p, r, results);
+		if (op->type == REQ_TYPE_MOVE_PID) {
+			if (op->cgroup[0] == '/' ||
+					(have_pid && op->vcred.pid != v.pid))
+				return batch_run(ops, nops, p, r, results);
+			v.pid = op->vcred.pid;
+			have_pid = true;
+		}
+		if (op->type == REQ_TYPE_CHOWN) {
+			if (have_ids && (op->vcred.uid != v.uid ||
+						op->vcred.gid != v.gid))
+				return batch_run(ops, nops, p, r, results);
+			v.uid = op->vcred.uid;
+			v.gid = op->vcred.gid;
+			have_ids = true;
+		}
+	}
+
+	if (!(message = start_dbus_request("BatchScm", sv))) {
+		nih_error("%s: error starting dbus request", __func__);
+		return -1;
+	}
+
+	dbus_message_iter_init_append(message, &iter);
+	if (!dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+				"(sssssii)", &array))
+		goto oom;
+	for (i = 0; i < nops; i++) {
+		struct batch_op *op = ops[i];
+		const char *strs[] = { batch_op_name(op->type), op->controller,
+			op->cgroup, op->key, op->value };
+		int j;
+
+		if (!dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT,
+					NULL, &entry))
+			goto oom;
+		for (j = 0; j < 5; j++) {
+			if (! dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &strs[j]))
+				goto oom;
+		}
+		gid = 0;  // arg2 is only the Chown gid, which BatchScm ignores
+		if (! dbus_message_iter_append_basic (&entry, DBUS_TYPE_INT32, &op->arg) ||
+				! dbus_message_iter_append_basic (&entry, DBUS_TYPE_INT32, &gid))
+			goto oom;
+		if (!dbus_message_iter_close_container(&array, &entry))
+			goto oom;
+	}
+	if (!dbus_message_iter_close_container(&iter, &array))
+		goto oom;
+	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1]))
+		goto oom;
+
+	if (!complete_dbus_request(message, sv, &r, &v)) {
 		nih_error("%s: error completing dbus request", __func__);
 		goto out;
 	}
 
-	if (proxyrecv(sv[0], buf, 1) == 1 && (*buf == '1'))
+	if (proxyrecv(sv[0], results, nops * sizeof(int32_t)) ==
+			nops * sizeof(int32_t))
 		ret = 0;
+	else
+		nih_error("%s: bad reply from cgmanager", __func__);
+	goto out;
+
+oom:
+	nih_error("%s: out of memory", __func__);
+	dbus_message_unref(message);
 out:
 	close(sv[0]);
 	close(sv[1]);
 	return ret;
 }
 
-int prune_main (const char *controller, const char *cgroup,
-		struct ucred p, struct ucred r)
+int get_values_main (struct batch_op **items, int32_t nitems, struct ucred p,
+		struct ucred r, int32_t *results)
 {
 	DBusMessage *message;
-	DBusMessageIter iter;
-	int sv[2], ret = -1;
-	char buf[1];
+	DBusMessageIter iter, array, entry;
+	nih_local char *values = NULL;
+	uint32_t len;
+	int sv[2];
+	int32_t i;
+	char *v;
+	int ret = -1;
 
 	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
 		nih_error("%s: proxy != requestor", __func__);
 		return -1;
 	}
 
-	if (!sane_cgroup(cgroup)) {
-		nih_error("%s: unsafe cgroup", __func__);
-		return -1;
+	for (i = 0; i < nitems; i++) {
+		if (!sane_cgroup(items[i]->cgroup)) {
+			nih_error("%s: unsafe cgroup", __func__);
+			return -1;
+		}
 	}
 
-	if (!(message = start_dbus_request("PruneScm", sv))) {
+	if (!(message = start_dbus_request("GetValuesScm", sv))) {
 		nih_error("%s: error starting dbus request", __func__);
 		return -1;
 	}
 
 	dbus_message_iter_init_append(message, &iter);
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &controller)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
+	if (!dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+				"(sss)", &array))
+		goto oom;
+	for (i = 0; i < nitems; i++) {
+		const char *strs[] = { items[i]->controller, items[i]->cgroup,
+			items[i]->key };
+		int j;
+
+		if (!dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT,
+					NULL, &entry))
+			goto oom;
+		for (j = 0; j < 3; j++) {
+			if (! dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &strs[j]))
+				goto oom;
+		}
+		if (!dbus_message_iter_close_container(&array, &entry))
+			goto oom;
 	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &cgroup)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
+	if (!dbus_message_iter_close_container(&iter, &array))
+		goto oom;
+	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1]))
+		goto oom;
+
+	if (!complete_dbus_request(message, sv, &r, NULL)) {
+		nih_error("%s: error completing dbus request", __func__);
 		goto out;
 	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1])) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
+
+	if (proxyrecv(sv[0], results, nitems * sizeof(int32_t)) !=
+			nitems * sizeof(int32_t) ||
+			proxyrecv(sv[0], &len, sizeof(uint32_t)) != sizeof(uint32_t)) {
+		nih_error("%s: bad reply from cgmanager", __func__);
 		goto out;
 	}
 
-	if (!complete_dbus_request(message, sv, &r, NULL)) {
-		nih_error("%s: error completing dbus request", __func__);
+	values = NIH_MUST( nih_alloc(NULL, len + 1) );
+	values[len] = '\0';
+	if (proxyrecv(sv[0], values, len) != len) {
+		nih_error("%s: Failed getting values from server", __func__);
 		goto out;
 	}
 
-	if (proxyrecv(sv[0], buf, 1) == 1 && (*buf == '1'))
-		ret = 0;
+	v = values;
+	for (i = 0; i < nitems; i++) {
+		if (v >= values + len) {
+			nih_error("%s: too few values from server", __func__);
+			goto out;
+		}
+		items[i]->value = NIH_MUST( nih_strdup(items[i], v) );
+		v += strlen(v) + 1;
+	}
+	ret = 0;
+	goto out;
+
+oom:
+	nih_error("%s: out of memory", __func__);
+	dbus_message_unref(message);
 out:
 	close(sv[0]);
 	close(sv[1]);
 	return ret;
 }
 
-int list_controllers_main (void *parent, char ***output)
+int set_values_main (struct batch_op **ops, int32_t nops, struct ucred p,
+		struct ucred r, int32_t *results)
 {
-	DBusMessage *message = NULL, *reply = NULL;
-	char **         output_local = NULL;
-	DBusError       error;
-	DBusMessageIter iter;
-	int		ret = -1;
-	DBusMessageIter output_local_iter;
-	size_t          output_local_size;
+	DBusMessage *message;
+	DBusMessageIter iter, array, entry;
+	int sv[2];
+	int32_t i;
+	int ret = -1;
 
-	*output = NULL;
-	message = dbus_message_new_method_call(dbus_bus_get_unique_name(server_conn),
-			"/org/linuxcontainers/cgmanager",
-			"org.linuxcontainers.cgmanager0_0", "ListControllers");
+	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
+		nih_error("%s: proxy != requestor", __func__);
+		return -1;
+	}
 
-	dbus_error_init (&error);
+	for (i = 0; i < nops; i++) {
+		if (!sane_cgroup(ops[i]->cgroup)) {
+			nih_error("%s: unsafe cgroup", __func__);
+			return -1;
+		}
+	}
 
-	reply = dbus_connection_send_with_reply_and_block (server_conn, message, -1, &error);
-	if (! reply) {
-		dbus_message_unref (message);
+	if (!(message = start_dbus_request("SetValuesScm", sv))) {
+		nih_error("%s: error starting dbus request", __func__);
+		return -1;
+	}
 
-		nih_error("%s: error completing dbus request: %s %s", __func__,
-			error.name, error.message);
+	dbus_message_iter_init_append(message, &iter);
+	if (!dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+				"(ssss)", &array))
+		goto oom;
+	for (i = 0; i < nops; i++) {
+		const char *strs[] = { ops[i]->controller, ops[i]->cgroup,
+			ops[i]->key, ops[i]->value };
+		int j;
+
+		if (!dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT,
+					NULL, &entry))
+			goto oom;
+		for (j = 0; j < 4; j++) {
+			if (! dbus_message_iter_append_basic (&entry, DBUS_TYPE_STRING, &strs[j]))
+				goto oom;
+		}
+		if (!dbus_message_iter_close_container(&array, &entry))
+			goto oom;
+	}
+	if (!dbus_message_iter_close_container(&iter, &array))
+		goto oom;
+	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1]))
+		goto oom;
 
-		dbus_error_free (&error);
-		return -1;
+	if (!complete_dbus_request(message, sv, &r, NULL)) {
+		nih_error("%s: error completing dbus request", __func__);
+		goto out;
 	}
-	dbus_message_unref (message);
+
+	if (proxyrecv(sv[0], results, nops * sizeof(int32_t)) ==
+			nops * sizeof(int32_t))
+		ret = 0;
+	else
+		nih_error("%s: bad reply from cgmanager", __func__);
+	goto out;
+
+oom:
+	nih_error("%s: out of memory", __func__);
+	dbus_message_unref(message);
+out:
+	close(sv[0]);
+	close(sv[1]);
+	return ret;
+}
+
+/*
+ * cgproxy neither watches cgroups itself nor relays cgmanager's
+ * signals, so populated notifications, WaitEmpty and key and pressure
+ * watches are only available from cgmanager.
+ */
+int subscribe_populated_main (DBusConnection *conn, char *controller,
+		const char *cgroup, struct ucred p, struct ucred r,
+		int32_t *populated)
+{
+	nih_error("%s: not supported through cgproxy", __func__);
+	return -1;
+}
+
+int unsubscribe_populated_main (DBusConnection *conn, char *controller,
+		const char *cgroup, struct ucred p, struct ucred r)
+{
+	nih_error("%s: not supported through cgproxy", __func__);
+	return -1;
+}
+
+int wait_empty_main (NihDBusMessage *message, char *controller,
+		const char *cgroup, struct ucred p, struct ucred r,
+		int32_t timeout)
+{
+	nih_error("%s: not supported through cgproxy", __func__);
+	return -1;
+}
+
+void populated_client_disconnect(DBusConnection *conn)
+{
+}
+
+int watch_key_main (DBusConnection *conn, char *controller,
+		const char *cgroup, const char *key, const char *args,
+		struct ucred p, struct ucred r)
+{
+	nih_error("%s: not supported through cgproxy", __func__);
+	return -1;
+}
+
+int unwatch_key_main (DBusConnection *conn, char *controller,
+		const char *cgroup, const char *key, const char *args,
+		struct ucred p, struct ucred r)
+{
+	nih_error("%s: not supported through cgproxy", __func__);
+	return -1;
+}
+
+int watch_pressure_main (DBusConnection *conn, char *controller,
+		const char *cgroup, const char *resource, const char *trigger,
+		struct ucred p, struct ucred r)
+{
+	nih_error("%s: not supported through cgproxy", __func__);
+	return -1;
+}
+
+int unwatch_pressure_main (DBusConnection *conn, char *controller,
+		const char *cgroup, const char *resource, const char *trigger,
+		struct ucred p, struct ucred r)
+{
+	nih_error("%s: not supported through cgproxy", __func__);
+	return -1;
+}
+
+void key_watch_client_disconnect(DBusConnection *conn)
+{
+}
+
+/*
+ * Read the controller list out of cgmanager's reply to ListControllers.
+ */
+static int parse_controllers(void *parent, DBusMessage *reply, char ***output)
+{
+	char **         output_local = NULL;
+	DBusMessageIter iter;
+	DBusMessageIter output_local_iter;
+	size_t          output_local_size;
 
 	dbus_message_iter_init (reply, &iter);
 
 	if (dbus_message_iter_get_arg_type (&iter) != DBUS_TYPE_ARRAY)
-		goto out;
+		return -1;
 
 	dbus_message_iter_recurse (&iter, &output_local_iter);
 
@@ -1208,7 +1361,7 @@ int list_controllers_main (void *parent, char ***output)
 		char *      output_local_element;
 
 		if (dbus_message_iter_get_arg_type (&output_local_iter) != DBUS_TYPE_STRING)
-			goto out;
+			goto err;
 
 		dbus_message_iter_get_basic (&output_local_iter, &output_local_element_dbus);
 
@@ -1228,17 +1381,43 @@ int list_controllers_main (void *parent, char ***output)
 	dbus_message_iter_next (&iter);
 
 	if (dbus_message_iter_get_arg_type (&iter) != DBUS_TYPE_INVALID)
-		goto out;
+		goto err;
 
 	*output = output_local;
+	return 0;
 
-	ret = 0;
+err:
+	nih_free (output_local);
+	return -1;
+}
 
-out:
-	if (reply)
-		dbus_message_unref (reply);
-	if (ret)
-		nih_free (output_local);
+int list_controllers_main (void *parent, char ***output)
+{
+	DBusMessage *message = NULL, *reply = NULL;
+	DBusError       error;
+	int		ret;
+
+	*output = NULL;
+	message = dbus_message_new_method_call(dbus_bus_get_unique_name(server_conn),
+			"/org/linuxcontainers/cgmanager",
+			"org.linuxcontainers.cgmanager0_0", "ListControllers");
+
+	dbus_error_init (&error);
+
+	reply = dbus_connection_send_with_reply_and_block (server_conn, message, -1, &error);
+	if (! reply) {
+		dbus_message_unref (message);
+
+		nih_error("%s: error completing dbus request: %s %s", __func__,
+			error.name, error.message);
+
+		dbus_error_free (&error);
+		return -1;
+	}
+	dbus_message_unref (message);
+
+	ret = parse_controllers(parent, reply, output);
+	dbus_message_unref (reply);
 	return ret;
 }
 
@@ -1249,18 +1428,66 @@ static char *find_eol(char *s)
 	return s;
 }
 
+/*
+ * Parse the @len bytes of "name\nuid\ngid\nperms\n" records in
+ * @results, as sent by cgmanager for ListKeysScm.  @results must be
+ * NUL-terminated at @len.
+ */
+static int parse_keys(void *parent, char *results, uint32_t len,
+		int32_t nrkeys, struct keys_return_type ***output)
+{
+	char *s;
+	int i;
+
+	*output = NIH_MUST( nih_alloc(parent, sizeof(**output)*(nrkeys+1)) );
+	memset(*output, 0, (nrkeys + 1) * sizeof(**output));
+
+	s = results;
+	for (i=0; i<nrkeys; i++) {
+		struct keys_return_type *tmp;
+		char *s2 = find_eol(s);
+		if (s2 > results + len)
+			goto bad;
+		*s2 = '\0';
+		(*output)[i] = tmp = NIH_MUST( nih_new(*output, struct keys_return_type) );
+		tmp->name = NIH_MUST( nih_strdup(tmp, s) );
+		s = s2 + 1;
+		s2 = find_eol(s);
+		if (s2 > results + len)
+			goto bad;
+		if (sscanf(s, "%u\n", &tmp->uid) != 1)
+			goto bad;
+		s = s2 + 1;
+		s2 = find_eol(s);
+		if (sscanf(s, "%u\n", &tmp->gid) != 1)
+			goto bad;
+		s = s2 + 1;
+		s2 = find_eol(s);
+		if (sscanf(s, "%u\n", &tmp->perms) != 1)
+			goto bad;
+		s = s2 + 1;
+	}
+	return nrkeys;
+
+bad:
+	nih_error("%s: corrupted result from cgmanager", __func__);
+	return -1;
+}
+
 int list_keys_main (void *parent, char *controller, const char *cgroup,
 		    struct ucred p, struct ucred r,
 		    struct keys_return_type ***output)
 {
-	DBusMessage *message;
-	DBusMessageIter iter;
-	int sv[2], ret = -1;
+	struct proxy_req req = {
+		.method = "ListKeysScm",
+		.type = REQ_TYPE_LISTKEYS,
+		.controller = controller,
+		.cgroup = cgroup,
+	};
+	int ret = -1;
 	uint32_t len;
 	int32_t nrkeys;
 	nih_local char * results = NULL;
-	char *s;
-	int i;
 
 	*output = NULL;
 	if (memcmp(&p, &r, sizeof(struct ucred)) != 0) {
@@ -1273,34 +1500,12 @@ int list_keys_main (void *parent, char *controller, const char *cgroup,
 		return -1;
 	}
 
-	if (!(message = start_dbus_request("ListKeysScm", sv))) {
-		nih_error("%s: error starting dbus request", __func__);
-		return -1;
-	}
-
-	dbus_message_iter_init_append(message, &iter);
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &controller)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &cgroup)) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
-		goto out;
-	}
-	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1])) {
-		nih_error("%s: out of memory", __func__);
-		dbus_message_unref(message);
+	if (!send_request(&req, &r, NULL)) {
+		nih_error("%s: error sending request", __func__);
 		goto out;
 	}
 
-	if (!complete_dbus_request(message, sv, &r, NULL)) {
-		nih_error("%s: error completing dbus request", __func__);
-		goto out;
-	}
-
-	if (proxyrecv(sv[0], &nrkeys, sizeof(int32_t)) != sizeof(int32_t))
+	if (recv_reply(&req, &nrkeys, sizeof(int32_t)) != sizeof(int32_t))
 		goto out;
 	if (nrkeys == 0) {
 		ret = 0;
@@ -1311,54 +1516,824 @@ int list_keys_main (void *parent, char *controller, const char *cgroup,
 		ret = -1;
 		goto out;
 	}
-	if (proxyrecv(sv[0], &len, sizeof(uint32_t)) != sizeof(uint32_t))
+	if (recv_reply(&req, &len, sizeof(uint32_t)) != sizeof(uint32_t))
 		goto out;
 
 	results = nih_alloc(NULL, len+1);
 	results[len] = '\0';
-	if (read(sv[0], results, len) != len) {
+	if (recv_reply(&req, results, len) != len) {
 		nih_error("%s: Failed getting results from server", __func__);
 		goto out;
 	}
 
-	*output = NIH_MUST( nih_alloc(parent, sizeof(**output)*(nrkeys+1)) );
-	memset(*output, 0, (nrkeys + 1) * sizeof(**output));
+	ret = parse_keys(parent, results, len, nrkeys, output);
+out:
+	end_request(&req);
+	return ret;
+}
 
-	s = results;
-	for (i=0; i<nrkeys; i++) {
-		struct keys_return_type *tmp;
-		char *s2 = find_eol(s);
-		if (s2 > results + len)
-			goto bad;
-		*s2 = '\0';
-		(*output)[i] = tmp = NIH_MUST( nih_new(*output, struct keys_return_type) );
-		tmp->name = NIH_MUST( nih_strdup(tmp, s) );
-		s = s2 + 1;
-		s2 = find_eol(s);
-		if (s2 > results + len)
-			goto bad;
-		if (sscanf(s, "%u\n", &tmp->uid) != 1)
-			goto bad;
-		s = s2 + 1;
-		s2 = find_eol(s);
-		if (sscanf(s, "%u\n", &tmp->gid) != 1)
-			goto bad;
-		s = s2 + 1;
-		s2 = find_eol(s);
-		if (sscanf(s, "%u\n", &tmp->perms) != 1)
-			goto bad;
-		s = s2 + 1;
+/*
+ * Asynchronous forwarding.
+ *
+ * When cgmanager supports it, cgproxy registers a channel with
+ * RegisterProxyChannel: a long-lived socket over which each request is
+ * a single datagram tagged with an id (see struct chan_req_hdr).  The
+ * *_main functions above, which wait for cgmanager's reply, are then
+ * bypassed: proxy_forward() queues each request, at most max_inflight
+ * of them are sent at once, and the channel is watched from the main
+ * loop so that each reply is matched to its request by id and relayed
+ * to the client when it arrives.  One slow request thus no longer
+ * stalls every other client of the proxy.
+ *
+ * A request which has no reply within its timeout is failed.  The
+ * timeout covers the time the request spends queued in cgmanager, so
+ * requests which change cgroups or walk a subtree, and may wait behind
+ * others acting on the same cgroups, get the longer update_timeout;
+ * failing one of those while cgmanager goes on to complete it would
+ * mislead the client.
+ *
+ * Nothing written from the main loop may wait for a full socket: a
+ * victim credential which does not fit in the channel, or a reply which
+ * does not fit in the client's queue, is finished from an NIH_IO_WRITE
+ * watch.  A client which does not drain its queue within a second is
+ * given up on, as scm_write() would.
+ */
+static int chan_fd = -1;
+static NihIoWatch *chan_watch;
+static uint32_t chan_next_id;
+
+static int max_inflight = 64;
+static int query_timeout = 2;    // s, 0 for none
+static int update_timeout = 30;  // s, 0 for none
+static int nr_inflight;
+static NihList *upstream_reqs;   // sent, waiting for the reply
+static NihList *upstream_queue;  // waiting for an in-flight slot
+static unsigned long upstream_forwarded, upstream_timeouts;
+static unsigned long upstream_reply_waits;
+
+/* the victim credential owed for the last request sent, if not yet sent */
+static bool chan_vcred_pending;
+static uint32_t chan_vcred_id;
+static struct ucred chan_vcred;
+
+struct upstream_req {
+	NihList entry;
+	uint32_t id;
+	struct scm_sock_data *d;   // the request; we are its child
+	NihTimer *timer;
+	bool sent;
+
+	/* the reply, as it arrives */
+	int nmsgs;
+	char status;               // one byte replies
+	char *str;                 // string replies, and list results
+	int32_t count;             // GetTasks*, ListChildren, ListKeys
+	uint32_t len;              // length of list results
+	int32_t *pids;
+	int32_t nrpids;
+
+	/* the reply to an Scm client, as far as it has been sent */
+	struct {
+		const void *buf;
+		size_t len;
+	} out[3];
+	int nout, nsent;
+	int32_t pids_sent;
+	NihIoWatch *out_watch;
+};
+
+static void upstream_done(struct upstream_req *u, bool ok);
+
+static int upstream_req_destroy(struct upstream_req *u)
+{
+	if (u->sent)
+		nr_inflight--;
+	if (u->timer)
+		nih_free(u->timer);
+	nih_list_destroy(&u->entry);
+	return 0;
+}
+
+static size_t chan_req_string(char *buf, const char *s)
+{
+	size_t len = s ? strlen(s) + 1 : 1;
+
+	if (buf) {
+		if (s)
+			memcpy(buf, s, len);
+		else
+			*buf = '\0';
+	}
+	return len;
+}
+
+/* Build the channel datagram for @d; returns its length */
+static size_t chan_req_build(char *buf, struct scm_sock_data *d, uint32_t id)
+{
+	struct chan_req_hdr hdr = {
+		.id = id,
+		.type = d->type,
+		.recursive = d->recursive,
+		.mode = d->mode,
+	};
+	const char *strs[] = { d->controller, d->cgroup, d->key,
+		d->value, d->file };
+	size_t len = sizeof(hdr);
+	int i;
+
+	if (buf)
+		memcpy(buf, &hdr, sizeof(hdr));
+	for (i = 0; i < 5; i++)
+		len += chan_req_string(buf ? buf + len : NULL, strs[i]);
+	return len;
+}
+
+static ssize_t chan_sendmsg(const void *buf, size_t len, struct ucred *cred)
+{
+	struct msghdr msg = { 0 };
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cmsgbuf[CMSG_SPACE(sizeof(*cred))];
+
+	msg.msg_control = cmsgbuf;
+	msg.msg_controllen = sizeof(cmsgbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_len = CMSG_LEN(sizeof(struct ucred));
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_CREDENTIALS;
+	memcpy(CMSG_DATA(cmsg), cred, sizeof(*cred));
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	return sendmsg(chan_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/*
+ * Send the pending victim credential.  Returns 1 if it was sent, 0 if
+ * cgmanager's queue is full, or -1 on error.
+ */
+static int chan_send_vcred(void)
+{
+	int ret;
+
+	ret = send_creds_batch(chan_fd, &chan_vcred, 1, &chan_vcred_id,
+			sizeof(chan_vcred_id), 0);
+	if (ret == -2)
+		return 0;
+	chan_vcred_pending = false;
+	if (ret != 1) {
+		nih_error("%s: Error sending pid over SCM_CREDENTIAL",
+			__func__);
+		return -1;
+	}
+	return 1;
+}
+
+/*
+ * Send @u over the channel.  Returns 1 if it was sent, 0 if cgmanager's
+ * queue is full, or -1 on error.
+ */
+static int chan_send(struct upstream_req *u)
+{
+	struct scm_sock_data *d = u->d;
+	nih_local char *buf = NULL;
+	size_t len;
+
+	len = chan_req_build(NULL, d, u->id);
+	buf = NIH_MUST( nih_alloc(NULL, len) );
+	chan_req_build(buf, d, u->id);
+
+	if (chan_sendmsg(buf, len, &d->rcred) < 0) {
+		if (errno == EAGAIN)
+			return 0;
+		nih_error("%s: Error sending request over proxy channel: %s",
+			__func__, strerror(errno));
+		return -1;
+	}
+	/* if the channel is full, upstream_pump() sends it later */
+	if (need_two_creds(d->type)) {
+		chan_vcred = d->vcred;
+		chan_vcred_id = u->id;
+		chan_vcred_pending = true;
+		if (chan_send_vcred() < 0)
+			return -1;
+	}
+	return 1;
+}
+
+static void upstream_timeout(struct upstream_req *u, NihTimer *timer)
+{
+	u->timer = NULL;  // freed by the main loop
+	upstream_timeouts++;
+	nih_warn("%s: no reply from cgmanager for request %u", __func__,
+		u->id);
+	upstream_done(u, false);
+}
+
+/* How long to wait for cgmanager's reply to a request of type @t */
+static int upstream_timeout_for(enum req_type t)
+{
+	switch (t) {
+	case REQ_TYPE_GET_PID:
+	case REQ_TYPE_GET_PID_ABS:
+	case REQ_TYPE_GET_VALUE:
+	case REQ_TYPE_GET_TASKS:
+	case REQ_TYPE_LIST_CHILDREN:
+	case REQ_TYPE_LISTKEYS:
+		return query_timeout;
+	default:
+		return update_timeout;
+	}
+}
+
+/* Send queued requests while there are free in-flight slots */
+static void upstream_pump(void)
+{
+	while (chan_fd != -1) {
+		struct upstream_req *u;
+		int ret, timeout;
+
+		/* cgmanager reads no other request until it has this */
+		if (chan_vcred_pending && chan_send_vcred() == 0) {
+			chan_watch->events |= NIH_IO_WRITE;
+			return;
+		}
+		if (nr_inflight >= max_inflight || NIH_LIST_EMPTY(upstream_queue))
+			return;
+
+		u = (struct upstream_req *)upstream_queue->next;
+		u->id = ++chan_next_id;
+		ret = chan_send(u);
+		if (ret == 0) {
+			/* wait for cgmanager to drain the channel */
+			chan_watch->events |= NIH_IO_WRITE;
+			return;
+		}
+		if (ret < 0) {
+			upstream_done(u, false);
+			continue;
+		}
+		nih_list_add(upstream_reqs, &u->entry);
+		u->sent = true;
+		nr_inflight++;
+		upstream_forwarded++;
+		timeout = upstream_timeout_for(u->d->type);
+		if (timeout > 0)
+			u->timer = NIH_MUST( nih_timer_add_timeout(NULL, timeout,
+					(NihTimerCb) upstream_timeout, u) );
+	}
+}
+
+/*
+ * Add one reply datagram to @u.  Returns 1 once the whole reply has
+ * arrived, 0 if more is expected, or -1 if the reply is bad.
+ */
+static int upstream_feed(struct upstream_req *u, const char *buf, size_t len,
+		struct ucred *cred)
+{
+	int n = u->nmsgs++;
+
+	switch (u->d->type) {
+	case REQ_TYPE_GET_PID:
+	case REQ_TYPE_GET_PID_ABS:
+	case REQ_TYPE_GET_VALUE:
+		if (len == 0)
+			return -1;
+		u->str = NIH_MUST( nih_strndup(u, buf, len) );
+		return 1;
+	case REQ_TYPE_GET_TASKS:
+	case REQ_TYPE_GET_TASKS_RECURSIVE:
+		if (n == 0) {
+			if (len != sizeof(int32_t))
+				return -1;
+			memcpy(&u->count, buf, sizeof(int32_t));
+			if (u->count <= 0)
+				return 1;
+			u->pids = NIH_MUST( nih_alloc(u, u->count * sizeof(int32_t)) );
+			return 0;
+		}
+		if (len != 0 || cred->pid == -1)
+			return -1;
+		u->pids[u->nrpids++] = cred->pid;
+		return u->nrpids == u->count ? 1 : 0;
+	case REQ_TYPE_LIST_CHILDREN:
+	case REQ_TYPE_LISTKEYS:
+		if (n == 0) {
+			if (len != sizeof(int32_t))
+				return -1;
+			memcpy(&u->count, buf, sizeof(int32_t));
+			return u->count <= 0 ? 1 : 0;
+		}
+		if (n == 1) {
+			if (len != sizeof(uint32_t))
+				return -1;
+			memcpy(&u->len, buf, sizeof(uint32_t));
+			return 0;
+		}
+		if (len != u->len)
+			return -1;
+		u->str = NIH_MUST( nih_alloc(u, len + 1) );
+		memcpy(u->str, buf, len);
+		u->str[len] = '\0';
+		return 1;
+	default:
+		if (len != 1)
+			return -1;
+		u->status = *buf;
+		return 1;
+	}
+}
+
+/* Queue one datagram of the reply to an Scm client */
+static void upstream_reply_add(struct upstream_req *u, const void *buf,
+		size_t len)
+{
+	u->out[u->nout].buf = buf;
+	u->out[u->nout++].len = len;
+}
+
+/*
+ * Send as much of @u's reply as the client's queue will take.  Returns
+ * true once it has all been sent, or cannot be, and false if the rest
+ * must wait for the client to read.
+ */
+static bool upstream_reply_flush(struct upstream_req *u)
+{
+	struct scm_sock_data *d = u->d;
+	ssize_t ret;
+
+	while (u->nsent < u->nout) {
+		ret = scm_send(d, u->out[u->nsent].buf, u->out[u->nsent].len, 0);
+		if (ret == -2)
+			return false;
+		if (ret < 0) {
+			nih_error("%s: Error replying to client: %s", __func__,
+				strerror(errno));
+			return true;
+		}
+		u->nsent++;
+	}
+	if (u->pids && u->count > 0)
+		return send_task_creds_from(d, u->pids, u->count,
+				&u->pids_sent, 0) != -2;
+	return true;
+}
+
+/*
+ * Relay the reply to a client which called an *Scm method (or sent its
+ * request over a proxy channel), exactly as *_scm_complete would have.
+ * Returns true once it has all been sent.
+ */
+static bool upstream_reply_scm(struct upstream_req *u, bool ok)
+{
+	struct scm_sock_data *d = u->d;
+
+	if (!ok) {
+		u->count = -1;
+		u->status = '0';
+	}
+
+	switch (d->type) {
+	case REQ_TYPE_GET_PID:
+	case REQ_TYPE_GET_PID_ABS:
+	case REQ_TYPE_GET_VALUE:
+		if (ok)
+			upstream_reply_add(u, u->str, strlen(u->str) + 1);
+		else
+			upstream_reply_add(u, NULL, 0);
+		break;
+	case REQ_TYPE_GET_TASKS:
+	case REQ_TYPE_GET_TASKS_RECURSIVE:
+		/* the pids follow, from upstream_reply_flush() */
+		upstream_reply_add(u, &u->count, sizeof(u->count));
+		break;
+	case REQ_TYPE_LIST_CHILDREN:
+	case REQ_TYPE_LISTKEYS:
+		upstream_reply_add(u, &u->count, sizeof(u->count));
+		if (u->count <= 0)
+			break;
+		upstream_reply_add(u, &u->len, sizeof(u->len));
+		upstream_reply_add(u, u->str, u->len);
+		break;
+	default:
+		upstream_reply_add(u, &u->status, 1);
+	}
+	return upstream_reply_flush(u);
+}
+
+/*
+ * Answer a client which called a plain dbus method, by turning the
+ * reply into the results which dbus_request_reply() expects.
+ */
+static void upstream_reply_dbus(struct upstream_req *u, bool ok)
+{
+	struct scm_sock_data *d = u->d;
+
+	d->ret = -1;
+	if (!ok)
+		goto out;
+
+	switch (d->type) {
+	case REQ_TYPE_GET_PID:
+	case REQ_TYPE_GET_PID_ABS:
+	case REQ_TYPE_GET_VALUE:
+		d->output = u->str;
+		d->ret = 0;
+		break;
+	case REQ_TYPE_CREATE:
+	case REQ_TYPE_REMOVE:
+		if (u->status == '1' || u->status == '2')
+			d->ret = 0;
+		d->existed = u->status == '2' ? 1 : -1;
+		break;
+	case REQ_TYPE_GET_TASKS:
+	case REQ_TYPE_GET_TASKS_RECURSIVE:
+		d->pids = u->pids;
+		d->ret = u->count;
+		break;
+	case REQ_TYPE_LIST_CHILDREN:
+		if (u->count >= 0)
+			d->ret = parse_children(d, u->str, u->len, u->count,
+					&d->outputs);
+		break;
+	case REQ_TYPE_LISTKEYS:
+		if (u->count >= 0)
+			d->ret = parse_keys(d, u->str, u->len, u->count, &d->keys);
+		break;
+	default:
+		if (u->status == '1')
+			d->ret = 0;
 	}
-	ret = nrkeys;
+out:
+	dbus_request_reply(d);
+}
+
+/*
+ * Free @u once its client has been answered.  Requests from an *Scm
+ * method are finished by shutting down the client's socket, like
+ * sock_scm_reader does, and all others by freeing the request.
+ */
+static void upstream_finish(struct upstream_req *u)
+{
+	struct scm_sock_data *d = u->d;
+	NihIo *io = d->io;
+
+	nih_free(u);
+	if (io)
+		nih_io_shutdown(io);
+	else
+		nih_free(d);
+}
+
+static void upstream_reply_timeout(struct upstream_req *u, NihTimer *timer)
+{
+	u->timer = NULL;  // freed by the main loop
+	nih_error("%s: timed out waiting for client", __func__);
+	upstream_finish(u);
+}
+
+static void upstream_reply_watcher(struct upstream_req *u, NihIoWatch *watch,
+		NihIoEvents events)
+{
+	if (upstream_reply_flush(u)) {
+		upstream_finish(u);
+		return;
+	}
+	/* the client read some: give it another second */
+	if (u->timer)
+		nih_free(u->timer);
+	u->timer = NIH_MUST( nih_timer_add_timeout(NULL, 1,
+				(NihTimerCb) upstream_reply_timeout, u) );
+}
+
+/*
+ * Answer the client, and free @u once that is done.  cgmanager is done
+ * with @u either way, so its in-flight slot is freed at once.
+ */
+static void upstream_done(struct upstream_req *u, bool ok)
+{
+	struct scm_sock_data *d = u->d;
+
+	if (u->sent)
+		nr_inflight--;
+	u->sent = false;
+	if (u->timer)
+		nih_free(u->timer);
+	u->timer = NULL;
+	nih_list_remove(&u->entry);
+
+	if (d->message) {
+		upstream_reply_dbus(u, ok);
+		upstream_finish(u);
+	} else if (upstream_reply_scm(u, ok)) {
+		upstream_finish(u);
+	} else {
+		upstream_reply_waits++;
+		u->out_watch = NIH_MUST( nih_io_add_watch(u, d->fd,
+					NIH_IO_WRITE,
+					(NihIoWatcher) upstream_reply_watcher, u) );
+		u->timer = NIH_MUST( nih_timer_add_timeout(NULL, 1,
+					(NihTimerCb) upstream_reply_timeout, u) );
+	}
+
+	upstream_pump();
+}
+
+static void upstream_dispatch(uint32_t id, const char *buf, size_t len,
+		struct ucred *cred)
+{
+	NIH_LIST_FOREACH(upstream_reqs, iter) {
+		struct upstream_req *u = (struct upstream_req *)iter;
+		int ret;
+
+		if (u->id != id)
+			continue;
+		ret = upstream_feed(u, buf, len, cred);
+		if (ret < 0)
+			nih_error("%s: bad reply from cgmanager for request %u",
+				__func__, id);
+		if (ret != 0)
+			upstream_done(u, ret > 0);
+		return;
+	}
+	/* the request timed out, or its client went away */
+	nih_debug("%s: dropping reply for request %u", __func__, id);
+}
+
+static void close_proxy_channel(void)
+{
+	if (chan_fd == -1)
+		return;
+
+	nih_free(chan_watch);
+	chan_watch = NULL;
+	close(chan_fd);
+	chan_fd = -1;
+	chan_vcred_pending = false;
+
+	NIH_LIST_FOREACH_SAFE(upstream_queue, iter)
+		upstream_done((struct upstream_req *)iter, false);
+	NIH_LIST_FOREACH_SAFE(upstream_reqs, iter)
+		upstream_done((struct upstream_req *)iter, false);
+}
+
+static void upstream_read(void)
+{
+	for (;;) {
+		char cmsgbuf[CMSG_SPACE(sizeof(struct ucred))];
+		struct ucred cred = { .pid = -1, .uid = -1, .gid = -1 };
+		nih_local char *buf = NULL;
+		struct msghdr msg = { 0 };
+		struct iovec iov[2];
+		struct cmsghdr *cmsg;
+		uint32_t id;
+		int avail = 0;
+		ssize_t ret;
+
+		/* the size of the next datagram */
+		if (ioctl(chan_fd, FIONREAD, &avail) < 0 || avail < 0)
+			avail = 0;
+		buf = NIH_MUST( nih_alloc(NULL, avail + 1) );
+
+		iov[0].iov_base = &id;
+		iov[0].iov_len = sizeof(id);
+		iov[1].iov_base = buf;
+		iov[1].iov_len = avail;
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		msg.msg_control = cmsgbuf;
+		msg.msg_controllen = sizeof(cmsgbuf);
+
+		ret = recvmsg(chan_fd, &msg, MSG_DONTWAIT);
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (ret <= 0) {
+			nih_error("%s: lost proxy channel: %s", __func__,
+				ret < 0 ? strerror(errno) : "closed");
+			close_proxy_channel();
+			return;
+		}
+		if (ret < sizeof(id))
+			continue;
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg && cmsg->cmsg_len == CMSG_LEN(sizeof(struct ucred)) &&
+				cmsg->cmsg_level == SOL_SOCKET &&
+				cmsg->cmsg_type == SCM_CREDENTIALS)
+			memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+
+		upstream_dispatch(id, buf, ret - sizeof(id), &cred);
+		if (chan_fd == -1)
+			return;
+	}
+}
+
+static void chan_watcher(void *data, NihIoWatch *watch, NihIoEvents events)
+{
+	if (events & NIH_IO_WRITE) {
+		watch->events &= ~NIH_IO_WRITE;
+		upstream_pump();
+	}
+	if ((events & NIH_IO_READ) && chan_fd != -1)
+		upstream_read();
+}
+
+/*
+ * Register a channel with cgmanager.  If cgmanager is too old to know
+ * RegisterProxyChannel, requests will be forwarded synchronously, each
+ * with its *Scm method.
+ */
+static void open_proxy_channel(void)
+{
+	DBusMessage *message, *reply;
+	DBusMessageIter iter;
+	DBusError error;
+	int sv[2];
+
+	close_proxy_channel();
+	if (!upstream_reqs) {
+		upstream_reqs = NIH_MUST( nih_list_new(NULL) );
+		upstream_queue = NIH_MUST( nih_list_new(NULL) );
+	}
+
+	if (!(message = start_dbus_request("RegisterProxyChannel", sv))) {
+		nih_error("%s: error starting dbus request", __func__);
+		return;
+	}
+
+	dbus_message_iter_init_append(message, &iter);
+	if (! dbus_message_iter_append_basic (&iter, DBUS_TYPE_UNIX_FD, &sv[1])) {
+		nih_error("%s: out of memory", __func__);
+		dbus_message_unref(message);
+		goto out;
+	}
+
+	dbus_error_init(&error);
+	reply = dbus_connection_send_with_reply_and_block(server_conn, message,
+			-1, &error);
+	dbus_message_unref(message);
+	if (!reply) {
+		nih_info("cgmanager does not support proxy channels (%s), "
+			"forwarding requests synchronously", error.message);
+		dbus_error_free(&error);
+		goto out;
+	}
+	dbus_message_unref(reply);
+
+	chan_fd = sv[0];
+	close(sv[1]);
+	chan_watch = NIH_MUST( nih_io_add_watch(NULL, chan_fd, NIH_IO_READ,
+				chan_watcher, NULL) );
+	return;
 out:
 	close(sv[0]);
 	close(sv[1]);
-	return ret;
+}
 
-bad:
-	ret = -1;
-	nih_error("%s: corrupted result from cgmanager", __func__);
-	goto out;
+static bool proxy_check(struct scm_sock_data *d)
+{
+	if (memcmp(&d->pcred, &d->rcred, sizeof(struct ucred)) != 0) {
+		nih_error("%s: proxy != requestor", __func__);
+		return false;
+	}
+	if (d->type == REQ_TYPE_GET_PID || d->type == REQ_TYPE_GET_PID_ABS)
+		return true;
+	if (!sane_cgroup(d->cgroup)) {
+		nih_error("%s: unsafe cgroup", __func__);
+		return false;
+	}
+	if (d->type == REQ_TYPE_MOVE_PID && d->cgroup[0] == '/') {
+		nih_error("%s: uid %u tried to escape its cgroup", __func__,
+			d->rcred.uid);
+		return false;
+	}
+	return true;
+}
+
+bool proxy_forward(struct scm_sock_data *d)
+{
+	struct upstream_req *u;
+
+	/* the channel has no room for a batch's operations */
+	if (chan_fd == -1 || d->type < 0 || d->type >= REQ_TYPE_MAX ||
+			d->type == REQ_TYPE_LISTCONTROLLERS ||
+			d->type == REQ_TYPE_BATCH ||
+			d->type == REQ_TYPE_GET_VALUES ||
+			d->type == REQ_TYPE_SET_VALUES ||
+			d->type == REQ_TYPE_CLAIM)
+		return false;
+	if (chan_req_build(NULL, d, 0) > CHAN_MAX_MSG)
+		return false;
+
+	u = NIH_MUST( nih_new(d, struct upstream_req) );
+	memset(u, 0, sizeof(*u));
+	nih_list_init(&u->entry);
+	nih_alloc_set_destructor(u, upstream_req_destroy);
+	u->d = d;
+
+	if (!proxy_check(d)) {
+		upstream_done(u, false);
+		return true;
+	}
+
+	nih_list_add(upstream_queue, &u->entry);
+	upstream_pump();
+	return true;
+}
+
+static void list_controllers_notify(DBusPendingCall *pending, void *data)
+{
+	NihDBusMessage *message = *(NihDBusMessage **)data;
+	DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+	char **output;
+
+	if (reply && dbus_message_get_type(reply) != DBUS_MESSAGE_TYPE_ERROR &&
+			parse_controllers(message, reply, &output) == 0 &&
+			cgmanager_list_controllers_reply(message, output) == 0)
+		goto out;
+
+	if (nih_dbus_message_error(message, DBUS_ERROR_INVALID_ARGS,
+				"invalid request") < 0) {
+		NihError *error = nih_error_get();
+		nih_free(error);
+	}
+out:
+	if (reply)
+		dbus_message_unref(reply);
+	dbus_pending_call_unref(pending);
+}
+
+static void list_controllers_free(void *data)
+{
+	nih_free(data);
+}
+
+/*
+ * ListControllers is a plain dbus call to cgmanager; answer the client
+ * from the pending call's notification rather than blocking for it.
+ */
+bool proxy_list_controllers(NihDBusMessage *message)
+{
+	DBusMessage *msg;
+	DBusPendingCall *pending = NULL;
+	NihDBusMessage **ref;
+
+	msg = dbus_message_new_method_call(dbus_bus_get_unique_name(server_conn),
+			"/org/linuxcontainers/cgmanager",
+			"org.linuxcontainers.cgmanager0_0", "ListControllers");
+	if (!msg)
+		return false;
+	if (!dbus_connection_send_with_reply(server_conn, msg, &pending, -1) ||
+			!pending) {
+		dbus_message_unref(msg);
+		return false;
+	}
+	dbus_message_unref(msg);
+
+	/* hold on to @message until cgmanager replies */
+	ref = NIH_MUST( nih_new(NULL, NihDBusMessage *) );
+	*ref = message;
+	nih_ref(message, ref);
+	if (!dbus_pending_call_set_notify(pending, list_controllers_notify,
+				ref, list_controllers_free)) {
+		dbus_pending_call_cancel(pending);
+		dbus_pending_call_unref(pending);
+		nih_free(ref);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Statistics are per-daemon, so report the proxy's own rather than
+ * forwarding the request to the host cgmanager.
+ */
+int get_stats_main (void *parent, char ***output)
+{
+	size_t len = 0;
+	unsigned long queued = 0;
+
+	*output = NIH_MUST( nih_str_array_new(parent) );
+
+	if (upstream_queue) {
+		NIH_LIST_FOREACH(upstream_queue, iter)
+			queued++;
+	}
+	add_stat(parent, output, &len, "upstream_channel", chan_fd != -1);
+	add_stat(parent, output, &len, "upstream_max_inflight", max_inflight);
+	add_stat(parent, output, &len, "upstream_inflight", nr_inflight);
+	add_stat(parent, output, &len, "upstream_queued", queued);
+	add_stat(parent, output, &len, "upstream_forwarded", upstream_forwarded);
+	add_stat(parent, output, &len, "upstream_timeouts", upstream_timeouts);
+	add_stat(parent, output, &len, "upstream_reply_waits",
+			upstream_reply_waits);
+	add_stat(parent, output, &len, "upstream_query_timeout", query_timeout);
+	add_stat(parent, output, &len, "upstream_update_timeout", update_timeout);
+
+	return 0;
 }
 
 /**
@@ -1373,6 +2348,12 @@ static NihOption options[] = {
 		NULL, NULL, &sigstop, NULL },
 	{ 0, "check-master", N_("Check whether cgmanager is running"),
 	  NULL, NULL, &checkmaster, NULL },
+	{ 0, "max-inflight", N_("Maximum number of requests forwarded to cgmanager at once (default 64)"),
+	  NULL, "N", &max_inflight, nih_option_int },
+	{ 0, "query-timeout", N_("Seconds to wait for cgmanager to answer a forwarded query before failing it (default 2, 0 to wait forever)"),
+	  NULL, "SECS", &query_timeout, nih_option_int },
+	{ 0, "update-timeout", N_("Seconds to wait for cgmanager to answer a forwarded request which changes cgroups or walks a subtree before failing it (default 30, 0 to wait forever)"),
+	  NULL, "SECS", &update_timeout, nih_option_int },
 
 	NIH_OPTION_LAST
 };
@@ -1401,6 +2382,15 @@ main (int argc, char *argv[])
 		exit(1);
 	}
 
+	if (max_inflight < 1) {
+		nih_fatal("%s: --max-inflight must be at least 1", __func__);
+		exit(1);
+	}
+	if (query_timeout < 0 || update_timeout < 0) {
+		nih_fatal("%s: timeouts may not be negative", __func__);
+		exit(1);
+	}
+
 	/*
 	 * If we are called with checkmaster, then only check whether
 	 * cgmanager is running.  This is used by the init script to
@@ -1456,6 +2446,8 @@ main (int argc, char *argv[])
 		exit(1);
 	}
 
+	open_proxy_channel();
+
 	if (sigstop)
 		raise(SIGSTOP);
 
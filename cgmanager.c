@@ -21,15 +21,122 @@
 #include <sys/resource.h>
 #include <sys/vfs.h>
 #include <linux/fs.h>
+#include <nih/hash.h>
+#include <nih/timer.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+
+/*
+ * Autoremove (RemoveOnEmpty on the unified hierarchy), PopulatedChanged
+ * signals and WaitEmpty are done with a single inotify instance.  Each
+ * entry watches its cgroup.events file for IN_MODIFY, and its parent
+ * directory for IN_DELETE to notice when somebody else removes it.
+ * Siblings share the parent's watch, as inotify hands out one wd per
+ * inode, so watches are refcounted and kept in a table keyed by wd.
+ * Entries are kept in a table keyed by path, so a DELETE event on a
+ * directory finds its entry by name.  An entry lives while it is to be
+ * autoremoved, or has subscribers or waiters.
+ */
+struct autoremove_watch {
+	NihList entry;
+
+	int wd;
+	int refs;
+	char *path;
+	struct autoremove_entry *owner;  // for a cgroup.events watch
+	struct key_watch *kw;            // for a Watch on the unified hierarchy
+};
 
 struct autoremove_entry {
 	NihList entry;
 
 	char *gpath, *evpath, *dirname;
-	int wd_cg, wd_events;
-	NihIo *io;
+	struct autoremove_watch *cg_watch, *events_watch;
+	bool autoremove;
+	bool deferred;    // a RemoveDeferred is retrying it
+	int populated;    // as last read from cgroup.events, or -1
+	NihList subs;     // struct populated_sub
+	NihList waiters;  // struct empty_waiter
+};
+
+/* A client connection subscribed to an entry's populated changes */
+struct populated_sub {
+	NihList entry;
+	DBusConnection *conn;
+	char *controller, *cgroup;  // as the client named them
+};
+
+/* A WaitEmpty call waiting for an entry to become empty */
+struct empty_waiter {
+	NihList entry;
+	NihDBusMessage *message;
+	NihTimer *timer;
+	struct autoremove_entry *owner;
+};
+
+/*
+ * Watch on a cgroup file.  However many clients watch it, the kernel
+ * is asked once: the file is added to the autoremove inotify instance
+ * on the unified hierarchy, or an eventfd is registered through
+ * cgroup.event_control on a v1 one.  A pressure watch instead holds a
+ * PSI trigger written to a unified cgroup's <resource>.pressure file,
+ * which the kernel reports as an exceptional condition on that fd.
+ * Watches are kept in a table keyed by path and event_control
+ * arguments or trigger, and live while they have subscribers.
+ */
+struct key_watch {
+	NihList entry;
+
+	char *name;      // path and args
+	char *path, *dir;
+	bool readable;   // is there a value to send with KeyChanged?
+	bool pressure;   // a PSI trigger, signalled with PressureChanged
+	struct autoremove_watch *iwatch;  // unified
+	int fd;                           // v1 eventfd, PSI trigger, or -1
+	NihIoWatch *io_watch;             // on fd
+
+	/*
+	 * A pressure watch signals at most once per pressure_holdoff ms;
+	 * triggers firing meanwhile are sent as one when it expires.
+	 */
+	int tfd;                          // holdoff timerfd, or -1
+	NihIoWatch *tfd_watch;
+	bool holdoff, pending;
+
+	NihList subs;    // struct key_sub
+};
+
+/* A client connection subscribed to a key watch */
+struct key_sub {
+	NihList entry;
+	DBusConnection *conn;
+	char *controller, *cgroup, *key, *args;  // as the client named them
+};
+
+/*
+ * A RemoveDeferred which has yet to succeed.  Each attempt is run on
+ * the work queue; after a failed one the next is timed on a timerfd,
+ * with the delay doubling each time.  On the unified hierarchy the
+ * cgroup's autoremove entry is kept while the removal is pending, so
+ * that it is retried at once when the cgroup becomes empty.  Pending
+ * removals are kept in a table keyed by path.
+ */
+struct deferred_remove {
+	NihList entry;
+
+	char *path;       // also its key on the work queue
+	bool unified, recursive;
+	int attempts;
+	bool running;     // an attempt is on the work queue
+	bool kicked;      // the cgroup became empty meanwhile
+	int result;       // of the last attempt, set by the worker
+	int tfd;
+	NihIoWatch *tfd_watch;
 };
 
+#define DEFERRED_REMOVE_MAX_DELAY 10000  // ms
+
 /*
  * Maximum depth of directories we allow in Create
  * Default is 16.  Figure 4 directories per level of container
@@ -37,8 +144,45 @@ struct autoremove_entry {
  * 4 containers deep.
  */
 static int maxdepth = 16;
+static int nr_threads = 0;
+static int pressure_holdoff = 100;  // ms
+static int max_watches = 64;  // per client connection
+static int use_mirror = FALSE;
+static int walk_fanout = 2;
+static int remove_retries = 10;
+static int remove_backoff = 50;  // ms
+static int pool_size = 0;
+static char *pool_parent;
+static int pool_uid = 0, pool_gid = 0;
+
+static NihHash *autoremove_entries;  // by gpath
+static NihHash *autoremove_watches;  // by wd
+static int autoremove_ifd = -1;
+static NihIo *autoremove_io;
+static unsigned long autoremove_overflows;
+static unsigned long populated_signals;
+
+static NihHash *deferred_removes;  // by path
+static unsigned long deferred_remove_queued, deferred_remove_attempts;
+static unsigned long deferred_remove_retries, deferred_remove_kicks;
+static unsigned long deferred_remove_succeeded, deferred_remove_failed;
+static void deferred_remove_kick(const char *gpath);
+static NihHash *key_watches;  // by path and args
+static unsigned long key_watch_events, key_watch_signals;
+static unsigned long pressure_coalesced, key_watch_refused;
+
+static void key_watch_inotify_event(struct key_watch *kw,
+		struct inotify_event *event);
 
-static NihList autoremove_entries;
+/*
+ * Is @controller a single controller, rather than "all" or a list?
+ * Requests on several controllers find the requestor's cgroups in all
+ * of them at once with resolve_pid_cgroups().
+ */
+static bool single_controller(const char *controller)
+{
+	return strcmp(controller, "all") != 0 && !strchr(controller, ',');
+}
 
 /* GetPidCgroup */
 int get_pid_cgroup_main(void *parent, char *controller, struct ucred p,
@@ -122,44 +266,45 @@ int get_pid_cgroup_abs_main(void *parent, char *controller,struct ucred p,
 	return 0;
 }
 
-static bool victim_under_proxy_cgroup(char *rcgpath, pid_t v,
-		const char *controller)
+static bool victim_under_proxy_cgroup(char *rcgpath,
+		const struct resolved_cgroup *vcg)
 {
-	char vcgpath[MAXPATHLEN];
-
-	if (!compute_pid_cgroup(v, controller, "", vcgpath, NULL)) {
+	if (!vcg->path) {
 		nih_error("%s: Could not determine the victim's cgroup for %s",
-				__func__, controller);
+				__func__, vcg->controller);
 		return false;
 	}
-	if (strncmp(vcgpath, rcgpath, strlen(rcgpath)) != 0)
+	if (strncmp(vcg->path, rcgpath, strlen(rcgpath)) != 0)
 		return false;
 	return true;
 }
 
-int per_ctrl_move_pid_main(const char *controller, const char *cgroup, struct ucred p,
-		struct ucred r, struct ucred v, bool escape)
+/*
+ * @rcg is the cgroup of r (of p if escaping), and @vcg that of the
+ * victim, in the same controller.
+ */
+int per_ctrl_move_pid_main(const struct resolved_cgroup *rcg,
+		const struct resolved_cgroup *vcg, const char *cgroup,
+		struct ucred p, struct ucred r, struct ucred v)
 {
-	char rcgpath[MAXPATHLEN], path[MAXPATHLEN];
+	const char *controller = rcg->controller;
+	char *rcgpath = rcg->path, path[MAXPATHLEN], pidstr[20];
 	bool unified = false;
-	FILE *f;
-	pid_t query = r.pid;
 	size_t maxlen;
+	int len;
 
 	if (is_unified_controller(controller))
 		unified = true;
 
-	// Get r's current cgroup in rcgpath
-	if (escape)
-		query = p.pid;
-	if (!compute_proxy_cgroup(query, controller, "", rcgpath, NULL)) {
+	// r's current cgroup, found by resolve_pid_cgroups()
+	if (!rcgpath) {
 		nih_error("%s: Could not determine the requestor's cgroup for %s",
                 __func__, controller);
 		return -1;
 	}
 
 	// If the victim is not under proxy's cgroup, refuse
-	if (!victim_under_proxy_cgroup(rcgpath, v.pid, controller)) {
+	if (!victim_under_proxy_cgroup(rcgpath, vcg)) {
 		nih_error("%s: victim's cgroup is not under proxy's (p.uid %u)", __func__, p.uid);
 		return -1;
 	}
@@ -204,20 +349,13 @@ int per_ctrl_move_pid_main(const char *controller, const char *cgroup, struct uc
 			r.pid, r.uid, r.gid, path);
 		return -1;
 	}
-	f = fopen(path, "w");
-	if (!f) {
-		nih_error("%s: Failed to open %s", __func__, path);
-		return -1;
-	}
-	if (fprintf(f, "%d\n", v.pid) < 0) {
-		fclose(f);
-		nih_error("%s: Failed to write %d to %s", __func__, v.pid, path);
-		return -1;
-	}
-	if (fclose(f) != 0) {
-		nih_error("%s: Failed to write %d to %s", __func__, v.pid, path);
+	len = snprintf(pidstr, sizeof(pidstr), "%d\n", v.pid);
+	if (cgfs_write(path, pidstr, len) < 0) {
+		nih_error("%s: Failed to write %d to %s: %s", __func__, v.pid,
+			path, strerror(errno));
 		return -1;
 	}
+	pid_cgroup_cache_invalidate(v.pid);
 	nih_info(_("%d moved to %s:%s by %d's request"), v.pid,
 		controller, cgroup, r.pid);
 	return 0;
@@ -226,9 +364,8 @@ int per_ctrl_move_pid_main(const char *controller, const char *cgroup, struct uc
 int do_move_pid_main(const char *controller, const char *cgroup, struct ucred p,
 		struct ucred r, struct ucred v, bool escape)
 {
-	nih_local char *c = NULL;
-	char *tok;
-	int ret;
+	nih_local struct resolved_cgroup *rcgs = NULL, *vcgs = NULL;
+	int i, n, ret;
 	int while_ret = 0;
 
 	if (!sane_cgroup(cgroup)) {
@@ -242,27 +379,24 @@ int do_move_pid_main(const char *controller, const char *cgroup, struct ucred p,
 		return -1;
 	}
 
-	if (strcmp(controller, "all") != 0 && !strchr(controller, ','))
-		return per_ctrl_move_pid_main(controller, cgroup, p, r, v, escape);
-
-	if (strcmp(controller, "all") == 0) {
-		if (!all_controllers)
-			return 0;
-		c = NIH_MUST( nih_strdup(NULL, all_controllers) );
-	} else {
-		c = NIH_MUST( nih_strdup(NULL, controller) );
-		do_prune_comounts(c);
+	n = resolve_pid_cgroups(NULL, escape ? p.pid : r.pid, controller, true,
+			&rcgs);
+	resolve_pid_cgroups(NULL, v.pid, controller, false, &vcgs);
+	if (n <= 0) {
+		nih_error("%s: no controllers in '%s'", __func__, controller);
+		return -1;
 	}
-	tok = strtok(c, ",");
-	while (tok) {
-		ret = per_ctrl_move_pid_main(tok, cgroup, p, r, v, escape);
+
+	if (single_controller(controller))
+		return per_ctrl_move_pid_main(&rcgs[0], &vcgs[0], cgroup, p, r, v);
+
+	for (i = 0; i < n; i++) {
+		ret = per_ctrl_move_pid_main(&rcgs[i], &vcgs[i], cgroup, p, r, v);
 
 		/* Save error for later (but ignore permission denied, -2),
 		   but try to complete rest of moves anyway */
 		if (ret != 0 && ret != -2)
 			while_ret = -1;
-
-		tok = strtok(NULL, ",");
 	}
 
 	return while_ret;
@@ -286,18 +420,19 @@ int move_pid_abs_main(const char *controller, const char *cgroup, struct ucred p
 	return do_move_pid_main(controller, cgroup, p, r, v, true);
 }
 
-int do_create_main(const char *controller, const char *cgroup, struct ucred p,
-		struct ucred r, int32_t *existed)
+int do_create_main(const struct resolved_cgroup *rcg, const char *cgroup,
+		struct ucred p, struct ucred r, int32_t *existed)
 {
-	int ret, depth;
-	char rcgpath[MAXPATHLEN], path[MAXPATHLEN], dirpath[MAXPATHLEN];
+	const char *controller = rcg->controller;
+	int ret, depth = rcg->depth;
+	char *rcgpath = rcg->path, path[MAXPATHLEN], dirpath[MAXPATHLEN];
 	nih_local char *copy = NULL;
 	size_t cgroup_len;
 	char *p1, *p2, oldp2;
 
 	*existed = 1;
-	// Get r's current cgroup in rcgpath
-	if (!compute_pid_cgroup(r.pid, controller, "", rcgpath, &depth)) {
+	// r's current cgroup, found by resolve_pid_cgroups()
+	if (!rcgpath) {
 		nih_error("%s: Could not determine the requestor's cgroup for %s",
                 __func__, controller);
 		return -1;
@@ -344,7 +479,7 @@ int do_create_main(const char *controller, const char *cgroup, struct ucred p,
 				r.pid, r.uid, r.gid, dirpath);
 			return -2;
 		}
-		ret = mkdir(path, 0755);
+		ret = cgfs_mkdir(path, 0755);
 		if (ret < 0) {  // Should we ignore EEXIST?  Ok, but don't chown.
 			if (errno == EEXIST) {
 				*existed = 1;
@@ -356,14 +491,14 @@ int do_create_main(const char *controller, const char *cgroup, struct ucred p,
 		if (!unified_copy_controllers(controller, path)) {
 			nih_error("%s: Failed to set cg controllers on %s", __func__,
 					path);
-			rmdir(path);
+			cgfs_rmdir(path);
 			return -1;
 		}
 		if (!chown_cgroup_path(path, r.uid, r.gid, true,
 				       is_unified_controller(controller))) {
 			nih_error("%s: Failed to change ownership on %s to %u:%u", __func__,
 				path, r.uid, r.gid);
-			rmdir(path);
+			cgfs_rmdir(path);
 			return -1;
 		}
 		*existed = -1;
@@ -384,9 +519,8 @@ next:
 int create_main(const char *controller, const char *cgroup, struct ucred p,
 		struct ucred r, int32_t *existed)
 {
-	nih_local char *c = NULL;
-	char *tok;
-	int ret;
+	nih_local struct resolved_cgroup *rcgs = NULL;
+	int i, n, ret;
 
 	*existed = -1;
 	if (!cgroup || ! *cgroup)  // nothing to do
@@ -397,42 +531,436 @@ int create_main(const char *controller, const char *cgroup, struct ucred p,
 		return -1;
 	}
 
-	if (strcmp(controller, "all") != 0 && !strchr(controller, ','))
-		return do_create_main(controller, cgroup, p, r, existed);
+	n = resolve_pid_cgroups(NULL, r.pid, controller, false, &rcgs);
+	if (n <= 0) {
+		nih_error("%s: no controllers in '%s'", __func__, controller);
+		return -1;
+	}
+	if (single_controller(controller))
+		return do_create_main(&rcgs[0], cgroup, p, r, existed);
 
-	if (strcmp(controller, "all") == 0) {
-		if (!all_controllers)
-			return 0;
-		c = NIH_MUST( nih_strdup(NULL, all_controllers) );
-	} else {
-		c = NIH_MUST( nih_strdup(NULL, controller) );
-		do_prune_comounts(c);
+	for (i = 0; i < n; i++) {
+		int32_t e = 1;
+		ret = do_create_main(&rcgs[i], cgroup, p, r, &e);
+		if (ret == -2)  // permission denied - ignore for group requests
+			continue;
+		if (ret != 0)
+			return -1;
+		if (e == 1)
+			*existed = 1;
+	}
+
+	return 0;
+}
+
+/*
+ * The warm pool.  With --pool=N, cgmanager keeps N spare cgroups,
+ * named .cgm_pool.<n>, in --pool-parent on each v1 hierarchy, made and
+ * chowned to --pool-uid:--pool-gid ahead of time.  Claim renames a
+ * spare into place, so that a new container's cgroup costs a rename
+ * per hierarchy rather than a mkdir and a chown of every file, and a
+ * worker then tops the pool up.  cgroupfs only renames a cgroup
+ * within its parent, and the unified hierarchy not at all, so only
+ * cgroups directly under the pool parent on v1 hierarchies come from
+ * the pool; anything else is created as by Create.  The list of
+ * hierarchies is fixed once set up; their spares are under pool_lock.
+ * The spares' names are reserved: no other request may name them, and
+ * ListChildren does not show them.
+ */
+
+struct pool_hier {
+	NihList entry;
+	char *dir;          // the pool parent
+	char **spares;      // names of the spare cgroups in dir
+	size_t nr_spares;
+};
+
+static NihList *pool_hiers;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long pool_serial;
+static unsigned long pool_claimed, pool_misses, pool_created, pool_errors;
+static bool pool_refill_failed;
+static int pool_efd = -1;
+static bool pool_refilling, pool_refill_again;  // main loop only
+
+static bool normalize_path(char *path);
+
+static struct pool_hier *pool_hier_lookup(const char *dir)
+{
+	if (!pool_hiers)
+		return NULL;
+	NIH_LIST_FOREACH(pool_hiers, iter) {
+		struct pool_hier *h = (struct pool_hier *)iter;
+
+		if (strcmp(h->dir, dir) == 0)
+			return h;
+	}
+	return NULL;
+}
+
+/* Runs on a worker: make spares until each hierarchy has pool_size */
+static void pool_refill_run(void *data)
+{
+	NIH_LIST_FOREACH(pool_hiers, iter) {
+		struct pool_hier *h = (struct pool_hier *)iter;
+		char name[NAME_MAX+1], path[MAXPATHLEN];
+		bool need;
+
+		for (;;) {
+			pthread_mutex_lock(&pool_lock);
+			need = h->nr_spares < (size_t)pool_size;
+			snprintf(name, sizeof(name), POOL_PREFIX "%lu",
+				 pool_serial++);
+			pthread_mutex_unlock(&pool_lock);
+			if (!need)
+				break;
+
+			snprintf(path, MAXPATHLEN, "%s/%s", h->dir, name);
+			if (cgfs_mkdir(path, 0755) < 0) {
+				if (errno == EEXIST)  // left by an earlier run
+					continue;
+				nih_warn("%s: Failed to create %s: %s",
+					 __func__, path, strerror(errno));
+				goto fail;
+			}
+			if ((pool_uid || pool_gid) &&
+					!chown_cgroup_path(path, pool_uid,
+						pool_gid, true, false)) {
+				nih_warn("%s: Failed to change ownership on %s to %d:%d",
+					 __func__, path, pool_uid, pool_gid);
+				cgfs_rmdir(path);
+				goto fail;
+			}
+
+			pthread_mutex_lock(&pool_lock);
+			NIH_MUST( nih_str_array_add(&h->spares, h,
+						&h->nr_spares, name) );
+			pool_created++;
+			pthread_mutex_unlock(&pool_lock);
+		}
+		continue;
+
+fail:
+		pthread_mutex_lock(&pool_lock);
+		pool_errors++;
+		pool_refill_failed = true;
+		pthread_mutex_unlock(&pool_lock);
+	}
+}
+
+static void pool_refill(void);
+
+static void pool_refill_done(void *data)
+{
+	bool failed;
+
+	pthread_mutex_lock(&pool_lock);
+	failed = pool_refill_failed;
+	pool_refill_failed = false;
+	pthread_mutex_unlock(&pool_lock);
+
+	pool_refilling = false;
+	if (pool_refill_again && !failed) {
+		pool_refill_again = false;
+		pool_refill();
+	}
+}
+
+/* Top up the pool, unless that is already under way */
+static void pool_refill(void)
+{
+	if (pool_refilling) {
+		pool_refill_again = true;
+		return;
+	}
+	pool_refilling = true;
+	work_submit(NULL, false, pool_refill_run, pool_refill_done, NULL);
+}
+
+static void pool_kick(void *data, NihIoWatch *watch, NihIoEvents events)
+{
+	uint64_t count;
+
+	if (read(pool_efd, &count, sizeof(count)) != sizeof(count))
+		return;
+	pool_refill();
+}
+
+/*
+ * Ask the main loop to top up the pool.  Claim may run on a worker, and
+ * without workers this keeps the refill off the Claim's own path.
+ */
+static void pool_wake(void)
+{
+	uint64_t one = 1;
+
+	if (write(pool_efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		nih_warn("%s: Failed to wake main loop: %s", __func__,
+			 strerror(errno));
+}
+
+/*
+ * Find the pool parent on each v1 hierarchy, creating it if need be,
+ * adopt any spares left there by an earlier run, and start filling it.
+ */
+static bool setup_pool(void)
+{
+	nih_local char *controllers = NULL;
+	char *tok, *saveptr = NULL;
+
+	pool_hiers = NIH_MUST( nih_list_new(NULL) );
+	if (pool_size <= 0 || !all_controllers)
+		return true;
+
+	pool_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (pool_efd < 0) {
+		nih_error("%s: Failed to create eventfd: %s", __func__,
+			  strerror(errno));
+		return false;
 	}
-	tok = strtok(c, ",");
-	while (tok) {
+	NIH_MUST( nih_io_add_watch(NULL, pool_efd, NIH_IO_READ, pool_kick,
+				NULL) );
+
+	controllers = NIH_MUST( nih_strdup(NULL, all_controllers) );
+	for (tok = strtok_r(controllers, ",", &saveptr); tok;
+			tok = strtok_r(NULL, ",", &saveptr)) {
+		const char *mnt = get_controller_path(tok);
+		char dir[MAXPATHLEN], path[MAXPATHLEN];
+		struct dirent dirent, *direntp;
+		struct pool_hier *h;
+		size_t len;
+		DIR *d;
+
+		if (!mnt || is_unified_controller(tok))
+			continue;
+		if (snprintf(dir, MAXPATHLEN, "%s/%s", mnt,
+				pool_parent ? pool_parent : "") >= MAXPATHLEN ||
+				!normalize_path(dir)) {
+			nih_error("%s: Bad pool parent %s", __func__, pool_parent);
+			return false;
+		}
+		len = strlen(dir);
+		if (len > 1 && dir[len - 1] == '/')
+			dir[len - 1] = '\0';
+		if (pool_hier_lookup(dir))  // comounted
+			continue;
+		if (!dir_exists(dir) && cgfs_mkdir(dir, 0755) < 0 &&
+				errno != EEXIST) {
+			nih_warn("%s: Failed to create %s: %s", __func__, dir,
+				 strerror(errno));
+			continue;
+		}
+
+		h = NIH_MUST( nih_new(pool_hiers, struct pool_hier) );
+		nih_list_init(&h->entry);
+		h->dir = NIH_MUST( nih_strdup(h, dir) );
+		h->spares = NIH_MUST( nih_str_array_new(h) );
+		h->nr_spares = 0;
+
+		/* adopt only spares which nobody has tampered with */
+		if ((d = cgfs_opendir(dir)) != NULL) {
+			while (readdir_r(d, &dirent, &direntp) == 0 && direntp) {
+				if (strncmp(direntp->d_name, POOL_PREFIX,
+						strlen(POOL_PREFIX)) != 0)
+					continue;
+				if (snprintf(path, MAXPATHLEN, "%s/%s", dir,
+						direntp->d_name) >= MAXPATHLEN)
+					continue;
+				if (!cgroup_pristine(path, pool_uid, pool_gid)) {
+					nih_warn("%s: Not adopting %s: it is not empty, or not owned by %d:%d",
+						 __func__, path, pool_uid, pool_gid);
+					continue;
+				}
+				NIH_MUST( nih_str_array_add(&h->spares, h,
+							&h->nr_spares,
+							direntp->d_name) );
+			}
+			closedir(d);
+		}
+		nih_list_add(pool_hiers, &h->entry);
+	}
+
+	pool_refill();
+	return true;
+}
+
+static void pool_get_stats(void *parent, char ***output, size_t *len)
+{
+	unsigned long spares = 0;
+
+	pthread_mutex_lock(&pool_lock);
+	if (pool_hiers) {
+		NIH_LIST_FOREACH(pool_hiers, iter)
+			spares += ((struct pool_hier *)iter)->nr_spares;
+	}
+	add_stat(parent, output, len, "pool_spares", spares);
+	add_stat(parent, output, len, "pool_claimed", pool_claimed);
+	add_stat(parent, output, len, "pool_misses", pool_misses);
+	add_stat(parent, output, len, "pool_created", pool_created);
+	add_stat(parent, output, len, "pool_errors", pool_errors);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static int do_claim_main(const struct resolved_cgroup *rcg,
+		const char *cgroup, struct ucred p, struct ucred r,
+		int32_t *existed)
+{
+	char path[MAXPATHLEN], *leaf;
+	nih_local char *spare = NULL, *sparepath = NULL;
+	struct pool_hier *h;
+	size_t len;
+
+	*existed = 1;
+	if (!rcg->path || is_unified_controller(rcg->controller) ||
+			snprintf(path, MAXPATHLEN, "%s/%s", rcg->path,
+				 cgroup) >= MAXPATHLEN ||
+			!normalize_path(path))
+		goto create;
+	len = strlen(path);
+	if (len > 1 && path[len - 1] == '/')
+		path[len - 1] = '\0';
+	if (!(leaf = strrchr(path, '/')) || !leaf[1])
+		goto create;
+	*leaf = '\0';
+	h = pool_hier_lookup(path);
+	*leaf = '/';
+	if (!h)
+		goto create;
+
+	if (rcg->depth > maxdepth) {
+		nih_error("%s: Cgroup too deep: %s/%s", __func__, rcg->path, cgroup);
+		return -1;
+	}
+	if (dir_exists(path)) {
+		if (!may_access(r.pid, r.uid, r.gid, path, O_RDONLY)) {
+			nih_error("%s: pid %d (uid %u gid %u) may not look under %s", __func__,
+				r.pid, r.uid, r.gid, path);
+			return -2;
+		}
+		return 0;
+	}
+	if (!may_access(r.pid, r.uid, r.gid, h->dir, O_RDWR)) {
+		nih_error("%s: pid %d (uid %u gid %u) may not create under %s", __func__,
+			r.pid, r.uid, r.gid, h->dir);
+		return -2;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	if (h->nr_spares) {
+		h->nr_spares--;
+		spare = NIH_MUST( nih_strdup(NULL, h->spares[h->nr_spares]) );
+		nih_free(h->spares[h->nr_spares]);
+		h->spares[h->nr_spares] = NULL;
+	} else
+		pool_misses++;
+	pthread_mutex_unlock(&pool_lock);
+	pool_wake();
+	if (!spare)
+		goto create;
+
+	sparepath = NIH_MUST( nih_sprintf(NULL, "%s/%s", h->dir, spare) );
+	if (!cgroup_pristine(sparepath, pool_uid, pool_gid)) {
+		nih_warn("%s: Not claiming %s: it is not empty, or not owned by %d:%d",
+			 __func__, sparepath, pool_uid, pool_gid);
+		pthread_mutex_lock(&pool_lock);
+		pool_errors++;
+		pthread_mutex_unlock(&pool_lock);
+		goto create;
+	}
+	if (cgfs_rename(sparepath, leaf + 1) < 0) {
+		if (errno == EEXIST) {
+			/* created meanwhile: put the spare back */
+			pthread_mutex_lock(&pool_lock);
+			NIH_MUST( nih_str_array_add(&h->spares, h,
+						&h->nr_spares, spare) );
+			pthread_mutex_unlock(&pool_lock);
+		} else {
+			nih_warn("%s: Failed to rename %s to %s: %s", __func__,
+				 sparepath, path, strerror(errno));
+			cgfs_rmdir(sparepath);
+		}
+		goto create;
+	}
+	if (r.uid != pool_uid || r.gid != pool_gid) {
+		if (!chown_cgroup_path(path, r.uid, r.gid, true, false)) {
+			nih_error("%s: Failed to change ownership on %s to %u:%u", __func__,
+				path, r.uid, r.gid);
+			cgfs_rmdir(path);
+			return -1;
+		}
+		/*
+		 * The pool's owner could write to the spare until now;
+		 * make sure nothing was put there since it was checked.
+		 */
+		if (!cgroup_pristine(path, r.uid, r.gid)) {
+			nih_error("%s: %s changed while being claimed", __func__,
+				path);
+			cgfs_rmdir(path);
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	pool_claimed++;
+	pthread_mutex_unlock(&pool_lock);
+	*existed = -1;
+	nih_info(_("Claimed %s for %d (%u:%u)"), path, r.pid, r.uid, r.gid);
+	return 0;
+
+create:
+	return do_create_main(rcg, cgroup, p, r, existed);
+}
+
+/*
+ * Create @cgroup as create_main() does, taking it from the warm pool on
+ * each hierarchy where it can.
+ */
+int claim_main(const char *controller, const char *cgroup, struct ucred p,
+		struct ucred r, int32_t *existed)
+{
+	nih_local struct resolved_cgroup *rcgs = NULL;
+	int i, n, ret;
+
+	*existed = -1;
+	if (!cgroup || ! *cgroup)  // nothing to do
+		return 0;
+
+	if (!sane_cgroup(cgroup)) {
+		nih_error("%s: unsafe cgroup", __func__);
+		return -1;
+	}
+
+	n = resolve_pid_cgroups(NULL, r.pid, controller, false, &rcgs);
+	if (n <= 0) {
+		nih_error("%s: no controllers in '%s'", __func__, controller);
+		return -1;
+	}
+	if (single_controller(controller))
+		return do_claim_main(&rcgs[0], cgroup, p, r, existed);
+
+	for (i = 0; i < n; i++) {
 		int32_t e = 1;
-		ret = do_create_main(tok, cgroup, p, r, &e);
+		ret = do_claim_main(&rcgs[i], cgroup, p, r, &e);
 		if (ret == -2)  // permission denied - ignore for group requests
-			goto next;
+			continue;
 		if (ret != 0)
 			return -1;
 		if (e == 1)
 			*existed = 1;
-next:
-		tok = strtok(NULL, ",");
 	}
 
 	return 0;
 }
 
-int do_chown_main(const char *controller, const char *cgroup, struct ucred p,
-		struct ucred r, struct ucred v)
+int do_chown_main(const struct resolved_cgroup *rcg, const char *cgroup,
+		struct ucred p, struct ucred r, struct ucred v)
 {
-	char rcgpath[MAXPATHLEN];
+	const char *controller = rcg->controller;
+	char *rcgpath = rcg->path;
 	nih_local char *path = NULL;
 
-	// Get r's current cgroup in rcgpath
-	if (!compute_pid_cgroup(r.pid, controller, "", rcgpath, NULL)) {
+	// r's current cgroup, found by resolve_pid_cgroups()
+	if (!rcgpath) {
 		nih_error("%s: Could not determine the requestor's cgroup for %s",
                 __func__, controller);
 		return -1;
@@ -483,9 +1011,8 @@ int chown_main(const char *controller, const char *cgroup, struct ucred p,
 		struct ucred r, struct ucred v)
 {
 	uid_t uid;
-	nih_local char *c = NULL;
-	char *tok;
-	int ret;
+	nih_local struct resolved_cgroup *rcgs = NULL;
+	int i, n, ret;
 
 	/* If caller is not root in his userns, then he can't chown, as
 	 * that requires privilege over two uids */
@@ -501,39 +1028,34 @@ int chown_main(const char *controller, const char *cgroup, struct ucred p,
 		return -1;
 	}
 
-	if (strcmp(controller, "all") != 0 && !strchr(controller, ','))
-		return do_chown_main(controller, cgroup, p, r, v);
-
-	if (strcmp(controller, "all") == 0) {
-		if (!all_controllers)
-			return 0;
-		c = NIH_MUST( nih_strdup(NULL, all_controllers) );
-	} else {
-		c = NIH_MUST( nih_strdup(NULL, controller) );
-		do_prune_comounts(c);
+	n = resolve_pid_cgroups(NULL, r.pid, controller, false, &rcgs);
+	if (n <= 0) {
+		nih_error("%s: no controllers in '%s'", __func__, controller);
+		return -1;
 	}
-	tok = strtok(c, ",");
-	while (tok) {
-		ret = do_chown_main(tok, cgroup, p, r, v);
+	if (single_controller(controller))
+		return do_chown_main(&rcgs[0], cgroup, p, r, v);
+
+	for (i = 0; i < n; i++) {
+		ret = do_chown_main(&rcgs[i], cgroup, p, r, v);
 		if (ret == -2)  // permission denied - ignore for group requests
-			goto next;
+			continue;
 		if (ret != 0)
 			return -1;
-next:
-		tok = strtok(NULL, ",");
 	}
 
 	return 0;
 }
 
-int do_chmod_main(const char *controller, const char *cgroup, const char *file,
-		struct ucred p, struct ucred r, int mode)
+int do_chmod_main(const struct resolved_cgroup *rcg, const char *cgroup,
+		const char *file, struct ucred p, struct ucred r, int mode)
 {
-	char rcgpath[MAXPATHLEN];
+	const char *controller = rcg->controller;
+	char *rcgpath = rcg->path;
 	nih_local char *path = NULL;
 
-	// Get r's current cgroup in rcgpath
-	if (!compute_pid_cgroup(r.pid, controller, "", rcgpath, NULL)) {
+	// r's current cgroup, found by resolve_pid_cgroups()
+	if (!rcgpath) {
 		nih_error("%s: Could not determine the requestor's cgroup for %s",
                 __func__, controller);
 		return -1;
@@ -572,9 +1094,8 @@ int do_chmod_main(const char *controller, const char *cgroup, const char *file,
 int chmod_main(const char *controller, const char *cgroup, const char *file,
 		struct ucred p, struct ucred r, int mode)
 {
-	nih_local char *c = NULL;
-	char *tok;
-	int ret;
+	nih_local struct resolved_cgroup *rcgs = NULL;
+	int i, n, ret;
 
 	if (!sane_cgroup(cgroup)) {
 		nih_error("%s: unsafe cgroup", __func__);
@@ -586,71 +1107,81 @@ int chmod_main(const char *controller, const char *cgroup, const char *file,
 		return -1;
 	}
 
-	if (strcmp(controller, "all") != 0 && !strchr(controller, ','))
-		return do_chmod_main(controller, cgroup, file, p, r, mode);
-
-	if (strcmp(controller, "all") == 0) {
-		if (!all_controllers)
-			return 0;
-		c = NIH_MUST( nih_strdup(NULL, all_controllers) );
-	} else {
-		c = NIH_MUST( nih_strdup(NULL, controller) );
-		do_prune_comounts(c);
+	n = resolve_pid_cgroups(NULL, r.pid, controller, false, &rcgs);
+	if (n <= 0) {
+		nih_error("%s: no controllers in '%s'", __func__, controller);
+		return -1;
 	}
-	tok = strtok(c, ",");
-	while (tok) {
-		ret = do_chmod_main(tok, cgroup, file, p, r, mode);
+	if (single_controller(controller))
+		return do_chmod_main(&rcgs[0], cgroup, file, p, r, mode);
+
+	for (i = 0; i < n; i++) {
+		ret = do_chmod_main(&rcgs[i], cgroup, file, p, r, mode);
 		if (ret == -2)  // permission denied - ignore for group requests
-			goto next;
+			continue;
 		if (ret != 0)
 			return -1;
-next:
-		tok = strtok(NULL, ",");
 	}
 
 	return 0;
 }
 
-int get_value_main(void *parent, char *controller, const char *cgroup,
-		const char *key, struct ucred p, struct ucred r, char **value)
+/*
+ * Find the directory of @cgroup for GetValue or SetValue, and check
+ * that @r may look under it.  The path is returned in @path
+ * (MAXPATHLEN bytes).
+ */
+static bool value_cgroup_dir(char *controller, const char *cgroup,
+		struct ucred p, struct ucred r, char *path)
 {
-	char path[MAXPATHLEN];
-
 	if (!(prune_verify_comounts(controller))) {
 		nih_error("%s: Multiple controllers given: %s",
 				__func__, controller);
-		return -1;
+		return false;
 	}
 
 	if (!sane_cgroup(cgroup)) {
 		nih_error("%s: unsafe cgroup", __func__);
-		return -1;
+		return false;
 	}
 
 	if (!compute_pid_cgroup(r.pid, controller, cgroup, path, NULL)) {
 		nih_error("%s: Could not determine the requested cgroup (%s:%s)",
                 __func__, controller, cgroup);
-		return -1;
+		return false;
 	}
 
 	/* Check access rights to the cgroup directory */
 	if (!may_access(r.pid, r.uid, r.gid, path, O_RDONLY)) {
 		nih_debug("%s: Pid %d may not access %s\n", __func__, r.pid, path);
-		return -1;
+		return false;
 	}
 
 	if (!path_is_under_proxycg(p.pid, controller, path)) {
 		nih_debug("%s: target cgroup is not below r (%d)'s", __func__,
 			r.pid);
-		return -1;
+		return false;
 	}
 
+	return true;
+}
+
+/*
+ * Read file @key in cgroup directory @dir, which value_cgroup_dir() has
+ * already checked.
+ */
+static int get_value_key(void *parent, const char *dir, const char *key,
+		struct ucred r, char **value)
+{
+	char path[MAXPATHLEN];
+
 	/* append the filename */
-	if (strlen(path) + strlen(key) + 2 > MAXPATHLEN) {
-		nih_error("%s: filename too long for cgroup %s key %s", __func__, path, key);
+	if (strlen(dir) + strlen(key) + 2 > MAXPATHLEN) {
+		nih_error("%s: filename too long for cgroup %s key %s", __func__, dir, key);
 		return -1;
 	}
 
+	strcpy(path, dir);
 	strncat(path, "/", MAXPATHLEN-1);
 	strncat(path, key, MAXPATHLEN-1);
 
@@ -667,52 +1198,92 @@ int get_value_main(void *parent, char *controller, const char *cgroup,
 		return -1;
 	}
 
-	nih_info(_("Sending to client: %s"), *value);
 	return 0;
 }
 
-int set_value_main(char *controller, const char *cgroup,
-		const char *key, const char *value, struct ucred p,
-		struct ucred r)
-
+int get_value_main(void *parent, char *controller, const char *cgroup,
+		const char *key, struct ucred p, struct ucred r, char **value)
 {
 	char path[MAXPATHLEN];
 
-	if (!(prune_verify_comounts(controller))) {
-		nih_error("%s: Multiple controllers given: %s",
-				__func__, controller);
+	if (!value_cgroup_dir(controller, cgroup, p, r, path))
 		return -1;
-	}
 
-	if (!sane_cgroup(cgroup)) {
-		nih_error("%s: unsafe cgroup", __func__);
+	if (get_value_key(parent, path, key, r, value) < 0)
 		return -1;
-	}
 
-	if (!compute_pid_cgroup(r.pid, controller, cgroup, path, NULL)) {
-		nih_error("%s: Could not determine the requested cgroup (%s:%s)",
-                __func__, controller, cgroup);
-		return -1;
-	}
+	nih_info(_("Sending to client: %s"), *value);
+	return 0;
+}
 
-	if (!path_is_under_proxycg(p.pid, controller, path)) {
-		nih_debug("%s: target cgroup is not below r (%d)'s", __func__,
-			r.pid);
-		return -1;
-	}
+/* A cgroup directory looked up by get_values_main() */
+struct value_dir {
+	NihList entry;
+	char *name;  // controller:cgroup
+	char *path;  // NULL if it may not be read
+};
 
-	/* Check access rights to the cgroup directory */
-	if (!may_access(r.pid, r.uid, r.gid, path, O_RDONLY)) {
-		nih_debug("%s: Pid %d may not access %s\n", __func__, r.pid, path);
-		return -1;
+/*
+ * Read the value of each of @items, a (controller, cgroup, key) held in
+ * a batch_op, into its @value.  The cgroup is looked up and its access
+ * checks made once for each distinct controller and cgroup, however
+ * many keys are read from it.  @results[i] is 1 if @items[i] was read,
+ * and 0 if not.
+ */
+int get_values_main(struct batch_op **items, int32_t nitems, struct ucred p,
+		struct ucred r, int32_t *results)
+{
+	nih_local NihHash *dirs = NULL;
+	int32_t i;
+
+	dirs = NIH_MUST( nih_hash_string_new(NULL, 0) );
+
+	for (i = 0; i < nitems; i++) {
+		struct batch_op *item = items[i];
+		nih_local char *name = NULL;
+		struct value_dir *dir;
+
+		name = NIH_MUST( nih_sprintf(NULL, "%s:%s", item->controller,
+					item->cgroup) );
+		dir = (struct value_dir *)nih_hash_lookup(dirs, name);
+		if (!dir) {
+			char path[MAXPATHLEN];
+
+			dir = NIH_MUST( nih_new(dirs, struct value_dir) );
+			nih_list_init(&dir->entry);
+			dir->name = NIH_MUST( nih_strdup(dir, name) );
+			dir->path = NULL;
+			if (value_cgroup_dir(item->controller, item->cgroup, p, r, path))
+				dir->path = NIH_MUST( nih_strdup(dir, path) );
+			nih_hash_add(dirs, &dir->entry);
+		}
+
+		results[i] = 0;
+		if (dir->path && get_value_key(item, dir->path, item->key, r,
+					&item->value) == 0)
+			results[i] = 1;
 	}
 
+	return 0;
+}
+
+/*
+ * Write @value to file @key in cgroup directory @dir, which
+ * value_cgroup_dir() has already checked.  The caller has checked
+ * @key against the blacklist.
+ */
+static int set_value_key(const char *controller, const char *dir,
+		const char *key, const char *value, struct ucred r)
+{
+	char path[MAXPATHLEN];
+
 	/* append the filename */
-	if (strlen(path) + strlen(key) + 2 > MAXPATHLEN) {
-		nih_error("%s: filename too long for cgroup %s key %s", __func__, path, key);
+	if (strlen(dir) + strlen(key) + 2 > MAXPATHLEN) {
+		nih_error("%s: filename too long for cgroup %s key %s", __func__, dir, key);
 		return -1;
 	}
 
+	strcpy(path, dir);
 	strncat(path, "/", MAXPATHLEN-1);
 	strncat(path, key, MAXPATHLEN-1);
 
@@ -722,8 +1293,7 @@ int set_value_main(char *controller, const char *cgroup,
 		return -1;
 	}
 
-	/* read and return the value */
-	if (!set_value(controller, path, value)) {
+	if (!set_value_unchecked(controller, path, value)) {
 		nih_error("%s: Failed to set value %s to %s", __func__, path, value);
 		return -1;
 	}
@@ -731,6 +1301,126 @@ int set_value_main(char *controller, const char *cgroup,
 	return 0;
 }
 
+int set_value_main(char *controller, const char *cgroup,
+		const char *key, const char *value, struct ucred p,
+		struct ucred r)
+
+{
+	char path[MAXPATHLEN];
+
+	if (set_value_blacklisted(key))
+		return -1;
+
+	if (!value_cgroup_dir(controller, cgroup, p, r, path))
+		return -1;
+
+	return set_value_key(controller, path, key, value, r);
+}
+
+/*
+ * The entries of a SetValues request which act on one cgroup, linked
+ * in request order through set_values_state.next.
+ */
+struct value_group {
+	NihList entry;
+	char *name;  // controller:cgroup
+	char *path;
+	int32_t first, last;
+};
+
+struct set_values_state {
+	struct batch_op **ops;
+	int32_t *results;
+	int32_t *next;
+	struct value_group **groups;
+	struct ucred r;
+};
+
+/* Apply, in order, the entries of the @i'th cgroup of a SetValues */
+static void set_values_group(void *data, int i)
+{
+	struct set_values_state *s = data;
+	struct value_group *g = s->groups[i];
+	int32_t j;
+
+	for (j = g->first; j != -1; j = s->next[j]) {
+		struct batch_op *op = s->ops[j];
+
+		if (set_value_key(op->controller, g->path, op->key,
+					op->value, s->r) == 0)
+			s->results[j] = 1;
+	}
+}
+
+/*
+ * Write the value of each of @ops, a (controller, cgroup, key, value)
+ * held in a batch_op.  Every key is checked against the blacklist,
+ * and each distinct cgroup looked up and checked, before anything is
+ * written.  The cgroups are then written in parallel, by as many
+ * workers as are free, while the entries for any one cgroup are
+ * written in order, so that e.g. memory.limit_in_bytes may be raised
+ * before memory.memsw.limit_in_bytes.  @results[i] is 1 if @ops[i]
+ * was written, and 0 if not.
+ */
+int set_values_main(struct batch_op **ops, int32_t nops, struct ucred p,
+		struct ucred r, int32_t *results)
+{
+	nih_local NihHash *dirs = NULL;
+	nih_local int32_t *next = NULL;
+	nih_local struct value_group **groups = NULL;
+	struct set_values_state s;
+	int32_t i, ngroups = 0;
+
+	dirs = NIH_MUST( nih_hash_string_new(NULL, 0) );
+	next = NIH_MUST( nih_alloc(NULL, nops * sizeof(int32_t)) );
+	groups = NIH_MUST( nih_alloc(NULL, nops * sizeof(struct value_group *)) );
+
+	for (i = 0; i < nops; i++) {
+		struct batch_op *op = ops[i];
+		nih_local char *name = NULL;
+		struct value_group *g;
+
+		results[i] = 0;
+		next[i] = -1;
+		if (set_value_blacklisted(op->key))
+			continue;
+
+		name = NIH_MUST( nih_sprintf(NULL, "%s:%s", op->controller,
+					op->cgroup) );
+		g = (struct value_group *)nih_hash_lookup(dirs, name);
+		if (!g) {
+			char path[MAXPATHLEN];
+
+			g = NIH_MUST( nih_new(dirs, struct value_group) );
+			nih_list_init(&g->entry);
+			g->name = NIH_MUST( nih_strdup(g, name) );
+			g->path = NULL;
+			g->first = g->last = -1;
+			if (value_cgroup_dir(op->controller, op->cgroup, p, r, path)) {
+				g->path = NIH_MUST( nih_strdup(g, path) );
+				groups[ngroups++] = g;
+			}
+			nih_hash_add(dirs, &g->entry);
+		}
+		if (!g->path)
+			continue;
+		if (g->last == -1)
+			g->first = i;
+		else
+			next[g->last] = i;
+		g->last = i;
+	}
+
+	s.ops = ops;
+	s.results = results;
+	s.next = next;
+	s.groups = groups;
+	s.r = r;
+	work_parallel(ngroups, set_values_group, &s);
+
+	return 0;
+}
+
 /*
  * Refuse any '..', and consolidate any '//'
  */
@@ -748,6 +1438,114 @@ static bool normalize_path(char *path)
 	return true;
 }
 
+/*
+ * Walk the subtree under a cgroup, as cgfs_walk() does, but have idle
+ * workers walk the subtrees below each directory within walk_fanout
+ * levels of the top in parallel (see work_parallel()).  Deeper
+ * directories are walked by cgfs_walk() on whichever thread reached
+ * them.  A directory is only passed to @post once all of its
+ * subdirectories have been, so removals still happen bottom up.  At the
+ * fan-out levels the callbacks are given -1 and the whole path rather
+ * than a parent handle and name, and may be called from several
+ * threads at once.
+ */
+struct subtree_walk {
+	bool skip_leaf;
+	CgfsWalkFunc pre, post;
+	void *data;
+};
+
+struct subtree_dir {
+	struct subtree_walk *w;
+	int depth;
+	bool skipped;
+	char **children;
+	size_t nr_children;
+	int *failed;    // by child
+};
+
+static int subtree_walk_dir(struct subtree_walk *w, const char *path,
+		int depth);
+
+/* Run @pre on the directory itself and list, but do not enter, the rest */
+static int subtree_list_pre(void *data, const char *path, int parentfd,
+		const char *name, int depth)
+{
+	struct subtree_dir *sd = data;
+	int ret;
+
+	if (depth == sd->depth) {
+		if (!sd->w->pre)
+			return 0;
+		ret = sd->w->pre(sd->w->data, path, parentfd, name, depth);
+		if (ret == CGFS_WALK_SKIP)
+			sd->skipped = true;
+		return ret;
+	}
+	NIH_MUST( nih_str_array_add(&sd->children, NULL, &sd->nr_children,
+				path) );
+	return CGFS_WALK_SKIP;
+}
+
+static void subtree_walk_child(void *data, int i)
+{
+	struct subtree_dir *sd = data;
+	int ret;
+
+	ret = subtree_walk_dir(sd->w, sd->children[i], sd->depth + 1);
+	sd->failed[i] = ret < 0 ? 1 : ret;
+}
+
+static int subtree_walk_dir(struct subtree_walk *w, const char *path,
+		int depth)
+{
+	nih_local char **children = NULL;
+	nih_local int *failed = NULL;
+	struct subtree_dir sd;
+	int ret;
+	size_t i;
+
+	if (depth >= walk_fanout || !workqueue_enabled())
+		return cgfs_walk(path, depth, w->skip_leaf, w->pre, w->post,
+				 w->data);
+
+	children = NIH_MUST( nih_str_array_new(NULL) );
+	sd.w = w;
+	sd.depth = depth;
+	sd.skipped = false;
+	sd.children = children;
+	sd.nr_children = 0;
+	ret = cgfs_walk(path, depth, w->skip_leaf, subtree_list_pre, NULL, &sd);
+	children = sd.children;
+	if (ret < 0 || sd.skipped)
+		return ret;
+
+	if (sd.nr_children) {
+		failed = NIH_MUST( nih_alloc(NULL, sd.nr_children * sizeof(int)) );
+		sd.failed = failed;
+		work_parallel(sd.nr_children, subtree_walk_child, &sd);
+		for (i = 0; i < sd.nr_children; i++)
+			ret += failed[i];
+	}
+
+	if (w->post && w->post(w->data, path, -1, path, depth) < 0)
+		ret++;
+	return ret;
+}
+
+static int subtree_walk(const char *path, bool skip_leaf, CgfsWalkFunc pre,
+		CgfsWalkFunc post, void *data)
+{
+	struct subtree_walk w = {
+		.skip_leaf = skip_leaf,
+		.pre = pre,
+		.post = post,
+		.data = data,
+	};
+
+	return subtree_walk_dir(&w, path, 0);
+}
+
 /*
  * Recursively delete a cgroup.
  * Cgroup files can't be deleted, but are cleaned up when you remove the
@@ -758,59 +1556,45 @@ static bool normalize_path(char *path)
  * under that, even if, say, it technically is not allowed to remove
  * /a/b/c/d/.
  */
+static int rmdir_walk_post(void *data, const char *path, int parentfd,
+		const char *name, int depth)
+{
+	return cgfs_rmdir(path);
+}
+
 static int recursive_rmdir(char *path)
 {
-	struct dirent dirent, *direntp;
-	DIR *dir;
-	int failed = 0;
+	int failed;
 
-	dir = opendir(path);
-	if (!dir) {
+	failed = subtree_walk(path, false, NULL, rmdir_walk_post, NULL);
+	if (failed < 0) {
 		nih_error("%s: Failed to open dir %s for recursive deletion", __func__, path);
 		return -1;
 	}
 
-	while (!readdir_r(dir, &dirent, &direntp)) {
-		struct stat mystat;
-		nih_local char *pathname = NULL;
-		int rc;
-
-		if (!direntp)
-			break;
-		if (!strcmp(direntp->d_name, ".") ||
-		    !strcmp(direntp->d_name, ".."))
-			continue;
-		pathname = NIH_MUST( nih_sprintf(NULL, "%s/%s", path, direntp->d_name) );
-		rc = lstat(pathname, &mystat);
-		if (rc) {
-			failed = 1;
-			continue;
-		}
-		if (S_ISDIR(mystat.st_mode)) {
-			if (recursive_rmdir(pathname) < 0)
-				failed = 1;
-		}
-	}
-
-	if (closedir(dir) < 0)
-		failed = 1;
-	if (rmdir(path) < 0)
-		failed = 1;
-
 	return failed ? -1 : 0;
 }
 
-int do_remove_main(const char *controller, const char *cgroup, struct ucred p,
-		struct ucred r, int recursive, int32_t *existed)
+/*
+ * Find the cgroup which @r names as @cgroup under @rcg, and check that
+ * @r may remove it: it must be able to write to the parent.  Its path
+ * is returned in @working, allocated with @parent.  Returns 0, with
+ * *@existed -1 if there is no such cgroup, -1 on error, or -2 if @r
+ * may not remove it.
+ */
+static int remove_target(void *parent, const struct resolved_cgroup *rcg,
+		const char *cgroup, struct ucred r, char **working,
+		int32_t *existed)
 {
-	char rcgpath[MAXPATHLEN];
+	const char *controller = rcg->controller;
+	char *rcgpath = rcg->path;
 	size_t cgroup_len;
-	nih_local char *working = NULL, *copy = NULL, *wcgroup = NULL;
+	nih_local char *copy = NULL, *wcgroup = NULL;
 	char *p1;
 
 	*existed = 1;
-	// Get r's current cgroup in rcgpath
-	if (!compute_pid_cgroup(r.pid, controller, "", rcgpath, NULL)) {
+	// r's current cgroup, found by resolve_pid_cgroups()
+	if (!rcgpath) {
 		nih_error("%s: Could not determine the requestor's cgroup for %s",
                 __func__, controller);
 		return -1;
@@ -827,16 +1611,16 @@ int do_remove_main(const char *controller, const char *cgroup, struct ucred p,
 	if (!normalize_path(wcgroup))
 		return -1;
 
-	working = NIH_MUST( nih_strdup(NULL, rcgpath) );
-	NIH_MUST( nih_strcat(&working, NULL, "/") );
-	NIH_MUST( nih_strcat(&working, NULL, wcgroup) );
+	*working = NIH_MUST( nih_strdup(parent, rcgpath) );
+	NIH_MUST( nih_strcat(working, parent, "/") );
+	NIH_MUST( nih_strcat(working, parent, wcgroup) );
 
-	if (!dir_exists(working)) {
+	if (!dir_exists(*working)) {
 		*existed = -1;
 		return 0;
 	}
 	// must have write access to the parent dir
-	copy = NIH_MUST( nih_strdup(NULL, working) );
+	copy = NIH_MUST( nih_strdup(NULL, *working) );
 	if (!(p1 = strrchr(copy, '/')))
 		return -1;
 	*p1 = '\0';
@@ -845,17 +1629,30 @@ int do_remove_main(const char *controller, const char *cgroup, struct ucred p,
 			r.pid, r.uid, r.gid, copy);
 		return -2;
 	}
+	return 0;
+}
+
+int do_remove_main(const struct resolved_cgroup *rcg, const char *cgroup,
+		struct ucred p, struct ucred r, int recursive, int32_t *existed)
+{
+	const char *controller = rcg->controller;
+	nih_local char *working = NULL;
+	int ret;
+
+	ret = remove_target(NULL, rcg, cgroup, r, &working, existed);
+	if (ret < 0 || *existed == -1)
+		return ret;
 
 	if (is_unified_controller(controller)) {
 		nih_local char *fpath = NULL;
 		fpath = NIH_MUST( nih_sprintf(NULL, "%s%s", working, U_LEAF) );
-		if (rmdir(fpath) < 0) {
+		if (cgfs_rmdir(fpath) < 0) {
 			nih_error("%s: Failed to remove %s: %s", __func__, fpath, strerror(errno));
 			return errno == EPERM ? -2 : -1;
 		}
 	}
 	if (!recursive) {
-		if (rmdir(working) < 0) {
+		if (cgfs_rmdir(working) < 0) {
 			nih_error("%s: Failed to remove %s: %s", __func__, working, strerror(errno));
 			return errno == EPERM ? -2 : -1;
 		}
@@ -870,9 +1667,8 @@ int do_remove_main(const char *controller, const char *cgroup, struct ucred p,
 int remove_main(const char *controller, const char *cgroup, struct ucred p,
 		struct ucred r, int recursive, int32_t *existed)
 {
-	nih_local char *c = NULL;
-	char *tok;
-	int ret;
+	nih_local struct resolved_cgroup *rcgs = NULL;
+	int i, n, ret;
 
 	*existed = 1;
 	if (!sane_cgroup(cgroup)) {
@@ -880,29 +1676,23 @@ int remove_main(const char *controller, const char *cgroup, struct ucred p,
 		return -1;
 	}
 
-	if (strcmp(controller, "all") != 0 && !strchr(controller, ','))
-		return do_remove_main(controller, cgroup, p, r, recursive, existed);
-
-	if (strcmp(controller, "all") == 0) {
-		if (!all_controllers)
-			return 0;
-		c = NIH_MUST( nih_strdup(NULL, all_controllers) );
-	} else {
-		c = NIH_MUST( nih_strdup(NULL, controller) );
-		do_prune_comounts(c);
+	n = resolve_pid_cgroups(NULL, r.pid, controller, false, &rcgs);
+	if (n <= 0) {
+		nih_error("%s: no controllers in '%s'", __func__, controller);
+		return -1;
 	}
-	tok = strtok(c, ",");
-	while (tok) {
+	if (single_controller(controller))
+		return do_remove_main(&rcgs[0], cgroup, p, r, recursive, existed);
+
+	for (i = 0; i < n; i++) {
 		int32_t e = 1;
-		ret = do_remove_main(tok, cgroup, p, r, recursive, &e);
+		ret = do_remove_main(&rcgs[i], cgroup, p, r, recursive, &e);
 		if (ret == -2)  // permission denied - ignore for group requests
-			goto next;
+			continue;
 		if (ret != 0)
 			return -1;
 		if (!e)
 			*existed = 0;
-next:
-		tok = strtok(NULL, ",");
 	}
 
 	return 0;
@@ -963,63 +1753,96 @@ int get_tasks_main(void *parent, char *controller, const char *cgroup,
 	return nrpids;
 }
 
-static int do_collect_tasks(void *parent, char **path, int32_t **pids,
-			    int *alloced_pids, int *nrpids, bool is_unified)
+struct collect_tasks_state {
+	pthread_mutex_t lock;   // for the pid list, as directories are
+				// read in parallel
+	void *parent;
+	int32_t **pids;
+	int *alloced_pids, *nrpids;
+	int **runs, *nr_runs;
+	const char *key;
+	int ret;
+};
+
+/*
+ * Get the tasks of one directory once its descendents are done.  Each
+ * tasks file is read and sorted as its own run, and appended to the
+ * pid list with the start of the run recorded, so that the caller can
+ * combine them with a single k-way merge rather than merging file by
+ * file.
+ */
+static int collect_tasks_walk_post(void *data, const char *path,
+		int parentfd, const char *name, int depth)
 {
-	struct dirent dirent, *direntp;
-	DIR *dir;
-	const char *key = is_unified ? U_LEAF_NAME "/cgroup.procs" : "tasks";
+	struct collect_tasks_state *st = data;
+	nih_local int32_t *pids = NULL;
+	char tasks[MAXPATHLEN];
+	int alloced = 0, nr = 0, start, ret;
+
+	if (snprintf(tasks, MAXPATHLEN, "%s/%s", path, st->key) >= MAXPATHLEN)
+		return -1;
+
+	ret = file_read_pid_run(NULL, tasks, &pids, &alloced, &nr);
+	if (ret == 0 && nr > 0) {
+		pthread_mutex_lock(&st->lock);
+		start = *st->nrpids;
+		if (pidlist_grow(st->parent, st->pids, st->alloced_pids,
+					start + nr)) {
+			memcpy(*st->pids + start, pids, nr * sizeof(int32_t));
+			*st->nrpids += nr;
+			pidlist_add_run(st->runs, st->nr_runs, start);
+		} else
+			ret = -1;
+		pthread_mutex_unlock(&st->lock);
+	}
+	if (depth == 0)
+		st->ret = ret;
+	else if (ret == -1)
+		nih_info("%s: error descending subdirs", __func__);
+	return 0;
+}
 
-	dir = opendir(*path);
-	if (!dir) {
+/* Collect the tasks of @path and all of its descendents. */
+static int do_collect_tasks(void *parent, const char *path, int32_t **pids,
+			    int *alloced_pids, int *nrpids, int **runs,
+			    int *nr_runs, bool is_unified)
+{
+	struct collect_tasks_state st = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.parent = parent,
+		.pids = pids,
+		.alloced_pids = alloced_pids,
+		.nrpids = nrpids,
+		.runs = runs,
+		.nr_runs = nr_runs,
+		.key = is_unified ? U_LEAF_NAME "/cgroup.procs" : "tasks",
+		.ret = 0,
+	};
+
+	if (subtree_walk(path, true, NULL, collect_tasks_walk_post, &st) < 0) {
 		nih_warn("%s: Failed to open dir %s for recursive collection",
-			 __func__, *path);
+			 __func__, path);
+		pthread_mutex_destroy(&st.lock);
 		return -2;
 	}
-
-	while (!readdir_r(dir, &dirent, &direntp)) {
-		struct stat mystat;
-		nih_local char *childname = NULL;
-		int rc;
-
-		if (!direntp)
-			break;
-		if (!strcmp(direntp->d_name, ".") ||
-		    !strcmp(direntp->d_name, "..") ||
-		    !strcmp(direntp->d_name, U_LEAF_NAME))
-			continue;
-		childname = NIH_MUST( nih_sprintf(NULL, "%s/%s", *path, direntp->d_name) );
-		rc = lstat(childname, &mystat);
-		if (rc)
-			continue;
-		if (S_ISDIR(mystat.st_mode))
-			if (do_collect_tasks(parent, &childname, pids,
-					     alloced_pids, nrpids,
-					     is_unified) == -1)
-				nih_info("%s: error descending subdirs", __func__);
-	}
-
-	closedir(dir);
-
-	/* Get tasks for this directory */
-	NIH_MUST( nih_strcat_sprintf(path, NULL, "/%s", key) );
-
-	return file_read_pids(parent, *path, pids, alloced_pids, nrpids);
+	pthread_mutex_destroy(&st.lock);
+	return st.ret;
 }
 
-int collect_tasks(void *parent, const char *controller, const char *cgroup,
-		struct ucred p, struct ucred r, int32_t **pids,
-		int *alloced_pids, int *nrpids)
+int collect_tasks(void *parent, const struct resolved_cgroup *rcg,
+		const char *cgroup, struct ucred p, struct ucred r,
+		int32_t **pids, int *alloced_pids, int *nrpids, int **runs,
+		int *nr_runs)
 {
+	const char *controller = rcg->controller;
 	char path[MAXPATHLEN];
-	nih_local char *rpath = NULL;
 
 	if (!sane_cgroup(cgroup)) {
 		nih_error("%s: unsafe cgroup", __func__);
 		return -1;
 	}
 
-	if (!compute_pid_cgroup(r.pid, controller, cgroup, path, NULL)) {
+	if (!resolved_cgroup_path(rcg, r.pid, cgroup, path)) {
 		nih_error("%s: Could not determine the requested cgroup (%s:%s)",
                 __func__, controller, cgroup);
 		return -2;
@@ -1037,18 +1860,17 @@ int collect_tasks(void *parent, const char *controller, const char *cgroup,
 		return -2;
 	}
 
-	rpath = NIH_MUST( nih_strdup(NULL, path) );
-	return do_collect_tasks(parent, &rpath, pids, alloced_pids, nrpids,
-				is_unified_controller(controller));
+	return do_collect_tasks(parent, path, pids, alloced_pids, nrpids,
+				runs, nr_runs, is_unified_controller(controller));
 }
 
 int get_tasks_recursive_main(void *parent, const char *controller,
 		const char *cgroup, struct ucred p, struct ucred r, int32_t **pids)
 {
-	nih_local char *c = NULL;
-	char *tok;
-	int ret;
-	int alloced_pids = 0, nrpids = 0;
+	nih_local struct resolved_cgroup *rcgs = NULL;
+	nih_local int *runs = NULL;
+	int i, n, ret;
+	int alloced_pids = 0, nrpids = 0, nr_runs = 0;
 
 	if (!sane_cgroup(cgroup)) {
 		nih_error("%s: unsafe cgroup", __func__);
@@ -1057,40 +1879,37 @@ int get_tasks_recursive_main(void *parent, const char *controller,
 
 	*pids = NULL;
 
-	if (strcmp(controller, "all") != 0 && !strchr(controller, ',')) {
-		if (collect_tasks(parent, controller, cgroup, p, r, pids,
-				&alloced_pids, &nrpids) < 0) {
-			if (*pids)
-				nih_free(*pids);
-			return -1;
-		}
-		return nrpids;
+	n = resolve_pid_cgroups(NULL, r.pid, controller, false, &rcgs);
+	if (n <= 0) {
+		nih_error("%s: no controllers in '%s'", __func__, controller);
+		return -1;
 	}
-
-	if (strcmp(controller, "all") == 0) {
-		if (!all_controllers)
-			return 0;
-		c = NIH_MUST( nih_strdup(NULL, all_controllers) );
-	} else {
-		c = NIH_MUST( nih_strdup(NULL, controller) );
-		do_prune_comounts(c);
+	if (single_controller(controller)) {
+		if (collect_tasks(parent, &rcgs[0], cgroup, p, r, pids,
+				&alloced_pids, &nrpids, &runs, &nr_runs) < 0)
+			goto err;
+		goto merge;
 	}
-	tok = strtok(c, ",");
-	while (tok) {
-		ret = collect_tasks(parent, tok, cgroup, p, r, pids,
-				&alloced_pids, &nrpids);
+
+	for (i = 0; i < n; i++) {
+		ret = collect_tasks(parent, &rcgs[i], cgroup, p, r, pids,
+				&alloced_pids, &nrpids, &runs, &nr_runs);
 		if (ret == -2)  // permission denied - ignore
-			goto next;
-		if (ret != 0) {
-			if (*pids)
-				nih_free(*pids);
-			return -1;
-		}
-next:
-		tok = strtok(NULL, ",");
+			continue;
+		if (ret != 0)
+			goto err;
 	}
 
+merge:
+	if (pidlist_merge_runs(parent, pids, &alloced_pids, &nrpids,
+				runs, nr_runs) < 0)
+		goto err;
 	return nrpids;
+
+err:
+	if (*pids)
+		nih_free(*pids);
+	return -1;
 }
 
 int list_children_main(void *parent, char *controller, const char *cgroup,
@@ -1131,6 +1950,105 @@ int list_children_main(void *parent, char *controller, const char *cgroup,
 	return get_directory_children(parent, path, output);
 }
 
+static const void *autoremove_entry_key(NihList *list)
+{
+	return ((struct autoremove_entry *)list)->gpath;
+}
+
+static const void *autoremove_watch_key(NihList *list)
+{
+	return &((struct autoremove_watch *)list)->wd;
+}
+
+static uint32_t autoremove_wd_hash(const int *wd)
+{
+	return (uint32_t)*wd;
+}
+
+static int autoremove_wd_cmp(const int *wd1, const int *wd2)
+{
+	return *wd1 - *wd2;
+}
+
+static struct autoremove_watch *autoremove_watch_lookup(int wd)
+{
+	return (struct autoremove_watch *)nih_hash_lookup(autoremove_watches, &wd);
+}
+
+static int autoremove_watch_destroy(struct autoremove_watch *w)
+{
+	/* the watch may already be gone (IN_IGNORED), so ignore errors */
+	inotify_rm_watch(autoremove_ifd, w->wd);
+	nih_list_destroy(&w->entry);
+	return 0;
+}
+
+/*
+ * Watch @path for @mask, sharing an existing watch on the same inode.
+ * Returns NULL on error.
+ */
+static struct autoremove_watch *autoremove_watch_get(const char *path,
+		uint32_t mask)
+{
+	struct autoremove_watch *w;
+	int wd;
+
+	wd = inotify_add_watch(autoremove_ifd, path, mask);
+	if (wd < 0) {
+		nih_error("%s: Failed to add watch for %s: %s", __func__, path,
+			  strerror(errno));
+		return NULL;
+	}
+
+	if ((w = autoremove_watch_lookup(wd)) != NULL) {
+		w->refs++;
+		return w;
+	}
+
+	w = NIH_MUST( nih_new(NULL, struct autoremove_watch) );
+	nih_list_init(&w->entry);
+	w->wd = wd;
+	w->refs = 1;
+	w->path = NIH_MUST( nih_strdup(w, path) );
+	w->owner = NULL;
+	w->kw = NULL;
+	nih_alloc_set_destructor(w, autoremove_watch_destroy);
+	nih_hash_add(autoremove_watches, &w->entry);
+	return w;
+}
+
+static void autoremove_watch_put(struct autoremove_watch *w)
+{
+	if (w && --w->refs == 0)
+		nih_free(w);
+}
+
+static int populated_sub_destroy(struct populated_sub *sub)
+{
+	dbus_connection_unref(sub->conn);
+	nih_list_destroy(&sub->entry);
+	return 0;
+}
+
+static int empty_waiter_destroy(struct empty_waiter *w)
+{
+	if (w->timer)
+		nih_free(w->timer);
+	nih_list_destroy(&w->entry);
+	return 0;
+}
+
+/* Answer WaitEmpty call @w with @empty, and free it */
+static void empty_waiter_done(struct empty_waiter *w, int32_t empty)
+{
+	if (cgmanager_wait_empty_reply(w->message, empty) < 0) {
+		NihError *err = nih_error_get();
+		nih_warn("%s: Failed to reply: %s", __func__, err->message);
+		nih_free(err);
+	}
+	nih_free(w);
+}
+
 static int autoremove_entry_destroy(struct autoremove_entry *entry)
 {
 	nih_assert(entry != NULL);
@@ -1144,15 +2062,51 @@ static int autoremove_entry_destroy(struct autoremove_entry *entry)
 	nih_assert(entry->dirname != NULL);
 	nih_discard(entry->dirname);
 
-	if (entry->io != NULL)
-		nih_discard(entry->io);
+	autoremove_watch_put(entry->events_watch);
+	autoremove_watch_put(entry->cg_watch);
+
+	/* the cgroup is gone, so it is empty */
+	NIH_LIST_FOREACH_SAFE(&entry->waiters, iter)
+		empty_waiter_done((struct empty_waiter *)iter, 1);
 
 	nih_list_destroy(&entry->entry);
 
 	return 0;
 }
 
-/* if this function returns true then discontinue watching the events file */
+/* Does anybody still want to hear about @entry? */
+static bool autoremove_entry_idle(struct autoremove_entry *entry)
+{
+	return !entry->autoremove && !entry->deferred &&
+		NIH_LIST_EMPTY(&entry->subs) && NIH_LIST_EMPTY(&entry->waiters);
+}
+
+/* Tell each subscriber of @entry that it is now @populated */
+static void populated_notify(struct autoremove_entry *entry, int populated)
+{
+	NIH_LIST_FOREACH(&entry->subs, iter) {
+		struct populated_sub *sub = (struct populated_sub *)iter;
+
+		if (cgmanager_emit_populated_changed(sub->conn,
+					"/org/linuxcontainers/cgmanager",
+					sub->controller, sub->cgroup,
+					populated) < 0) {
+			NihError *err = nih_error_get();
+			nih_warn("%s: Failed to signal %s: %s", __func__,
+				 entry->gpath, err->message);
+			nih_free(err);
+			continue;
+		}
+		populated_signals++;
+	}
+}
+
+/*
+ * Read @entry's populated value, tell its subscribers if it changed,
+ * and answer its waiters and autoremove it if it is now empty.  If
+ * this function returns true then discontinue watching the events
+ * file.
+ */
 static bool autoremove_events_modified(struct autoremove_entry *entry)
 {
 	FILE *f;
@@ -1163,7 +2117,7 @@ static bool autoremove_events_modified(struct autoremove_entry *entry)
 	nih_assert(entry != NULL);
 	nih_assert(entry->evpath != NULL);
 
-	f = fopen(entry->evpath, "r");
+	f = cgfs_fopen(entry->evpath, "r");
 	if (!f) {
 		nih_error("%s: Cannot open %s in watcher: %s",
 			  __func__, entry->evpath, strerror(errno));
@@ -1173,215 +2127,1279 @@ static bool autoremove_events_modified(struct autoremove_entry *entry)
 	while (fgets(line, 1024, f) != NULL) {
 		int val;
 
-		if (sscanf(line, " populated %d", &val) != 1)
-			continue;
+		if (sscanf(line, " populated %d", &val) != 1)
+			continue;
+
+		pop_val = !!val;
+		break;
+	}
+
+	fclose(f);
+
+	if (pop_val == -1) {
+		nih_error("%s: Cannot find or parse populated value in %s",
+			  __func__, entry->evpath);
+		return false;
+	}
+
+	if (entry->populated != -1 && pop_val != entry->populated)
+		populated_notify(entry, pop_val);
+	entry->populated = pop_val;
+	if (pop_val == 1)
+		return false;
+
+	NIH_LIST_FOREACH_SAFE(&entry->waiters, iter)
+		empty_waiter_done((struct empty_waiter *)iter, 1);
+	if (entry->deferred)
+		deferred_remove_kick(entry->gpath);
+	if (!entry->autoremove)
+		return autoremove_entry_idle(entry);
+
+	nih_assert(entry->gpath != NULL);
+	leafpath = NIH_MUST( nih_sprintf(NULL, "%s%s", entry->gpath, U_LEAF) );
+	if (cgfs_rmdir(leafpath) < 0) {
+		if (errno == EBUSY)
+			return false;
+
+		nih_error("%s: Failed to remove %s: %s", __func__, leafpath,
+			  strerror(errno));
+	}
+
+	if (cgfs_rmdir(entry->gpath) < 0) {
+		if (errno == EBUSY)
+			return false;
+
+		nih_error("%s: Failed to remove %s: %s", __func__, entry->gpath,
+			  strerror(errno));
+		return false;
+	}
+
+	nih_info(_("Removed %s as it was empty"), entry->gpath);
+	return true;
+}
+
+/*
+ * The kernel dropped events: any entry may have become empty without
+ * our noticing, so look at them all.
+ */
+static void autoremove_recheck_all(void)
+{
+	NIH_HASH_FOREACH_SAFE(autoremove_entries, iter) {
+		struct autoremove_entry *entry = (struct autoremove_entry *)iter;
+
+		if (autoremove_events_modified(entry))
+			nih_discard(entry);
+	}
+}
+
+static void autoremove_dir_event(struct autoremove_watch *w,
+				 struct inotify_event *event)
+{
+	struct autoremove_entry *entry;
+	nih_local char *gpath = NULL;
+
+	if (event->mask & IN_IGNORED) {
+		/* the directory is gone, and so is everything under it */
+		nih_info(_("%s watch was removed"), w->path);
+		NIH_HASH_FOREACH_SAFE(autoremove_entries, iter) {
+			entry = (struct autoremove_entry *)iter;
+			if (entry->cg_watch == w)
+				nih_discard(entry);
+		}
+		return;
+	}
+
+	if (!(event->mask & IN_DELETE))
+		return;
+	if (event->len < 1) {
+		nih_warn("got DELETE inotify event without object name");
+		return;
+	}
+
+	gpath = NIH_MUST( nih_sprintf(NULL, "%s/%s", w->path, event->name) );
+	entry = (struct autoremove_entry *)nih_hash_lookup(autoremove_entries,
+							  gpath);
+	if (!entry)
+		return;
+
+	nih_info(_("%s was removed by somebody else"), entry->gpath);
+	nih_discard(entry);
+}
+
+static void autoremove_inotify_read(void *data, NihIo *io, const char *buf,
+				    size_t len)
+{
+	struct inotify_event *event;
+
+	nih_assert(io != NULL);
+	nih_assert(buf != NULL);
+
+	while (len >= sizeof(*event)) {
+		struct autoremove_watch *w;
+		size_t esize;
+
+		event = (struct inotify_event *)buf;
+		esize = sizeof(*event) + event->len;
+		if (len < esize)
+			break;
+
+		if (event->mask & IN_Q_OVERFLOW) {
+			nih_warn("%s: inotify queue overflowed", __func__);
+			autoremove_overflows++;
+			autoremove_recheck_all();
+			goto next;
+		}
+
+		w = autoremove_watch_lookup(event->wd);
+		if (!w) {
+			/* i.e. IN_IGNORED after we removed the watch */
+			nih_debug("%s: Got unknown watch descriptor %d",
+				  __func__, event->wd);
+			goto next;
+		}
+
+		if (w->kw) {
+			/* a key which is also a cgroup.events holds 2 refs */
+			bool owned = w->owner != NULL;
+
+			key_watch_inotify_event(w->kw, event);
+			if (!owned)
+				goto next;
+		}
+
+		if (!w->owner) {
+			autoremove_dir_event(w, event);
+			goto next;
+		}
+
+		if (event->mask & IN_IGNORED) {
+			nih_info(_("%s watch was removed"), w->owner->gpath);
+			nih_discard(w->owner);
+			goto next;
+		}
+
+		if (event->mask & IN_MODIFY &&
+		    autoremove_events_modified(w->owner))
+			nih_discard(w->owner);
+
+	next:
+		/* buf points into recv_buf, which this shrinks */
+		nih_io_buffer_shrink(io->recv_buf, esize);
+		len -= esize;
+	}
+}
+
+/*
+ * Set up the shared inotify instance the first time an autoremove
+ * entry is added.
+ */
+static bool autoremove_init(void)
+{
+	if (autoremove_io)
+		return true;
+
+	autoremove_ifd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (autoremove_ifd < 0) {
+		nih_error("%s: Failed to init inotify: %s", __func__,
+			  strerror(errno));
+		return false;
+	}
+
+	autoremove_io = nih_io_reopen(NULL, autoremove_ifd, NIH_IO_STREAM,
+				      autoremove_inotify_read,
+				      NULL, NULL, NULL);
+	if (!autoremove_io) {
+		NihError *err = nih_error_get();
+		nih_error("%s: Failed to add IO for inotify: %s", __func__,
+			  err->message);
+		nih_free(err);
+		close(autoremove_ifd);
+		autoremove_ifd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Find the entry watching @path, or if @create start watching it.
+ * Returns NULL on error, or if there is none.
+ */
+static struct autoremove_entry *autoremove_entry_get(const char *path,
+		bool create)
+{
+	nih_local char *wpath = NIH_MUST( nih_alloc(NULL, PATH_MAX) );
+	nih_local char *evpath = NULL;
+	nih_local char *parentpath = NULL;
+	char *lastpart;
+	struct autoremove_entry *entry;
+	struct autoremove_watch *cg_watch, *events_watch;
+
+	if (!cgfs_realpath(path, wpath) || strlen(wpath) < 1) {
+		nih_error("%s: Failed to expand path %s: %s", __func__, path,
+			  strerror(errno));
+		return NULL;
+	}
+
+	if (wpath[strlen(wpath) - 1] == '/')
+		wpath[strlen(wpath) - 1] = '\0';
+
+	entry = (struct autoremove_entry *)nih_hash_lookup(autoremove_entries,
+							  wpath);
+	if (entry || !create)
+		return entry;
+
+	evpath = NIH_MUST( nih_sprintf(NULL, "%s/cgroup.events", wpath) );
+
+	parentpath = NIH_MUST( nih_strdup(NULL, wpath) );
+	lastpart = strrchr(parentpath, '/');
+	if (lastpart == NULL) {
+		nih_error("%s: Failed to get last directory in path %s (%s)",
+			  __func__, parentpath, path);
+		return NULL;
+	}
+	*lastpart = '\0';
+	lastpart++;
+
+	if (!autoremove_init())
+		return NULL;
+
+	/*
+	 * IN_DELETE_SELF or IN_IGNORED events aren't generated for a cgroup
+	 * (or its files) that is being removed, we have to monitor parent cgroup
+	 * directory for IN_DELETE events instead
+	 */
+	cg_watch = autoremove_watch_get(parentpath, IN_DELETE);
+	if (!cg_watch)
+		return NULL;
+
+	events_watch = autoremove_watch_get(evpath, IN_MODIFY);
+	if (!events_watch) {
+		autoremove_watch_put(cg_watch);
+		return NULL;
+	}
+
+	entry = NIH_MUST( nih_alloc(NULL, sizeof(*entry)) );
+	nih_list_init(&entry->entry);
+	entry->gpath = NIH_MUST( nih_strdup(NULL, wpath) );
+	entry->evpath = NIH_MUST( nih_strdup(NULL, evpath) );
+	entry->dirname = NIH_MUST( nih_strdup(NULL, lastpart) );
+	entry->cg_watch = cg_watch;
+	entry->events_watch = events_watch;
+	entry->autoremove = false;
+	entry->deferred = false;
+	entry->populated = -1;
+	nih_list_init(&entry->subs);
+	nih_list_init(&entry->waiters);
+	events_watch->owner = entry;
+
+	nih_hash_add(autoremove_entries, &entry->entry);
+	nih_alloc_set_destructor(entry, autoremove_entry_destroy);
+
+	return entry;
+}
+
+static int do_remove_on_empty_unified(const char *path)
+{
+	struct autoremove_entry *entry;
+
+	if (!(entry = autoremove_entry_get(path, true)))
+		return -1;
+	if (entry->autoremove)
+		return 0;
+	entry->autoremove = true;
+
+	if (autoremove_events_modified(entry))
+		nih_discard(entry);
+
+	return 0;
+}
+
+/*
+ * Find the entry watching the unified cgroup @cgroup, on behalf of
+ * @r, who must be able to read it.  If @create, start watching it and
+ * read its populated value.  Returns NULL on error, or if there is no
+ * entry.
+ */
+static struct autoremove_entry *populated_entry_get(char *controller,
+		const char *cgroup, struct ucred p, struct ucred r, bool create)
+{
+	struct autoremove_entry *entry;
+	char path[MAXPATHLEN];
+
+	if (!value_cgroup_dir(controller, cgroup, p, r, path))
+		return NULL;
+	if (!is_unified_controller(controller)) {
+		nih_error("%s: %s is not on the unified hierarchy", __func__,
+			  controller);
+		return NULL;
+	}
+
+	entry = autoremove_entry_get(path, create);
+	if (!entry || entry->populated != -1)
+		return entry;
+
+	/*
+	 * Nobody is waiting on a new entry yet, so it is kept even if
+	 * it is idle; the caller will add itself.
+	 */
+	autoremove_events_modified(entry);
+	if (entry->populated == -1) {
+		if (autoremove_entry_idle(entry))
+			nih_discard(entry);
+		return NULL;
+	}
+	return entry;
+}
+
+/*
+ * Send PopulatedChanged signals to @conn whenever @cgroup becomes
+ * empty or populated.  Its current value is returned in @populated.
+ */
+int subscribe_populated_main(DBusConnection *conn, char *controller,
+		const char *cgroup, struct ucred p, struct ucred r,
+		int32_t *populated)
+{
+	struct autoremove_entry *entry;
+	struct populated_sub *sub;
+
+	entry = populated_entry_get(controller, cgroup, p, r, true);
+	if (!entry)
+		return -1;
+	*populated = entry->populated;
+
+	NIH_LIST_FOREACH(&entry->subs, iter) {
+		sub = (struct populated_sub *)iter;
+		if (sub->conn == conn && strcmp(sub->controller, controller) == 0 &&
+				strcmp(sub->cgroup, cgroup) == 0)
+			return 0;
+	}
+
+	sub = NIH_MUST( nih_new(entry, struct populated_sub) );
+	nih_list_init(&sub->entry);
+	sub->conn = dbus_connection_ref(conn);
+	sub->controller = NIH_MUST( nih_strdup(sub, controller) );
+	sub->cgroup = NIH_MUST( nih_strdup(sub, cgroup) );
+	nih_alloc_set_destructor(sub, populated_sub_destroy);
+	nih_list_add(&entry->subs, &sub->entry);
+	return 0;
+}
+
+int unsubscribe_populated_main(DBusConnection *conn, char *controller,
+		const char *cgroup, struct ucred p, struct ucred r)
+{
+	struct autoremove_entry *entry;
+
+	entry = populated_entry_get(controller, cgroup, p, r, false);
+	if (!entry)
+		return -1;
+
+	NIH_LIST_FOREACH_SAFE(&entry->subs, iter) {
+		struct populated_sub *sub = (struct populated_sub *)iter;
+
+		if (sub->conn == conn && strcmp(sub->controller, controller) == 0 &&
+				strcmp(sub->cgroup, cgroup) == 0) {
+			nih_free(sub);
+			if (autoremove_entry_idle(entry))
+				nih_discard(entry);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void empty_waiter_timeout(struct empty_waiter *w, NihTimer *timer)
+{
+	struct autoremove_entry *entry = w->owner;
+
+	w->timer = NULL;  // freed by the main loop
+	empty_waiter_done(w, 0);
+	if (autoremove_entry_idle(entry))
+		nih_discard(entry);
+}
+
+/*
+ * Answer WaitEmpty @message with 1 once @cgroup is empty (or removed),
+ * or with 0 if it is still populated after @timeout seconds.  A
+ * @timeout of 0 answers at once, and a negative one waits for ever.
+ */
+int wait_empty_main(NihDBusMessage *message, char *controller,
+		const char *cgroup, struct ucred p, struct ucred r,
+		int32_t timeout)
+{
+	struct autoremove_entry *entry;
+	struct empty_waiter *w;
+
+	entry = populated_entry_get(controller, cgroup, p, r, true);
+	if (!entry)
+		return -1;
+
+	w = NIH_MUST( nih_new(entry, struct empty_waiter) );
+	nih_list_init(&w->entry);
+	w->message = message;
+	nih_ref(message, w);
+	w->timer = NULL;
+	w->owner = entry;
+	nih_alloc_set_destructor(w, empty_waiter_destroy);
+
+	if (entry->populated == 0 || timeout == 0) {
+		empty_waiter_done(w, entry->populated == 0);
+		if (autoremove_entry_idle(entry))
+			nih_discard(entry);
+		return 0;
+	}
+
+	nih_list_add(&entry->waiters, &w->entry);
+	if (timeout > 0)
+		w->timer = NIH_MUST( nih_timer_add_timeout(NULL, timeout,
+				(NihTimerCb) empty_waiter_timeout, w) );
+	return 0;
+}
+
+/* Drop the subscriptions and WaitEmpty calls of a departing client */
+void populated_client_disconnect(DBusConnection *conn)
+{
+	if (!autoremove_entries)
+		return;
+
+	NIH_HASH_FOREACH_SAFE(autoremove_entries, iter) {
+		struct autoremove_entry *entry = (struct autoremove_entry *)iter;
+
+		NIH_LIST_FOREACH_SAFE(&entry->subs, siter) {
+			struct populated_sub *sub = (struct populated_sub *)siter;
+
+			if (sub->conn == conn)
+				nih_free(sub);
+		}
+		NIH_LIST_FOREACH_SAFE(&entry->waiters, witer) {
+			struct empty_waiter *w = (struct empty_waiter *)witer;
+
+			if (w->message->connection == conn)
+				nih_free(w);
+		}
+		if (autoremove_entry_idle(entry))
+			nih_discard(entry);
+	}
+}
+
+static int deferred_remove_destroy(struct deferred_remove *dr)
+{
+	struct autoremove_entry *entry;
+
+	if (dr->tfd_watch)
+		nih_free(dr->tfd_watch);
+	if (dr->tfd >= 0)
+		close(dr->tfd);
+	if (dr->unified) {
+		entry = (struct autoremove_entry *)nih_hash_lookup(
+				autoremove_entries, dr->path);
+		if (entry) {
+			entry->deferred = false;
+			if (autoremove_entry_idle(entry))
+				nih_discard(entry);
+		}
+	}
+	nih_list_destroy(&dr->entry);
+	return 0;
+}
+
+/*
+ * Time @dr's next attempt for @ms from now.  It is always run from the
+ * main loop, never from here, as this may be called while the autoremove
+ * entry which kicked it is in use.
+ */
+static bool deferred_remove_arm(struct deferred_remove *dr, int ms)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	if (!ms)
+		its.it_value.tv_nsec = 1;  // zero would disarm it
+	if (timerfd_settime(dr->tfd, 0, &its, NULL) < 0) {
+		nih_warn("%s: Failed to arm retry timer for %s: %s",
+			 __func__, dr->path, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* Runs on a worker */
+static void deferred_remove_run(struct deferred_remove *dr)
+{
+	nih_local char *leafpath = NULL;
+
+	if (dr->unified) {
+		leafpath = NIH_MUST( nih_sprintf(NULL, "%s%s", dr->path, U_LEAF) );
+		if (cgfs_rmdir(leafpath) < 0 && errno != ENOENT)
+			goto busy;
+	}
+	if (dr->recursive ? recursive_rmdir(dr->path) < 0 :
+			cgfs_rmdir(dr->path) < 0)
+		goto busy;
+	dr->result = 0;
+	return;
+
+busy:
+	/* somebody else may have removed it meanwhile */
+	dr->result = dir_exists(dr->path) ? -1 : 0;
+}
+
+static void deferred_remove_done(struct deferred_remove *dr)
+{
+	int delay, i;
+
+	dr->running = false;
+	dr->attempts++;
+	deferred_remove_attempts++;
+	if (dr->result == 0) {
+		nih_info(_("Removed %s after %d attempts"), dr->path,
+			 dr->attempts);
+		deferred_remove_succeeded++;
+		nih_free(dr);
+		return;
+	}
+	if (dr->attempts >= remove_retries) {
+		nih_warn("%s: Giving up removing %s after %d attempts",
+			 __func__, dr->path, dr->attempts);
+		deferred_remove_failed++;
+		nih_free(dr);
+		return;
+	}
+
+	delay = remove_backoff > 0 ? remove_backoff : 0;
+	for (i = 1; i < dr->attempts && delay < DEFERRED_REMOVE_MAX_DELAY; i++)
+		delay *= 2;
+	if (delay > DEFERRED_REMOVE_MAX_DELAY)
+		delay = DEFERRED_REMOVE_MAX_DELAY;
+	if (dr->kicked)
+		delay = 0;
+	dr->kicked = false;
+
+	deferred_remove_retries++;
+	if (!deferred_remove_arm(dr, delay)) {
+		deferred_remove_failed++;
+		nih_free(dr);
+	}
+}
+
+static void deferred_remove_timer(struct deferred_remove *dr,
+		NihIoWatch *watch, NihIoEvents events)
+{
+	char *keys[] = { dr->path, NULL };
+	uint64_t count;
+
+	if (read(dr->tfd, &count, sizeof(count)) != sizeof(count))
+		return;
+
+	dr->running = true;
+	work_submit(keys, false, (WorkFunc) deferred_remove_run,
+		    (WorkFunc) deferred_remove_done, dr);
+}
+
+/* @gpath has become empty: retry any pending removal of it now */
+static void deferred_remove_kick(const char *gpath)
+{
+	struct deferred_remove *dr;
+
+	dr = (struct deferred_remove *)nih_hash_lookup(deferred_removes, gpath);
+	if (!dr)
+		return;
+
+	deferred_remove_kicks++;
+	if (dr->running)
+		dr->kicked = true;
+	else
+		deferred_remove_arm(dr, 0);
+}
+
+/* Start removing @working, a cgroup in @rcg's hierarchy, until it is gone */
+static int deferred_remove_queue(const struct resolved_cgroup *rcg,
+		const char *working, int recursive)
+{
+	char path[MAXPATHLEN];
+	struct deferred_remove *dr;
+	struct autoremove_entry *entry;
+	size_t len;
+
+	if (!cgfs_realpath(working, path)) {
+		nih_error("%s: Failed to expand path %s: %s", __func__,
+			  working, strerror(errno));
+		return -1;
+	}
+	len = strlen(path);
+	if (len > 1 && path[len - 1] == '/')
+		path[len - 1] = '\0';
+
+	if (nih_hash_lookup(deferred_removes, path))
+		return 0;
+
+	dr = NIH_MUST( nih_new(NULL, struct deferred_remove) );
+	nih_list_init(&dr->entry);
+	dr->path = NIH_MUST( nih_strdup(dr, path) );
+	dr->unified = is_unified_controller(rcg->controller);
+	dr->recursive = recursive;
+	dr->attempts = 0;
+	dr->running = dr->kicked = false;
+	dr->result = -1;
+	dr->tfd_watch = NULL;
+	dr->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	nih_alloc_set_destructor(dr, deferred_remove_destroy);
+	if (dr->tfd < 0) {
+		nih_error("%s: Failed to create timerfd: %s", __func__,
+			  strerror(errno));
+		nih_free(dr);
+		return -1;
+	}
+	dr->tfd_watch = NIH_MUST( nih_io_add_watch(dr, dr->tfd, NIH_IO_READ,
+				(NihIoWatcher) deferred_remove_timer, dr) );
+	if (!deferred_remove_arm(dr, 0)) {
+		nih_free(dr);
+		return -1;
+	}
+	nih_hash_add(deferred_removes, &dr->entry);
+	deferred_remove_queued++;
+
+	if (dr->unified && (entry = autoremove_entry_get(dr->path, true)))
+		entry->deferred = true;
+	return 0;
+}
+
+/*
+ * Remove @cgroup as remove_main() does, but in the background, retrying
+ * for as long as it is busy, e.g. because its tasks have exited but not
+ * yet been reaped.  Permissions are checked, and @existed set, before
+ * returning; the removal itself is not waited for.
+ */
+int remove_deferred_main(const char *controller, const char *cgroup,
+		struct ucred p, struct ucred r, int recursive, int32_t *existed)
+{
+	nih_local struct resolved_cgroup *rcgs = NULL;
+	int i, n, ret;
+
+	*existed = -1;
+	if (!sane_cgroup(cgroup)) {
+		nih_error("%s: unsafe cgroup", __func__);
+		return -1;
+	}
+
+	n = resolve_pid_cgroups(NULL, r.pid, controller, false, &rcgs);
+	for (i = 0; i < n; i++) {
+		nih_local char *working = NULL;
+		int32_t e;
+
+		ret = remove_target(NULL, &rcgs[i], cgroup, r, &working, &e);
+		if (ret == -2 && !single_controller(controller))
+			continue;  // permission denied - ignore for group requests
+		if (ret != 0)
+			return -1;
+		if (e == -1)
+			continue;
+		*existed = 1;
+		if (deferred_remove_queue(&rcgs[i], working, recursive) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void deferred_remove_get_stats(void *parent, char ***output,
+		size_t *len)
+{
+	unsigned long pending = 0;
+
+	NIH_HASH_FOREACH(deferred_removes, iter)
+		pending++;
+
+	add_stat(parent, output, len, "deferred_removes", pending);
+	add_stat(parent, output, len, "deferred_remove_queued",
+		 deferred_remove_queued);
+	add_stat(parent, output, len, "deferred_remove_attempts",
+		 deferred_remove_attempts);
+	add_stat(parent, output, len, "deferred_remove_retries",
+		 deferred_remove_retries);
+	add_stat(parent, output, len, "deferred_remove_kicks",
+		 deferred_remove_kicks);
+	add_stat(parent, output, len, "deferred_remove_succeeded",
+		 deferred_remove_succeeded);
+	add_stat(parent, output, len, "deferred_remove_failed",
+		 deferred_remove_failed);
+}
+
+static int key_sub_destroy(struct key_sub *sub)
+{
+	dbus_connection_unref(sub->conn);
+	nih_list_destroy(&sub->entry);
+	return 0;
+}
+
+static int key_watch_destroy(struct key_watch *kw)
+{
+	if (kw->iwatch) {
+		kw->iwatch->kw = NULL;
+		autoremove_watch_put(kw->iwatch);
+	}
+	if (kw->io_watch)
+		nih_free(kw->io_watch);
+	if (kw->tfd_watch)
+		nih_free(kw->tfd_watch);
+	/* closing the eventfd or trigger also unregisters it */
+	if (kw->fd >= 0)
+		close(kw->fd);
+	if (kw->tfd >= 0)
+		close(kw->tfd);
+	nih_list_destroy(&kw->entry);
+	return 0;
+}
+
+/* Send the current value of @kw to each of its subscribers */
+static void key_watch_fire(struct key_watch *kw)
+{
+	nih_local char *value = NULL;
+	int ret;
+
+	key_watch_events++;
+	if (kw->readable)
+		value = file_read_string(NULL, kw->path);
+
+	NIH_LIST_FOREACH(&kw->subs, iter) {
+		struct key_sub *sub = (struct key_sub *)iter;
+
+		if (kw->pressure)
+			ret = cgmanager_emit_pressure_changed(sub->conn,
+					"/org/linuxcontainers/cgmanager",
+					sub->controller, sub->cgroup, sub->key,
+					sub->args, value ? value : "");
+		else
+			ret = cgmanager_emit_key_changed(sub->conn,
+					"/org/linuxcontainers/cgmanager",
+					sub->controller, sub->cgroup, sub->key,
+					sub->args, value ? value : "");
+		if (ret < 0) {
+			NihError *err = nih_error_get();
+			nih_warn("%s: Failed to signal %s: %s", __func__,
+				 kw->path, err->message);
+			nih_free(err);
+			continue;
+		}
+		key_watch_signals++;
+	}
+}
+
+static void key_watch_inotify_event(struct key_watch *kw,
+		struct inotify_event *event)
+{
+	if (event->mask & IN_IGNORED) {
+		nih_info(_("%s watch was removed"), kw->path);
+		nih_free(kw);
+		return;
+	}
+
+	if (event->mask & IN_MODIFY)
+		key_watch_fire(kw);
+}
+
+static void key_watch_eventfd_ready(struct key_watch *kw, NihIoWatch *watch,
+		NihIoEvents events)
+{
+	uint64_t count;
+
+	if (read(kw->fd, &count, sizeof(count)) != sizeof(count))
+		return;
+
+	/* the kernel also signals the eventfd when the cgroup is removed */
+	if (!dir_exists(kw->dir)) {
+		nih_info(_("%s watch was removed"), kw->path);
+		nih_free(kw);
+		return;
+	}
+
+	key_watch_fire(kw);
+}
+
+/* Signal @kw's subscribers, and hold off further signals for a while */
+static void pressure_fire(struct key_watch *kw)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+	key_watch_fire(kw);
+	if (pressure_holdoff <= 0)
+		return;
+
+	its.it_value.tv_sec = pressure_holdoff / 1000;
+	its.it_value.tv_nsec = (pressure_holdoff % 1000) * 1000000L;
+	if (timerfd_settime(kw->tfd, 0, &its, NULL) < 0) {
+		nih_warn("%s: Failed to arm holdoff timer for %s: %s",
+			 __func__, kw->path, strerror(errno));
+		return;
+	}
+	kw->holdoff = true;
+}
+
+static void pressure_ready(struct key_watch *kw, NihIoWatch *watch,
+		NihIoEvents events)
+{
+	/* a removed cgroup's pressure file is always ready */
+	if (!dir_exists(kw->dir)) {
+		nih_info(_("%s watch was removed"), kw->path);
+		nih_free(kw);
+		return;
+	}
+
+	if (kw->holdoff) {
+		kw->pending = true;
+		pressure_coalesced++;
+		return;
+	}
+	pressure_fire(kw);
+}
+
+static void pressure_holdoff_done(struct key_watch *kw, NihIoWatch *watch,
+		NihIoEvents events)
+{
+	uint64_t count;
+
+	if (read(kw->tfd, &count, sizeof(count)) != sizeof(count))
+		return;
 
-		pop_val = !!val;
-		break;
+	kw->holdoff = false;
+	if (kw->pending) {
+		kw->pending = false;
+		pressure_fire(kw);
 	}
+}
 
-	fclose(f);
+/* Watch @kw's file on the unified hierarchy, which writes notify */
+static bool key_watch_inotify(struct key_watch *kw)
+{
+	struct autoremove_watch *w;
 
-	if (pop_val == -1) {
-		nih_error("%s: Cannot find or parse populated value in %s",
-			  __func__, entry->evpath);
+	if (!autoremove_init())
 		return false;
-	} else if (pop_val == 1)
+
+	w = autoremove_watch_get(kw->path, IN_MODIFY);
+	if (!w)
 		return false;
+	nih_assert(w->kw == NULL);  // the same path has the same key_watch
+	w->kw = kw;
+	kw->iwatch = w;
+	return true;
+}
 
-	nih_assert(entry->gpath != NULL);
-	leafpath = NIH_MUST( nih_sprintf(NULL, "%s%s", entry->gpath, U_LEAF) );
-	if (rmdir(leafpath) < 0) {
-		if (errno == EBUSY)
-			return false;
+/*
+ * Register an eventfd for @kw's file through cgroup.event_control,
+ * passing the controller-specific @args (a memory.pressure_level level,
+ * or a memory.usage_in_bytes threshold).
+ */
+static bool key_watch_eventfd(struct key_watch *kw, const char *args)
+{
+	nih_local char *ctlpath = NULL, *cmd = NULL;
+	int kfd;
+	ssize_t ret;
 
-		nih_error("%s: Failed to remove %s: %s", __func__, leafpath,
+	kw->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (kw->fd < 0) {
+		nih_error("%s: Failed to create eventfd: %s", __func__,
 			  strerror(errno));
+		return false;
 	}
 
-	if (rmdir(entry->gpath) < 0) {
-		if (errno == EBUSY)
-			return false;
-
-		nih_error("%s: Failed to remove %s: %s", __func__, entry->gpath,
+	kfd = cgfs_open(kw->path, O_RDONLY);
+	if (kfd < 0) {
+		nih_error("%s: Failed to open %s: %s", __func__, kw->path,
 			  strerror(errno));
 		return false;
 	}
 
-	nih_info(_("Removed %s as it was empty"), entry->gpath);
+	ctlpath = NIH_MUST( nih_sprintf(NULL, "%s/cgroup.event_control",
+				kw->dir) );
+	if (*args)
+		cmd = NIH_MUST( nih_sprintf(NULL, "%d %d %s", kw->fd, kfd,
+					args) );
+	else
+		cmd = NIH_MUST( nih_sprintf(NULL, "%d %d", kw->fd, kfd) );
+	ret = cgfs_write(ctlpath, cmd, strlen(cmd));
+	close(kfd);
+	if (ret < 0) {
+		nih_error("%s: Failed to register for %s events: %s", __func__,
+			  kw->path, strerror(errno));
+		return false;
+	}
+
+	kw->io_watch = NIH_MUST( nih_io_add_watch(kw, kw->fd, NIH_IO_READ,
+				(NihIoWatcher) key_watch_eventfd_ready, kw) );
 	return true;
 }
 
-static void autoremove_inotify_read(void *data, NihIo *io, const char *buf,
-				    size_t len)
+/*
+ * Write PSI @trigger ("some|full <threshold us> <window us>") to @kw's
+ * pressure file.  The trigger lives as long as the fd it was written
+ * to, and the kernel rate limits it to one event per window.
+ */
+static bool key_watch_pressure(struct key_watch *kw, const char *trigger)
 {
-	struct autoremove_entry *entry = data;
-	struct inotify_event *event;
-
-	nih_assert(entry != NULL);
-	nih_assert(io != NULL);
-	nih_assert(buf != NULL);
+	kw->fd = cgfs_open(kw->path, O_RDWR | O_NONBLOCK);
+	if (kw->fd < 0) {
+		nih_error("%s: Failed to open %s: %s", __func__, kw->path,
+			  strerror(errno));
+		return false;
+	}
 
-	bool should_exit = false;
-	while (len >= sizeof(*event)) {
-		size_t esize;
+	if (write(kw->fd, trigger, strlen(trigger) + 1) < 0) {
+		nih_error("%s: Failed to set trigger \"%s\" on %s: %s",
+			  __func__, trigger, kw->path, strerror(errno));
+		return false;
+	}
 
-		event = (struct inotify_event *)buf;
-		esize = sizeof(*event) + event->len;
-		if (len < esize)
-			break;
+	kw->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (kw->tfd < 0) {
+		nih_error("%s: Failed to create timerfd: %s", __func__,
+			  strerror(errno));
+		return false;
+	}
 
-		if (event->wd != entry->wd_cg &&
-		    event->wd != entry->wd_events) {
-			nih_error("%s: Got unknown watch descriptor %d (expected %d or %d) while watching %s",
-				  __func__, event->wd, entry->wd_cg,
-				  entry->wd_events, entry->gpath);
-			goto next;
-		}
+	kw->io_watch = NIH_MUST( nih_io_add_watch(kw, kw->fd, NIH_IO_EXCEPT,
+				(NihIoWatcher) pressure_ready, kw) );
+	kw->tfd_watch = NIH_MUST( nih_io_add_watch(kw, kw->tfd, NIH_IO_READ,
+				(NihIoWatcher) pressure_holdoff_done, kw) );
+	return true;
+}
 
-		if (event->mask & IN_IGNORED) {
-			nih_info(_("%s watch was removed"),
-				 entry->gpath);
-			should_exit = true;
-			goto next;
-		}
+/*
+ * Find the watch on @key in cgroup directory @dir, which
+ * value_cgroup_dir() has already checked, on behalf of @r, who must be
+ * able to read it, or for a PSI trigger to write it, since we write
+ * the trigger.  If @create, start watching it, with PSI trigger @args
+ * if @pressure.  Returns NULL on error, or if there is no watch.
+ */
+static struct key_watch *key_watch_get(char *controller, const char *dir,
+		const char *key, const char *args, struct ucred r, bool pressure,
+		bool create)
+{
+	nih_local char *path = NULL, *name = NULL;
+	struct key_watch *kw;
+	struct stat sb;
+	bool unified = is_unified_controller(controller);
+	bool ok;
 
-		if (event->mask & IN_DELETE &&
-		    event->wd == entry->wd_cg)
-			do {
-				if (event->len < 1) {
-					nih_warn("got DELETE inotify event without object name");
-					break;
-				}
+	if (!*key || strchr(key, '/')) {
+		nih_error("%s: bad key %s", __func__, key);
+		return NULL;
+	}
+	if (unified && *args && !pressure) {
+		nih_error("%s: arguments are only for cgroup.event_control",
+			  __func__);
+		return NULL;
+	}
+	if (!unified && pressure) {
+		nih_error("%s: %s is not on the unified hierarchy", __func__,
+			  controller);
+		return NULL;
+	}
 
-				if (strcmp(event->name, entry->dirname) != 0)
-					break;
+	path = NIH_MUST( nih_sprintf(NULL, "%s/%s", dir, key) );
+	if (!may_access(r.pid, r.uid, r.gid, path,
+				pressure ? O_RDWR : O_RDONLY)) {
+		nih_debug("%s: Pid %d may not access %s\n", __func__, r.pid, path);
+		return NULL;
+	}
+
+	name = NIH_MUST( nih_sprintf(NULL, "%s %s", path, args) );
+	kw = (struct key_watch *)nih_hash_lookup(key_watches, name);
+	if (kw || !create)
+		return kw;
+
+	kw = NIH_MUST( nih_new(NULL, struct key_watch) );
+	nih_list_init(&kw->entry);
+	kw->name = NIH_MUST( nih_strdup(kw, name) );
+	kw->path = NIH_MUST( nih_strdup(kw, path) );
+	kw->dir = NIH_MUST( nih_strdup(kw, dir) );
+	/* e.g. memory.pressure_level can only be registered, not read */
+	kw->readable = stat(path, &sb) == 0 && sb.st_mode & S_IRUSR;
+	kw->pressure = pressure;
+	kw->iwatch = NULL;
+	kw->fd = kw->tfd = -1;
+	kw->io_watch = kw->tfd_watch = NULL;
+	kw->holdoff = kw->pending = false;
+	nih_list_init(&kw->subs);
+	nih_alloc_set_destructor(kw, key_watch_destroy);
+
+	if (pressure)
+		ok = key_watch_pressure(kw, args);
+	else if (unified)
+		ok = key_watch_inotify(kw);
+	else
+		ok = key_watch_eventfd(kw, args);
+	if (!ok) {
+		nih_free(kw);
+		return NULL;
+	}
 
-				nih_info(_("%s was removed by somebody else"),
-					 entry->gpath);
-				should_exit = true;
-				goto next;
-			} while (0);
+	nih_hash_add(key_watches, &kw->entry);
+	return kw;
+}
 
-		if (event->mask & IN_MODIFY &&
-		    event->wd == entry->wd_events)
-			if (autoremove_events_modified(entry)) {
-				should_exit = true;
-				goto next;
-			}
+/*
+ * May @conn start another watch?  Each costs an inotify watch, an
+ * event_control registration or a PSI trigger, so a client may only
+ * hold max_watches of them.
+ */
+static bool key_watch_allowed(DBusConnection *conn)
+{
+	int n = 0;
 
-	next:
-		nih_io_buffer_shrink(io->recv_buf, esize);
-		len -= esize;
+	NIH_HASH_FOREACH(key_watches, iter) {
+		struct key_watch *kw = (struct key_watch *)iter;
 
-		if (should_exit) {
-			nih_discard(entry);
-			return;
+		NIH_LIST_FOREACH(&kw->subs, siter) {
+			if (((struct key_sub *)siter)->conn == conn)
+				n++;
 		}
 	}
+	if (n < max_watches)
+		return true;
+	nih_error("%s: client already holds %d watches", __func__, n);
+	key_watch_refused++;
+	return false;
 }
 
-static int do_remove_on_empty_unified(const char *path)
+/*
+ * Subscribe @conn to @kw, naming it in signals by the @controller,
+ * @cgroup, @key and @args it was asked for with.
+ */
+static void key_watch_subscribe(struct key_watch *kw, DBusConnection *conn,
+		const char *controller, const char *cgroup, const char *key,
+		const char *args)
 {
-	nih_local char *wpath = NIH_MUST( nih_alloc(NULL, PATH_MAX) );
-	nih_local char *evpath = NULL;
-	nih_local char *parentpath = NULL;
-	char *lastpart;
-	struct autoremove_entry *entry;
-	int ifd, wd_cg, wd_events;
+	struct key_sub *sub;
 
-	if (realpath(path, wpath) == NULL || strlen(wpath) < 1) {
-		nih_error("%s: Failed to expand path %s: %s", __func__, path,
-			  strerror(errno));
-		return -1;
+	NIH_LIST_FOREACH(&kw->subs, iter) {
+		sub = (struct key_sub *)iter;
+		if (sub->conn == conn && strcmp(sub->controller, controller) == 0 &&
+				strcmp(sub->cgroup, cgroup) == 0 &&
+				strcmp(sub->key, key) == 0)
+			return;
 	}
 
-	if (wpath[strlen(wpath) - 1] == '/')
-		wpath[strlen(wpath) - 1] = '\0';
-
-	NIH_LIST_FOREACH(&autoremove_entries, lentry) {
-		entry = (struct autoremove_entry *)lentry;
-
-		nih_assert(entry != NULL);
-		nih_assert(entry->gpath != NULL);
+	sub = NIH_MUST( nih_new(kw, struct key_sub) );
+	nih_list_init(&sub->entry);
+	sub->conn = dbus_connection_ref(conn);
+	sub->controller = NIH_MUST( nih_strdup(sub, controller) );
+	sub->cgroup = NIH_MUST( nih_strdup(sub, cgroup) );
+	sub->key = NIH_MUST( nih_strdup(sub, key) );
+	sub->args = NIH_MUST( nih_strdup(sub, args) );
+	nih_alloc_set_destructor(sub, key_sub_destroy);
+	nih_list_add(&kw->subs, &sub->entry);
+}
 
-		if (strcmp(entry->gpath, wpath) == 0)
+static int key_watch_unsubscribe(struct key_watch *kw, DBusConnection *conn,
+		const char *controller, const char *cgroup, const char *key)
+{
+	NIH_LIST_FOREACH_SAFE(&kw->subs, iter) {
+		struct key_sub *sub = (struct key_sub *)iter;
+
+		if (sub->conn == conn && strcmp(sub->controller, controller) == 0 &&
+				strcmp(sub->cgroup, cgroup) == 0 &&
+				strcmp(sub->key, key) == 0) {
+			nih_free(sub);
+			if (NIH_LIST_EMPTY(&kw->subs))
+				nih_free(kw);
 			return 0;
+		}
 	}
+	return -1;
+}
 
-	evpath = NIH_MUST( nih_sprintf(NULL, "%s/cgroup.events", wpath) );
+/*
+ * Send KeyChanged signals to @conn whenever @key in @cgroup changes:
+ * on the unified hierarchy whenever the file is modified (e.g.
+ * memory.events), and on v1 whenever its event_control event, as
+ * chosen by @args, fires (e.g. memory.oom_control).
+ */
+int watch_key_main(DBusConnection *conn, char *controller, const char *cgroup,
+		const char *key, const char *args, struct ucred p,
+		struct ucred r)
+{
+	char path[MAXPATHLEN];
+	struct key_watch *kw;
 
-	parentpath = NIH_MUST( nih_strdup(NULL, wpath) );
-	lastpart = strrchr(parentpath, '/');
-	if (lastpart == NULL) {
-		nih_error("%s: Failed to get last directory in path %s (%s)",
-			  __func__, parentpath, path);
+	if (!value_cgroup_dir(controller, cgroup, p, r, path))
+		return -1;
+	if (!key_watch_allowed(conn))
 		return -1;
-	}
-	*lastpart = '\0';
-	lastpart++;
 
-	ifd = inotify_init1(IN_CLOEXEC);
-	if (ifd < 0) {
-		nih_error("%s: Failed to init inotify for %s: %s", __func__,
-			  path, strerror(errno));
+	kw = key_watch_get(controller, path, key, args, r, false, true);
+	if (!kw)
 		return -1;
-	}
 
-	/*
-	 * IN_DELETE_SELF or IN_IGNORED events aren't generated for a cgroup
-	 * (or its files) that is being removed, we have to monitor parent cgroup
-	 * directory for IN_DELETE events instead
-	 */
-	wd_cg = inotify_add_watch(ifd, parentpath, IN_DELETE);
-	if (wd_cg < 0) {
-		nih_error("%s: Failed to add watch for %s: %s", __func__, parentpath,
-			  strerror(errno));
-		close(ifd);
+	key_watch_subscribe(kw, conn, controller, cgroup, key, args);
+	return 0;
+}
+
+int unwatch_key_main(DBusConnection *conn, char *controller, const char *cgroup,
+		const char *key, const char *args, struct ucred p,
+		struct ucred r)
+{
+	char path[MAXPATHLEN];
+	struct key_watch *kw;
+
+	if (!value_cgroup_dir(controller, cgroup, p, r, path))
 		return -1;
-	}
 
-	wd_events = inotify_add_watch(ifd, evpath, IN_MODIFY);
-	if (wd_events < 0) {
-		nih_error("%s: Failed to add watch for %s: %s", __func__, evpath,
-			  strerror(errno));
-		close(ifd);
+	kw = key_watch_get(controller, path, key, args, r, false, false);
+	if (!kw)
 		return -1;
+
+	return key_watch_unsubscribe(kw, conn, controller, cgroup, key);
+}
+
+/*
+ * Find the file for @resource's pressure and the normal form of
+ * @trigger, so that subscribers asking for the same trigger share it.
+ * We write triggers as root, so apply the limit which the kernel puts
+ * on unprivileged ones ourselves unless @r is root on the host: their
+ * window must be a whole number of PSI_UNPRIV_WINDOW.
+ */
+#define PSI_UNPRIV_WINDOW 2000000  // us
+
+static bool pressure_key(void *parent, const char *resource,
+		const char *trigger, struct ucred r, char **key, char **args)
+{
+	char kind[5], extra;
+	unsigned int threshold, window;
+
+	if (strcmp(resource, "cpu") != 0 && strcmp(resource, "memory") != 0 &&
+			strcmp(resource, "io") != 0) {
+		nih_error("%s: no pressure for %s", __func__, resource);
+		return false;
+	}
+	if (sscanf(trigger, "%4s %u %u %c", kind, &threshold, &window,
+				&extra) != 3 ||
+			(strcmp(kind, "some") != 0 && strcmp(kind, "full") != 0)) {
+		nih_error("%s: bad trigger \"%s\"", __func__, trigger);
+		return false;
+	}
+	if (r.uid != 0 && window % PSI_UNPRIV_WINDOW != 0) {
+		nih_error("%s: pid %d (uid %u) may only use windows of whole %ds",
+			  __func__, r.pid, r.uid, PSI_UNPRIV_WINDOW / 1000000);
+		return false;
 	}
 
-	entry = NIH_MUST( nih_alloc(NULL, sizeof(*entry)) );
-	nih_list_init(&entry->entry);
-	entry->gpath = NIH_MUST( nih_strdup(NULL, wpath) );
-	entry->evpath = NIH_MUST( nih_strdup(NULL, evpath) );
-	entry->dirname = NIH_MUST( nih_strdup(NULL, lastpart) );
-	entry->wd_cg = wd_cg;
-	entry->wd_events = wd_events;
-	entry->io = NULL;
+	*key = NIH_MUST( nih_sprintf(parent, "%s.pressure", resource) );
+	*args = NIH_MUST( nih_sprintf(parent, "%s %u %u", kind, threshold,
+				window) );
+	return true;
+}
 
-	nih_list_add(&autoremove_entries, &entry->entry);
-	nih_alloc_set_destructor(entry, autoremove_entry_destroy);
+/*
+ * Send PressureChanged signals to @conn whenever PSI @trigger fires
+ * for @resource in @cgroup, which must be on the unified hierarchy.
+ */
+int watch_pressure_main(DBusConnection *conn, char *controller,
+		const char *cgroup, const char *resource, const char *trigger,
+		struct ucred p, struct ucred r)
+{
+	char path[MAXPATHLEN];
+	nih_local char *key = NULL, *args = NULL;
+	struct key_watch *kw;
 
-	entry->io = nih_io_reopen(NULL, ifd, NIH_IO_STREAM,
-				  autoremove_inotify_read,
-				  NULL, NULL, entry);
-	if (entry->io == NULL) {
-		nih_error("%s: Failed to add IO for watch for %s",
-			  __func__, evpath);
-		nih_discard(entry);
-		close(ifd);
+	if (!pressure_key(NULL, resource, trigger, r, &key, &args))
+		return -1;
+	if (!value_cgroup_dir(controller, cgroup, p, r, path))
+		return -1;
+	if (!key_watch_allowed(conn))
 		return -1;
-	}
 
-	if (autoremove_events_modified(entry))
-		nih_discard(entry);
+	kw = key_watch_get(controller, path, key, args, r, true, true);
+	if (!kw)
+		return -1;
 
+	key_watch_subscribe(kw, conn, controller, cgroup, resource, trigger);
 	return 0;
 }
 
-int do_remove_on_empty_main(const char *controller, const char *cgroup,
+int unwatch_pressure_main(DBusConnection *conn, char *controller,
+		const char *cgroup, const char *resource, const char *trigger,
 		struct ucred p, struct ucred r)
 {
-	char rcgpath[MAXPATHLEN];
+	char path[MAXPATHLEN];
+	nih_local char *key = NULL, *args = NULL;
+	struct key_watch *kw;
+
+	if (!pressure_key(NULL, resource, trigger, r, &key, &args))
+		return -1;
+	if (!value_cgroup_dir(controller, cgroup, p, r, path))
+		return -1;
+
+	kw = key_watch_get(controller, path, key, args, r, true, false);
+	if (!kw)
+		return -1;
+
+	return key_watch_unsubscribe(kw, conn, controller, cgroup, resource);
+}
+
+/* Drop the key and pressure watches of a departing client */
+void key_watch_client_disconnect(DBusConnection *conn)
+{
+	NIH_HASH_FOREACH_SAFE(key_watches, iter) {
+		struct key_watch *kw = (struct key_watch *)iter;
+
+		NIH_LIST_FOREACH_SAFE(&kw->subs, siter) {
+			struct key_sub *sub = (struct key_sub *)siter;
+
+			if (sub->conn == conn)
+				nih_free(sub);
+		}
+		if (NIH_LIST_EMPTY(&kw->subs))
+			nih_free(kw);
+	}
+}
+
+void autoremove_get_stats(void *parent, char ***output, size_t *len)
+{
+	unsigned long entries = 0, watches = 0, subs = 0, waiters = 0;
+
+	NIH_HASH_FOREACH(autoremove_entries, iter) {
+		struct autoremove_entry *entry = (struct autoremove_entry *)iter;
+
+		entries++;
+		NIH_LIST_FOREACH(&entry->subs, siter)
+			subs++;
+		NIH_LIST_FOREACH(&entry->waiters, witer)
+			waiters++;
+	}
+	NIH_HASH_FOREACH(autoremove_watches, iter)
+		watches++;
+
+	add_stat(parent, output, len, "autoremove_entries", entries);
+	add_stat(parent, output, len, "autoremove_watches", watches);
+	add_stat(parent, output, len, "autoremove_overflows",
+		 autoremove_overflows);
+	add_stat(parent, output, len, "populated_subscriptions", subs);
+	add_stat(parent, output, len, "populated_signals", populated_signals);
+	add_stat(parent, output, len, "empty_waiters", waiters);
+
+	watches = subs = 0;
+	NIH_HASH_FOREACH(key_watches, iter) {
+		struct key_watch *kw = (struct key_watch *)iter;
+
+		watches++;
+		NIH_LIST_FOREACH(&kw->subs, siter)
+			subs++;
+	}
+	add_stat(parent, output, len, "key_watches", watches);
+	add_stat(parent, output, len, "key_watch_subscriptions", subs);
+	add_stat(parent, output, len, "key_watch_events", key_watch_events);
+	add_stat(parent, output, len, "key_watch_signals", key_watch_signals);
+	add_stat(parent, output, len, "pressure_coalesced", pressure_coalesced);
+	add_stat(parent, output, len, "key_watch_refused", key_watch_refused);
+}
+
+int do_remove_on_empty_main(const struct resolved_cgroup *rcg,
+		const char *cgroup, struct ucred p, struct ucred r)
+{
+	const char *controller = rcg->controller;
+	char *rcgpath = rcg->path;
 	size_t cgroup_len;
 	nih_local char *working = NULL, *wcgroup = NULL;
 
@@ -1391,8 +3409,8 @@ int do_remove_on_empty_main(const char *controller, const char *cgroup,
 		return -2;
 	}
 
-	// Get r's current cgroup in rcgpath
-	if (!compute_pid_cgroup(r.pid, controller, "", rcgpath, NULL)) {
+	// r's current cgroup, found by resolve_pid_cgroups()
+	if (!rcgpath) {
 		nih_error("%s: Could not determine the requestor's cgroup for %s",
                 __func__, controller);
 		return -1;
@@ -1439,93 +3457,73 @@ int do_remove_on_empty_main(const char *controller, const char *cgroup,
 int remove_on_empty_main(const char *controller, const char *cgroup,
 		struct ucred p, struct ucred r)
 {
-	nih_local char *c = NULL;
-	char *tok;
-	int ret;
+	nih_local struct resolved_cgroup *rcgs = NULL;
+	int i, n, ret;
 
 	if (!sane_cgroup(cgroup)) {
 		nih_error("%s: unsafe cgroup", __func__);
 		return -1;
 	}
 
-	if (strcmp(controller, "all") != 0 && !strchr(controller, ','))
-		return do_remove_on_empty_main(controller, cgroup, p, r);
-
-	if (strcmp(controller, "all") == 0) {
-		if (!all_controllers)
-			return 0;
-		c = NIH_MUST( nih_strdup(NULL, all_controllers) );
-	} else {
-		c = NIH_MUST( nih_strdup(NULL, controller) );
-		do_prune_comounts(c);
+	n = resolve_pid_cgroups(NULL, r.pid, controller, false, &rcgs);
+	if (n <= 0) {
+		nih_error("%s: no controllers in '%s'", __func__, controller);
+		return -1;
 	}
-	tok = strtok(c, ",");
-	while (tok) {
-		ret = do_remove_on_empty_main(tok, cgroup, p, r);
+	if (single_controller(controller))
+		return do_remove_on_empty_main(&rcgs[0], cgroup, p, r);
+
+	for (i = 0; i < n; i++) {
+		ret = do_remove_on_empty_main(&rcgs[i], cgroup, p, r);
 		if (ret == -2)  // autoremove not supported, ignore
-			goto next;
+			continue;
 		if (ret != 0)
 			return -1;
-next:
-		tok = strtok(NULL, ",");
 	}
 
 	return 0;
 }
 
-void do_recursive_prune(char *path, bool autoremove)
+static int prune_walk_pre(void *data, const char *path, int parentfd,
+		const char *name, int depth)
 {
-	nih_local char *releasefile = NULL;
-	struct dirent dirent, *direntp;
-	DIR *dir;
+	char releasefile[MAXPATHLEN];
 
-	if (!autoremove)
-		goto remove;
-
-	releasefile = NIH_MUST( nih_strdup(NULL, path) );
-	NIH_MUST( nih_strcat(&releasefile, NULL, "/notify_on_release") );
-
-	if (!set_value_trusted(releasefile, "1\n"))
+	if (strncmp(name, POOL_PREFIX, strlen(POOL_PREFIX)) == 0)
+		return CGFS_WALK_SKIP;  // leave the warm pool's spares be
+	if (!*(bool *)data)
+		return 0;
+	if (snprintf(releasefile, MAXPATHLEN, "%s/notify_on_release",
+			path) >= MAXPATHLEN ||
+			!set_value_trusted(releasefile, "1\n"))
 		nih_info("Failed to set remove-on-empty for %s\n", path);
+	return 0;
+}
 
-remove:
-	dir = opendir(path);
-	if (!dir) {
-		nih_warn("%s: Failed to open dir %s for recursive deletion", __func__, path);
-		return;
-	}
-
-	while (!readdir_r(dir, &dirent, &direntp)) {
-		struct stat mystat;
-		int rc;
-		nih_local char *pathname = NULL;
-
-		if (!direntp)
-			break;
-		if (!strcmp(direntp->d_name, ".") ||
-		    !strcmp(direntp->d_name, ".."))
-			continue;
-		pathname = NIH_MUST( nih_sprintf(NULL, "%s/%s", path, direntp->d_name) );
-		rc = lstat(pathname, &mystat);
-		if (rc)
-			continue;
-		if (S_ISDIR(mystat.st_mode))
-			do_recursive_prune(pathname, autoremove);
-	}
+static int prune_walk_post(void *data, const char *path, int parentfd,
+		const char *name, int depth)
+{
+	cgfs_rmdir(path);
+	return 0;
+}
 
-	closedir(dir);
-	rmdir(path);
+void do_recursive_prune(char *path, bool autoremove)
+{
+	if (subtree_walk(path, false, prune_walk_pre, prune_walk_post,
+			&autoremove) < 0)
+		nih_warn("%s: Failed to open dir %s for recursive deletion", __func__, path);
 }
 
-int do_prune_main(const char *controller, const char *cgroup,
+int do_prune_main(const struct resolved_cgroup *rcg, const char *cgroup,
 		struct ucred p, struct ucred r)
 {
-	char rcgpath[MAXPATHLEN];
+	const char *controller = rcg->controller;
+	char *rcgpath = rcg->path;
 	size_t cgroup_len;
 	nih_local char *working = NULL, *wcgroup = NULL;
 
-	// Get r's current cgroup in rcgpath
-	if (!compute_pid_cgroup(r.pid, controller, "", rcgpath, NULL)) {
+	// r's current cgroup, found by resolve_pid_cgroups()
+	if (!rcgpath) {
 		nih_error("%s: Could not determine the requestor's cgroup for %s",
                 __func__, controller);
 		return -1;
@@ -1566,37 +3564,42 @@ int do_prune_main(const char *controller, const char *cgroup,
 int prune_main(const char *controller, const char *cgroup,
 		struct ucred p, struct ucred r)
 {
-	nih_local char *c = NULL;
-	char *tok;
-	int ret;
+	nih_local struct resolved_cgroup *rcgs = NULL;
+	int i, n, ret;
 
 	if (!sane_cgroup(cgroup)) {
 		nih_error("%s: unsafe cgroup", __func__);
 		return -1;
 	}
 
-	if (strcmp(controller, "all") != 0 && !strchr(controller, ','))
-		return do_prune_main(controller, cgroup, p, r);
-
-	if (strcmp(controller, "all") == 0) {
-		if (!all_controllers)
-			return 0;
-		c = NIH_MUST( nih_strdup(NULL, all_controllers) );
-	} else {
-		c = NIH_MUST( nih_strdup(NULL, controller) );
-		do_prune_comounts(c);
+	n = resolve_pid_cgroups(NULL, r.pid, controller, false, &rcgs);
+	if (n <= 0) {
+		nih_error("%s: no controllers in '%s'", __func__, controller);
+		return -1;
 	}
-	tok = strtok(c, ",");
-	while (tok) {
-		ret = do_prune_main(tok, cgroup, p, r);
+	if (single_controller(controller))
+		return do_prune_main(&rcgs[0], cgroup, p, r);
+
+	for (i = 0; i < n; i++) {
+		ret = do_prune_main(&rcgs[i], cgroup, p, r);
 		if (ret != 0)
-			nih_warn("do_prune_main for %s: %s failed", tok, cgroup);
-		tok = strtok(NULL, ",");
+			nih_warn("do_prune_main for %s: %s failed",
+				 rcgs[i].controller, cgroup);
 	}
 
 	return 0;
 }
 
+/*
+ * Batch: cgmanager simply runs each operation in turn.  (cgproxy
+ * instead forwards the whole batch.)
+ */
+int batch_main(struct batch_op **ops, int32_t nops, struct ucred p,
+		struct ucred r, int32_t *results)
+{
+	return batch_run(ops, nops, p, r, results);
+}
+
 int list_controllers_main(void *parent, char ***output)
 {
 	*output = NULL;
@@ -1606,6 +3609,24 @@ int list_controllers_main(void *parent, char ***output)
 	return 0;
 }
 
+int get_stats_main(void *parent, char ***output)
+{
+	size_t len = 0;
+
+	*output = NIH_MUST( nih_str_array_new(parent) );
+
+	pid_cgroup_cache_get_stats(parent, output, &len);
+	fd_caches_get_stats(parent, output, &len);
+	idmap_cache_get_stats(parent, output, &len);
+	workqueue_get_stats(parent, output, &len);
+	autoremove_get_stats(parent, output, &len);
+	deferred_remove_get_stats(parent, output, &len);
+	pool_get_stats(parent, output, &len);
+	mirror_get_stats(parent, output, &len);
+
+	return 0;
+}
+
 int list_keys_main(void *parent, char *controller, const char *cgroup,
 			struct ucred p, struct ucred r,
 			struct keys_return_type ***output)
@@ -1667,6 +3688,14 @@ extra_mounts_set (NihOption *option, const char *arg)
 	return 0;
 }
 
+static int
+pool_parent_set (NihOption *option, const char *arg)
+{
+	pool_parent = NIH_MUST( strdup(arg) );
+
+	return 0;
+}
+
 static int
 allow_autoremove_premounted_set (NihOption *option, const char *arg)
 {
@@ -1694,6 +3723,28 @@ static NihOption options[] = {
 	{ 0, "autoremove-premounted-set-release-agent",
 	  N_("Set our release agent for premounted v1 controllers with autoremove enabled that do not have an agent already set"),
 	  NULL, NULL, &autoremove_premounted_set_release_agent, NULL },
+	{ 0, "threads", N_("Number of worker threads for cgroup operations (default 0: run them in the main loop)"),
+		NULL, "N", &nr_threads, nih_option_int },
+	{ 0, "pressure-holdoff", N_("Minimum milliseconds between PressureChanged signals for one trigger (default 100)"),
+		NULL, "MS", &pressure_holdoff, nih_option_int },
+	{ 0, "max-watches", N_("Maximum number of Watch and WatchPressure subscriptions one client connection may hold (default 64)"),
+		NULL, "N", &max_watches, nih_option_int },
+	{ 0, "remove-retries", N_("Attempts a RemoveDeferred makes to remove a busy cgroup before giving up (default 10)"),
+		NULL, "N", &remove_retries, nih_option_int },
+	{ 0, "remove-backoff", N_("Milliseconds before a RemoveDeferred first retries, doubling after each attempt (default 50)"),
+		NULL, "MS", &remove_backoff, nih_option_int },
+	{ 0, "pool", N_("Number of spare cgroups to keep ready in the pool parent of each v1 hierarchy for Claim (default 0)"),
+		NULL, "N", &pool_size, nih_option_int },
+	{ 0, "pool-parent", N_("Cgroup, relative to each hierarchy's root, under which Claim takes cgroups from the pool (default the root)"),
+		NULL, "CGROUP", NULL, pool_parent_set },
+	{ 0, "pool-uid", N_("Owner of the spare cgroups in the pool (default 0)"),
+		NULL, "UID", &pool_uid, nih_option_int },
+	{ 0, "pool-gid", N_("Group of the spare cgroups in the pool (default 0)"),
+		NULL, "GID", &pool_gid, nih_option_int },
+	{ 0, "walk-fanout", N_("Number of levels of a subtree being removed, pruned or listed whose sibling cgroups are walked in parallel by worker threads (default 2, 0 to disable)"),
+		NULL, "DEPTH", &walk_fanout, nih_option_int },
+	{ 0, "mirror", N_("Keep an in-memory index of the cgroup hierarchies to answer ListChildren, ListKeys and access checks from"),
+		NULL, NULL, &use_mirror, NULL },
 	{ 0, "daemon", N_("Detach and run in the background"),
 		NULL, NULL, &daemonise, NULL },
 	{ 0, "sigstop", N_("Raise SIGSTOP when ready"),
@@ -1787,7 +3838,16 @@ main (int argc, char *argv[])
 	struct stat sb;
 	struct rlimit newrlimit;
 
-	nih_list_init(&autoremove_entries);
+	autoremove_entries = NIH_MUST( nih_hash_new(NULL, 0,
+				autoremove_entry_key,
+				(NihHashFunction)nih_hash_string_hash,
+				(NihCmpFunction)nih_hash_string_cmp) );
+	autoremove_watches = NIH_MUST( nih_hash_new(NULL, 0,
+				autoremove_watch_key,
+				(NihHashFunction)autoremove_wd_hash,
+				(NihCmpFunction)autoremove_wd_cmp) );
+	key_watches = NIH_MUST( nih_hash_string_new(NULL, 0) );
+	deferred_removes = NIH_MUST( nih_hash_string_new(NULL, 0) );
 
 	nih_main_init (argv[0]);
 
@@ -1836,6 +3896,11 @@ main (int argc, char *argv[])
 		exit(1);
 	}
 
+	setup_pid_cgroup_cache();
+
+	if (use_mirror && !setup_mirror())
+		nih_warn("Failed to set up the hierarchy mirror, continuing without");
+
 	if (stat("/proc/self/ns/pid", &sb) == 0) {
 		mypidns = read_pid_ns_link(getpid());
 		setns_pid_supported = true;
@@ -1866,13 +3931,22 @@ main (int argc, char *argv[])
 		}
 	}
 
+	/* after daemonising, as threads do not survive fork() */
+	if (nr_threads > 0 && !workqueue_init(nr_threads)) {
+		nih_fatal("Failed to start worker threads");
+		exit(1);
+	}
+
+	if (!setup_pool())
+		nih_warn("Failed to set up the cgroup pool, continuing without");
+
 	if (sigstop)
 		raise(SIGSTOP);
 
 	ret = nih_main_loop ();
 
-	while (!NIH_LIST_EMPTY(&autoremove_entries))
-		nih_free(autoremove_entries.next);
+	NIH_HASH_FOREACH_SAFE(autoremove_entries, iter)
+		nih_free(iter);
 
 	return ret;
 }
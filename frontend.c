@@ -36,6 +36,8 @@ bool sane_cgroup(const char *cgroup)
 		return false;
 	if (strstr(cgroup, ".."))
 		return false;
+	if (pool_reserved(cgroup))
+		return false;
 	return true;
 }
 
@@ -80,7 +82,7 @@ static struct scm_sock_data *alloc_scm_sock_data(NihDBusMessage *message,
  * the requestor's.  Some require a second SCM cred to identify
  * a pid or uid/gid:
  */
-static bool need_two_creds(enum req_type t)
+bool need_two_creds(enum req_type t)
 {
 	switch (t) {
 	case REQ_TYPE_GET_PID:
@@ -88,6 +90,7 @@ static bool need_two_creds(enum req_type t)
 	case REQ_TYPE_MOVE_PID:
 	case REQ_TYPE_MOVE_PID_ABS:
 	case REQ_TYPE_CHOWN:
+	case REQ_TYPE_BATCH:
 		return true;
 	default:
 		return false;
@@ -131,6 +134,94 @@ static bool kick_fd_client(int fd)
 	return true;
 }
 
+/*
+ * Send one reply datagram to the client.  Replies on a proxy channel
+ * are prefixed with the request id.  The socket is non-blocking, so if
+ * the client's queue is full wait up to @timeout ms for it to drain.
+ *
+ * Returns the number of bytes of @buf sent, -2 if the queue stayed
+ * full, or -1 on any other error.
+ */
+ssize_t scm_send(struct scm_sock_data *data, const void *buf, size_t len,
+		int timeout)
+{
+	struct msghdr msg = { 0 };
+	struct iovec iov[2];
+	ssize_t ret;
+	int n = 0;
+
+	if (data->on_chan) {
+		iov[n].iov_base = &data->chan_id;
+		iov[n++].iov_len = sizeof(data->chan_id);
+	}
+	iov[n].iov_base = (void *)buf;
+	iov[n++].iov_len = len;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+
+	for (;;) {
+		struct pollfd pfd = { .fd = data->fd, .events = POLLOUT };
+
+		ret = sendmsg(data->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret >= 0)
+			return data->on_chan ? ret - (ssize_t)sizeof(data->chan_id) : ret;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN)
+			return -1;
+		if (timeout == 0)
+			return -2;
+		if (poll(&pfd, 1, timeout) == 0) {
+			nih_error("%s: timed out waiting for client", __func__);
+			return -2;
+		}
+	}
+}
+
+/* scm_send(), waiting up to a second for the client */
+ssize_t scm_write(struct scm_sock_data *data, const void *buf, size_t len)
+{
+	ssize_t ret = scm_send(data, buf, len, 1000);
+
+	return ret < 0 ? -1 : ret;
+}
+
+/*
+ * Finish a request once all of its credentials have arrived.  Returns
+ * false if @data->type is not a valid request type.
+ */
+static bool scm_complete(struct scm_sock_data *data)
+{
+	switch (data->type) {
+	case REQ_TYPE_GET_PID: get_pid_scm_complete(data); break;
+	case REQ_TYPE_GET_PID_ABS: get_pid_abs_scm_complete(data); break;
+	case REQ_TYPE_MOVE_PID: move_pid_scm_complete(data); break;
+	case REQ_TYPE_MOVE_PID_ABS: move_pid_abs_scm_complete(data); break;
+	case REQ_TYPE_CREATE: create_scm_complete(data); break;
+	case REQ_TYPE_CHOWN: chown_scm_complete(data); break;
+	case REQ_TYPE_CHMOD: chmod_scm_complete(data); break;
+	case REQ_TYPE_GET_VALUE: get_value_complete(data); break;
+	case REQ_TYPE_SET_VALUE: set_value_complete(data); break;
+	case REQ_TYPE_REMOVE: remove_scm_complete(data); break;
+	case REQ_TYPE_GET_TASKS: get_tasks_scm_complete(data); break;
+	case REQ_TYPE_LIST_CHILDREN: list_children_scm_complete(data); break;
+	case REQ_TYPE_REMOVE_ON_EMPTY: remove_on_empty_scm_complete(data); break;
+	case REQ_TYPE_PRUNE: prune_scm_complete(data); break;
+	case REQ_TYPE_GET_TASKS_RECURSIVE: get_tasks_recursive_scm_complete(data); break;
+	case REQ_TYPE_LISTKEYS: list_keys_scm_complete(data); break;
+	case REQ_TYPE_BATCH: batch_scm_complete(data); break;
+	case REQ_TYPE_GET_VALUES: get_values_scm_complete(data); break;
+	case REQ_TYPE_SET_VALUES: set_values_scm_complete(data); break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+#ifdef CGMANAGER
+static void submit_request(struct scm_sock_data *d);
+#endif
+
 /*
  * Called when an scm credential has been received.  If this was
  * the first of two expected creds, then kick the client again
@@ -158,28 +249,579 @@ static void sock_scm_reader(struct scm_sock_data *data,
 	} else
 		memcpy(&data->vcred, &ucred, sizeof(struct ucred));
 
-	switch (data->type) {
-	case REQ_TYPE_GET_PID: get_pid_scm_complete(data); break;
-	case REQ_TYPE_GET_PID_ABS: get_pid_abs_scm_complete(data); break;
-	case REQ_TYPE_MOVE_PID: move_pid_scm_complete(data); break;
-	case REQ_TYPE_MOVE_PID_ABS: move_pid_abs_scm_complete(data); break;
-	case REQ_TYPE_CREATE: create_scm_complete(data); break;
-	case REQ_TYPE_CHOWN: chown_scm_complete(data); break;
-	case REQ_TYPE_CHMOD: chmod_scm_complete(data); break;
-	case REQ_TYPE_GET_VALUE: get_value_complete(data); break;
-	case REQ_TYPE_SET_VALUE: set_value_complete(data); break;
-	case REQ_TYPE_REMOVE: remove_scm_complete(data); break;
-	case REQ_TYPE_GET_TASKS: get_tasks_scm_complete(data); break;
-	case REQ_TYPE_LIST_CHILDREN: list_children_scm_complete(data); break;
-	case REQ_TYPE_REMOVE_ON_EMPTY: remove_on_empty_scm_complete(data); break;
-	case REQ_TYPE_PRUNE: prune_scm_complete(data); break;
-	case REQ_TYPE_GET_TASKS_RECURSIVE: get_tasks_recursive_scm_complete(data); break;
-	case REQ_TYPE_LISTKEYS: list_keys_scm_complete(data); break;
-	default:
+	data->io = io;
+#ifdef CGMANAGER
+	/* @io is shut down once the request has run */
+	submit_request(data);
+#else
+	/* proxy_forward() shuts down @io once the reply has been relayed */
+	if (proxy_forward(data))
+		return;
+	if (!scm_complete(data)) {
 		nih_fatal("%s: bad req_type %d", __func__, data->type);
 		exit(1);
 	}
 	nih_io_shutdown(io);
+#endif
+}
+
+/*
+ * A proxy channel, registered by cgproxy with RegisterProxyChannel.
+ * The proxy credential is taken once, from the dbus connection which
+ * registered the channel; requestor and victim credentials come with
+ * each request as SCM credentials, exactly as for the *Scm methods.
+ */
+struct proxy_chan {
+	int fd;
+	struct ucred pcred;
+	struct scm_sock_data *pending; // request waiting for its victim cred
+};
+
+static void chan_complete(struct scm_sock_data *d)
+{
+#ifdef CGMANAGER
+	submit_request(d);
+#else
+	/* proxy_forward() frees @d once the reply has been relayed */
+	if (proxy_forward(d))
+		return;
+	if (!scm_complete(d)) {
+		nih_error("%s: bad req_type %d", __func__, d->type);
+		scm_write(d, NULL, 0);
+	}
+	nih_free(d);
+#endif
+}
+
+/*
+ * Copy the next NUL-terminated string out of a request, advancing *p.
+ * Returns NULL if the request is truncated.
+ */
+static char *chan_req_string(void *parent, const char **p, const char *end)
+{
+	const char *q = memchr(*p, '\0', end - *p);
+	char *ret;
+
+	if (!q)
+		return NULL;
+	ret = NIH_MUST( nih_strdup(parent, *p) );
+	*p = q + 1;
+	return ret;
+}
+
+static void chan_handle_msg(struct proxy_chan *chan, NihIoMessage *msg)
+{
+	struct scm_sock_data *d;
+	struct chan_req_hdr hdr;
+	struct ucred ucred;
+	const char *p, *end;
+
+	if (!get_nih_io_msg_creds(msg, &ucred)) {
+		nih_error("%s: request without credentials", __func__);
+		return;
+	}
+	if (msg->data->len < sizeof(uint32_t)) {
+		nih_error("%s: short request", __func__);
+		return;
+	}
+
+	if (chan->pending) {
+		uint32_t id;
+
+		d = chan->pending;
+		chan->pending = NULL;
+		memcpy(&id, msg->data->buf, sizeof(id));
+		if (msg->data->len == sizeof(id) && id == d->chan_id) {
+			memcpy(&d->vcred, &ucred, sizeof(struct ucred));
+			chan_complete(d);
+			return;
+		}
+		nih_error("%s: expected victim credential for request %u",
+			__func__, d->chan_id);
+		scm_write(d, NULL, 0);
+		nih_free(d);
+	}
+
+	if (msg->data->len < sizeof(hdr)) {
+		nih_error("%s: short request", __func__);
+		return;
+	}
+	memcpy(&hdr, msg->data->buf, sizeof(hdr));
+
+	/* not a child of @chan: it may still be running when @chan closes */
+	d = NIH_MUST( nih_alloc(NULL, sizeof(*d)) );
+	memset(d, 0, sizeof(*d));
+	d->fd = chan->fd;
+	d->on_chan = true;
+	d->chan_id = hdr.id;
+	d->type = hdr.type;
+	d->recursive = hdr.recursive;
+	d->mode = hdr.mode;
+	memcpy(&d->pcred, &chan->pcred, sizeof(struct ucred));
+	memcpy(&d->rcred, &ucred, sizeof(struct ucred));
+
+	p = msg->data->buf + sizeof(hdr);
+	end = msg->data->buf + msg->data->len;
+	if (!(d->controller = chan_req_string(d, &p, end)) ||
+			!(d->cgroup = chan_req_string(d, &p, end)) ||
+			!(d->key = chan_req_string(d, &p, end)) ||
+			!(d->value = chan_req_string(d, &p, end)) ||
+			!(d->file = chan_req_string(d, &p, end))) {
+		nih_error("%s: malformed request %u", __func__, hdr.id);
+		scm_write(d, NULL, 0);
+		nih_free(d);
+		return;
+	}
+
+	if (d->type < 0 || d->type >= REQ_TYPE_MAX) {
+		chan_complete(d);  // reports the bad type
+		return;
+	}
+	if (need_two_creds(d->type)) {
+		chan->pending = d;
+		return;
+	}
+	chan_complete(d);
+}
+
+static void chan_reader(struct proxy_chan *chan, NihIo *io,
+			const char *buf, size_t len)
+{
+	NihIoMessage *msg;
+
+	while ((msg = nih_io_read_message(NULL, io)) != NULL) {
+		chan_handle_msg(chan, msg);
+		nih_free(msg);
+	}
+}
+
+static void chan_error_handler (struct proxy_chan *chan, NihIo *io)
+{
+	NihError *error = nih_error_get ();
+	nih_error("proxy channel error: %s", error->message);
+	nih_free(error);
+	nih_io_shutdown(io);
+}
+
+static void chan_close (struct proxy_chan *chan, NihIo *io)
+{
+	nih_info("proxy channel closed");
+	if (chan->pending)
+		nih_free (chan->pending);
+	nih_free (io);
+	nih_free (chan);
+}
+
+/*
+ * This is one of the dbus callbacks.
+ * cgproxy registers @sockfd, one end of a SOCK_DGRAM socketpair, as
+ * a channel for all its subsequent requests.
+ */
+int cgmanager_register_proxy_channel (void *data, NihDBusMessage *message,
+				int sockfd)
+{
+	struct proxy_chan *chan;
+	int optval = 1, dbusfd;
+	socklen_t len;
+
+	if (message == NULL) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"message was null");
+		return -1;
+	}
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_PASSCRED, &optval, sizeof(optval)) == -1) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+				"Failed to set passcred: %s", strerror(errno));
+		return -1;
+	}
+
+	chan = NIH_MUST( nih_alloc(NULL, sizeof(*chan)) );
+	memset(chan, 0, sizeof(*chan));
+	chan->fd = sockfd;
+
+	if (!dbus_connection_get_socket(message->connection, &dbusfd)) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get client socket.");
+		nih_free(chan);
+		return -1;
+	}
+	len = sizeof(struct ucred);
+	if (getsockopt(dbusfd, SOL_SOCKET, SO_PEERCRED, &chan->pcred, &len) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get peer cred: %s",
+					     strerror(errno));
+		nih_free(chan);
+		return -1;
+	}
+
+	if (!nih_io_reopen(NULL, sockfd, NIH_IO_MESSAGE,
+				(NihIoReader) chan_reader,
+				(NihIoCloseHandler) chan_close,
+				(NihIoErrorHandler) chan_error_handler, chan)) {
+		NihError *error = nih_error_steal ();
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"Failed queue scm message: %s", error->message);
+		nih_free(error);
+		nih_free(chan);
+		return -1;
+	}
+	nih_info(_("Registered proxy channel for pid %d"), chan->pcred.pid);
+	return 0;
+}
+
+/*
+ * Plain dbus requests.  Each method handler builds a request from its
+ * arguments with new_dbus_request(), on behalf of requestor @r, and
+ * hands it to dbus_request_submit().  The caller is answered once the
+ * request has run: in cgmanager possibly on a worker thread (see
+ * workqueue.c), and in cgproxy once cgmanager has replied.
+ */
+static struct scm_sock_data *new_dbus_request(enum req_type t,
+		const char *controller, const char *cgroup, struct ucred r)
+{
+	struct scm_sock_data *d;
+
+	d = NIH_MUST( nih_alloc(NULL, sizeof(*d)) );
+	memset(d, 0, sizeof(*d));
+	d->fd = -1;
+	d->type = t;
+	d->controller = NIH_MUST( nih_strdup(d, controller) );
+	if (cgroup)
+		d->cgroup = NIH_MUST( nih_strdup(d, cgroup) );
+	memcpy(&d->pcred, &r, sizeof(struct ucred));
+	memcpy(&d->rcred, &r, sizeof(struct ucred));
+	return d;
+}
+
+/* Run dbus request @d, keeping the results in @d */
+static void dbus_request_run(struct scm_sock_data *d)
+{
+	struct ucred p = d->pcred, r = d->rcred, v = d->vcred;
+
+	switch (d->type) {
+	case REQ_TYPE_GET_PID:
+		d->ret = get_pid_cgroup_main(d, d->controller, p, r, v, &d->output);
+		break;
+	case REQ_TYPE_GET_PID_ABS:
+		d->ret = get_pid_cgroup_abs_main(d, d->controller, p, r, v,
+				&d->output);
+		break;
+	case REQ_TYPE_MOVE_PID:
+		d->ret = move_pid_main(d->controller, d->cgroup, p, r, v);
+		break;
+	case REQ_TYPE_MOVE_PID_ABS:
+		d->ret = move_pid_abs_main(d->controller, d->cgroup, p, r, v);
+		break;
+	case REQ_TYPE_CREATE:
+		d->ret = create_main(d->controller, d->cgroup, p, r, &d->existed);
+		break;
+	case REQ_TYPE_CLAIM:
+		d->ret = claim_main(d->controller, d->cgroup, p, r, &d->existed);
+		break;
+	case REQ_TYPE_CHOWN:
+		d->ret = chown_main(d->controller, d->cgroup, p, r, v);
+		break;
+	case REQ_TYPE_CHMOD:
+		d->ret = chmod_main(d->controller, d->cgroup, d->file, p, r,
+				d->mode);
+		break;
+	case REQ_TYPE_GET_VALUE:
+		d->ret = get_value_main(d, d->controller, d->cgroup, d->key, p, r,
+				&d->output);
+		break;
+	case REQ_TYPE_SET_VALUE:
+		d->ret = set_value_main(d->controller, d->cgroup, d->key,
+				d->value, p, r);
+		break;
+	case REQ_TYPE_REMOVE:
+		d->ret = remove_main(d->controller, d->cgroup, p, r,
+				d->recursive, &d->existed);
+		break;
+	case REQ_TYPE_GET_TASKS:
+		d->ret = get_tasks_main(d, d->controller, d->cgroup, p, r,
+				&d->pids);
+		break;
+	case REQ_TYPE_GET_TASKS_RECURSIVE:
+		d->ret = get_tasks_recursive_main(d, d->controller, d->cgroup,
+				p, r, &d->pids);
+		break;
+	case REQ_TYPE_LIST_CHILDREN:
+		d->ret = list_children_main(d, d->controller, d->cgroup, p, r,
+				&d->outputs);
+		break;
+	case REQ_TYPE_REMOVE_ON_EMPTY:
+		d->ret = remove_on_empty_main(d->controller, d->cgroup, p, r);
+		break;
+	case REQ_TYPE_PRUNE:
+		d->ret = prune_main(d->controller, d->cgroup, p, r);
+		break;
+	case REQ_TYPE_LISTKEYS:
+		d->ret = list_keys_main(d, d->controller, d->cgroup, p, r,
+				&d->keys);
+		break;
+	case REQ_TYPE_BATCH:
+		d->ret = batch_main(d->ops, d->nops, p, r, d->results);
+		break;
+	case REQ_TYPE_GET_VALUES:
+		d->ret = get_values_main(d->ops, d->nops, p, r, d->results);
+		break;
+	case REQ_TYPE_SET_VALUES:
+		d->ret = set_values_main(d->ops, d->nops, p, r, d->results);
+		break;
+	default:
+		d->ret = -1;
+	}
+}
+
+/* Answer the caller of dbus request @d from its results */
+void dbus_request_reply(struct scm_sock_data *d)
+{
+	NihDBusMessage *message = d->message;
+	nih_local char **values = NULL;
+	int32_t i;
+	int ret = -1, fd;
+
+	switch (d->type) {
+	case REQ_TYPE_GET_TASKS:
+	case REQ_TYPE_GET_TASKS_RECURSIVE:
+	case REQ_TYPE_LIST_CHILDREN:
+	case REQ_TYPE_REMOVE_ON_EMPTY:
+	case REQ_TYPE_PRUNE:
+	case REQ_TYPE_LISTKEYS:
+		if (d->ret < 0)
+			goto err;
+		break;
+	default:
+		if (d->ret != 0)
+			goto err;
+	}
+
+	switch (d->type) {
+	case REQ_TYPE_GET_PID:
+		ret = cgmanager_get_pid_cgroup_reply(message, d->output);
+		break;
+	case REQ_TYPE_GET_PID_ABS:
+		ret = cgmanager_get_pid_cgroup_abs_reply(message, d->output);
+		break;
+	case REQ_TYPE_MOVE_PID:
+		ret = cgmanager_move_pid_reply(message);
+		break;
+	case REQ_TYPE_MOVE_PID_ABS:
+		ret = cgmanager_move_pid_abs_reply(message);
+		break;
+	case REQ_TYPE_CREATE:
+		nih_info(_("%s: returning %d; existed is %d"), __func__, d->ret,
+			d->existed);
+		ret = cgmanager_create_reply(message, d->existed);
+		break;
+	case REQ_TYPE_CLAIM:
+		ret = cgmanager_claim_reply(message, d->existed);
+		break;
+	case REQ_TYPE_CHOWN:
+		ret = cgmanager_chown_reply(message);
+		break;
+	case REQ_TYPE_CHMOD:
+		ret = cgmanager_chmod_reply(message);
+		break;
+	case REQ_TYPE_GET_VALUE:
+		ret = cgmanager_get_value_reply(message, d->output);
+		break;
+	case REQ_TYPE_SET_VALUE:
+		ret = cgmanager_set_value_reply(message);
+		break;
+	case REQ_TYPE_REMOVE:
+		ret = cgmanager_remove_reply(message, d->existed);
+		break;
+	case REQ_TYPE_GET_TASKS:
+		if (!d->pids_fd) {
+			ret = cgmanager_get_tasks_reply(message, d->pids, d->ret);
+			break;
+		}
+		fd = sealed_memfd("cgmanager-tasks", d->pids,
+				d->ret * sizeof(int32_t));
+		if (fd < 0)
+			goto err;
+		ret = cgmanager_get_tasks_fd_reply(message, fd);
+		close(fd);  // dbus has its own copy
+		break;
+	case REQ_TYPE_GET_TASKS_RECURSIVE:
+		ret = cgmanager_get_tasks_recursive_reply(message, d->pids,
+				d->ret);
+		break;
+	case REQ_TYPE_LIST_CHILDREN:
+		ret = cgmanager_list_children_reply(message, d->outputs);
+		break;
+	case REQ_TYPE_REMOVE_ON_EMPTY:
+		ret = cgmanager_remove_on_empty_reply(message);
+		break;
+	case REQ_TYPE_PRUNE:
+		ret = cgmanager_prune_reply(message);
+		break;
+	case REQ_TYPE_LISTKEYS:
+		ret = cgmanager_list_keys_reply(message,
+				(CgmanagerListKeysOutputElement **)d->keys);
+		break;
+	case REQ_TYPE_BATCH:
+		ret = cgmanager_batch_reply(message, d->results, d->nops);
+		break;
+	case REQ_TYPE_GET_VALUES:
+		values = NIH_MUST( nih_alloc(NULL, (d->nops + 1) * sizeof(char *)) );
+		for (i = 0; i < d->nops; i++)
+			values[i] = d->ops[i]->value ? d->ops[i]->value : "";
+		values[d->nops] = NULL;
+		ret = cgmanager_get_values_reply(message, d->results, d->nops,
+				values);
+		break;
+	case REQ_TYPE_SET_VALUES:
+		ret = cgmanager_set_values_reply(message, d->results, d->nops);
+		break;
+	}
+	if (ret == 0)
+		return;
+	if (ret < 0) {
+		NihError *error = nih_error_get();
+		nih_error("%s: error sending reply: %s", __func__,
+			error->message);
+		nih_free(error);
+	}
+
+err:
+	if (nih_dbus_message_error(message, DBUS_ERROR_INVALID_ARGS,
+				"invalid request") < 0) {
+		NihError *error = nih_error_get();
+		nih_free(error);
+	}
+}
+
+#ifdef CGMANAGER
+/*
+ * Requests are run by work_submit(), on a worker thread if there are
+ * any.  The worker does the filesystem work and, for Scm requests,
+ * writes the reply to the client's socket; dbus replies are sent, and
+ * the request freed, from the main loop.
+ */
+static void request_run(struct scm_sock_data *d)
+{
+	if (d->message)
+		dbus_request_run(d);
+	else if (!scm_complete(d)) {
+		nih_error("%s: bad req_type %d", __func__, d->type);
+		scm_write(d, NULL, 0);
+	}
+}
+
+static void request_done(struct scm_sock_data *d)
+{
+	if (d->message)
+		dbus_request_reply(d);
+	if (d->io) {
+		nih_io_shutdown(d->io);  // frees @d
+		return;
+	}
+	if (d->close_fd)
+		close(d->fd);
+	nih_free(d);
+}
+
+/*
+ * A batch, GetValues or SetValues may act on several cgroups.  Key it
+ * on the cgroups of all of its operations.
+ */
+static char **batch_keys(struct scm_sock_data *d)
+{
+	char **keys = NULL, **k, **kp;
+	size_t n = 0;
+	int32_t i;
+
+	for (i = 0; i < d->nops; i++) {
+		k = pid_cgroup_keys(NULL, d->rcred.pid, d->ops[i]->controller,
+				d->ops[i]->cgroup, false);
+		if (!k)
+			continue;
+		if (!keys)
+			keys = NIH_MUST( nih_str_array_new(NULL) );
+		for (kp = k; *kp; kp++)
+			NIH_MUST( nih_str_array_add(&keys, NULL, &n, *kp) );
+		nih_free(k);
+	}
+	return keys;
+}
+
+/* RemoveOnEmpty adds inotify watches, so runs on the main thread */
+static bool batch_main_only(struct scm_sock_data *d)
+{
+	int32_t i;
+
+	for (i = 0; i < d->nops; i++) {
+		if (d->ops[i]->type == REQ_TYPE_REMOVE_ON_EMPTY)
+			return true;
+	}
+	return false;
+}
+
+static void submit_request(struct scm_sock_data *d)
+{
+	nih_local char **keys = NULL;
+	bool abs;
+
+	if (workqueue_enabled()) {
+		/*
+		 * Order requests by the cgroups they act on.  MovePidAbs
+		 * names its cgroup relative to the proxy's.
+		 */
+		abs = d->type == REQ_TYPE_MOVE_PID_ABS;
+		if (d->type == REQ_TYPE_BATCH || d->type == REQ_TYPE_GET_VALUES ||
+				d->type == REQ_TYPE_SET_VALUES)
+			keys = batch_keys(d);
+		else if (d->type != REQ_TYPE_GET_PID && d->type != REQ_TYPE_GET_PID_ABS)
+			keys = pid_cgroup_keys(NULL, abs ? d->pcred.pid : d->rcred.pid,
+					d->controller, d->cgroup ? d->cgroup : "",
+					abs);
+
+		/*
+		 * The client's socket must outlive the request: stop
+		 * watching it until we shut it down, and keep our own copy
+		 * of a proxy channel, which may be closed meanwhile.
+		 */
+		if (d->io)
+			d->io->watch->events = NIH_IO_NONE;
+		if (d->on_chan) {
+			int fd = dup(d->fd);
+
+			if (fd < 0) {
+				nih_error("%s: failed to dup channel: %s",
+					__func__, strerror(errno));
+				scm_write(d, NULL, 0);
+				nih_free(d);
+				return;
+			}
+			d->fd = fd;
+			d->close_fd = true;
+		}
+	}
+
+	work_submit(keys, d->type == REQ_TYPE_REMOVE_ON_EMPTY ||
+			(d->type == REQ_TYPE_BATCH && batch_main_only(d)),
+			(WorkFunc) request_run, (WorkFunc) request_done, d);
+}
+#endif
+
+static int dbus_request_submit(struct scm_sock_data *d,
+		NihDBusMessage *message)
+{
+	d->message = message;
+	nih_ref(message, d);
+#ifdef CGMANAGER
+	submit_request(d);
+#else
+	if (!proxy_forward(d)) {
+		dbus_request_run(d);
+		dbus_request_reply(d);
+		nih_free(d);
+	}
+#endif
+	return 0;
 }
 
 int cgmanager_ping (void *data, NihDBusMessage *message, int junk)
@@ -203,10 +845,10 @@ void get_pid_scm_complete(struct scm_sock_data *data)
 	ret = get_pid_cgroup_main(data, data->controller, data->pcred,
 			data->rcred, data->vcred, &output);
 	if (ret == 0)
-		ret = write(data->fd, output, strlen(output)+1);
+		ret = scm_write(data, output, strlen(output)+1);
 	else
 		// Let the client know it failed
-		ret = write(data->fd, &data->rcred, 0);
+		ret = scm_write(data, &data->rcred, 0);
 	if (ret < 0)
 		nih_error("GetPidCgroupScm: Error writing final result to client: %s",
 			strerror(errno));
@@ -248,9 +890,9 @@ int cgmanager_get_pid_cgroup_scm (void *data, NihDBusMessage *message,
  * Caller requests the cgroup of @pid in a given @controller
  */
 int cgmanager_get_pid_cgroup (void *data, NihDBusMessage *message,
-			char *controller, int plain_pid, char **output)
+			char *controller, int plain_pid)
 {
-	int fd = 0, ret;
+	int fd = 0;
 	struct ucred rcred, vcred;
 	socklen_t len;
 
@@ -291,13 +933,10 @@ int cgmanager_get_pid_cgroup (void *data, NihDBusMessage *message,
 	vcred.uid = 0;
 	vcred.gid = 0;
 	vcred.pid = plain_pid;
-	ret = get_pid_cgroup_main(message, controller, rcred, rcred, vcred, output);
-	if (ret) {
-		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-				"invalid request");
-		return -1;
-	}
-	return 0;
+	struct scm_sock_data *d = new_dbus_request(REQ_TYPE_GET_PID, controller,
+			NULL, rcred);
+	d->vcred = vcred;
+	return dbus_request_submit(d, message);
 }
 
 void get_pid_abs_scm_complete(struct scm_sock_data *data)
@@ -310,10 +949,10 @@ void get_pid_abs_scm_complete(struct scm_sock_data *data)
 	ret = get_pid_cgroup_abs_main(data, data->controller, data->pcred,
 			data->rcred, data->vcred, &output);
 	if (ret == 0)
-		ret = write(data->fd, output, strlen(output)+1);
+		ret = scm_write(data, output, strlen(output)+1);
 	else
 		// Let the client know it failed
-		ret = write(data->fd, &data->rcred, 0);
+		ret = scm_write(data, &data->rcred, 0);
 	if (ret < 0)
 		nih_error("GetPidCgroupAbsScm: Error writing final result to client: %s",
 			strerror(errno));
@@ -357,9 +996,9 @@ int cgmanager_get_pid_cgroup_abs_scm (void *data, NihDBusMessage *message,
  * to the proxy's
  */
 int cgmanager_get_pid_cgroup_abs (void *data, NihDBusMessage *message,
-			char *controller, int plain_pid, char **output)
+			char *controller, int plain_pid)
 {
-	int fd = 0, ret;
+	int fd = 0;
 	struct ucred rcred, vcred;
 	socklen_t len;
 
@@ -422,13 +1061,11 @@ int cgmanager_get_pid_cgroup_abs (void *data, NihDBusMessage *message,
 #define mycred rcred
 #endif
 
-	ret = get_pid_cgroup_abs_main(message, controller, mycred, rcred, vcred, output);
-	if (ret) {
-		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-				"invalid request");
-		return -1;
-	}
-	return 0;
+	struct scm_sock_data *d = new_dbus_request(REQ_TYPE_GET_PID_ABS, controller,
+			NULL, rcred);
+	d->vcred = vcred;
+	d->pcred = mycred;
+	return dbus_request_submit(d, message);
 }
 
 void move_pid_scm_complete(struct scm_sock_data *data)
@@ -438,7 +1075,7 @@ void move_pid_scm_complete(struct scm_sock_data *data)
 	if (move_pid_main(data->controller, data->cgroup, data->pcred,
 				data->rcred, data->vcred) == 0)
 		b = '1';
-	if (write(data->fd, &b, 1) < 0)
+	if (scm_write(data, &b, 1) < 0)
 		nih_error("MovePidScm: Error writing final result to client");
 }
 
@@ -477,7 +1114,7 @@ int cgmanager_move_pid_scm (void *data, NihDBusMessage *message,
 int cgmanager_move_pid (void *data, NihDBusMessage *message,
 			const char *controller, const char *cgroup, int plain_pid)
 {
-	int fd = 0, ret;
+	int fd = 0;
 	struct ucred rcred, vcred;
 	socklen_t len;
 
@@ -514,11 +1151,10 @@ int cgmanager_move_pid (void *data, NihDBusMessage *message,
 	vcred.uid = 0;
 	vcred.gid = 0;
 	vcred.pid = plain_pid;
-	ret = move_pid_main(controller, cgroup, rcred, rcred, vcred);
-	if (ret)
-		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-					     "invalid request");
-	return ret;
+	struct scm_sock_data *d = new_dbus_request(REQ_TYPE_MOVE_PID, controller,
+			cgroup, rcred);
+	d->vcred = vcred;
+	return dbus_request_submit(d, message);
 }
 
 void move_pid_abs_scm_complete(struct scm_sock_data *data)
@@ -528,7 +1164,7 @@ void move_pid_abs_scm_complete(struct scm_sock_data *data)
 	if (move_pid_abs_main(data->controller, data->cgroup, data->pcred,
 				data->rcred, data->vcred) == 0)
 		b = '1';
-	if (write(data->fd, &b, 1) < 0)
+	if (scm_write(data, &b, 1) < 0)
 		nih_error("MovePidScm: Error writing final result to client");
 }
 
@@ -562,7 +1198,7 @@ int cgmanager_move_pid_abs_scm (void *data, NihDBusMessage *message,
 int cgmanager_move_pid_abs (void *data, NihDBusMessage *message,
 			const char *controller, const char *cgroup, int plain_pid)
 {
-	int fd = 0, ret;
+	int fd = 0;
 	struct ucred rcred, vcred;
 	socklen_t len;
 
@@ -631,11 +1267,11 @@ int cgmanager_move_pid_abs (void *data, NihDBusMessage *message,
 	 */
 #define mycred rcred
 #endif
-	ret = move_pid_abs_main(controller, cgroup, mycred, rcred, vcred);
-	if (ret)
-		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-					     "invalid request");
-	return ret;
+	struct scm_sock_data *d = new_dbus_request(REQ_TYPE_MOVE_PID_ABS, controller,
+			cgroup, rcred);
+	d->vcred = vcred;
+	d->pcred = mycred;
+	return dbus_request_submit(d, message);
 }
 
 void create_scm_complete(struct scm_sock_data *data)
@@ -646,7 +1282,7 @@ void create_scm_complete(struct scm_sock_data *data)
 	if (create_main(data->controller, data->cgroup, data->pcred,
 				data->rcred, &existed) == 0)
 		b = existed == 1 ? '2' : '1';
-	if (write(data->fd, &b, 1) < 0)
+	if (scm_write(data, &b, 1) < 0)
 		nih_error("createScm: Error writing final result to client");
 }
 
@@ -683,13 +1319,12 @@ int cgmanager_create_scm (void *data, NihDBusMessage *message,
  * start with / or .. .
  */
 int cgmanager_create (void *data, NihDBusMessage *message,
-			 const char *controller, const char *cgroup, int32_t *existed)
+			 const char *controller, const char *cgroup)
 {
-	int fd = 0, ret;
+	int fd = 0;
 	struct ucred rcred;
 	socklen_t len;
 
-	*existed = -1;
 	if (message == NULL) {
 		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
 				"message was null");
@@ -713,12 +1348,49 @@ int cgmanager_create (void *data, NihDBusMessage *message,
 	nih_info (_("Create: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
 			fd, rcred.pid, rcred.uid, rcred.gid);
 
-	ret = create_main(controller, cgroup, rcred, rcred, existed);
-	if (ret)
+	struct scm_sock_data *d = new_dbus_request(REQ_TYPE_CREATE, controller,
+			cgroup, rcred);
+	return dbus_request_submit(d, message);
+}
+
+/*
+ * This is one of the dbus callbacks.
+ * Caller requests @cgroup as by Create, but taken from the warm pool of
+ * pre-created cgroups where it can be.
+ */
+int cgmanager_claim (void *data, NihDBusMessage *message,
+			 const char *controller, const char *cgroup)
+{
+	int fd = 0;
+	struct ucred rcred;
+	socklen_t len;
+
+	if (message == NULL) {
 		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-				"invalid request");
-	nih_info(_("%s: returning %d; existed is %d"), __func__, ret, *existed);
-	return ret;
+				"message was null");
+		return -1;
+	}
+
+	if (!dbus_connection_get_socket(message->connection, &fd)) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+				"Could not get client socket.");
+		return -1;
+	}
+
+	len = sizeof(struct ucred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &rcred, &len) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get peer cred: %s",
+					     strerror(errno));
+		return -1;
+	}
+
+	nih_info (_("Claim: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
+			fd, rcred.pid, rcred.uid, rcred.gid);
+
+	struct scm_sock_data *d = new_dbus_request(REQ_TYPE_CLAIM, controller,
+			cgroup, rcred);
+	return dbus_request_submit(d, message);
 }
 
 void chown_scm_complete(struct scm_sock_data *data)
@@ -728,7 +1400,7 @@ void chown_scm_complete(struct scm_sock_data *data)
 	if (chown_main(data->controller, data->cgroup, data->pcred,
 				data->rcred, data->vcred) == 0)
 		b = '1';
-	if (write(data->fd, &b, 1) < 0)
+	if (scm_write(data, &b, 1) < 0)
 		nih_error("ChownScm: Error writing final result to client");
 }
 
@@ -771,7 +1443,7 @@ int cgmanager_chown_scm (void *data, NihDBusMessage *message,
 int cgmanager_chown (void *data, NihDBusMessage *message,
 			const char *controller, const char *cgroup, int uid, int gid)
 {
-	int fd = 0, ret;
+	int fd = 0;
 	struct ucred rcred, vcred;
 	socklen_t len;
 
@@ -815,11 +1487,10 @@ int cgmanager_chown (void *data, NihDBusMessage *message,
 	vcred.uid = uid;
 	vcred.gid = gid;
 
-	ret = chown_main(controller, cgroup, rcred, rcred, vcred);
-	if (ret)
-		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-					     "invalid request");
-	return ret;
+	struct scm_sock_data *d = new_dbus_request(REQ_TYPE_CHOWN, controller,
+			cgroup, rcred);
+	d->vcred = vcred;
+	return dbus_request_submit(d, message);
 }
 
 void chmod_scm_complete(struct scm_sock_data *data)
@@ -829,7 +1500,7 @@ void chmod_scm_complete(struct scm_sock_data *data)
 	if (chmod_main(data->controller, data->cgroup, data->file,
 				data->pcred, data->rcred, data->mode) == 0)
 		b = '1';
-	if (write(data->fd, &b, 1) < 0)
+	if (scm_write(data, &b, 1) < 0)
 		nih_error("ChownScm: Error writing final result to client");
 }
 
@@ -870,7 +1541,7 @@ int cgmanager_chmod (void *data, NihDBusMessage *message,
 			const char *controller, const char *cgroup,
 			const char *file, int mode)
 {
-	int fd = 0, ret;
+	int fd = 0;
 	struct ucred rcred;
 	socklen_t len;
 
@@ -897,11 +1568,11 @@ int cgmanager_chmod (void *data, NihDBusMessage *message,
 	nih_info (_("Chown: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
 			fd, rcred.pid, rcred.uid, rcred.gid);
 
-	ret = chmod_main(controller, cgroup, file, rcred, rcred, mode);
-	if (ret)
-		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-					     "invalid request");
-	return ret;
+	struct scm_sock_data *d = new_dbus_request(REQ_TYPE_CHMOD, controller,
+			cgroup, rcred);
+	d->file = NIH_MUST( nih_strdup(d, file) );
+	d->mode = mode;
+	return dbus_request_submit(d, message);
 }
 
 void get_value_complete(struct scm_sock_data *data)
@@ -911,9 +1582,9 @@ void get_value_complete(struct scm_sock_data *data)
 
 	if (!get_value_main(data, data->controller, data->cgroup, data->key,
 			data->pcred, data->rcred, &output))
-		ret = write(data->fd, output, strlen(output)+1);
+		ret = scm_write(data, output, strlen(output)+1);
 	else
-		ret = write(data->fd, &data->rcred, 0);  // kick the client
+		ret = scm_write(data, &data->rcred, 0);  // kick the client
 	if (ret < 0)
 		nih_error("GetValueScm: Error writing final result to client");
 }
@@ -959,10 +1630,10 @@ int cgmanager_get_value_scm (void *data, NihDBusMessage *message,
  */
 int cgmanager_get_value (void *data, NihDBusMessage *message,
 				 char *controller, const char *req_cgroup,
-				 const char *key, char **value)
+				 const char *key)
 
 {
-	int fd = 0, ret;
+	int fd = 0;
 	struct ucred rcred;
 	socklen_t len;
 
@@ -989,11 +1660,10 @@ int cgmanager_get_value (void *data, NihDBusMessage *message,
 	nih_info (_("GetValue: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
 			fd, rcred.pid, rcred.uid, rcred.gid);
 
-	ret = get_value_main(message, controller, req_cgroup, key, rcred, rcred, value);
-	if (ret)
-		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-				"invalid request");
-	return ret;
+	struct scm_sock_data *d = new_dbus_request(REQ_TYPE_GET_VALUE, controller,
+			req_cgroup, rcred);
+	d->key = NIH_MUST( nih_strdup(d, key) );
+	return dbus_request_submit(d, message);
 }
 
 void set_value_complete(struct scm_sock_data *data)
@@ -1002,7 +1672,7 @@ void set_value_complete(struct scm_sock_data *data)
 	if (set_value_main(data->controller, data->cgroup, data->key,
 				data->value, data->pcred, data->rcred) == 0)
 		b = '1';
-	if (write(data->fd, &b, 1) < 0)
+	if (scm_write(data, &b, 1) < 0)
 		nih_error("SetValueScm: Error writing final result to client");
 }
 
@@ -1047,7 +1717,7 @@ int cgmanager_set_value (void *data, NihDBusMessage *message,
 				 const char *key, const char *value)
 
 {
-	int fd = 0, ret;
+	int fd = 0;
 	struct ucred rcred;
 	socklen_t len;
 
@@ -1074,11 +1744,11 @@ int cgmanager_set_value (void *data, NihDBusMessage *message,
 	nih_info (_("SetValue: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
 			fd, rcred.pid, rcred.uid, rcred.gid);
 
-	ret = set_value_main(controller, req_cgroup, key, value, rcred, rcred);
-	if (ret)
-		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-					     "invalid request");
-	return ret;
+	struct scm_sock_data *d = new_dbus_request(REQ_TYPE_SET_VALUE, controller,
+			req_cgroup, rcred);
+	d->key = NIH_MUST( nih_strdup(d, key) );
+	d->value = NIH_MUST( nih_strdup(d, value) );
+	return dbus_request_submit(d, message);
 }
 
 void remove_scm_complete(struct scm_sock_data *data)
@@ -1091,7 +1761,7 @@ void remove_scm_complete(struct scm_sock_data *data)
 			data->rcred, data->recursive, &existed);
 	if (ret == 0)
 		b = existed == 1 ? '2' : '1';
-	if (write(data->fd, &b, 1) < 0)
+	if (scm_write(data, &b, 1) < 0)
 		nih_error("removeScm: Error writing final result to client");
 }
 
@@ -1129,13 +1799,12 @@ int cgmanager_remove_scm (void *data, NihDBusMessage *message,
  * start with / or .. .
  */
 int cgmanager_remove (void *data, NihDBusMessage *message, const char *controller,
-			const char *cgroup, int recursive, int32_t *existed)
+			const char *cgroup, int recursive)
 {
-	int fd = 0, ret;
+	int fd = 0;
 	struct ucred rcred;
 	socklen_t len;
 
-	*existed = -1;
 	if (message == NULL) {
 		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
 			"message was null");
@@ -1159,19 +1828,124 @@ int cgmanager_remove (void *data, NihDBusMessage *message, const char *controlle
 	nih_info (_("Remove: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
 			fd, rcred.pid, rcred.uid, rcred.gid);
 
-	ret = remove_main(controller, cgroup, rcred, rcred, recursive, existed);
-	if (ret)
+	struct scm_sock_data *d = new_dbus_request(REQ_TYPE_REMOVE, controller,
+			cgroup, rcred);
+	d->recursive = recursive;
+	return dbus_request_submit(d, message);
+}
+
+/*
+ * This is one of the dbus callbacks.
+ * Caller requests that @cgroup be removed once it is no longer busy.
+ * The retries are timed from the main loop, so this is not passed to
+ * the work queue; each attempt is.
+ */
+int cgmanager_remove_deferred (void *data, NihDBusMessage *message,
+		const char *controller, const char *cgroup, int32_t recursive,
+		int32_t *existed)
+{
+	int fd = 0;
+	struct ucred rcred;
+	socklen_t len;
+
+	if (message == NULL) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"message was null");
+		return -1;
+	}
+
+	if (!dbus_connection_get_socket(message->connection, &fd)) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get client socket.");
+		return -1;
+	}
+
+	len = sizeof(struct ucred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &rcred, &len) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get peer cred: %s",
+					     strerror(errno));
+		return -1;
+	}
+
+	nih_info (_("RemoveDeferred: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
+			fd, rcred.pid, rcred.uid, rcred.gid);
+
+	if (remove_deferred_main(controller, cgroup, rcred, rcred, recursive,
+				existed) < 0) {
 		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
 					     "invalid request");
-	return ret;
+		return -1;
+	}
+	return 0;
 }
 
 /* get_tasks - list tasks for a single cgroup */
+/*
+ * Send @pids, from *@next on, to the client, translated into its pid
+ * namespace by the kernel.  Pids are sent in batches of
+ * SCM_CREDS_BATCH, waiting up to @timeout ms for each to fit in the
+ * client's queue, and *@next is advanced past those sent.  If a task
+ * exits before we can send it, send a duplicate of the first valid pid
+ * in its place so the client still gets the promised count.
+ *
+ * Returns 0 once all are sent, -2 if the client's queue stayed full,
+ * or -1 on error.
+ */
+int send_task_creds_from(struct scm_sock_data *data, int32_t *pids,
+		int32_t nrpids, int32_t *next, int timeout)
+{
+	struct ucred creds[SCM_CREDS_BATCH];
+	pid_t firstvalid = *next > 0 ? pids[0] : -1;
+	int i = *next, j, n, ret;
+	char p = 'p';
+
+	while (i < nrpids) {
+		n = nrpids - i < SCM_CREDS_BATCH ? nrpids - i : SCM_CREDS_BATCH;
+		for (j = 0; j < n; j++) {
+			creds[j].pid = pids[i+j];
+			creds[j].uid = 0;
+			creds[j].gid = 0;
+		}
+		if (data->on_chan)
+			ret = send_creds_batch(data->fd, creds, n,
+					&data->chan_id, sizeof(data->chan_id),
+					timeout);
+		else
+			ret = send_creds_batch(data->fd, creds, n, &p, 1,
+					timeout);
+		if (ret == -3) {
+			if (firstvalid == -1 || firstvalid == pids[i]) {
+				nih_error("gettasks: too much pid churn.  Last valid pid was %d\n",
+						firstvalid);
+				return -1;
+			}
+			nih_info("gettasks: sending dup pid %d in place of exited pid %d\n",
+					firstvalid, pids[i]);
+			pids[i] = firstvalid;
+			continue;
+		} else if (ret < 0)
+			return ret;
+		if (firstvalid == -1)
+			firstvalid = pids[i];
+		i += ret;
+		*next = i;
+	}
+	return 0;
+}
+
+/* send_task_creds_from() for all of @pids, waiting up to a second */
+void send_task_creds(struct scm_sock_data *data, int32_t *pids,
+		int32_t nrpids)
+{
+	int32_t next = 0;
+
+	send_task_creds_from(data, pids, nrpids, &next, 1000);
+}
+
 void get_tasks_scm_complete(struct scm_sock_data *data)
 {
-	struct ucred pcred;
-	int i, ret;
-	pid_t firstvalid = -1;
+	int ret;
 	int32_t *pids, nrpids;
 	ret = get_tasks_main(data, data->controller, data->cgroup,
 			data->pcred, data->rcred, &pids);
@@ -1181,31 +1955,11 @@ void get_tasks_scm_complete(struct scm_sock_data *data)
 		ret = -1;
 	}
 	nrpids = ret;
-	if (write(data->fd, &nrpids, sizeof(int32_t)) != sizeof(int32_t)) {
+	if (scm_write(data, &nrpids, sizeof(int32_t)) != sizeof(int32_t)) {
 		nih_error("get_tasks_scm: Error writing final result to client");
 		return;
 	}
-	pcred.uid = 0; pcred.gid = 0;
-	for (i=0; i<nrpids; i++) {
-		pcred.pid = pids[i];
-again:
-		ret = send_creds(data->fd, &pcred);
-		if (ret == -3) {
-			if (firstvalid == -1 || firstvalid == pcred.pid) {
-				nih_error("gettasks: too much pid churn.  Last valid pid was %d\n",
-						firstvalid);
-				return;
-			}
-			nih_info("gettasks: sending dup pid %d in place of exited pid %d\n",
-					firstvalid, pcred.pid);
-			pcred.pid = firstvalid;
-			goto again;
-
-		} else if (ret < 0)
-			return;
-		if (firstvalid == -1)
-			firstvalid = pids[i];
-	}
+	send_task_creds(data, pids, nrpids);
 }
 
 int cgmanager_get_tasks_scm (void *data, NihDBusMessage *message,
@@ -1240,12 +1994,11 @@ int cgmanager_get_tasks_scm (void *data, NihDBusMessage *message,
  * returns nrpids, or -1 on error.
  */
 int cgmanager_get_tasks (void *data, NihDBusMessage *message, char *controller,
-			const char *cgroup, int32_t **pids, size_t *nrpids)
+			const char *cgroup)
 {
-	int fd = 0, ret;
+	int fd = 0;
 	struct ucred rcred;
 	socklen_t len;
-	int32_t *tmp;
 
 	if (message == NULL) {
 		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
@@ -1270,24 +2023,56 @@ int cgmanager_get_tasks (void *data, NihDBusMessage *message, char *controller,
 	nih_info (_("GetTasks: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
 			fd, rcred.pid, rcred.uid, rcred.gid);
 
-	ret = get_tasks_main(message, controller, cgroup, rcred, rcred, &tmp);
-	if (ret >= 0) {
-		*nrpids = ret;
-		*pids = tmp;
-		ret = 0;
-	} else
+	struct scm_sock_data *d = new_dbus_request(REQ_TYPE_GET_TASKS, controller,
+			cgroup, rcred);
+	return dbus_request_submit(d, message);
+}
+
+/*
+ * This is one of the dbus callbacks.
+ * As GetTasks, but the pids are returned in a sealed memfd.
+ */
+int cgmanager_get_tasks_fd (void *data, NihDBusMessage *message,
+		char *controller, const char *cgroup)
+{
+	struct scm_sock_data *d;
+	int fd = 0;
+	struct ucred rcred;
+	socklen_t len;
+
+	if (message == NULL) {
 		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-					     "invalid request");
-	return ret;
+			"message was null");
+		return -1;
+	}
+
+	if (!dbus_connection_get_socket(message->connection, &fd)) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get client socket.");
+		return -1;
+	}
+
+	len = sizeof(struct ucred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &rcred, &len) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get peer cred: %s",
+					     strerror(errno));
+		return -1;
+	}
+
+	nih_info (_("GetTasksFd: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
+			fd, rcred.pid, rcred.uid, rcred.gid);
+
+	d = new_dbus_request(REQ_TYPE_GET_TASKS, controller, cgroup, rcred);
+	d->pids_fd = true;
+	return dbus_request_submit(d, message);
 }
 
 /* GetTasksRecursive - list tasks for a cgroup and any descendents
  * inherintly racy. */
 void get_tasks_recursive_scm_complete(struct scm_sock_data *data)
 {
-	struct ucred pcred;
-	int i, ret;
-	pid_t firstvalid = -1;
+	int ret;
 	int32_t *pids, nrpids;
 
 	ret = get_tasks_recursive_main(data, data->controller, data->cgroup,
@@ -1298,30 +2083,11 @@ void get_tasks_recursive_scm_complete(struct scm_sock_data *data)
 		ret = -1;
 	}
 	nrpids = ret;
-	if (write(data->fd, &nrpids, sizeof(int32_t)) != sizeof(int32_t)) {
+	if (scm_write(data, &nrpids, sizeof(int32_t)) != sizeof(int32_t)) {
 		nih_error("get_tasks_recursive_scm: Error writing final result to client");
 		return;
 	}
-	pcred.uid = 0; pcred.gid = 0;
-	for (i=0; i<nrpids; i++) {
-		pcred.pid = pids[i];
-again:
-		ret = send_creds(data->fd, &pcred);
-		if (ret == -3) {
-			if (firstvalid == -1 || firstvalid == pcred.pid) {
-				nih_error("gettasks: too much pid churn.  Last valid pid was %d\n",
-						firstvalid);
-				return;
-			}
-			nih_info("gettasks: sending dup pid %d in place of exited pid %d\n",
-					firstvalid, pcred.pid);
-			pcred.pid = firstvalid;
-			goto again;
-		} else if (ret < 0)
-			return;
-		if (firstvalid == -1)
-			firstvalid = pids[i];
-	}
+	send_task_creds(data, pids, nrpids);
 }
 
 int cgmanager_get_tasks_recursive_scm (void *data, NihDBusMessage *message,
@@ -1359,10 +2125,9 @@ int cgmanager_get_tasks_recursive (void *data, NihDBusMessage *message,
 		const char *controller, const char *cgroup, int32_t **pids,
 		size_t *nrpids)
 {
-	int fd = 0, ret;
+	int fd = 0;
 	struct ucred rcred;
 	socklen_t len;
-	int32_t *tmp;
 
 	if (message == NULL) {
 		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
@@ -1387,15 +2152,9 @@ int cgmanager_get_tasks_recursive (void *data, NihDBusMessage *message,
 	nih_info (_("GetTasksRecursive: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
 			fd, rcred.pid, rcred.uid, rcred.gid);
 
-	ret = get_tasks_recursive_main(message, controller, cgroup, rcred, rcred, &tmp);
-	if (ret >= 0) {
-		*nrpids = ret;
-		*pids = tmp;
-		ret = 0;
-	} else
-		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-					     "invalid request");
-	return ret;
+	struct scm_sock_data *d = new_dbus_request(REQ_TYPE_GET_TASKS_RECURSIVE, controller,
+			cgroup, rcred);
+	return dbus_request_submit(d, message);
 }
 
 
@@ -1411,7 +2170,7 @@ void list_children_scm_complete(struct scm_sock_data *data)
 
 	nrkids = list_children_main(data, data->controller, data->cgroup,
 			data->pcred, data->rcred, &output);
-	if (write(data->fd, &nrkids, sizeof(int32_t)) != sizeof(int32_t)) {
+	if (scm_write(data, &nrkids, sizeof(int32_t)) != sizeof(int32_t)) {
 		nih_error("%s: error writing results", __func__);
 		return;
 	}
@@ -1440,12 +2199,12 @@ void list_children_scm_complete(struct scm_sock_data *data)
 		remainlen -= ret + 1;
 	}
 
-	if (write(data->fd, &len, sizeof(uint32_t)) != sizeof(uint32_t)) {
+	if (scm_write(data, &len, sizeof(uint32_t)) != sizeof(uint32_t)) {
 		nih_error("%s: error writing results", __func__);
 		return;
 	}
 
-	if (write(data->fd, path, len) != len) {
+	if (scm_write(data, path, len) != len) {
 		nih_error("list_children_scm: Error writing final result to client");
 		return;
 	}
@@ -1483,14 +2242,12 @@ int cgmanager_list_children_scm (void *data, NihDBusMessage *message,
  * returns nrpids, or -1 on error.
  */
 int cgmanager_list_children (void *data, NihDBusMessage *message,
-		char *controller, const char *cgroup, char ***output)
+		char *controller, const char *cgroup)
 {
-	int fd = 0, ret;
+	int fd = 0;
 	struct ucred rcred;
 	socklen_t len;
 
-	nih_assert(output);
-
 	if (message == NULL) {
 		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
 			"message was null");
@@ -1514,13 +2271,9 @@ int cgmanager_list_children (void *data, NihDBusMessage *message,
 	nih_info (_("ListChildren: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
 			fd, rcred.pid, rcred.uid, rcred.gid);
 
-	ret = list_children_main(message, controller, cgroup, rcred, rcred, output);
-	if (ret >= 0)
-		ret = 0;
-	else
-		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-					     "invalid request");
-	return ret;
+	struct scm_sock_data *d = new_dbus_request(REQ_TYPE_LIST_CHILDREN, controller,
+			cgroup, rcred);
+	return dbus_request_submit(d, message);
 }
 
 void remove_on_empty_scm_complete(struct scm_sock_data *data)
@@ -1530,7 +2283,7 @@ void remove_on_empty_scm_complete(struct scm_sock_data *data)
 	if (remove_on_empty_main(data->controller, data->cgroup, data->pcred,
 				data->rcred) == 0)
 		b = '1';
-	if (write(data->fd, &b, 1) < 0)
+	if (scm_write(data, &b, 1) < 0)
 		nih_error("RemoveOnEmptyScm: Error writing final result to client");
 }
 
@@ -1569,7 +2322,7 @@ int cgmanager_remove_on_empty_scm (void *data, NihDBusMessage *message,
 int cgmanager_remove_on_empty (void *data, NihDBusMessage *message,
 		const char *controller, const char *cgroup)
 {
-	int fd = 0, ret;
+	int fd = 0;
 	struct ucred rcred;
 	socklen_t len;
 
@@ -1596,13 +2349,9 @@ int cgmanager_remove_on_empty (void *data, NihDBusMessage *message,
 	nih_info (_("RemoveOnEmpty: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
 			fd, rcred.pid, rcred.uid, rcred.gid);
 
-	ret = remove_on_empty_main(controller, cgroup, rcred, rcred);
-	if (ret >= 0)
-		ret = 0;
-	else
-		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-					     "invalid request");
-	return ret;
+	struct scm_sock_data *d = new_dbus_request(REQ_TYPE_REMOVE_ON_EMPTY, controller,
+			cgroup, rcred);
+	return dbus_request_submit(d, message);
 }
 
 /*
@@ -1616,7 +2365,7 @@ void prune_scm_complete(struct scm_sock_data *data)
 	if (prune_main(data->controller, data->cgroup, data->pcred,
 				data->rcred) == 0)
 		b = '1';
-	if (write(data->fd, &b, 1) < 0)
+	if (scm_write(data, &b, 1) < 0)
 		nih_error("PruneScm: Error writing final result to client");
 }
 
@@ -1654,7 +2403,7 @@ int cgmanager_prune_scm (void *data, NihDBusMessage *message,
 int cgmanager_prune (void *data, NihDBusMessage *message,
 		const char *controller, const char *cgroup)
 {
-	int fd = 0, ret;
+	int fd = 0;
 	struct ucred rcred;
 	socklen_t len;
 
@@ -1681,26 +2430,20 @@ int cgmanager_prune (void *data, NihDBusMessage *message,
 	nih_info (_("Prune: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
 			fd, rcred.pid, rcred.uid, rcred.gid);
 
-	ret = prune_main(controller, cgroup, rcred, rcred);
-	if (ret >= 0)
-		ret = 0;
-	else
-		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-					     "invalid request");
-	return ret;
+	struct scm_sock_data *d = new_dbus_request(REQ_TYPE_PRUNE, controller,
+			cgroup, rcred);
+	return dbus_request_submit(d, message);
 }
 
 /*
  * listcontrollers
  */
-int cgmanager_list_controllers (void *data, NihDBusMessage *message,
-		char ***output)
+int cgmanager_list_controllers (void *data, NihDBusMessage *message)
 {
 	int fd = 0, ret;
 	struct ucred rcred;
 	socklen_t len;
-
-	nih_assert(output);
+	char **output;
 
 	if (message == NULL) {
 		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
@@ -1725,13 +2468,17 @@ int cgmanager_list_controllers (void *data, NihDBusMessage *message,
 	nih_info (_("ListControllers: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
 			fd, rcred.pid, rcred.uid, rcred.gid);
 
-	ret = list_controllers_main(message, output);
-	if (ret >= 0)
-		ret = 0;
-	else
+#ifndef CGMANAGER
+	if (proxy_list_controllers(message))
+		return 0;
+#endif
+	ret = list_controllers_main(message, &output);
+	if (ret < 0) {
 		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-					     "invalid request");
-	return ret;
+				"invalid request");
+		return -1;
+	}
+	return cgmanager_list_controllers_reply(message, output);
 }
 
 /*
@@ -1749,7 +2496,7 @@ void list_keys_scm_complete(struct scm_sock_data *data)
 
 	nrkeys = list_keys_main(data, data->controller, data->cgroup,
 			data->pcred, data->rcred, &output);
-	if (write(data->fd, &nrkeys, sizeof(int32_t)) != sizeof(int32_t)) {
+	if (scm_write(data, &nrkeys, sizeof(int32_t)) != sizeof(int32_t)) {
 		nih_error("%s: error writing results", __func__);
 		return;
 	}
@@ -1769,12 +2516,12 @@ void list_keys_scm_complete(struct scm_sock_data *data)
 	}
 
 	len = strlen(retdata);
-	if (write(data->fd, &len, sizeof(uint32_t)) != sizeof(uint32_t)) {
+	if (scm_write(data, &len, sizeof(uint32_t)) != sizeof(uint32_t)) {
 		nih_error("%s: error writing results", __func__);
 		return;
 	}
 
-	if (write(data->fd, retdata, len) != len) {
+	if (scm_write(data, retdata, len) != len) {
 		nih_error("list_keysscm: Error writing final result to client");
 		return;
 	}
@@ -1812,15 +2559,12 @@ int cgmanager_list_keys_scm (void *data, NihDBusMessage *message,
  * returns nrkeys, or -1 on error.
  */
 int cgmanager_list_keys (void *data, NihDBusMessage *message,
-		char *controller, const char *cgroup,
-		struct keys_return_type ***output)
+		char *controller, const char *cgroup)
 {
-	int fd = 0, ret;
+	int fd = 0;
 	struct ucred rcred;
 	socklen_t len;
 
-	nih_assert(output);
-
 	if (message == NULL) {
 		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
 			"message was null");
@@ -1844,13 +2588,949 @@ int cgmanager_list_keys (void *data, NihDBusMessage *message,
 	nih_info (_("ListKeys: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
 			fd, rcred.pid, rcred.uid, rcred.gid);
 
-	ret = list_keys_main(message, controller, cgroup, rcred, rcred, output);
-	if (ret >= 0)
-		ret = 0;
-	else
+	struct scm_sock_data *d = new_dbus_request(REQ_TYPE_LISTKEYS, controller,
+			cgroup, rcred);
+	return dbus_request_submit(d, message);
+}
+
+/* Batch */
+static const struct {
+	const char *name;
+	enum req_type type;
+} batch_op_names[] = {
+	{ "Create", REQ_TYPE_CREATE },
+	{ "Chown", REQ_TYPE_CHOWN },
+	{ "Chmod", REQ_TYPE_CHMOD },
+	{ "SetValue", REQ_TYPE_SET_VALUE },
+	{ "MovePid", REQ_TYPE_MOVE_PID },
+	{ "Remove", REQ_TYPE_REMOVE },
+	{ "RemoveOnEmpty", REQ_TYPE_REMOVE_ON_EMPTY },
+	{ "Prune", REQ_TYPE_PRUNE },
+};
+
+/* The name of batch operation @type, as sent in a Batch request */
+const char *batch_op_name(int type)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(batch_op_names) / sizeof(batch_op_names[0]); i++) {
+		if (batch_op_names[i].type == type)
+			return batch_op_names[i].name;
+	}
+	return NULL;
+}
+
+/*
+ * Copy the operations of a Batch or BatchScm request into @d.  MovePid
+ * and Chown take their victim from the arguments, as MovePid and Chown
+ * do; BatchScm replaces it with the victim's scm credential.  Returns
+ * false, having raised a dbus error, if @ops is not a valid batch.
+ */
+static bool batch_ops_parse(struct scm_sock_data *d,
+		CgmanagerBatchOpsElement * const *ops)
+{
+	int32_t i, n;
+	size_t j;
+
+	for (n = 0; ops && ops[n]; n++)
+		;
+	if (n == 0 || n > BATCH_MAX_OPS) {
 		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
-					     "invalid request");
-	return ret;
+			"A batch must have between 1 and %d operations",
+			BATCH_MAX_OPS);
+		return false;
+	}
+
+	d->ops = NIH_MUST( nih_alloc(d, n * sizeof(struct batch_op *)) );
+	d->results = NIH_MUST( nih_alloc(d, n * sizeof(int32_t)) );
+	d->nops = n;
+	for (i = 0; i < n; i++) {
+		struct batch_op *op;
+
+		op = d->ops[i] = NIH_MUST( nih_new(d->ops, struct batch_op) );
+		memset(op, 0, sizeof(*op));
+		op->type = -1;
+		for (j = 0; j < sizeof(batch_op_names) / sizeof(batch_op_names[0]); j++) {
+			if (strcmp(ops[i]->item0, batch_op_names[j].name) == 0)
+				op->type = batch_op_names[j].type;
+		}
+		if (op->type == -1) {
+			nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+				"Unknown batch operation '%s'", ops[i]->item0);
+			return false;
+		}
+		op->controller = NIH_MUST( nih_strdup(op, ops[i]->item1) );
+		op->cgroup = NIH_MUST( nih_strdup(op, ops[i]->item2) );
+		op->key = NIH_MUST( nih_strdup(op, ops[i]->item3) );
+		op->value = NIH_MUST( nih_strdup(op, ops[i]->item4) );
+		op->arg = ops[i]->item5;
+		if (op->type == REQ_TYPE_MOVE_PID)
+			op->vcred.pid = ops[i]->item5;
+		if (op->type == REQ_TYPE_CHOWN) {
+			op->vcred.pid = getpid(); // cgmanager ignores this
+			op->vcred.uid = ops[i]->item5;
+			op->vcred.gid = ops[i]->item6;
+		}
+	}
+	return true;
+}
+
+/*
+ * Run the operations of a batch in order, stopping at the first one
+ * which fails.  Each gets the result its *Scm method would have sent:
+ * 1 on success, 2 if Create or Remove found the cgroup existed, 0 on
+ * failure, and -1 if it was not run.
+ */
+int batch_run(struct batch_op **ops, int32_t nops, struct ucred p,
+		struct ucred r, int32_t *results)
+{
+	bool failed = false;
+	int32_t i, existed;
+	int ret;
+
+	for (i = 0; i < nops; i++) {
+		struct batch_op *op = ops[i];
+
+		if (failed) {
+			results[i] = -1;
+			continue;
+		}
+		existed = -1;
+		switch (op->type) {
+		case REQ_TYPE_CREATE:
+			ret = create_main(op->controller, op->cgroup, p, r,
+					&existed);
+			break;
+		case REQ_TYPE_CHOWN:
+			ret = chown_main(op->controller, op->cgroup, p, r,
+					op->vcred);
+			break;
+		case REQ_TYPE_CHMOD:
+			ret = chmod_main(op->controller, op->cgroup, op->key,
+					p, r, op->arg);
+			break;
+		case REQ_TYPE_SET_VALUE:
+			ret = set_value_main(op->controller, op->cgroup,
+					op->key, op->value, p, r);
+			break;
+		case REQ_TYPE_MOVE_PID:
+			ret = move_pid_main(op->controller, op->cgroup, p, r,
+					op->vcred);
+			break;
+		case REQ_TYPE_REMOVE:
+			ret = remove_main(op->controller, op->cgroup, p, r,
+					op->arg, &existed);
+			break;
+		case REQ_TYPE_REMOVE_ON_EMPTY:
+			ret = remove_on_empty_main(op->controller, op->cgroup,
+					p, r);
+			if (ret > 0)
+				ret = 0;
+			break;
+		case REQ_TYPE_PRUNE:
+			ret = prune_main(op->controller, op->cgroup, p, r);
+			if (ret > 0)
+				ret = 0;
+			break;
+		default:
+			ret = -1;
+		}
+
+		if (ret != 0) {
+			nih_info(_("Batch: operation %d of %d failed"), i + 1,
+				nops);
+			results[i] = 0;
+			failed = true;
+		} else
+			results[i] = existed == 1 ? 2 : 1;
+	}
+	return 0;
+}
+
+void batch_scm_complete(struct scm_sock_data *data)
+{
+	int32_t i;
+	int ret;
+
+	/* a proxy channel cannot carry the operations */
+	if (!data->ops) {
+		nih_error("BatchScm: request has no operations");
+		scm_write(data, NULL, 0);
+		return;
+	}
+
+	for (i = 0; i < data->nops; i++) {
+		if (data->ops[i]->type == REQ_TYPE_MOVE_PID ||
+				data->ops[i]->type == REQ_TYPE_CHOWN)
+			data->ops[i]->vcred = data->vcred;
+	}
+
+	if (batch_main(data->ops, data->nops, data->pcred, data->rcred,
+				data->results) == 0)
+		ret = scm_write(data, data->results,
+				data->nops * sizeof(int32_t));
+	else
+		ret = scm_write(data, NULL, 0);
+	if (ret < 0)
+		nih_error("BatchScm: Error writing final result to client");
+}
+
+int cgmanager_batch_scm (void *data, NihDBusMessage *message,
+		CgmanagerBatchOpsElement * const *ops, int sockfd)
+{
+	struct scm_sock_data *d;
+
+	d = alloc_scm_sock_data(message, sockfd, REQ_TYPE_BATCH);
+	if (!d)
+		return -1;
+	if (!batch_ops_parse(d, ops)) {
+		nih_free(d);
+		return -1;
+	}
+
+	if (!nih_io_reopen(NULL, sockfd, NIH_IO_MESSAGE,
+				(NihIoReader) sock_scm_reader,
+				(NihIoCloseHandler) scm_sock_close,
+				scm_sock_error_handler, d)) {
+		NihError *error = nih_error_steal ();
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"Failed queue scm message: %s", error->message);
+		nih_free(error);
+		return -1;
+	}
+	if (!kick_fd_client(sockfd))
+		return -1;
+	return 0;
+}
+
+/*
+ * This is one of the dbus callbacks.
+ * Caller requests running the operations @ops in order, and gets
+ * back a result for each.
+ */
+int cgmanager_batch (void *data, NihDBusMessage *message,
+		CgmanagerBatchOpsElement * const *ops)
+{
+	struct scm_sock_data *d;
+	int fd = 0;
+	struct ucred rcred;
+	socklen_t len;
+	int32_t i;
+
+	if (message == NULL) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"message was null");
+		return -1;
+	}
+
+	if (!dbus_connection_get_socket(message->connection, &fd)) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get client socket.");
+		return -1;
+	}
+
+	len = sizeof(struct ucred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &rcred, &len) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get peer cred: %s",
+					     strerror(errno));
+		return -1;
+	}
+
+	nih_info (_("Batch: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
+			fd, rcred.pid, rcred.uid, rcred.gid);
+
+	d = new_dbus_request(REQ_TYPE_BATCH, "", NULL, rcred);
+	if (!batch_ops_parse(d, ops)) {
+		nih_free(d);
+		return -1;
+	}
+
+	/* the same restrictions as for plain MovePid and Chown */
+	for (i = 0; i < d->nops; i++) {
+		if (d->ops[i]->type == REQ_TYPE_MOVE_PID &&
+				!is_same_pidns(rcred.pid)) {
+			nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+				"Escape request from different namespace requires a proxy");
+			nih_free(d);
+			return -1;
+		}
+		if (d->ops[i]->type == REQ_TYPE_CHOWN &&
+				!is_same_userns(rcred.pid)) {
+			nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+				"chown called from different user namespace");
+			nih_free(d);
+			return -1;
+		}
+	}
+	return dbus_request_submit(d, message);
+}
+
+/* GetValues */
+
+/*
+ * Copy the (controller, cgroup, key) items of a GetValues or
+ * GetValuesScm request into @d.  Returns false, having raised a dbus
+ * error, if there are too few or too many.
+ */
+static bool get_values_parse(struct scm_sock_data *d,
+		CgmanagerGetValuesItemsElement * const *items)
+{
+	int32_t i, n;
+
+	for (n = 0; items && items[n]; n++)
+		;
+	if (n == 0 || n > BATCH_MAX_OPS) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"GetValues must have between 1 and %d items",
+			BATCH_MAX_OPS);
+		return false;
+	}
+
+	d->ops = NIH_MUST( nih_alloc(d, n * sizeof(struct batch_op *)) );
+	d->results = NIH_MUST( nih_alloc(d, n * sizeof(int32_t)) );
+	d->nops = n;
+	for (i = 0; i < n; i++) {
+		struct batch_op *op;
+
+		op = d->ops[i] = NIH_MUST( nih_new(d->ops, struct batch_op) );
+		memset(op, 0, sizeof(*op));
+		op->type = REQ_TYPE_GET_VALUE;
+		op->controller = NIH_MUST( nih_strdup(op, items[i]->item0) );
+		op->cgroup = NIH_MUST( nih_strdup(op, items[i]->item1) );
+		op->key = NIH_MUST( nih_strdup(op, items[i]->item2) );
+	}
+	return true;
+}
+
+void get_values_scm_complete(struct scm_sock_data *data)
+{
+	nih_local char *buf = NULL;
+	uint32_t len = 0;
+	int32_t i;
+	char *p;
+
+	/* a proxy channel cannot carry the items */
+	if (!data->ops) {
+		nih_error("GetValuesScm: request has no items");
+		scm_write(data, NULL, 0);
+		return;
+	}
+
+	if (get_values_main(data->ops, data->nops, data->pcred, data->rcred,
+				data->results) != 0) {
+		scm_write(data, NULL, 0);
+		return;
+	}
+
+	for (i = 0; i < data->nops; i++) {
+		if (data->ops[i]->value)
+			len += strlen(data->ops[i]->value);
+		len++;
+	}
+	buf = NIH_MUST( nih_alloc(NULL, len) );
+	p = buf;
+	for (i = 0; i < data->nops; i++) {
+		strcpy(p, data->ops[i]->value ? data->ops[i]->value : "");
+		p += strlen(p) + 1;
+	}
+
+	if (scm_write(data, data->results, data->nops * sizeof(int32_t)) !=
+			data->nops * sizeof(int32_t) ||
+			scm_write(data, &len, sizeof(uint32_t)) != sizeof(uint32_t) ||
+			scm_write(data, buf, len) != len)
+		nih_error("GetValuesScm: Error writing final result to client");
+}
+
+int cgmanager_get_values_scm (void *data, NihDBusMessage *message,
+		CgmanagerGetValuesItemsElement * const *items, int sockfd)
+{
+	struct scm_sock_data *d;
+
+	d = alloc_scm_sock_data(message, sockfd, REQ_TYPE_GET_VALUES);
+	if (!d)
+		return -1;
+	if (!get_values_parse(d, items)) {
+		nih_free(d);
+		return -1;
+	}
+
+	if (!nih_io_reopen(NULL, sockfd, NIH_IO_MESSAGE,
+				(NihIoReader) sock_scm_reader,
+				(NihIoCloseHandler) scm_sock_close,
+				scm_sock_error_handler, d)) {
+		NihError *error = nih_error_steal ();
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"Failed queue scm message: %s", error->message);
+		nih_free(error);
+		return -1;
+	}
+	if (!kick_fd_client(sockfd))
+		return -1;
+	return 0;
+}
+
+/*
+ * This is one of the dbus callbacks.
+ * Caller requests the values of the (controller, cgroup, key) @items,
+ * and gets back a result and a value for each.
+ */
+int cgmanager_get_values (void *data, NihDBusMessage *message,
+		CgmanagerGetValuesItemsElement * const *items)
+{
+	struct scm_sock_data *d;
+	int fd = 0;
+	struct ucred rcred;
+	socklen_t len;
+
+	if (message == NULL) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"message was null");
+		return -1;
+	}
+
+	if (!dbus_connection_get_socket(message->connection, &fd)) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get client socket.");
+		return -1;
+	}
+
+	len = sizeof(struct ucred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &rcred, &len) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get peer cred: %s",
+					     strerror(errno));
+		return -1;
+	}
+
+	nih_info (_("GetValues: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
+			fd, rcred.pid, rcred.uid, rcred.gid);
+
+	d = new_dbus_request(REQ_TYPE_GET_VALUES, "", NULL, rcred);
+	if (!get_values_parse(d, items)) {
+		nih_free(d);
+		return -1;
+	}
+	return dbus_request_submit(d, message);
+}
+
+/* SetValues */
+
+/*
+ * Copy the (controller, cgroup, key, value) entries of a SetValues or
+ * SetValuesScm request into @d.  Returns false, having raised a dbus
+ * error, if there are too few or too many.
+ */
+static bool set_values_parse(struct scm_sock_data *d,
+		CgmanagerSetValuesEntriesElement * const *entries)
+{
+	int32_t i, n;
+
+	for (n = 0; entries && entries[n]; n++)
+		;
+	if (n == 0 || n > BATCH_MAX_OPS) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"SetValues must have between 1 and %d entries",
+			BATCH_MAX_OPS);
+		return false;
+	}
+
+	d->ops = NIH_MUST( nih_alloc(d, n * sizeof(struct batch_op *)) );
+	d->results = NIH_MUST( nih_alloc(d, n * sizeof(int32_t)) );
+	d->nops = n;
+	for (i = 0; i < n; i++) {
+		struct batch_op *op;
+
+		op = d->ops[i] = NIH_MUST( nih_new(d->ops, struct batch_op) );
+		memset(op, 0, sizeof(*op));
+		op->type = REQ_TYPE_SET_VALUE;
+		op->controller = NIH_MUST( nih_strdup(op, entries[i]->item0) );
+		op->cgroup = NIH_MUST( nih_strdup(op, entries[i]->item1) );
+		op->key = NIH_MUST( nih_strdup(op, entries[i]->item2) );
+		op->value = NIH_MUST( nih_strdup(op, entries[i]->item3) );
+	}
+	return true;
+}
+
+void set_values_scm_complete(struct scm_sock_data *data)
+{
+	int ret;
+
+	/* a proxy channel cannot carry the entries */
+	if (!data->ops) {
+		nih_error("SetValuesScm: request has no entries");
+		scm_write(data, NULL, 0);
+		return;
+	}
+
+	if (set_values_main(data->ops, data->nops, data->pcred, data->rcred,
+				data->results) == 0)
+		ret = scm_write(data, data->results,
+				data->nops * sizeof(int32_t));
+	else
+		ret = scm_write(data, NULL, 0);
+	if (ret < 0)
+		nih_error("SetValuesScm: Error writing final result to client");
+}
+
+int cgmanager_set_values_scm (void *data, NihDBusMessage *message,
+		CgmanagerSetValuesEntriesElement * const *entries, int sockfd)
+{
+	struct scm_sock_data *d;
+
+	d = alloc_scm_sock_data(message, sockfd, REQ_TYPE_SET_VALUES);
+	if (!d)
+		return -1;
+	if (!set_values_parse(d, entries)) {
+		nih_free(d);
+		return -1;
+	}
+
+	if (!nih_io_reopen(NULL, sockfd, NIH_IO_MESSAGE,
+				(NihIoReader) sock_scm_reader,
+				(NihIoCloseHandler) scm_sock_close,
+				scm_sock_error_handler, d)) {
+		NihError *error = nih_error_steal ();
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"Failed queue scm message: %s", error->message);
+		nih_free(error);
+		return -1;
+	}
+	if (!kick_fd_client(sockfd))
+		return -1;
+	return 0;
+}
+
+/*
+ * This is one of the dbus callbacks.
+ * Caller requests writing the (controller, cgroup, key, value)
+ * @entries, and gets back a result for each.
+ */
+int cgmanager_set_values (void *data, NihDBusMessage *message,
+		CgmanagerSetValuesEntriesElement * const *entries)
+{
+	struct scm_sock_data *d;
+	int fd = 0;
+	struct ucred rcred;
+	socklen_t len;
+
+	if (message == NULL) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"message was null");
+		return -1;
+	}
+
+	if (!dbus_connection_get_socket(message->connection, &fd)) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get client socket.");
+		return -1;
+	}
+
+	len = sizeof(struct ucred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &rcred, &len) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get peer cred: %s",
+					     strerror(errno));
+		return -1;
+	}
+
+	nih_info (_("SetValues: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
+			fd, rcred.pid, rcred.uid, rcred.gid);
+
+	d = new_dbus_request(REQ_TYPE_SET_VALUES, "", NULL, rcred);
+	if (!set_values_parse(d, entries)) {
+		nih_free(d);
+		return -1;
+	}
+	return dbus_request_submit(d, message);
+}
+
+/*
+ * This is one of the dbus callbacks.
+ * Caller asks for PopulatedChanged signals for @cgroup, and gets back
+ * whether it is populated now.
+ */
+int cgmanager_subscribe_populated (void *data, NihDBusMessage *message,
+		char *controller, const char *cgroup, int32_t *populated)
+{
+	int fd = 0;
+	struct ucred rcred;
+	socklen_t len;
+
+	if (message == NULL) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"message was null");
+		return -1;
+	}
+
+	if (!dbus_connection_get_socket(message->connection, &fd)) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get client socket.");
+		return -1;
+	}
+
+	len = sizeof(struct ucred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &rcred, &len) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get peer cred: %s",
+					     strerror(errno));
+		return -1;
+	}
+
+	nih_info (_("SubscribePopulated: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
+			fd, rcred.pid, rcred.uid, rcred.gid);
+
+	if (subscribe_populated_main(message->connection, controller, cgroup,
+				rcred, rcred, populated) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "invalid request");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * This is one of the dbus callbacks.
+ * Caller no longer wants PopulatedChanged signals for @cgroup.
+ */
+int cgmanager_unsubscribe_populated (void *data, NihDBusMessage *message,
+		char *controller, const char *cgroup)
+{
+	int fd = 0;
+	struct ucred rcred;
+	socklen_t len;
+
+	if (message == NULL) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"message was null");
+		return -1;
+	}
+
+	if (!dbus_connection_get_socket(message->connection, &fd)) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get client socket.");
+		return -1;
+	}
+
+	len = sizeof(struct ucred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &rcred, &len) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get peer cred: %s",
+					     strerror(errno));
+		return -1;
+	}
+
+	nih_info (_("UnsubscribePopulated: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
+			fd, rcred.pid, rcred.uid, rcred.gid);
+
+	if (unsubscribe_populated_main(message->connection, controller,
+				cgroup, rcred, rcred) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "invalid request");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * This is one of the dbus callbacks.
+ * Caller waits up to @timeout seconds for @cgroup to be empty.  The
+ * inotify watch which tells us is main loop state, so this is not
+ * passed to the work queue.
+ */
+int cgmanager_wait_empty (void *data, NihDBusMessage *message,
+		char *controller, const char *cgroup, int32_t timeout)
+{
+	int fd = 0;
+	struct ucred rcred;
+	socklen_t len;
+
+	if (message == NULL) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"message was null");
+		return -1;
+	}
+
+	if (!dbus_connection_get_socket(message->connection, &fd)) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get client socket.");
+		return -1;
+	}
+
+	len = sizeof(struct ucred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &rcred, &len) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get peer cred: %s",
+					     strerror(errno));
+		return -1;
+	}
+
+	nih_info (_("WaitEmpty: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
+			fd, rcred.pid, rcred.uid, rcred.gid);
+
+	if (wait_empty_main(message, controller, cgroup, rcred, rcred,
+				timeout) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "invalid request");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * This is one of the dbus callbacks.
+ * Caller wants KeyChanged signals when @key in @cgroup changes.  The
+ * kernel notifications are main loop state, so this is not passed to
+ * the work queue.
+ */
+int cgmanager_watch (void *data, NihDBusMessage *message,
+		char *controller, const char *cgroup, const char *key,
+		const char *args)
+{
+	int fd = 0;
+	struct ucred rcred;
+	socklen_t len;
+
+	if (message == NULL) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"message was null");
+		return -1;
+	}
+
+	if (!dbus_connection_get_socket(message->connection, &fd)) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get client socket.");
+		return -1;
+	}
+
+	len = sizeof(struct ucred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &rcred, &len) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get peer cred: %s",
+					     strerror(errno));
+		return -1;
+	}
+
+	nih_info (_("Watch: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
+			fd, rcred.pid, rcred.uid, rcred.gid);
+
+	if (watch_key_main(message->connection, controller, cgroup, key,
+				args, rcred, rcred) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "invalid request");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * This is one of the dbus callbacks.
+ * Caller no longer wants KeyChanged signals for @key in @cgroup.
+ */
+int cgmanager_unwatch (void *data, NihDBusMessage *message,
+		char *controller, const char *cgroup, const char *key,
+		const char *args)
+{
+	int fd = 0;
+	struct ucred rcred;
+	socklen_t len;
+
+	if (message == NULL) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"message was null");
+		return -1;
+	}
+
+	if (!dbus_connection_get_socket(message->connection, &fd)) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get client socket.");
+		return -1;
+	}
+
+	len = sizeof(struct ucred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &rcred, &len) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get peer cred: %s",
+					     strerror(errno));
+		return -1;
+	}
+
+	nih_info (_("Unwatch: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
+			fd, rcred.pid, rcred.uid, rcred.gid);
+
+	if (unwatch_key_main(message->connection, controller, cgroup, key,
+				args, rcred, rcred) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "invalid request");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * This is one of the dbus callbacks.
+ * Caller wants PressureChanged signals when PSI @trigger fires for
+ * @resource in @cgroup.  Like Watch, this is main loop state.
+ */
+int cgmanager_watch_pressure (void *data, NihDBusMessage *message,
+		char *controller, const char *cgroup, const char *resource,
+		const char *trigger)
+{
+	int fd = 0;
+	struct ucred rcred;
+	socklen_t len;
+
+	if (message == NULL) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"message was null");
+		return -1;
+	}
+
+	if (!dbus_connection_get_socket(message->connection, &fd)) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get client socket.");
+		return -1;
+	}
+
+	len = sizeof(struct ucred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &rcred, &len) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get peer cred: %s",
+					     strerror(errno));
+		return -1;
+	}
+
+	nih_info (_("WatchPressure: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
+			fd, rcred.pid, rcred.uid, rcred.gid);
+
+	if (watch_pressure_main(message->connection, controller, cgroup,
+				resource, trigger, rcred, rcred) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "invalid request");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * This is one of the dbus callbacks.
+ * Caller no longer wants PressureChanged signals for @trigger.
+ */
+int cgmanager_unwatch_pressure (void *data, NihDBusMessage *message,
+		char *controller, const char *cgroup, const char *resource,
+		const char *trigger)
+{
+	int fd = 0;
+	struct ucred rcred;
+	socklen_t len;
+
+	if (message == NULL) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"message was null");
+		return -1;
+	}
+
+	if (!dbus_connection_get_socket(message->connection, &fd)) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get client socket.");
+		return -1;
+	}
+
+	len = sizeof(struct ucred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &rcred, &len) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get peer cred: %s",
+					     strerror(errno));
+		return -1;
+	}
+
+	nih_info (_("UnwatchPressure: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
+			fd, rcred.pid, rcred.uid, rcred.gid);
+
+	if (unwatch_pressure_main(message->connection, controller, cgroup,
+				resource, trigger, rcred, rcred) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "invalid request");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Return a list of "name value" statistics about the running daemon,
+ * e.g. cache hit and miss counts.
+ */
+int cgmanager_get_stats (void *data, NihDBusMessage *message,
+		char ***output)
+{
+	int ret;
+
+	nih_assert(output);
+
+	if (message == NULL) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"message was null");
+		return -1;
+	}
+
+	ret = get_stats_main(message, output);
+	if (ret >= 0)
+		ret = 0;
+	else
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "invalid request");
+	return ret;
+}
+
+/*
+ * This is one of the dbus callbacks.
+ * Check the hierarchy mirror against cgroupfs and repair it.  This
+ * reads every cgroup directory, so only host root may ask for it.
+ */
+int cgmanager_mirror_resync (void *data, NihDBusMessage *message,
+		int32_t *differences)
+{
+	int fd = 0, ret;
+	struct ucred rcred;
+	socklen_t len;
+
+	if (message == NULL) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+			"message was null");
+		return -1;
+	}
+
+	if (!dbus_connection_get_socket(message->connection, &fd)) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get client socket.");
+		return -1;
+	}
+
+	len = sizeof(struct ucred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &rcred, &len) < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Could not get peer cred: %s",
+					     strerror(errno));
+		return -1;
+	}
+
+	nih_info (_("MirrorResync: Client fd is: %d (pid=%d, uid=%u, gid=%u)"),
+			fd, rcred.pid, rcred.uid, rcred.gid);
+
+	if (rcred.uid != 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "Only root may resync the mirror");
+		return -1;
+	}
+
+	ret = mirror_resync();
+	if (ret < 0) {
+		nih_dbus_error_raise_printf (DBUS_ERROR_INVALID_ARGS,
+					     "invalid request");
+		return -1;
+	}
+	*differences = ret;
+	return 0;
 }
 
 /*
@@ -1895,4 +3575,6 @@ void client_disconnect (DBusConnection *conn)
 		return;
 
 	nih_info (_("Disconnected from private client"));
+	populated_client_disconnect(conn);
+	key_watch_client_disconnect(conn);
 }
@@ -54,9 +54,12 @@
 #include <nih-dbus/dbus_error.h>
 
 #include <sys/socket.h>
+#include <poll.h>
 
 #include "cgmanager.h"
 #include "fs.h"
+#include "pidlist.h"
+#include "workqueue.h"
 #include "access_checks.h"
 #include "org.linuxcontainers.cgmanager.h"
 
@@ -91,6 +94,25 @@ struct scm_sock_data {
 	int recursive;
 	int mode;
 	char *file;
+	bool on_chan;      // request arrived over a proxy channel
+	uint32_t chan_id;  // and this is its id
+	bool close_fd;     // fd is our own dup of the channel's
+	NihIo *io;         // client's scm socket, shut down once answered
+
+	/* a plain dbus request: its caller, and the results to reply with */
+	NihDBusMessage *message;
+	int ret;
+	int32_t existed;
+	char *output;
+	char **outputs;
+	int32_t *pids;
+	bool pids_fd;     // GetTasksFd: reply with the pids in a memfd
+	struct keys_return_type **keys;
+
+	/* a Batch, GetValues or SetValues request: its operations, and a result for each */
+	struct batch_op **ops;
+	int32_t nops;
+	int32_t *results;
 };
 
 enum req_type {
@@ -111,6 +133,40 @@ enum req_type {
 	REQ_TYPE_PRUNE,
 	REQ_TYPE_LISTCONTROLLERS,
 	REQ_TYPE_LISTKEYS,
+	REQ_TYPE_BATCH,
+	REQ_TYPE_GET_VALUES,
+	REQ_TYPE_SET_VALUES,
+	REQ_TYPE_CLAIM,
+	REQ_TYPE_MAX,
+};
+
+/*
+ * A cgproxy may register a long-lived channel (RegisterProxyChannel)
+ * over which it forwards requests, rather than sending a dbus message
+ * and a new socketpair for every *Scm call.  A request is one datagram
+ * carrying the requestor's SCM credential: this header, followed by
+ * the NUL-terminated strings controller, cgroup, key, value and file
+ * (empty if unused).  If the request needs a victim credential, it is
+ * sent next in a datagram holding only the request id.  Every reply
+ * datagram starts with the id of the request it answers, followed by
+ * what the *Scm method would have written on its socket.
+ */
+struct chan_req_hdr {
+	uint32_t id;
+	int32_t type;
+	int32_t recursive;
+	int32_t mode;
+};
+
+/* requests larger than this are sent the classic way */
+#define CHAN_MAX_MSG 65536
+
+/* A task's cgroup in one hierarchy; see resolve_pid_cgroups() */
+struct resolved_cgroup {
+	char *controller;
+	char *cgroup;  // as shown in /proc/pid/cgroup, or NULL if not found
+	char *path;    // its full path, or NULL if it could not be resolved
+	int depth;
 };
 
 struct keys_return_type {
@@ -120,6 +176,46 @@ struct keys_return_type {
 	uint32_t perms;
 };
 
+/*
+ * One operation of a Batch request.  @type is one of the REQ_TYPEs
+ * Create, Chown, Chmod, SetValue, MovePid, Remove, RemoveOnEmpty and
+ * Prune; @key is the SetValue key or Chmod file, and @arg the Chmod
+ * mode or Remove recursive flag.  MovePid and Chown act on @vcred.
+ */
+struct batch_op {
+	int type;
+	char *controller;
+	char *cgroup;
+	char *key;
+	char *value;
+	int32_t arg;
+	struct ucred vcred;
+};
+
+/* the most operations one Batch, or items one GetValues or SetValues, may carry */
+#define BATCH_MAX_OPS 1024
+
+bool need_two_creds(enum req_type t);
+ssize_t scm_send(struct scm_sock_data *data, const void *buf, size_t len,
+		int timeout);
+ssize_t scm_write(struct scm_sock_data *data, const void *buf, size_t len);
+int send_task_creds_from(struct scm_sock_data *data, int32_t *pids,
+		int32_t nrpids, int32_t *next, int timeout);
+void send_task_creds(struct scm_sock_data *data, int32_t *pids,
+		int32_t nrpids);
+
+void dbus_request_reply(struct scm_sock_data *d);
+
+/*
+ * cgproxy only: forward request @d to cgmanager without waiting for the
+ * reply.  The reply goes to the dbus caller d->message if set, else
+ * back over d->fd, after which d->io (if set) is shut down or else @d
+ * is freed.  Returns false if the caller must complete the request
+ * synchronously instead.
+ */
+bool proxy_forward(struct scm_sock_data *d);
+bool proxy_list_controllers(NihDBusMessage *message);
+
 int get_pid_cgroup_main(void *parent, char *controller,
 		struct ucred p, struct ucred r, struct ucred v, char **output);
 void get_pid_scm_complete(struct scm_sock_data *data);
@@ -135,6 +231,8 @@ void move_pid_abs_scm_complete(struct scm_sock_data *data);
 int create_main(const char *controller, const char *cgroup,
 		struct ucred p, struct ucred r, int32_t *existed);
 void create_scm_complete(struct scm_sock_data *data);
+int claim_main(const char *controller, const char *cgroup,
+		struct ucred p, struct ucred r, int32_t *existed);
 int chown_main(const char *controller, const char *cgroup,
 		struct ucred p, struct ucred r, struct ucred v);
 void chown_scm_complete(struct scm_sock_data *data);
@@ -151,6 +249,8 @@ int set_value_main(char *controller, const char *req_cgroup,
 void set_value_complete(struct scm_sock_data *data);
 int remove_main(const char *controller, const char *cgroup, struct ucred p,
 		struct ucred r, int recursive, int32_t *existed);
+int remove_deferred_main(const char *controller, const char *cgroup,
+		struct ucred p, struct ucred r, int recursive, int32_t *existed);
 void remove_scm_complete(struct scm_sock_data *data);
 int get_tasks_main (void *parent, char *controller, const char *cgroup,
 		struct ucred p, struct ucred r, int32_t **pids);
@@ -170,8 +270,46 @@ int prune_main (const char *controller, const char *cgroup,
 		struct ucred p, struct ucred r);
 void prune_scm_complete(struct scm_sock_data *data);
 
+const char *batch_op_name(int type);
+int batch_run (struct batch_op **ops, int32_t nops, struct ucred p,
+		struct ucred r, int32_t *results);
+int batch_main (struct batch_op **ops, int32_t nops, struct ucred p,
+		struct ucred r, int32_t *results);
+void batch_scm_complete(struct scm_sock_data *data);
+int get_values_main (struct batch_op **items, int32_t nitems, struct ucred p,
+		struct ucred r, int32_t *results);
+void get_values_scm_complete(struct scm_sock_data *data);
+int set_values_main (struct batch_op **ops, int32_t nops, struct ucred p,
+		struct ucred r, int32_t *results);
+void set_values_scm_complete(struct scm_sock_data *data);
+
+int subscribe_populated_main (DBusConnection *conn, char *controller,
+		const char *cgroup, struct ucred p, struct ucred r,
+		int32_t *populated);
+int unsubscribe_populated_main (DBusConnection *conn, char *controller,
+		const char *cgroup, struct ucred p, struct ucred r);
+int wait_empty_main (NihDBusMessage *message, char *controller,
+		const char *cgroup, struct ucred p, struct ucred r,
+		int32_t timeout);
+void populated_client_disconnect(DBusConnection *conn);
+int watch_key_main (DBusConnection *conn, char *controller,
+		const char *cgroup, const char *key, const char *args,
+		struct ucred p, struct ucred r);
+int unwatch_key_main (DBusConnection *conn, char *controller,
+		const char *cgroup, const char *key, const char *args,
+		struct ucred p, struct ucred r);
+int watch_pressure_main (DBusConnection *conn, char *controller,
+		const char *cgroup, const char *resource, const char *trigger,
+		struct ucred p, struct ucred r);
+int unwatch_pressure_main (DBusConnection *conn, char *controller,
+		const char *cgroup, const char *resource, const char *trigger,
+		struct ucred p, struct ucred r);
+void key_watch_client_disconnect(DBusConnection *conn);
+
 int list_controllers_main (void *parent, char ***output);
 
+int get_stats_main (void *parent, char ***output);
+
 int list_keys_main (void *parent, char *controller, const char *cgroup,
 			struct ucred p, struct ucred r,
 			struct keys_return_type ***output);
@@ -184,6 +322,6 @@ void client_disconnect (DBusConnection *conn);
 
 bool sane_cgroup(const char *cgroup);
 
-#define API_VERSION 10
+#define API_VERSION 22
 
 #endif
@@ -37,6 +37,10 @@
 #include <sys/param.h>
 #include <stdbool.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/syscall.h>
 
 #include <nih/macros.h>
 #include <nih/alloc.h>
@@ -53,6 +57,7 @@
 
 #include "frontend.h"  // for keys_return_type
 #include "fs.h"        // for #defines
+#include "pidlist.h"
 
 /* defines relating to the release agent */
 #define AGENT LIBEXECDIR "/cgmanager/cgm-release-agent"
@@ -73,6 +78,52 @@ return -1;
 extern int pivot_root(const char * new_root, const char * put_old);
 #endif
 
+/*
+ * openat2() is called directly, as the C library may not wrap it.  The
+ * arguments are a stable kernel ABI, so declare them here rather than
+ * depend on <linux/openat2.h>.
+ */
+struct cgm_open_how {
+	uint64_t flags;
+	uint64_t mode;
+	uint64_t resolve;
+};
+#ifndef RESOLVE_NO_MAGICLINKS
+#define RESOLVE_NO_MAGICLINKS	0x02
+#endif
+#ifndef RESOLVE_NO_SYMLINKS
+#define RESOLVE_NO_SYMLINKS	0x04
+#endif
+#ifndef RESOLVE_BENEATH
+#define RESOLVE_BENEATH		0x08
+#endif
+
+/* Likewise memfd_create(), and the file seals from <linux/fcntl.h> */
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC		0x0001U
+#endif
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING	0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS		1033
+#endif
+#ifndef F_SEAL_SEAL
+#define F_SEAL_SEAL		0x0001
+#define F_SEAL_SHRINK		0x0002
+#define F_SEAL_GROW		0x0004
+#define F_SEAL_WRITE		0x0008
+#endif
+
+/* And getdents64(), whose records are laid out as in getdents64(2) */
+struct cgm_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
 char *all_controllers;
 
 struct controller_mounts {
@@ -88,33 +139,1559 @@ struct controller_mounts {
 	bool unified;
 };
 
-static struct controller_mounts *all_mounts;
-static int num_controllers;
+static struct controller_mounts *all_mounts;
+static int num_controllers;
+
+/*
+ * Lookup index over all_mounts, keyed by controller name.  Each
+ * controller is entered both as "foo" and as "name=foo", so named
+ * hierarchies resolve in a single lookup.  It is built once all_mounts
+ * is final at the end of collect_subsystems() and never modified
+ * afterwards, so the worker threads may read it without locking.
+ */
+struct controller_index_entry {
+	NihList entry;
+	char *name;
+	struct controller_mounts *m;
+};
+
+static NihHash *controller_index;
+
+/*
+ * the controller_mnts is an array of the mounts to export as the controller
+ * list.  If freezer and devices are comounted, then they will form one
+ * entry "freezer,devices"
+ */
+static int num_controller_mnts;
+static char **controller_mnts;
+
+static char *base_path;
+
+/*
+ * Caches of open handles on recently used cgroupfs paths.  Most
+ * requests touch several files under the same cgroup, and each of those
+ * used to cost a walk of the full cgroupfs path, plus an open and close
+ * of the file itself.  cgdir_cache holds O_PATH handles on directories,
+ * which the fs helpers below use with the *at() calls.  The cgfile
+ * caches hold value, tasks and cgroup.procs files open for reading or
+ * writing, so that a hot SetValue, GetValue or MovePid is a single
+ * pread() or pwrite().
+ *
+ * Cgroups may be removed or renamed behind our back, so an entry is
+ * checked on every hit: the kernel must still know the handle by the
+ * same path (a removed directory reads back as "... (deleted)").  That
+ * is much cheaper than walking the path again, and makes sure a
+ * request can never reach a cgroup other than the one its access checks
+ * were made against.  Entries are dropped as soon as we remove a cgroup
+ * ourselves, and the least recently used entry goes when a cache is
+ * full.  Worker threads share the caches; each is protected by its own
+ * lock, and an entry which is dropped while in use is closed by its
+ * last user.
+ */
+struct fd_cache_entry {
+	NihList entry;		// in cache->hash, keyed by path
+	char *path;
+	NihList lru;		// in cache->lru, most recently used first
+	struct fd_cache *cache;
+	int fd;
+	int users;
+	bool dead;		// no longer in the cache
+};
+
+struct fd_cache {
+	const char *name;
+	int size;
+	int flags;
+	int (*open)(const char *path, int flags);
+	NihHash *hash;
+	NihList lru;
+	int entries;
+	unsigned long hits, misses, stale;
+	pthread_mutex_t lock;
+};
+
+#define fd_cache_lru_entry(l) \
+	((struct fd_cache_entry *)((char *)(l) - offsetof(struct fd_cache_entry, lru)))
+
+static int cgdir_open(const char *path, int flags)
+{
+	return open(path, flags | O_CLOEXEC);
+}
+
+static struct fd_cache cgdir_cache = {
+	.name = "cgdir_cache",
+	.size = 64,
+	.flags = O_PATH | O_DIRECTORY,
+	.open = cgdir_open,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct fd_cache cgfile_read_cache = {
+	.name = "cgfile_read_cache",
+	.size = 64,
+	.flags = O_RDONLY,
+	.open = cgfs_open,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct fd_cache cgfile_write_cache = {
+	.name = "cgfile_write_cache",
+	.size = 128,
+	.flags = O_WRONLY,
+	.open = cgfs_open,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct fd_cache *all_fd_caches[] = {
+	&cgdir_cache, &cgfile_read_cache, &cgfile_write_cache, NULL
+};
+
+/* Called with e->cache->lock held */
+static void fd_cache_release(struct fd_cache_entry *e)
+{
+	if (--e->users || !e->dead)
+		return;
+	close(e->fd);
+	nih_free(e);
+}
+
+/*
+ * Take @e out of its cache; it is closed once nobody is using it.
+ * Called with e->cache->lock held.
+ */
+static void fd_cache_unlink(struct fd_cache_entry *e)
+{
+	nih_list_remove(&e->entry);
+	nih_list_remove(&e->lru);
+	e->dead = true;
+	e->cache->entries--;
+	e->users++;
+	fd_cache_release(e);
+}
+
+/*
+ * Copy the path by which the kernel knows @fd into @buf, which must
+ * hold MAXPATHLEN bytes.
+ */
+static bool fd_path(int fd, char *buf)
+{
+	char link[50];
+	ssize_t len;
+
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+	len = readlink(link, buf, MAXPATHLEN);
+	if (len < 0 || len >= MAXPATHLEN)
+		return false;
+	buf[len] = '\0';
+	return true;
+}
+
+/*
+ * Is @fd still the file at @path?
+ */
+static bool fd_still_valid(int fd, const char *path)
+{
+	char buf[MAXPATHLEN];
+
+	return fd_path(fd, buf) && strcmp(buf, path) == 0;
+}
+
+/*
+ * Return an open handle on @path from cache @c, opening it if needed.
+ * The handle must be returned with fd_cache_put().  Only absolute,
+ * normalized paths can be cached; anything else is opened for this one
+ * use.
+ */
+static struct fd_cache_entry *fd_cache_get(struct fd_cache *c, const char *path)
+{
+	struct fd_cache_entry *e;
+	int fd;
+
+	pthread_mutex_lock(&c->lock);
+	if (!c->hash) {
+		c->hash = NIH_MUST( nih_hash_string_new(NULL, c->size) );
+		nih_list_init(&c->lru);
+	}
+	e = (struct fd_cache_entry *)nih_hash_lookup(c->hash, path);
+	if (e) {
+		if (fd_still_valid(e->fd, path)) {
+			c->hits++;
+			e->users++;
+			nih_list_add_after(&c->lru, &e->lru);
+			pthread_mutex_unlock(&c->lock);
+			return e;
+		}
+		c->stale++;
+		fd_cache_unlink(e);
+	}
+	c->misses++;
+	pthread_mutex_unlock(&c->lock);
+
+	if ((fd = c->open(path, c->flags)) < 0)
+		return NULL;
+
+	e = NIH_MUST( nih_new(NULL, struct fd_cache_entry) );
+	nih_list_init(&e->entry);
+	nih_list_init(&e->lru);
+	e->path = NIH_MUST( nih_strdup(e, path) );
+	e->cache = c;
+	e->fd = fd;
+	e->users = 1;
+	e->dead = true;
+
+	pthread_mutex_lock(&c->lock);
+	if (*path == '/' && !nih_hash_lookup(c->hash, path)) {
+		if (c->entries >= c->size)
+			fd_cache_unlink(fd_cache_lru_entry(c->lru.prev));
+		e->dead = false;
+		nih_hash_add(c->hash, &e->entry);
+		nih_list_add_after(&c->lru, &e->lru);
+		c->entries++;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return e;
+}
+
+static void fd_cache_put(struct fd_cache_entry *e)
+{
+	struct fd_cache *c = e->cache;
+
+	pthread_mutex_lock(&c->lock);
+	fd_cache_release(e);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Forget the handles on @path and everything below it, because we
+ * just removed it.  This only releases the handles early; a stale
+ * handle would be caught by fd_still_valid() anyway.
+ */
+static void fd_caches_invalidate(const char *path)
+{
+	struct fd_cache **c;
+	size_t len = strlen(path);
+
+	while (len > 1 && path[len-1] == '/')
+		len--;
+
+	for (c = all_fd_caches; *c; c++) {
+		pthread_mutex_lock(&(*c)->lock);
+		if ((*c)->hash) {
+			NIH_HASH_FOREACH_SAFE((*c)->hash, iter) {
+				struct fd_cache_entry *e = (struct fd_cache_entry *)iter;
+
+				if (strncmp(e->path, path, len) == 0 &&
+						(e->path[len] == '\0' || e->path[len] == '/'))
+					fd_cache_unlink(e);
+			}
+		}
+		pthread_mutex_unlock(&(*c)->lock);
+	}
+}
+
+/*
+ * Close every cached handle, i.e. after we have moved into a new root.
+ */
+static void fd_caches_flush(void)
+{
+	struct fd_cache **c;
+
+	for (c = all_fd_caches; *c; c++) {
+		pthread_mutex_lock(&(*c)->lock);
+		while ((*c)->entries)
+			fd_cache_unlink(fd_cache_lru_entry((*c)->lru.prev));
+		pthread_mutex_unlock(&(*c)->lock);
+	}
+}
+
+void fd_caches_get_stats(void *parent, char ***output, size_t *len)
+{
+	struct fd_cache **c;
+
+	for (c = all_fd_caches; *c; c++) {
+		unsigned long hits, misses, stale;
+		int entries;
+		char name[100];
+
+		pthread_mutex_lock(&(*c)->lock);
+		hits = (*c)->hits;
+		misses = (*c)->misses;
+		stale = (*c)->stale;
+		entries = (*c)->entries;
+		pthread_mutex_unlock(&(*c)->lock);
+
+		snprintf(name, sizeof(name), "%s_hits", (*c)->name);
+		add_stat(parent, output, len, name, hits);
+		snprintf(name, sizeof(name), "%s_misses", (*c)->name);
+		add_stat(parent, output, len, name, misses);
+		snprintf(name, sizeof(name), "%s_stale", (*c)->name);
+		add_stat(parent, output, len, name, stale);
+		snprintf(name, sizeof(name), "%s_entries", (*c)->name);
+		add_stat(parent, output, len, name, entries);
+	}
+}
+
+/*
+ * Copy @path into @out (MAXPATHLEN bytes), squashing repeated and
+ * trailing slashes so that cache keys match.
+ */
+static bool cgfs_normalize(const char *path, char *out)
+{
+	char *p;
+
+	if (strlen(path) >= MAXPATHLEN) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	for (p = out; *path; path++) {
+		if (*path == '/' && p > out && p[-1] == '/')
+			continue;
+		*p++ = *path;
+	}
+	*p = '\0';
+	while (p > out + 1 && p[-1] == '/')
+		*--p = '\0';
+	return true;
+}
+
+/*
+ * Return a handle on the directory containing @path, and copy the last
+ * component of @path into @leaf, which must hold NAME_MAX+1 bytes.
+ * The handle must be returned with fd_cache_put().
+ */
+static struct fd_cache_entry *cgfs_parent(const char *path, char *leaf)
+{
+	char dir[MAXPATHLEN], *p;
+	const char *name;
+
+	if (!cgfs_normalize(path, dir))
+		return NULL;
+
+	p = strrchr(dir, '/');
+	if (!p) {
+		name = dir;
+	} else {
+		name = p + 1;
+		if (!*name)  // path was "/"
+			name = ".";
+	}
+	if (strlen(name) > NAME_MAX) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	memmove(leaf, name, strlen(name) + 1);
+
+	if (!p)
+		return fd_cache_get(&cgdir_cache, ".");
+	if (p == dir)
+		return fd_cache_get(&cgdir_cache, "/");
+	*p = '\0';
+	return fd_cache_get(&cgdir_cache, dir);
+}
+
+static bool mirror_stat(const char *path, struct stat *sb);
+static void mirror_refresh(const char *path, bool contents);
+static void mirror_file_written(const char *path);
+
+static int cgfs_stat(const char *path, struct stat *sb)
+{
+	char leaf[NAME_MAX+1];
+	struct fd_cache_entry *dir;
+	int ret;
+
+	if (mirror_stat(path, sb))
+		return 0;
+	if ((dir = cgfs_parent(path, leaf)) == NULL)
+		return -1;
+	ret = fstatat(dir->fd, leaf, sb, 0);
+	fd_cache_put(dir);
+	return ret;
+}
+
+/*
+ * open(2) @path relative to a cached handle on its directory.
+ */
+int cgfs_open(const char *path, int flags)
+{
+	char leaf[NAME_MAX+1];
+	struct fd_cache_entry *dir;
+	int fd, saved_errno;
+
+	if ((dir = cgfs_parent(path, leaf)) == NULL)
+		return -1;
+	fd = openat(dir->fd, leaf, flags | O_CLOEXEC);
+	saved_errno = errno;
+	fd_cache_put(dir);
+	errno = saved_errno;
+	return fd;
+}
+
+/*
+ * fopen(3) for cgroup files.  Only the "r" and "w" modes are supported;
+ * cgroup files are never created or truncated.
+ */
+FILE *cgfs_fopen(const char *path, const char *mode)
+{
+	int fd = cgfs_open(path, *mode == 'r' ? O_RDONLY : O_WRONLY);
+	FILE *f;
+
+	if (fd < 0)
+		return NULL;
+	if ((f = fdopen(fd, mode)) == NULL)
+		close(fd);
+	return f;
+}
+
+/*
+ * Write @len bytes of @buf to cgroup file @path in one write(2), using
+ * a cached handle on the file.
+ */
+ssize_t cgfs_write(const char *path, const char *buf, size_t len)
+{
+	char key[MAXPATHLEN];
+	struct fd_cache_entry *e;
+	ssize_t ret;
+	int saved_errno;
+
+	if (!cgfs_normalize(path, key))
+		return -1;
+	if ((e = fd_cache_get(&cgfile_write_cache, key)) == NULL)
+		return -1;
+	ret = pwrite(e->fd, buf, len, 0);
+	saved_errno = errno;
+	fd_cache_put(e);
+	if (ret >= 0)
+		mirror_file_written(key);
+	errno = saved_errno;
+	return ret;
+}
+
+DIR *cgfs_opendir(const char *path)
+{
+	int fd = cgfs_open(path, O_RDONLY | O_DIRECTORY);
+	DIR *d;
+
+	if (fd < 0)
+		return NULL;
+	if ((d = fdopendir(fd)) == NULL)
+		close(fd);
+	return d;
+}
+
+/*
+ * One directory being read by cgfs_walk().  The frames are kept in an
+ * array indexed by depth, and a frame's buffer is reused by every
+ * directory at that depth.
+ */
+struct cgfs_walk_frame {
+	int fd;
+	size_t pathlen;		// of this directory's path
+	char *buf;
+	long pos, len;		// in buf
+};
+
+#define CGFS_WALK_BUFSIZE 32768
+
+static void cgfs_walk_push(struct cgfs_walk_frame **frames, int *alloced,
+		int depth, int fd, size_t pathlen)
+{
+	struct cgfs_walk_frame *f;
+
+	if (depth == *alloced) {
+		*frames = NIH_MUST( nih_realloc(*frames, NULL,
+				(*alloced + 1) * sizeof(**frames)) );
+		(*frames)[depth].buf = NIH_MUST( nih_alloc(*frames,
+					CGFS_WALK_BUFSIZE) );
+		(*alloced)++;
+	}
+	f = &(*frames)[depth];
+	f->fd = fd;
+	f->pathlen = pathlen;
+	f->pos = f->len = 0;
+}
+
+/*
+ * Walk the directory tree at @path, depth first, calling @pre as each
+ * directory is entered and @post once all below it have been left
+ * (either may be NULL).  The callbacks are given the directory's path,
+ * a handle on its parent and its name there (-1 and the whole path for
+ * @path itself), and its depth, @path being at @depth.  @pre may return
+ * CGFS_WALK_SKIP to not descend into a directory, which is then not
+ * given to @post either.  @U_LEAF_NAME directories are skipped if
+ * @skip_leaf.
+ *
+ * Directories are read with getdents64() in large batches, and only
+ * stat()ed if the file system does not report their type, which cgroupfs
+ * does.  The walk keeps its own stack rather than recursing, and builds
+ * paths in a single buffer, so the only allocations are one buffer per
+ * level of depth.  Callbacks which remove directories should do so with
+ * cgfs_rmdir(), so that the handle caches and mirror see it.
+ *
+ * Returns -1 if @path could not be opened, else the number of failures
+ * (of the callbacks, or of opening or reading directories below @path).
+ */
+int cgfs_walk(const char *path, int depth, bool skip_leaf, CgfsWalkFunc pre,
+		CgfsWalkFunc post, void *data)
+{
+	nih_local struct cgfs_walk_frame *frames = NULL;
+	char wpath[MAXPATHLEN];
+	int alloced = 0, level = 0, failed = 0, fd, ret;
+
+	if (!cgfs_normalize(path, wpath))
+		return -1;
+
+	if (pre && (ret = pre(data, wpath, -1, wpath, depth)) != 0) {
+		if (ret == CGFS_WALK_SKIP)
+			return 0;
+		failed++;
+	}
+	if ((fd = cgfs_open(wpath, O_RDONLY | O_DIRECTORY)) < 0)
+		return -1;
+	cgfs_walk_push(&frames, &alloced, level++, fd, strlen(wpath));
+
+	while (level > 0) {
+		struct cgfs_walk_frame *f = &frames[level - 1];
+		struct cgm_dirent64 *de;
+		unsigned char type;
+		size_t namelen;
+
+		if (f->pos >= f->len) {
+#ifdef __NR_getdents64
+			f->len = syscall(__NR_getdents64, f->fd, f->buf,
+					 CGFS_WALK_BUFSIZE);
+#else
+			f->len = -1;
+			errno = ENOSYS;
+#endif
+			f->pos = 0;
+			if (f->len > 0)
+				continue;
+			if (f->len < 0)
+				failed++;
+
+			/* leave this directory */
+			close(f->fd);
+			level--;
+			if (post) {
+				struct cgfs_walk_frame *up = level ? &frames[level - 1] : NULL;
+
+				if (post(data, wpath, up ? up->fd : -1,
+						up ? wpath + up->pathlen + 1 : wpath,
+						depth + level) < 0)
+					failed++;
+			}
+			if (level)
+				wpath[frames[level - 1].pathlen] = '\0';
+			continue;
+		}
+
+		de = (struct cgm_dirent64 *)(f->buf + f->pos);
+		f->pos += de->d_reclen;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (skip_leaf && !strcmp(de->d_name, U_LEAF_NAME))
+			continue;
+
+		type = de->d_type;
+		if (type == DT_UNKNOWN) {
+			struct stat sb;
+
+			if (fstatat(f->fd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+				failed++;
+				continue;
+			}
+			type = S_ISDIR(sb.st_mode) ? DT_DIR : DT_REG;
+		}
+		if (type != DT_DIR)
+			continue;
+
+		namelen = strlen(de->d_name);
+		if (f->pathlen + 1 + namelen >= MAXPATHLEN) {
+			failed++;
+			continue;
+		}
+		wpath[f->pathlen] = '/';
+		memcpy(wpath + f->pathlen + 1, de->d_name, namelen + 1);
+
+		if (pre && (ret = pre(data, wpath, f->fd, de->d_name,
+					depth + level)) != 0) {
+			if (ret != CGFS_WALK_SKIP)
+				failed++;
+			else {
+				wpath[f->pathlen] = '\0';
+				continue;
+			}
+		}
+		fd = openat(f->fd, de->d_name,
+			    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0) {
+			failed++;
+			wpath[f->pathlen] = '\0';
+			continue;
+		}
+		/* this may move frames, so f is not used again */
+		cgfs_walk_push(&frames, &alloced, level++, fd,
+			       f->pathlen + 1 + namelen);
+	}
+
+	return failed;
+}
+
+int cgfs_mkdir(const char *path, mode_t mode)
+{
+	char leaf[NAME_MAX+1];
+	struct fd_cache_entry *dir;
+	int ret, saved_errno;
+
+	if ((dir = cgfs_parent(path, leaf)) == NULL)
+		return -1;
+	ret = mkdirat(dir->fd, leaf, mode);
+	saved_errno = errno;
+	fd_cache_put(dir);
+	if (ret == 0)
+		mirror_refresh(path, false);
+	errno = saved_errno;
+	return ret;
+}
+
+int cgfs_rmdir(const char *path)
+{
+	char leaf[NAME_MAX+1];
+	struct fd_cache_entry *dir;
+	int ret, saved_errno;
+
+	if ((dir = cgfs_parent(path, leaf)) == NULL)
+		return -1;
+	ret = unlinkat(dir->fd, leaf, AT_REMOVEDIR);
+	saved_errno = errno;
+	fd_cache_put(dir);
+	if (ret == 0) {
+		fd_caches_invalidate(path);
+		mirror_refresh(path, false);
+	}
+	errno = saved_errno;
+	return ret;
+}
+
+/*
+ * Rename the directory @path to @newname in the same parent, which is
+ * all that cgroupfs allows.  It fails with EEXIST if @newname exists.
+ */
+int cgfs_rename(const char *path, const char *newname)
+{
+	char leaf[NAME_MAX+1], newpath[MAXPATHLEN], *p;
+	struct fd_cache_entry *dir;
+	int ret, saved_errno;
+
+	if ((dir = cgfs_parent(path, leaf)) == NULL)
+		return -1;
+	ret = renameat(dir->fd, leaf, dir->fd, newname);
+	saved_errno = errno;
+	fd_cache_put(dir);
+	if (ret == 0) {
+		/* cached handles follow the directory to its new name */
+		fd_caches_invalidate(path);
+		mirror_refresh(path, false);
+		strncpy(newpath, path, MAXPATHLEN - 1);
+		newpath[MAXPATHLEN - 1] = '\0';
+		if ((p = strrchr(newpath, '/')) != NULL &&
+				snprintf(p + 1, MAXPATHLEN - (p + 1 - newpath),
+					 "%s", newname) < MAXPATHLEN - (p + 1 - newpath))
+			mirror_refresh(newpath, true);
+	}
+	errno = saved_errno;
+	return ret;
+}
+
+/*
+ * Like realpath(3), but let the kernel resolve @path in one go and read
+ * the result back from /proc rather than looking at each component in
+ * turn.  @resolved must hold MAXPATHLEN bytes.
+ */
+bool cgfs_realpath(const char *path, char *resolved)
+{
+	int fd;
+	bool ret;
+
+	if ((fd = cgfs_open(path, O_PATH)) < 0)
+		return false;
+	ret = fd_path(fd, resolved);
+	close(fd);
+	if (!ret)  // no /proc?
+		return realpath(path, resolved) != NULL;
+	return true;
+}
+
+bool file_exists(const char *path)
+{
+	struct stat sb;
+	if (cgfs_stat(path, &sb) < 0)
+		return false;
+	return true;
+}
+
+bool dir_exists(const char *path)
+{
+	struct stat sb;
+	if (cgfs_stat(path, &sb) < 0 || !S_ISDIR(sb.st_mode))
+		return false;
+	return true;
+}
+
+/*
+ * In-memory mirror of the mounted hierarchies (--mirror).  ListChildren,
+ * ListKeys and the stat behind every access check are answered from a
+ * tree of the cgroup directories, holding the owner and mode of each
+ * directory and of each file in it, rather than from cgroupfs.
+ *
+ * The tree is read at startup, and kept up to date by an inotify watch
+ * on each directory for IN_CREATE, IN_DELETE, IN_MOVED_* and IN_ATTRIB.
+ * On the unified hierarchy enabling a controller adds files to the
+ * children without any such event, so each cgroup.subtree_control is
+ * watched for IN_MODIFY too.  cgmanager's own mkdir, rmdir, chown and
+ * chmod update the tree at once, so that a request sees its own
+ * changes.  Changes made by others are only seen once the main loop has
+ * read their events, so only hits are trusted: a path which is not in
+ * the tree is looked up in cgroupfs.  A directory we could not watch is
+ * left out, and its parent marked incomplete so that it is listed from
+ * cgroupfs.
+ *
+ * MirrorResync reads every directory again, repairs the tree and
+ * returns the number of differences it found, which should be 0 unless
+ * events are still queued.  An inotify queue overflow does the same.
+ *
+ * The main loop and the worker threads share the tree under
+ * mirror_lock; hit and miss counts are kept under mirror_stats_lock so
+ * that readers need not take it for writing.
+ */
+struct mirror_key {
+	char *name;
+	uid_t uid;
+	gid_t gid;
+	mode_t mode;
+};
+
+struct mirror_dir {
+	NihList entry;			// in parent->children, keyed by name
+	char *name;
+	char *path;
+	struct mirror_dir *parent;
+	NihHash *children;
+	struct mirror_key *keys;	// sorted by name
+	size_t nr_keys;
+	uid_t uid;
+	gid_t gid;
+	mode_t mode;
+	bool unified;
+	bool complete;			// are all subdirectories mirrored?
+	bool seen;			// by mirror_scan() of the parent
+	struct mirror_watch *watch, *ctl_watch;
+};
+
+/* An inotify watch on a directory, or on its cgroup.subtree_control */
+struct mirror_watch {
+	NihList entry;			// in mirror_watches, keyed by wd
+	int wd;
+	struct mirror_dir *dir;
+};
+
+/* A mount point, by the path requests use; comounts share a tree */
+struct mirror_root {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	struct mirror_dir *dir;
+};
+
+#define MIRROR_DIR_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+		IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR)
+
+static bool mirror_on;
+static pthread_rwlock_t mirror_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct mirror_root *mirror_roots;
+static int nr_mirror_roots;
+static NihHash *mirror_watches;  // by wd
+static int mirror_ifd = -1;
+static NihIo *mirror_io;
+static unsigned long mirror_events, mirror_overflows, mirror_resyncs,
+	mirror_differences;
+static pthread_mutex_t mirror_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long mirror_hits, mirror_misses;
+
+static const void *mirror_watch_key(NihList *list)
+{
+	return &((struct mirror_watch *)list)->wd;
+}
+
+static uint32_t mirror_wd_hash(const int *wd)
+{
+	return (uint32_t)*wd;
+}
+
+static int mirror_wd_cmp(const int *wd1, const int *wd2)
+{
+	return *wd1 - *wd2;
+}
+
+static int mirror_watch_destroy(struct mirror_watch *w)
+{
+	/* the watch may already be gone (IN_IGNORED), so ignore errors */
+	inotify_rm_watch(mirror_ifd, w->wd);
+	nih_list_destroy(&w->entry);
+	return 0;
+}
+
+static int mirror_dir_destroy(struct mirror_dir *d)
+{
+	nih_list_destroy(&d->entry);
+	return 0;
+}
+
+static struct mirror_watch *mirror_watch_add(struct mirror_dir *d,
+		const char *path, uint32_t mask)
+{
+	struct mirror_watch *w;
+	int wd;
+
+	wd = inotify_add_watch(mirror_ifd, path, mask);
+	if (wd < 0) {
+		nih_warn("%s: Failed to watch %s: %s", __func__, path,
+			 strerror(errno));
+		return NULL;
+	}
+	/* i.e. the same hierarchy reached through two paths */
+	if (nih_hash_lookup(mirror_watches, &wd))
+		return NULL;
+
+	w = NIH_MUST( nih_new(d, struct mirror_watch) );
+	nih_list_init(&w->entry);
+	w->wd = wd;
+	w->dir = d;
+	nih_alloc_set_destructor(w, mirror_watch_destroy);
+	nih_hash_add(mirror_watches, &w->entry);
+	return w;
+}
+
+/*
+ * Add directory @name under @parent (or a root if @parent is NULL) and
+ * start watching it.  It is empty until mirror_scan() reads it.
+ */
+static struct mirror_dir *mirror_dir_new(struct mirror_dir *parent,
+		const char *name, const char *path, bool unified)
+{
+	struct mirror_dir *d;
+	nih_local char *ctlpath = NULL;
+
+	d = NIH_MUST( nih_new(parent, struct mirror_dir) );
+	nih_list_init(&d->entry);
+	d->name = NIH_MUST( nih_strdup(d, name) );
+	d->path = NIH_MUST( nih_strdup(d, path) );
+	d->parent = parent;
+	d->children = NIH_MUST( nih_hash_string_new(d, 0) );
+	d->keys = NULL;
+	d->nr_keys = 0;
+	d->uid = -1;
+	d->gid = -1;
+	d->mode = 0;
+	d->unified = unified;
+	d->complete = true;
+	d->seen = true;
+	d->ctl_watch = NULL;
+	nih_alloc_set_destructor(d, mirror_dir_destroy);
+
+	d->watch = mirror_watch_add(d, path, MIRROR_DIR_EVENTS);
+	if (!d->watch) {
+		nih_free(d);
+		return NULL;
+	}
+	if (unified) {
+		ctlpath = NIH_MUST( nih_sprintf(NULL, "%s/cgroup.subtree_control",
+					path) );
+		d->ctl_watch = mirror_watch_add(d, ctlpath, IN_MODIFY);
+	}
+
+	if (parent)
+		nih_hash_add(parent->children, &d->entry);
+	return d;
+}
+
+static int mirror_key_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct mirror_key *)a)->name,
+		      ((const struct mirror_key *)b)->name);
+}
+
+static struct mirror_key *mirror_key_find(struct mirror_dir *d,
+		const char *name)
+{
+	struct mirror_key k = { .name = (char *)name };
+
+	return bsearch(&k, d->keys, d->nr_keys, sizeof(k), mirror_key_cmp);
+}
+
+static void mirror_key_set(struct mirror_key *k, const struct stat *sb)
+{
+	k->uid = sb->st_uid;
+	k->gid = sb->st_gid;
+	k->mode = sb->st_mode;
+}
+
+/* Bring file @name in @d up to date, given its @sb, or NULL if gone */
+static void mirror_key_update(struct mirror_dir *d, const char *name,
+		const struct stat *sb)
+{
+	struct mirror_key *k = mirror_key_find(d, name);
+
+	if (!sb || !S_ISREG(sb->st_mode)) {
+		if (k) {
+			nih_free(k->name);
+			memmove(k, k + 1, (d->keys + d->nr_keys - (k + 1)) *
+					sizeof(*k));
+			d->nr_keys--;
+		}
+		return;
+	}
+
+	if (!k) {
+		d->keys = NIH_MUST( nih_realloc(d->keys, d,
+				(d->nr_keys + 1) * sizeof(*k)) );
+		k = &d->keys[d->nr_keys++];
+		k->name = NIH_MUST( nih_strdup(d->keys, name) );
+		mirror_key_set(k, sb);
+		qsort(d->keys, d->nr_keys, sizeof(*k), mirror_key_cmp);
+		return;
+	}
+	mirror_key_set(k, sb);
+}
+
+static bool mirror_attrs_differ(uid_t uid, gid_t gid, mode_t mode,
+		const struct stat *sb)
+{
+	return uid != sb->st_uid || gid != sb->st_gid || mode != sb->st_mode;
+}
+
+/*
+ * Read the owner, mode, files and subdirectories of @d from cgroupfs,
+ * adding subdirectories which are new and dropping those which are
+ * gone.  Subdirectories already mirrored are only read again if @deep.
+ * Returns the number of differences found, or -1 if @d itself is gone.
+ * Called with mirror_lock held for writing.
+ */
+static int mirror_scan(struct mirror_dir *d, bool deep)
+{
+	struct dirent dirent, *direntp;
+	struct mirror_key *keys = NULL;
+	size_t nr_keys = 0, i;
+	struct stat sb;
+	DIR *dir;
+	int fd, diffs = 0, ret;
+
+	fd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &sb) < 0 || (dir = fdopendir(fd)) == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	if (mirror_attrs_differ(d->uid, d->gid, d->mode, &sb))
+		diffs++;
+	d->uid = sb.st_uid;
+	d->gid = sb.st_gid;
+	d->mode = sb.st_mode;
+
+	d->complete = true;
+	NIH_HASH_FOREACH(d->children, iter)
+		((struct mirror_dir *)iter)->seen = false;
+
+	while (readdir_r(dir, &dirent, &direntp) == 0 && direntp) {
+		struct mirror_dir *child;
+		nih_local char *path = NULL;
+
+		if (!strcmp(direntp->d_name, ".") || !strcmp(direntp->d_name, ".."))
+			continue;
+
+		if (direntp->d_type == DT_REG) {
+			if (fstatat(dirfd(dir), direntp->d_name, &sb, 0) < 0)
+				continue;
+			keys = NIH_MUST( nih_realloc(keys, d,
+					(nr_keys + 1) * sizeof(*keys)) );
+			keys[nr_keys].name = NIH_MUST( nih_strdup(keys,
+						direntp->d_name) );
+			mirror_key_set(&keys[nr_keys++], &sb);
+			continue;
+		}
+		if (direntp->d_type != DT_DIR)
+			continue;
+
+		child = (struct mirror_dir *)nih_hash_lookup(d->children,
+							    direntp->d_name);
+		if (child) {
+			child->seen = true;
+			if (!deep)
+				continue;
+			ret = mirror_scan(child, true);
+			if (ret >= 0) {
+				diffs += ret;
+				continue;
+			}
+			nih_free(child);
+			diffs++;
+			continue;
+		}
+
+		diffs++;
+		path = NIH_MUST( nih_sprintf(NULL, "%s/%s", d->path,
+					direntp->d_name) );
+		child = mirror_dir_new(d, direntp->d_name, path, d->unified);
+		if (child && mirror_scan(child, true) < 0) {
+			nih_free(child);
+			child = NULL;
+		}
+		if (!child)
+			d->complete = false;
+	}
+	closedir(dir);
+
+	NIH_HASH_FOREACH_SAFE(d->children, iter) {
+		struct mirror_dir *child = (struct mirror_dir *)iter;
+
+		if (!child->seen) {
+			nih_free(child);
+			diffs++;
+		}
+	}
+
+	if (nr_keys)
+		qsort(keys, nr_keys, sizeof(*keys), mirror_key_cmp);
+	if (nr_keys != d->nr_keys) {
+		diffs++;
+	} else {
+		for (i = 0; i < nr_keys; i++) {
+			if (strcmp(keys[i].name, d->keys[i].name) != 0 ||
+					keys[i].uid != d->keys[i].uid ||
+					keys[i].gid != d->keys[i].gid ||
+					keys[i].mode != d->keys[i].mode) {
+				diffs++;
+				break;
+			}
+		}
+	}
+	if (d->keys)
+		nih_free(d->keys);
+	d->keys = keys;
+	d->nr_keys = nr_keys;
+
+	return diffs;
+}
+
+/*
+ * Find the mirror of directory @path, or NULL if it is not mirrored.
+ * Called with mirror_lock held.
+ */
+static struct mirror_dir *mirror_lookup(const char *path)
+{
+	char npath[MAXPATHLEN], *tok, *save;
+	struct mirror_dir *d = NULL;
+	size_t len = 0;
+	int i;
+
+	if (!cgfs_normalize(path, npath))
+		return NULL;
+
+	for (i = 0; i < nr_mirror_roots; i++) {
+		len = strlen(mirror_roots[i].path);
+		if (strncmp(npath, mirror_roots[i].path, len) == 0 &&
+				(npath[len] == '\0' || npath[len] == '/')) {
+			d = mirror_roots[i].dir;
+			break;
+		}
+	}
+	if (!d)
+		return NULL;
+
+	for (tok = strtok_r(npath + len, "/", &save); tok && d;
+			tok = strtok_r(NULL, "/", &save)) {
+		if (strcmp(tok, ".") == 0)
+			continue;
+		if (strcmp(tok, "..") == 0)  // leave that to the kernel
+			return NULL;
+		d = (struct mirror_dir *)nih_hash_lookup(d->children, tok);
+	}
+	return d;
+}
+
+/*
+ * Split @path into its directory, which is returned in @dir (MAXPATHLEN
+ * bytes), and its last component, which is returned.
+ */
+static char *mirror_split(const char *path, char *dir)
+{
+	char *leaf;
+
+	if (!cgfs_normalize(path, dir) || (leaf = strrchr(dir, '/')) == NULL ||
+			leaf == dir)
+		return NULL;
+	*leaf++ = '\0';
+	return leaf;
+}
+
+static void mirror_count(bool hit)
+{
+	pthread_mutex_lock(&mirror_stats_lock);
+	if (hit)
+		mirror_hits++;
+	else
+		mirror_misses++;
+	pthread_mutex_unlock(&mirror_stats_lock);
+}
+
+/*
+ * Fill in the owner and mode of @path in @sb if it is mirrored.  Only
+ * those fields are set, which is all the callers of cgfs_stat() use.
+ */
+static bool mirror_stat(const char *path, struct stat *sb)
+{
+	char dir[MAXPATHLEN], *leaf;
+	struct mirror_dir *d;
+	struct mirror_key *k;
+	bool found = false;
+
+	if (!mirror_on)
+		return false;
+
+	pthread_rwlock_rdlock(&mirror_lock);
+	if ((d = mirror_lookup(path)) != NULL) {
+		memset(sb, 0, sizeof(*sb));
+		sb->st_uid = d->uid;
+		sb->st_gid = d->gid;
+		sb->st_mode = d->mode;
+		found = true;
+	} else if ((leaf = mirror_split(path, dir)) != NULL &&
+			(d = mirror_lookup(dir)) != NULL &&
+			(k = mirror_key_find(d, leaf)) != NULL) {
+		memset(sb, 0, sizeof(*sb));
+		sb->st_uid = k->uid;
+		sb->st_gid = k->gid;
+		sb->st_mode = k->mode;
+		found = true;
+	}
+	pthread_rwlock_unlock(&mirror_lock);
+
+	mirror_count(found);
+	return found;
+}
+
+/*
+ * Entry @name in @d was created, removed or changed.  Called with
+ * mirror_lock held for writing.
+ */
+static void mirror_entry_changed(struct mirror_dir *d, const char *name,
+		bool contents)
+{
+	nih_local char *path = NULL;
+	struct mirror_dir *child;
+	struct stat sb;
+
+	path = NIH_MUST( nih_sprintf(NULL, "%s/%s", d->path, name) );
+	child = (struct mirror_dir *)nih_hash_lookup(d->children, name);
+
+	if (stat(path, &sb) < 0) {
+		if (child)
+			nih_free(child);
+		mirror_key_update(d, name, NULL);
+		return;
+	}
+	if (!S_ISDIR(sb.st_mode)) {
+		mirror_key_update(d, name, &sb);
+		return;
+	}
+
+	if (!child) {
+		child = mirror_dir_new(d, name, path, d->unified);
+		if (child && mirror_scan(child, true) < 0) {
+			nih_free(child);
+			child = NULL;
+		}
+		if (!child)
+			d->complete = false;
+		return;
+	}
+
+	if (contents && mirror_scan(child, false) < 0) {
+		nih_free(child);
+		return;
+	}
+	child->uid = sb.st_uid;
+	child->gid = sb.st_gid;
+	child->mode = sb.st_mode;
+}
+
+/*
+ * Bring the mirror of @path, and the files in it if @contents, up to
+ * date after we changed it ourselves, rather than waiting for inotify.
+ */
+static void mirror_refresh(const char *path, bool contents)
+{
+	char dir[MAXPATHLEN], *leaf;
+	struct mirror_dir *d;
+
+	if (!mirror_on || (leaf = mirror_split(path, dir)) == NULL)
+		return;
+
+	pthread_rwlock_wrlock(&mirror_lock);
+	if ((d = mirror_lookup(dir)) != NULL)
+		mirror_entry_changed(d, leaf, contents);
+	pthread_rwlock_unlock(&mirror_lock);
+}
+
+/* Controllers were enabled or disabled for the children of @d */
+static void mirror_subtree_changed(struct mirror_dir *d)
+{
+	NIH_HASH_FOREACH_SAFE(d->children, iter) {
+		struct mirror_dir *child = (struct mirror_dir *)iter;
+
+		if (mirror_scan(child, false) < 0)
+			nih_free(child);
+	}
+}
+
+/* We wrote @path, which may be a cgroup.subtree_control */
+static void mirror_file_written(const char *path)
+{
+	char dir[MAXPATHLEN], *leaf;
+	struct mirror_dir *d;
+
+	if (!mirror_on || (leaf = mirror_split(path, dir)) == NULL ||
+			strcmp(leaf, "cgroup.subtree_control") != 0)
+		return;
+
+	pthread_rwlock_wrlock(&mirror_lock);
+	if ((d = mirror_lookup(dir)) != NULL)
+		mirror_subtree_changed(d);
+	pthread_rwlock_unlock(&mirror_lock);
+}
+
+/* Called with mirror_lock held for writing */
+static int mirror_resync_locked(void)
+{
+	int i, j, ret, diffs = 0;
+
+	for (i = 0; i < nr_mirror_roots; i++) {
+		for (j = 0; j < i; j++)
+			if (mirror_roots[j].dir == mirror_roots[i].dir)
+				break;
+		if (j < i)
+			continue;
+		ret = mirror_scan(mirror_roots[i].dir, true);
+		if (ret > 0)
+			diffs += ret;
+	}
+	mirror_resyncs++;
+	mirror_differences += diffs;
+	return diffs;
+}
+
+/*
+ * Compare the whole mirror against cgroupfs and repair it.  Returns
+ * the number of differences found, or -1 if the mirror is off.
+ */
+int mirror_resync(void)
+{
+	int diffs;
+
+	if (!mirror_on) {
+		nih_error("%s: the hierarchy mirror is not enabled", __func__);
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&mirror_lock);
+	diffs = mirror_resync_locked();
+	pthread_rwlock_unlock(&mirror_lock);
+
+	if (diffs)
+		nih_info(_("Hierarchy mirror had %d differences"), diffs);
+	return diffs;
+}
+
+static void mirror_event(struct inotify_event *event)
+{
+	struct mirror_watch *w;
+	struct mirror_dir *d;
+	struct stat sb;
+
+	mirror_events++;
+	if (event->mask & IN_Q_OVERFLOW) {
+		nih_warn("%s: inotify queue overflowed, resyncing", __func__);
+		mirror_overflows++;
+		mirror_resync_locked();
+		return;
+	}
+
+	w = (struct mirror_watch *)nih_hash_lookup(mirror_watches, &event->wd);
+	if (!w)
+		return;  // i.e. IN_IGNORED after we removed the watch
+	d = w->dir;
+
+	if (w == d->ctl_watch) {
+		if (event->mask & IN_IGNORED) {
+			d->ctl_watch = NULL;
+			nih_free(w);
+		} else if (event->mask & IN_MODIFY) {
+			mirror_subtree_changed(d);
+		}
+		return;
+	}
+
+	if (event->mask & IN_IGNORED) {
+		/* the directory is gone */
+		d->watch = NULL;
+		nih_free(w);
+		if (d->parent)
+			nih_free(d);
+		return;
+	}
+
+	if (event->len) {
+		/* a directory's own watch tells us about its attributes */
+		if (!(event->mask & IN_ISDIR && event->mask & IN_ATTRIB))
+			mirror_entry_changed(d, event->name, false);
+		return;
+	}
+
+	if (event->mask & IN_ATTRIB && stat(d->path, &sb) == 0) {
+		d->uid = sb.st_uid;
+		d->gid = sb.st_gid;
+		d->mode = sb.st_mode;
+	}
+}
+
+static void mirror_inotify_read(void *data, NihIo *io, const char *buf,
+				size_t len)
+{
+	struct inotify_event *event;
+
+	pthread_rwlock_wrlock(&mirror_lock);
+	while (len >= sizeof(*event)) {
+		size_t esize;
+
+		event = (struct inotify_event *)buf;
+		esize = sizeof(*event) + event->len;
+		if (len < esize)
+			break;
+
+		mirror_event(event);
+
+		/* buf points into recv_buf, which this shrinks */
+		nih_io_buffer_shrink(io->recv_buf, esize);
+		len -= esize;
+	}
+	pthread_rwlock_unlock(&mirror_lock);
+}
 
 /*
- * the controller_mnts is an array of the mounts to export as the controller
- * list.  If freezer and devices are comounted, then they will form one
- * entry "freezer,devices"
+ * Read the mounted hierarchies into the mirror, and start answering
+ * from it.  Called once the cgroup mounts are final.
  */
-static int num_controller_mnts;
-static char **controller_mnts;
+bool setup_mirror(void)
+{
+	int i, j;
 
-static char *base_path;
+	mirror_watches = NIH_MUST( nih_hash_new(NULL, 0, mirror_watch_key,
+				(NihHashFunction)mirror_wd_hash,
+				(NihCmpFunction)mirror_wd_cmp) );
 
-bool file_exists(const char *path)
-{
-	struct stat sb;
-	if (stat(path, &sb) < 0)
+	mirror_ifd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (mirror_ifd < 0) {
+		nih_error("%s: Failed to init inotify: %s", __func__,
+			  strerror(errno));
+		return false;
+	}
+	mirror_io = nih_io_reopen(NULL, mirror_ifd, NIH_IO_STREAM,
+				  mirror_inotify_read, NULL, NULL, NULL);
+	if (!mirror_io) {
+		NihError *err = nih_error_get();
+		nih_error("%s: Failed to add IO for inotify: %s", __func__,
+			  err->message);
+		nih_free(err);
+		close(mirror_ifd);
+		mirror_ifd = -1;
 		return false;
+	}
+
+	for (i = 0; i < num_controllers; i++) {
+		struct controller_mounts *m = &all_mounts[i];
+		char path[MAXPATHLEN];
+		struct mirror_dir *d = NULL;
+		struct stat sb;
+
+		if (m->skip || !m->path || !cgfs_normalize(m->path, path) ||
+				stat(path, &sb) < 0)
+			continue;
+
+		for (j = 0; j < nr_mirror_roots; j++) {
+			if (strcmp(mirror_roots[j].path, path) == 0)
+				break;
+			if (mirror_roots[j].dev == sb.st_dev &&
+					mirror_roots[j].ino == sb.st_ino)
+				d = mirror_roots[j].dir;
+		}
+		if (j < nr_mirror_roots)
+			continue;
+
+		if (!d) {
+			d = mirror_dir_new(NULL, path, path, m->unified);
+			if (d && mirror_scan(d, true) < 0) {
+				nih_free(d);
+				d = NULL;
+			}
+			if (!d) {
+				nih_warn("%s: Not mirroring %s", __func__, path);
+				continue;
+			}
+		}
+
+		mirror_roots = NIH_MUST( nih_realloc(mirror_roots, NULL,
+				(nr_mirror_roots + 1) * sizeof(*mirror_roots)) );
+		mirror_roots[nr_mirror_roots].path = NIH_MUST( nih_strdup(
+					mirror_roots, path) );
+		mirror_roots[nr_mirror_roots].dev = sb.st_dev;
+		mirror_roots[nr_mirror_roots].ino = sb.st_ino;
+		mirror_roots[nr_mirror_roots].dir = d;
+		nr_mirror_roots++;
+	}
+
+	mirror_on = true;
 	return true;
 }
 
-bool dir_exists(const char *path)
+/*
+ * Answer ListChildren for @path from the mirror.  Returns -1 if it is
+ * not mirrored, or not completely.
+ */
+static int mirror_children(void *parent, const char *path, char ***output)
 {
-	struct stat sb;
-	if (stat(path, &sb) < 0 || !S_ISDIR(sb.st_mode))
-		return false;
-	return true;
+	struct mirror_dir *d;
+	int used = 0;
+
+	if (!mirror_on)
+		return -1;
+
+	pthread_rwlock_rdlock(&mirror_lock);
+	d = mirror_lookup(path);
+	if (!d || !d->complete) {
+		pthread_rwlock_unlock(&mirror_lock);
+		mirror_count(false);
+		return -1;
+	}
+
+	NIH_HASH_FOREACH(d->children, iter)
+		used++;
+	*output = NIH_MUST( nih_alloc(parent, (used + 1) * sizeof(char *)) );
+	used = 0;
+	NIH_HASH_FOREACH(d->children, iter) {
+		struct mirror_dir *child = (struct mirror_dir *)iter;
+
+		if (!strcmp(child->name, U_LEAF_NAME) ||
+				!strncmp(child->name, POOL_PREFIX, strlen(POOL_PREFIX)))
+			continue;
+		(*output)[used++] = NIH_MUST( nih_strdup(parent, child->name) );
+	}
+	(*output)[used] = NULL;
+	pthread_rwlock_unlock(&mirror_lock);
+
+	mirror_count(true);
+	return used;
+}
+
+/* Answer ListKeys for @path from the mirror, or return -1 */
+static int mirror_contents(void *parent, const char *path,
+		struct keys_return_type ***output)
+{
+	struct mirror_dir *d;
+	size_t i;
+
+	if (!mirror_on)
+		return -1;
+
+	pthread_rwlock_rdlock(&mirror_lock);
+	d = mirror_lookup(path);
+	if (!d) {
+		pthread_rwlock_unlock(&mirror_lock);
+		mirror_count(false);
+		return -1;
+	}
+
+	*output = NIH_MUST( nih_alloc(parent, (d->nr_keys + 1) *
+				sizeof(**output)) );
+	for (i = 0; i < d->nr_keys; i++) {
+		struct keys_return_type *tmp;
+
+		(*output)[i] = tmp = NIH_MUST( nih_new(*output,
+					struct keys_return_type) );
+		tmp->name = NIH_MUST( nih_strdup(tmp, d->keys[i].name) );
+		tmp->uid = d->keys[i].uid;
+		tmp->gid = d->keys[i].gid;
+		tmp->perms = (uint32_t) d->keys[i].mode;
+	}
+	(*output)[i] = NULL;
+	pthread_rwlock_unlock(&mirror_lock);
+
+	mirror_count(true);
+	return i;
+}
+
+/* Add up the directories, files and (roughly) bytes of @d and below */
+static void mirror_dir_usage(struct mirror_dir *d, unsigned long *dirs,
+		unsigned long *keys, unsigned long *bytes)
+{
+	size_t i;
+
+	(*dirs)++;
+	*keys += d->nr_keys;
+	*bytes += sizeof(*d) + strlen(d->name) + strlen(d->path) + 2 +
+		sizeof(struct mirror_watch) * (d->ctl_watch ? 2 : 1) +
+		d->nr_keys * sizeof(struct mirror_key);
+	for (i = 0; i < d->nr_keys; i++)
+		*bytes += strlen(d->keys[i].name) + 1;
+
+	NIH_HASH_FOREACH(d->children, iter)
+		mirror_dir_usage((struct mirror_dir *)iter, dirs, keys, bytes);
+}
+
+void mirror_get_stats(void *parent, char ***output, size_t *len)
+{
+	unsigned long dirs = 0, keys = 0, bytes = 0, hits, misses;
+	int i, j;
+
+	if (!mirror_on)
+		return;
+
+	pthread_mutex_lock(&mirror_stats_lock);
+	hits = mirror_hits;
+	misses = mirror_misses;
+	pthread_mutex_unlock(&mirror_stats_lock);
+
+	pthread_rwlock_rdlock(&mirror_lock);
+	for (i = 0; i < nr_mirror_roots; i++) {
+		for (j = 0; j < i; j++)
+			if (mirror_roots[j].dir == mirror_roots[i].dir)
+				break;
+		if (j == i)
+			mirror_dir_usage(mirror_roots[i].dir, &dirs, &keys, &bytes);
+	}
+	add_stat(parent, output, len, "mirror_dirs", dirs);
+	add_stat(parent, output, len, "mirror_keys", keys);
+	add_stat(parent, output, len, "mirror_bytes", bytes);
+	add_stat(parent, output, len, "mirror_events", mirror_events);
+	add_stat(parent, output, len, "mirror_overflows", mirror_overflows);
+	add_stat(parent, output, len, "mirror_resyncs", mirror_resyncs);
+	add_stat(parent, output, len, "mirror_differences", mirror_differences);
+	pthread_rwlock_unlock(&mirror_lock);
+
+	add_stat(parent, output, len, "mirror_hits", hits);
+	add_stat(parent, output, len, "mirror_misses", misses);
 }
 
 char *allow_autoremove_premounted;
@@ -123,7 +1700,7 @@ int autoremove_premounted_set_release_agent = FALSE;
 bool premounted_should_allow_autoremove(const char *controller)
 {
 	nih_local char *allowed = NULL;
-	char *ctrl;
+	char *ctrl, *saveptr = NULL;
 
 	if (allow_autoremove_premounted == NULL)
 		return false;
@@ -134,8 +1711,8 @@ bool premounted_should_allow_autoremove(const char *controller)
 	allowed = NIH_MUST( nih_strdup(NULL, allow_autoremove_premounted) );
 
 	nih_assert(controller != NULL);
-	for (ctrl = strtok(allowed, ","); ctrl != NULL;
-	     ctrl = strtok(NULL, ","))
+	for (ctrl = strtok_r(allowed, ",", &saveptr); ctrl != NULL;
+	     ctrl = strtok_r(NULL, ",", &saveptr))
 		if (strcmp(controller, ctrl) == 0)
 			return true;
 
@@ -264,6 +1841,60 @@ static int find_controller_in_mounts(const char *c, bool *found)
 	return mid;
 }
 
+static void controller_index_add(const char *name, struct controller_mounts *m)
+{
+	struct controller_index_entry *e;
+
+	if (nih_hash_lookup(controller_index, name))
+		return;
+	e = NIH_MUST( nih_new(controller_index, struct controller_index_entry) );
+	nih_list_init(&e->entry);
+	e->name = NIH_MUST( nih_strdup(e, name) );
+	e->m = m;
+	nih_hash_add(controller_index, &e->entry);
+}
+
+static void build_controller_index(void)
+{
+	int i;
+
+	if (controller_index)
+		nih_free(controller_index);
+	controller_index = NIH_MUST( nih_hash_string_new(NULL, num_controllers * 2) );
+
+	for (i = 0; i < num_controllers; i++) {
+		nih_local char *alias = NULL;
+
+		controller_index_add(all_mounts[i].controller, &all_mounts[i]);
+		if (strncmp(all_mounts[i].controller, "name=", 5) == 0)
+			continue;
+		alias = NIH_MUST( nih_sprintf(NULL, "name=%s", all_mounts[i].controller) );
+		controller_index_add(alias, &all_mounts[i]);
+	}
+}
+
+/*
+ * Find the controller_mounts for @c, which may carry a "name=" prefix.
+ * Until the index is built (i.e. while collect_subsystems() is still
+ * filling in all_mounts) fall back to searching all_mounts directly.
+ */
+static struct controller_mounts *lookup_controller(const char *c)
+{
+	struct controller_index_entry *e;
+	bool found;
+	int i;
+
+	if (controller_index) {
+		e = (struct controller_index_entry *)nih_hash_lookup(controller_index, c);
+		return e ? e->m : NULL;
+	}
+
+	i = find_controller_in_mounts(c, &found);
+	if (!found && strncmp(c, "name=", 5) == 0)
+		i = find_controller_in_mounts(c+5, &found);
+	return found ? &all_mounts[i] : NULL;
+}
+
 static bool fill_in_controller(struct controller_mounts *m, char *controller,
 			char *src)
 {
@@ -1176,6 +2807,7 @@ int collect_subsystems(char *extra_mounts, char *skip_mounts)
 	build_all_controllers(skip_mounts);
 
 	build_controller_mntlist();
+	build_controller_index();
 	print_debug_controller_info();
 
 	return 0;
@@ -1348,6 +2980,9 @@ int setup_cgroup_mounts(void)
 		}
 	}
 
+	/* handles opened before the pivot no longer name the same paths */
+	fd_caches_flush();
+
 	return 0;
 }
 
@@ -1382,63 +3017,274 @@ bool create_agent_symlinks(void)
 		      autoremove_premounted_set_release_agent))
 			continue;
 
-		ret = snprintf(buf+plen, MAXPATHLEN-plen, "cgm-release-agent.%s",
-				all_mounts[i].controller);
-		if (ret < 0 || ret >= MAXPATHLEN) {
-			nih_error("path names too long");
-			return false;
-		}
-		nih_info("buf is %s", buf);
-		if (!file_exists(buf)) {
-			unlink(buf); // in case link dest moved
-			if (symlink(AGENT, buf) < 0) {
-				nih_error("failed to create release agent for %s",
-					all_mounts[i].controller);
-				return false;
-			}
-		}
-		if ((all_mounts[i].agent = strdup(buf)) == NULL) {
-			nih_error("out of memory");
-			return false;
-		}
-	}
+		ret = snprintf(buf+plen, MAXPATHLEN-plen, "cgm-release-agent.%s",
+				all_mounts[i].controller);
+		if (ret < 0 || ret >= MAXPATHLEN) {
+			nih_error("path names too long");
+			return false;
+		}
+		nih_info("buf is %s", buf);
+		if (!file_exists(buf)) {
+			unlink(buf); // in case link dest moved
+			if (symlink(AGENT, buf) < 0) {
+				nih_error("failed to create release agent for %s",
+					all_mounts[i].controller);
+				return false;
+			}
+		}
+		if ((all_mounts[i].agent = strdup(buf)) == NULL) {
+			nih_error("out of memory");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * The user will pass in 'cpuset' or 'systemd'.  /proc/self/cgroup will
+ * show 'cpuset:' or 'name=systemd:'.  We have to account for that.
+ */
+static bool is_same_controller(const char *cmp, const char *cnt)
+{
+	if (strcmp(cmp, cnt) == 0)
+		return true;
+	if (strncmp(cmp, "name=", 5) != 0)
+		return false;
+	if (strcmp(cmp+5, cnt) == 0)
+		return true;
+	return false;
+}
+
+/*
+ * In unified hierarchy tasks must be in a leaf node.  Cgmanager
+ * creates .cgm_leaf for tasks.  Ignore that.
+ */
+static void chop_leaf(char *path)
+{
+	size_t len;
+	char *cmp;
+
+	if (!path)
+		return;
+
+	len = strlen(path);
+	if (len < strlen(U_LEAF))
+		return;
+	cmp = path + len - strlen(U_LEAF_NAME);
+	if (strcmp(cmp, U_LEAF_NAME) == 0)
+		*cmp = '\0';
+}
+
+/*
+ * Cache of parsed /proc/pid/cgroup files.  A single request on "all"
+ * looks up the requestor's (and for MovePid the victim's) cgroup once
+ * or twice per controller, so parse the file once and answer the rest
+ * from memory.  Tasks can be moved behind our back, so an entry is only
+ * trusted during the main loop iteration in which it was read.  MovePid
+ * drops the victim's entry as soon as it has been moved.  Worker threads
+ * share the cache, so it is protected by pid_cgroup_lock.
+ */
+#define PID_CGROUP_CACHE_SIZE 64
+
+struct pid_cgroup_line {
+	long hierarchy;
+	char *controllers;	// e.g. "cpu,cpuacct" or "name=systemd"
+	char *path;
+};
+
+struct pid_cgroup_cache_entry {
+	pid_t pid;
+	unsigned long generation; // 0 == invalid
+	int nr_lines;
+	struct pid_cgroup_line *lines;
+};
+
+static struct pid_cgroup_cache_entry pid_cgroup_cache[PID_CGROUP_CACHE_SIZE];
+static unsigned long pid_cgroup_generation = 1;
+static unsigned long pid_cgroup_cache_hits, pid_cgroup_cache_misses;
+static pthread_mutex_t pid_cgroup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool pid_cgroup_cache_fill(struct pid_cgroup_cache_entry *e, pid_t pid)
+{
+	FILE *f;
+	char path[100];
+	char *line = NULL;
+	size_t len = 0;
+	struct pid_cgroup_line *lines = NULL;
+	int nr = 0;
+
+	e->generation = 0;
+	if (e->lines) {
+		nih_free(e->lines);
+		e->lines = NULL;
+		e->nr_lines = 0;
+	}
+
+	sprintf(path, "/proc/%d/cgroup", pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		nih_error("could not open cgroup file for %d", pid);
+		return false;
+	}
+	while (getline(&line, &len, f) != -1) {
+		char *c1, *c2;
+		char *endptr;
+		long cnr;
+
+		if ((c1 = strchr(line, ':')) == NULL)
+			continue;
+		if (c1 == line)
+			continue;
+		*c1 = '\0';
+
+		cnr = strtol(line, &endptr, 10);
+		if (*endptr != '\0')
+			continue;
+
+		if ((c2 = strchr(++c1, ':')) == NULL)
+			continue;
+		*c2 = '\0';
+
+		drop_newlines(c2 + 1);
+		if (strlen(c2 + 1) + 1 > MAXPATHLEN) {
+			nih_error("cgroup name too long");
+			continue;
+		}
+
+		lines = NIH_MUST( nih_realloc(lines, NULL, (nr + 1) * sizeof(*lines)) );
+		lines[nr].hierarchy = cnr;
+		lines[nr].controllers = NIH_MUST( nih_strdup(lines, c1) );
+		lines[nr].path = NIH_MUST( nih_strdup(lines, c2 + 1) );
+		nr++;
+	}
+
+	fclose(f);
+	free(line);
+
+	e->pid = pid;
+	e->lines = lines;
+	e->nr_lines = nr;
+	e->generation = pid_cgroup_generation;
+	return true;
+}
+
+static struct pid_cgroup_cache_entry *pid_cgroup_cache_get(pid_t pid)
+{
+	struct pid_cgroup_cache_entry *e;
+
+	e = &pid_cgroup_cache[pid % PID_CGROUP_CACHE_SIZE];
+	if (e->pid == pid && e->generation == pid_cgroup_generation) {
+		pid_cgroup_cache_hits++;
+		return e;
+	}
+
+	pid_cgroup_cache_misses++;
+	if (!pid_cgroup_cache_fill(e, pid))
+		return NULL;
+	return e;
+}
+
+/*
+ * Forget what we know about @pid's cgroups, i.e. because we just
+ * moved it.
+ */
+void pid_cgroup_cache_invalidate(pid_t pid)
+{
+	struct pid_cgroup_cache_entry *e;
+
+	pthread_mutex_lock(&pid_cgroup_lock);
+	e = &pid_cgroup_cache[pid % PID_CGROUP_CACHE_SIZE];
+	if (e->pid == pid)
+		e->generation = 0;
+	pthread_mutex_unlock(&pid_cgroup_lock);
+}
+
+static void pid_cgroup_cache_expire(void *data, NihMainLoopFunc *func)
+{
+	pthread_mutex_lock(&pid_cgroup_lock);
+	pid_cgroup_generation++;
+	if (!pid_cgroup_generation)
+		pid_cgroup_generation++;
+	pthread_mutex_unlock(&pid_cgroup_lock);
+}
+
+/*
+ * Called once at startup: expire all cached entries on every main
+ * loop iteration.
+ */
+void setup_pid_cgroup_cache(void)
+{
+	NIH_MUST( nih_main_loop_add_func(NULL, pid_cgroup_cache_expire, NULL) );
+}
+
+/*
+ * Append a "name value" line to a list of statistics built with
+ * nih_str_array_new().
+ */
+void add_stat(void *parent, char ***output, size_t *len, const char *name,
+		unsigned long value)
+{
+	nih_local char *s = NIH_MUST( nih_sprintf(NULL, "%s %lu", name, value) );
+
+	NIH_MUST( nih_str_array_add(output, parent, len, s) );
+}
+
+void pid_cgroup_cache_get_stats(void *parent, char ***output, size_t *len)
+{
+	unsigned long hits, misses;
 
-	return true;
+	pthread_mutex_lock(&pid_cgroup_lock);
+	hits = pid_cgroup_cache_hits;
+	misses = pid_cgroup_cache_misses;
+	pthread_mutex_unlock(&pid_cgroup_lock);
+
+	add_stat(parent, output, len, "pid_cgroup_cache_hits", hits);
+	add_stat(parent, output, len, "pid_cgroup_cache_misses", misses);
 }
 
 /*
- * The user will pass in 'cpuset' or 'systemd'.  /proc/self/cgroup will
- * show 'cpuset:' or 'name=systemd:'.  We have to account for that.
+ * Is @controller one of the comma-separated controllers in @list, as
+ * shown in /proc/pid/cgroup?
  */
-static bool is_same_controller(const char *cmp, const char *cnt)
+static bool controller_in_list(const char *controller, const char *list)
 {
-	if (strcmp(cmp, cnt) == 0)
-		return true;
-	if (strncmp(cmp, "name=", 5) != 0)
-		return false;
-	if (strcmp(cmp+5, cnt) == 0)
-		return true;
+	char *copy = strdupa(list), *token, *saveptr = NULL;
+
+	for (; (token = strtok_r(copy, ",", &saveptr)); copy = NULL)
+		if (is_same_controller(token, controller))
+			return true;
 	return false;
 }
 
 /*
- * In unified hierarchy tasks must be in a leaf node.  Cgmanager
- * creates .cgm_leaf for tasks.  Ignore that.
+ * Copy @e's cgroup for @controller into @retv.  Called with
+ * pid_cgroup_lock held.
  */
-static void chop_leaf(char *path)
+static bool pid_cgroup_find(struct pid_cgroup_cache_entry *e,
+		const char *controller, char *retv)
 {
-	size_t len;
-	char *cmp;
+	bool is_unified = is_unified_controller(controller);
+	int i;
 
-	if (!path)
-		return;
+	for (i = 0; i < e->nr_lines; i++) {
+		struct pid_cgroup_line *l = &e->lines[i];
 
-	len = strlen(path);
-	if (len < strlen(U_LEAF))
-		return;
-	cmp = path + len - strlen(U_LEAF_NAME);
-	if (strcmp(cmp, U_LEAF_NAME) == 0)
-		*cmp = '\0';
+		if (is_unified) {
+			if (l->hierarchy != 0)
+				continue;
+		} else {
+			if (l->hierarchy == 0)
+				continue;
+			if (!controller_in_list(controller, l->controllers))
+				continue;
+		}
+
+		strcpy(retv, l->path);
+		if (is_unified)
+			chop_leaf(retv);
+		return true;
+	}
+	return false;
 }
 
 /*
@@ -1448,91 +3294,148 @@ static void chop_leaf(char *path)
  */
 static inline char *pid_cgroup(pid_t pid, const char *controller, char *retv)
 {
-	FILE *f;
-	char path[100];
-	char *line = NULL, *cgroup = NULL;
-	size_t len = 0;
-	bool is_unified = is_unified_controller(controller);
+	struct pid_cgroup_cache_entry *e;
+	char *ret = NULL;
+
+	pthread_mutex_lock(&pid_cgroup_lock);
+	if ((e = pid_cgroup_cache_get(pid)) != NULL &&
+			pid_cgroup_find(e, controller, retv))
+		ret = retv;
+	pthread_mutex_unlock(&pid_cgroup_lock);
+	return ret;
+}
 
-	sprintf(path, "/proc/%d/cgroup", pid);
-	if ((f = fopen(path, "r")) == NULL) {
-		nih_error("could not open cgroup file for %d", pid);
-		return NULL;
-	}
-	while (getline(&line, &len, f) != -1) {
-		char *c1, *c2;
-		char *endptr;
-		long cnr;
+static void chop_proxy_slice(char *path);
 
-		if ((c1 = strchr(line, ':')) == NULL)
+/*
+ * Return the cgroupfs paths of @cgroup as named by @pid, one for each
+ * hierarchy of @controller (a list of controllers, or "all"), in a
+ * NULL-terminated array, or NULL if none can be determined.  A relative
+ * @cgroup is under @pid's own cgroup; so is an absolute one if
+ * @under_pid is set, as for MovePidAbs, which names its cgroup relative
+ * to the proxy's, less the cgproxy slice as in compute_proxy_cgroup().
+ * This does not touch the cgroup filesystem; it only identifies which
+ * requests act on the same cgroups so that they can be ordered.
+ */
+char **pid_cgroup_keys(void *parent, pid_t pid, const char *controller,
+		const char *cgroup, bool under_pid)
+{
+	char cgpath[MAXPATHLEN], key[MAXPATHLEN];
+	char **keys;
+	char *list, *tok, *saveptr = NULL, *src, *dst;
+	const char *mount;
+	bool relative;
+	size_t n = 0, len;
+	int ret;
+
+	if (!cgroup || !controller)
+		return NULL;
+	if (strcmp(controller, "all") == 0)
+		controller = all_controllers;
+	if (!controller)
+		return NULL;
+	list = strdupa(controller);
+	if (strchr(list, ','))
+		do_prune_comounts(list);
+	relative = under_pid || cgroup[0] != '/';
+
+	keys = NIH_MUST( nih_str_array_new(parent) );
+	for (tok = strtok_r(list, ",", &saveptr); tok;
+			tok = strtok_r(NULL, ",", &saveptr)) {
+		if ((mount = get_controller_path(tok)) == NULL)
 			continue;
-		if (c1 == line)
+		if (relative && !pid_cgroup(pid, tok, cgpath))
 			continue;
-		*c1 = '\0';
-
-		cnr = strtol(line, &endptr, 10);
-		if (*endptr != '\0')
+		ret = snprintf(key, MAXPATHLEN, "%s/%s", mount,
+				relative ? cgpath : "");
+		if (ret < 0 || ret >= MAXPATHLEN)
 			continue;
-
-		if ((c2 = strchr(++c1, ':')) == NULL)
+		/* the proxy's cgroup, as compute_proxy_cgroup() finds it */
+		if (under_pid)
+			chop_proxy_slice(key);
+		len = strlen(key);
+		ret = snprintf(key + len, MAXPATHLEN - len, "/%s", cgroup);
+		if (ret < 0 || ret >= MAXPATHLEN - len)
 			continue;
-		*c2 = '\0';
 
-		if (is_unified) {
-			if (cnr != 0)
+		/* squash repeated and trailing '/' so that equal paths compare equal */
+		for (src = dst = key; *src; src++) {
+			if (*src == '/' && dst > key && dst[-1] == '/')
 				continue;
-		} else {
-			char *token, *saveptr = NULL;
+			*dst++ = *src;
+		}
+		if (dst > key + 1 && dst[-1] == '/')
+			dst--;
+		*dst = '\0';
+		NIH_MUST( nih_str_array_add(&keys, parent, &n, key) );
+	}
 
-			if (cnr == 0)
-				continue;
+	if (!n) {
+		nih_free(keys);
+		return NULL;
+	}
+	return keys;
+}
 
-			for (; (token = strtok_r(c1, ",", &saveptr));
-			     c1 = NULL)
-				if (is_same_controller(token, controller))
-					break;
+/*
+ * Cache of parsed /proc/pid/{u,g}id_map files, one entry per user
+ * namespace, keyed by the inode of /proc/pid/ns/user.  Permission
+ * checks map several ids into the requestor's namespace, and used to
+ * reread the map file for each one.  The maps of a namespace can only
+ * be written once, so an entry stays good for the namespace's lifetime,
+ * and each entry holds the namespace open so that its inode number
+ * can't be reused by another namespace while we remember it.
+ * Namespaces whose maps have not been written yet are not cached.
+ * Worker threads share the cache, so it is protected by idmap_lock.
+ */
+#define IDMAP_CACHE_SIZE 32
 
-			if (token == NULL)
-				continue;
-		}
+struct id_range {
+	unsigned int nsid;	// base id in the namespace
+	unsigned int hostid;	// base id in our namespace
+	unsigned int count;
+};
 
-		if (strlen(c2 + 1) + 1 > MAXPATHLEN) {
-			nih_error("cgroup name too long");
-			break;
-		}
+struct idmap_cache_entry {
+	unsigned long ino;	// 0 == unused
+	int nsfd;
+	unsigned long last_used;
+	int nr_uids, nr_gids;
+	struct id_range *uids, *gids;
+};
 
-		strncpy(retv, c2 + 1, strlen(c2 + 1) + 1);
-		drop_newlines(retv);
-		cgroup = retv;
-		break;
-	}
+static struct idmap_cache_entry idmap_cache[IDMAP_CACHE_SIZE];
+static unsigned long idmap_clock;
+static unsigned long idmap_cache_hits, idmap_cache_misses;
+static pthread_mutex_t idmap_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	fclose(f);
-	free(line);
-	if (is_unified_controller(controller))
-		chop_leaf(cgroup);
-	return cgroup;
+static int id_range_cmp(const void *a, const void *b)
+{
+	const struct id_range *r1 = a, *r2 = b;
+
+	if (r1->hostid < r2->hostid)
+		return -1;
+	return r1->hostid > r2->hostid;
 }
 
 /*
- * Given a open file * to /proc/pid/{u,g}id_map, and an id
- * valid in the caller's namespace, return the id mapped into
- * pid's namespace.
- * Returns the mapped id, or -1 on error.
+ * Read the id map at @path into a table sorted by host id.  Returns
+ * the number of ranges, or -1 on error.
  */
-unsigned int
-convert_id_to_ns(FILE *idfile, unsigned int in_id)
+static int idmap_parse(void *parent, const char *path, struct id_range **out)
 {
 	unsigned int nsuid,   // base id for a range in the idfile's namespace
 		     hostuid, // base id for a range in the caller's namespace
 		     count;   // number of ids in this range
+	struct id_range *ranges = NULL;
 	char line[400];
-	int ret;
+	int nr = 0;
+	FILE *f;
 
-	fseek(idfile, 0L, SEEK_SET);
-	while (fgets(line, 400, idfile)) {
-		ret = sscanf(line, "%u %u %u\n", &nsuid, &hostuid, &count);
-		if (ret != 3)
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+	while (fgets(line, 400, f)) {
+		if (sscanf(line, "%u %u %u\n", &nsuid, &hostuid, &count) != 3)
 			continue;
 		if (hostuid + count < hostuid || nsuid + count < nsuid) {
 			/*
@@ -1541,39 +3444,177 @@ convert_id_to_ns(FILE *idfile, unsigned int in_id)
 			 */
 			nih_error("pid wrapparound at entry %u %u %u in %s",
 				nsuid, hostuid, count, line);
+			fclose(f);
+			if (ranges)
+				nih_free(ranges);
 			return -1;
 		}
-		if (hostuid <= in_id && hostuid+count > in_id) {
+		ranges = NIH_MUST( nih_realloc(ranges, parent, (nr + 1) * sizeof(*ranges)) );
+		ranges[nr].nsid = nsuid;
+		ranges[nr].hostid = hostuid;
+		ranges[nr].count = count;
+		nr++;
+	}
+	fclose(f);
+
+	if (nr)
+		qsort(ranges, nr, sizeof(*ranges), id_range_cmp);
+	*out = ranges;
+	return nr;
+}
+
+/*
+ * Return the id in the namespace to which host id @in_id maps, or -1 if
+ * it is not mapped.
+ */
+static unsigned int idmap_lookup(const struct id_range *ranges, int nr,
+		unsigned int in_id)
+{
+	int low = 0, high = nr - 1;
+
+	while (low <= high) {
+		int mid = low + (high - low) / 2;
+
+		if (in_id < ranges[mid].hostid)
+			high = mid - 1;
+		else if (in_id - ranges[mid].hostid >= ranges[mid].count)
+			low = mid + 1;
+		else
 			/*
-			 * now since hostuid <= in_id < hostuid+count, and
-			 * hostuid+count and nsuid+count do not wrap around,
-			 * we know that nsuid+(in_id-hostuid) which must be
-			 * less that nsuid+(count) must not wrap around
+			 * hostid <= in_id < hostid+count, and neither
+			 * hostid+count nor nsid+count wrap around, so this
+			 * can't wrap either.
 			 */
-			return (in_id - hostuid) + nsuid;
-		}
+			return (in_id - ranges[mid].hostid) + ranges[mid].nsid;
 	}
 
 	// no answer found
 	return -1;
 }
 
+static void idmap_cache_clear(struct idmap_cache_entry *e)
+{
+	if (e->nsfd >= 0)
+		close(e->nsfd);
+	if (e->uids)
+		nih_free(e->uids);
+	if (e->gids)
+		nih_free(e->gids);
+	memset(e, 0, sizeof(*e));
+	e->nsfd = -1;
+}
+
+/*
+ * Return the id maps of @pid's user namespace.  Called with idmap_lock
+ * held.  If the maps are not cached, they are read into @tmp, which is
+ * only entered into the cache if the maps have been written.
+ */
+static struct idmap_cache_entry *idmap_get(pid_t pid,
+		struct idmap_cache_entry *tmp)
+{
+	struct idmap_cache_entry *e, *victim = &idmap_cache[0];
+	unsigned long ino;
+	struct stat sb;
+	char path[100];
+	int i, fd;
+
+	ino = read_user_ns_link(pid);
+	if (!ino)
+		return NULL;
+
+	for (i = 0; i < IDMAP_CACHE_SIZE; i++) {
+		e = &idmap_cache[i];
+		if (e->ino == ino) {
+			idmap_cache_hits++;
+			e->last_used = ++idmap_clock;
+			return e;
+		}
+		if (e->last_used < victim->last_used)
+			victim = e;
+	}
+	idmap_cache_misses++;
+
+	/* pin the namespace, and make sure pid didn't change under us */
+	snprintf(path, sizeof(path), "/proc/%d/ns/user", pid);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+	if (fstat(fd, &sb) < 0 || sb.st_ino != ino) {
+		close(fd);
+		return NULL;
+	}
+
+	memset(tmp, 0, sizeof(*tmp));
+	tmp->nsfd = -1;
+	snprintf(path, sizeof(path), "/proc/%d/uid_map", pid);
+	tmp->nr_uids = idmap_parse(NULL, path, &tmp->uids);
+	snprintf(path, sizeof(path), "/proc/%d/gid_map", pid);
+	tmp->nr_gids = idmap_parse(NULL, path, &tmp->gids);
+	if (tmp->nr_uids < 0 || tmp->nr_gids < 0) {
+		close(fd);
+		idmap_cache_clear(tmp);
+		return NULL;
+	}
+	if (!tmp->nr_uids || !tmp->nr_gids) {
+		// not written yet, may still change
+		close(fd);
+		return tmp;
+	}
+
+	if (victim->ino)
+		idmap_cache_clear(victim);
+	*victim = *tmp;
+	victim->ino = ino;
+	victim->nsfd = fd;
+	victim->last_used = ++idmap_clock;
+	tmp->uids = tmp->gids = NULL;
+	return victim;
+}
+
+/*
+ * Map host id @id into @pid's user namespace, using the uid map if
+ * @gid is false and the gid map otherwise.  The answer is -1 if @id is
+ * not mapped.
+ */
+static bool hostid_to_ns(unsigned int id, pid_t pid, bool gid,
+		unsigned int *answer)
+{
+	struct idmap_cache_entry tmp = { .nsfd = -1 }, *e;
+
+	pthread_mutex_lock(&idmap_lock);
+	e = idmap_get(pid, &tmp);
+	if (e) {
+		if (gid)
+			*answer = idmap_lookup(e->gids, e->nr_gids, id);
+		else
+			*answer = idmap_lookup(e->uids, e->nr_uids, id);
+	}
+	pthread_mutex_unlock(&idmap_lock);
+	idmap_cache_clear(&tmp);
+
+	return e != NULL;
+}
+
+void idmap_cache_get_stats(void *parent, char ***output, size_t *len)
+{
+	unsigned long hits, misses;
+
+	pthread_mutex_lock(&idmap_lock);
+	hits = idmap_cache_hits;
+	misses = idmap_cache_misses;
+	pthread_mutex_unlock(&idmap_lock);
+
+	add_stat(parent, output, len, "idmap_cache_hits", hits);
+	add_stat(parent, output, len, "idmap_cache_misses", misses);
+}
+
 /*
  * Given host @uid, return the uid to which it maps in
  * @pid's user namespace, or -1 if none.
  */
 bool hostuid_to_ns(uid_t uid, pid_t pid, uid_t *answer)
 {
-	FILE *f;
-	char line[400];
-
-	sprintf(line, "/proc/%d/uid_map", pid);
-	if ((f = fopen(line, "r")) == NULL) {
+	if (!hostid_to_ns(uid, pid, false, answer))
 		return false;
-	}
-
-	*answer = convert_id_to_ns(f, uid);
-	fclose(f);
 
 	if (*answer == -1)
 		return false;
@@ -1598,7 +3639,7 @@ bool may_access(pid_t pid, uid_t uid, gid_t gid, const char *path, int mode)
 	int ret;
 	uid_t nsruid, nsvuid;
 
-	ret = stat(path, &sb);
+	ret = cgfs_stat(path, &sb);
 	if (ret < 0) {
 		nih_debug("Could not look up %s\n", path);
 		return false;
@@ -1646,46 +3687,143 @@ bool may_access(pid_t pid, uid_t uid, gid_t gid, const char *path, int mode)
 
 const char *get_controller_path(const char *controller)
 {
-	int i;
-	bool found;
+	struct controller_mounts *m = lookup_controller(controller);
 
-	i = find_controller_in_mounts(controller, &found);
-	if (!found) {
-		if (strncmp(controller, "name=", 5) == 0) {
-			i = find_controller_in_mounts(controller+5, &found);
-			if (found)
-				return all_mounts[i].path;
-		}
-		return NULL;
-	}
-	return all_mounts[i].path;
+	return m ? m->path : NULL;
 }
 
 bool is_unified_controller(const char *controller)
 {
-	int i;
-	for (i = 0; i < num_controllers; i++)
-		if (strcmp(all_mounts[i].controller, controller) == 0 &&
-				all_mounts[i].unified)
-			return true;
-	return false;
+	struct controller_mounts *m = lookup_controller(controller);
+
+	return m && m->unified;
 }
 
 int get_path_depth(const char *p)
 {
 	int depth = 0;
 
-	if (!p)
-		return 0;
-	while (*p) {
-		while (*p && *p == '/')
-			p++;
-		if (*p)
-			depth++;
-		while (*p && *p != '/')
-			p++;
+	if (!p)
+		return 0;
+	while (*p) {
+		while (*p && *p == '/')
+			p++;
+		if (*p)
+			depth++;
+		while (*p && *p != '/')
+			p++;
+	}
+	return depth;
+}
+
+/*
+ * Does @cgroup name, or lie under, one of the warm pool's spares?  No
+ * request may act on those except Claim, which hands them out.
+ */
+bool pool_reserved(const char *cgroup)
+{
+	const char *p;
+
+	for (p = cgroup; p && *p; p = strchr(p, '/')) {
+		while (*p == '/')
+			p++;
+		if (strncmp(p, POOL_PREFIX, strlen(POOL_PREFIX)) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Is the cgroup at @path as the warm pool made it: without tasks or
+ * child cgroups, and with it and all its files owned by @uid:@gid and
+ * writable by nobody else?  Claim hands out spares only if they are,
+ * so that whoever can write the pool parent cannot plant anything in
+ * a cgroup which is later given to someone else.
+ */
+bool cgroup_pristine(const char *path, uid_t uid, gid_t gid)
+{
+	struct dirent dirent, *direntp;
+	struct stat sb;
+	bool ok = false;
+	DIR *d;
+	int dfd, fd;
+	char c;
+
+	if ((dfd = cgfs_open(path, O_RDONLY | O_DIRECTORY)) < 0)
+		return false;
+	if (fstat(dfd, &sb) < 0 || sb.st_uid != uid || sb.st_gid != gid ||
+			(sb.st_mode & 022) || !(d = fdopendir(dfd))) {
+		close(dfd);
+		return false;
+	}
+
+	while (readdir_r(d, &dirent, &direntp) == 0 && direntp) {
+		if (!strcmp(direntp->d_name, ".") || !strcmp(direntp->d_name, ".."))
+			continue;
+		if (fstatat(dirfd(d), direntp->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0)
+			goto out;
+		if (S_ISDIR(sb.st_mode))
+			goto out;
+		if (sb.st_uid != uid || sb.st_gid != gid)
+			goto out;
+		/* the kernel makes cgroup.event_control writable by all */
+		if ((sb.st_mode & 022) &&
+				strcmp(direntp->d_name, "cgroup.event_control") != 0)
+			goto out;
+	}
+
+	if ((fd = openat(dirfd(d), "tasks", O_RDONLY | O_CLOEXEC)) < 0)
+		goto out;
+	ok = read(fd, &c, 1) == 0;
+	close(fd);
+
+out:
+	closedir(d);
+	return ok;
+}
+
+/*
+ * Build the full path of @cgroup in @controller's hierarchy into @path.
+ * A relative @cgroup is taken to be under @cg, the cgroup of @pid.
+ */
+static bool cgroup_full_path(pid_t pid, const char *controller,
+		const char *cg, const char *cgroup, char *path)
+{
+	int ret;
+	char fullpath[MAXPATHLEN];
+	const char *cont_path;
+	bool abspath = cgroup[0] == '/';
+
+	if (pool_reserved(cgroup)) {
+		nih_error("%s: %s is reserved for the warm pool", __func__, cgroup);
+		return false;
+	}
+	if ((cont_path = get_controller_path(controller)) == NULL) {
+		nih_error("Controller %s not mounted", controller);
+		return false;
+	}
+
+	/* append the requested cgroup */
+	ret = snprintf(fullpath, MAXPATHLEN, "%s/%s%s%s", cont_path,
+			abspath ? "" : cg, abspath ? "" : "/",
+			cgroup ? cgroup : "");
+	if (ret < 0 || ret >= MAXPATHLEN) {
+		nih_error("Path name too long: %s/%s/%s", cont_path, cg, cgroup);
+		return false;
+	}
+
+	/* Make sure client isn't passing us a bunch of bogus '../'s to
+	 * try to read host files */
+	if (!cgfs_realpath(fullpath, path)) {
+		nih_error("Invalid path %s (%s)", fullpath, strerror(errno));
+		return false;
 	}
-	return depth;
+	if (strncmp(path, cont_path, strlen(cont_path)) != 0) {
+		nih_error("invalid cgroup path '%s' for pid %d", cgroup, pid);
+		return false;
+	}
+
+	return true;
 }
 
 /*
@@ -1702,15 +3840,12 @@ int get_path_depth(const char *p)
 bool compute_pid_cgroup(pid_t pid, const char *controller, const char *cgroup,
 		char *path, int *depth)
 {
-	int ret;
-	char requestor_cgpath[MAXPATHLEN], fullpath[MAXPATHLEN];
+	char requestor_cgpath[MAXPATHLEN];
 	/*
 	 * cg contains the the requestor's current cgroup, to prepend to
 	 * the requested cgroup - or "" if requesting an absolute path
 	 */
 	char *cg = "";
-	const char *cont_path;
-	bool abspath = false;
 
 	if (!cgroup) {
 		nih_error("%s: BUG: called with NULL cgroup\n", __func__);
@@ -1724,38 +3859,12 @@ bool compute_pid_cgroup(pid_t pid, const char *controller, const char *cgroup,
 				(unsigned long)pid, controller);
 			return false;
 		}
-	} else
-		abspath = true;
+	}
 
 	if (depth)
 		*depth = get_path_depth(cg) + get_path_depth(cgroup);
 
-	if ((cont_path = get_controller_path(controller)) == NULL) {
-		nih_error("Controller %s not mounted", controller);
-		return false;
-	}
-
-	/* append the requested cgroup */
-	ret = snprintf(fullpath, MAXPATHLEN, "%s/%s%s%s", cont_path,
-			abspath ? "" : cg, abspath ? "" : "/",
-			cgroup ? cgroup : "");
-	if (ret < 0 || ret >= MAXPATHLEN) {
-		nih_error("Path name too long: %s/%s/%s", cont_path, cg, cgroup);
-		return false;
-	}
-
-	/* Make sure client isn't passing us a bunch of bogus '../'s to
-	 * try to read host files */
-	if (!realpath(fullpath, path)) {
-		nih_error("Invalid path %s (%s)", fullpath, strerror(errno));
-		return false;
-	}
-	if (strncmp(path, cont_path, strlen(cont_path)) != 0) {
-		nih_error("invalid cgroup path '%s' for pid %d", cgroup, pid);
-		return false;
-	}
-
-	return true;
+	return cgroup_full_path(pid, controller, cg, cgroup, path);
 }
 
 #define SYSTEMD_INIT_SLICE "/init.scope"
@@ -1799,6 +3908,15 @@ static inline bool check_cgproxy_slice(char *path, size_t pathlen)
 	return false;
 }
 
+static void chop_proxy_slice(char *path)
+{
+	size_t pathlen = strlen(path);
+
+	if (check_init_slice(path, pathlen))
+		return;
+	check_cgproxy_slice(path, pathlen);
+}
+
 /*
  * compute_proxy_cgroup - same as compute_pid_cgroup, but chops of the
  * final /system.slice/cgproxy.service.
@@ -1806,20 +3924,89 @@ static inline bool check_cgproxy_slice(char *path, size_t pathlen)
 bool compute_proxy_cgroup(pid_t pid, const char *controller, const char *cgroup,
 		char *path, int *depth)
 {
-	size_t pathlen;
-
 	if (!compute_pid_cgroup(pid, controller, cgroup, path, depth))
 		return false;
 
-	pathlen = strlen(path);
+	chop_proxy_slice(path);
+	return true;
+}
 
-	if (check_init_slice(path, pathlen))
-		return true;
+/*
+ * Find the cgroup of @pid in each of @controllers: "all", one
+ * controller, or a comma-separated list (of which only one of each
+ * set of comounted controllers is kept).  /proc/pid/cgroup is looked
+ * up once for all of them, rather than once per controller as
+ * compute_pid_cgroup() would.  If @proxy, chop the cgproxy slice
+ * off each path as compute_proxy_cgroup() does.
+ *
+ * Returns the number of controllers, with *@out an array of their
+ * cgroups allocated under @parent.  An entry whose cgroup could not
+ * be found has a NULL path.
+ */
+int resolve_pid_cgroups(void *parent, pid_t pid, const char *controllers,
+		bool proxy, struct resolved_cgroup **out)
+{
+	nih_local char *list = NULL;
+	struct pid_cgroup_cache_entry *e;
+	struct resolved_cgroup *cgs = NULL;
+	char *tok, *saveptr = NULL;
+	char buf[MAXPATHLEN];
+	int i, n = 0;
 
-	if (check_cgproxy_slice(path, pathlen))
-		return true;
+	*out = NULL;
+	if (strcmp(controllers, "all") == 0) {
+		if (!all_controllers)
+			return 0;
+		list = NIH_MUST( nih_strdup(NULL, all_controllers) );
+	} else {
+		list = NIH_MUST( nih_strdup(NULL, controllers) );
+		if (strchr(list, ','))
+			do_prune_comounts(list);
+	}
 
-	return true;
+	pthread_mutex_lock(&pid_cgroup_lock);
+	e = pid_cgroup_cache_get(pid);
+	for (tok = strtok_r(list, ",", &saveptr); tok;
+			tok = strtok_r(NULL, ",", &saveptr)) {
+		cgs = NIH_MUST( nih_realloc(cgs, parent, (n + 1) * sizeof(*cgs)) );
+		memset(&cgs[n], 0, sizeof(cgs[n]));
+		cgs[n].controller = NIH_MUST( nih_strdup(cgs, tok) );
+		if (e && pid_cgroup_find(e, tok, buf))
+			cgs[n].cgroup = NIH_MUST( nih_strdup(cgs, buf) );
+		n++;
+	}
+	pthread_mutex_unlock(&pid_cgroup_lock);
+
+	for (i = 0; i < n; i++) {
+		if (!cgs[i].cgroup) {
+			nih_error("Found no cgroup entry for pid %lu controller %s\n",
+				(unsigned long)pid, cgs[i].controller);
+			continue;
+		}
+		if (!cgroup_full_path(pid, cgs[i].controller, cgs[i].cgroup,
+					"", buf))
+			continue;
+		if (proxy)
+			chop_proxy_slice(buf);
+		cgs[i].path = NIH_MUST( nih_strdup(cgs, buf) );
+		cgs[i].depth = get_path_depth(cgs[i].cgroup);
+	}
+
+	*out = cgs;
+	return n;
+}
+
+/*
+ * compute_pid_cgroup() for a task whose cgroup in @rcg's controller
+ * has already been found by resolve_pid_cgroups().
+ */
+bool resolved_cgroup_path(const struct resolved_cgroup *rcg, pid_t pid,
+		const char *cgroup, char *path)
+{
+	if (cgroup[0] != '/' && !rcg->cgroup)
+		return false;
+	return cgroup_full_path(pid, rcg->controller, rcg->cgroup, cgroup,
+			path);
 }
 
 /*
@@ -1841,10 +4028,14 @@ bool compute_proxy_cgroup(pid_t pid, const char *controller, const char *cgroup,
  */
 char *file_read_string(void *parent, const char *path)
 {
-	int ret, fd = open(path, O_RDONLY);
+	char key[MAXPATHLEN];
+	struct fd_cache_entry *e;
+	ssize_t ret;
 	char *string = NULL;
 	off_t sz = 0;
-	if (fd < 0) {
+
+	if (!cgfs_normalize(path, key) ||
+			(e = fd_cache_get(&cgfile_read_cache, key)) == NULL) {
 		nih_error("Error opening %s: %s", path, strerror(errno));
 		return NULL;
 	}
@@ -1860,7 +4051,7 @@ char *file_read_string(void *parent, const char *path)
 		}
 		string = n;
 		memset(string+sz-1024, 0, 1024);
-		ret = read(fd, string+sz-1024, 1024);
+		ret = pread(e->fd, string+sz-1024, 1024, sz-1024);
 		if (ret < 0) {
 			nih_error("failure reading path %s: %s\n",
 				path, strerror(errno));
@@ -1872,63 +4063,85 @@ char *file_read_string(void *parent, const char *path)
 			break;
 	}
 out:
-	close(fd);
+	fd_cache_put(e);
 	if (string && *string)
 		drop_newlines(string);
 	return string;
 }
 
-static int find_ordered_pid(int32_t *pids, int32_t pid, int nrpids)
+/*
+ * Append the newline-separated pids in @path to the end of @pids,
+ * reading the file in large chunks rather than one int at a time.
+ */
+static int file_append_pids(void *parent, const char *path, int32_t **pids,
+			int *alloced_pids, int *nrpids)
 {
-	int low = 0, mid = low, high = nrpids-1;
+	char buf[8192];
+	ssize_t n;
+	int32_t pid = 0;
+	bool in_pid = false;
+	int fd = cgfs_open(path, O_RDONLY);
 
-	if (!nrpids)
-		return 0;
+	if (fd < 0) {
+		nih_error("Error opening %s: %s", path, strerror(errno));
+		return -2;
+	}
 
-	while (low <= high) {
-		if (high == low)
-			break;
-		if (high == low+1) {
-			if (pid <= pids[low]) {
-				mid = low;
-				break;
+	while ((n = read(fd, buf, sizeof(buf))) != 0) {
+		ssize_t i;
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			nih_error("Error reading %s: %s", path, strerror(errno));
+			close(fd);
+			return -2;
+		}
+		for (i = 0; i < n; i++) {
+			if (buf[i] >= '0' && buf[i] <= '9') {
+				pid = pid * 10 + buf[i] - '0';
+				in_pid = true;
+				continue;
 			}
-			if (pid > pids[high]) {
-				mid = high + 1;
-				if (mid >= nrpids)
-					mid = nrpids-1;
-				break;
+			if (!in_pid)
+				continue;
+			if (!pidlist_grow(parent, pids, alloced_pids, *nrpids + 1)) {
+				close(fd);
+				return -1;
 			}
-			mid = high;
-			break;
+			(*pids)[(*nrpids)++] = pid;
+			pid = 0;
+			in_pid = false;
 		}
-		mid = low + (high-low)/2;
-		if (pid == pids[mid])
-			break;
-		if (pid < pids[mid])
-			high = mid;
-		else
-			low = mid;
 	}
+	close(fd);
 
-	if (pid > pids[mid])
-		mid++;
-
-	return mid;
+	if (in_pid) {
+		if (!pidlist_grow(parent, pids, alloced_pids, *nrpids + 1))
+			return -1;
+		(*pids)[(*nrpids)++] = pid;
+	}
+	return 0;
 }
 
-static bool insert_ordered_pid(int32_t *pids, int32_t pid, int nrpids)
+/*
+ * file_read_pid_run:
+ *
+ * Like file_read_pids, but only the pids read from @path are sorted
+ * (as one run starting at the old value of @nrpids).  Used when many
+ * files are read in a row, after which the runs are combined with
+ * pidlist_merge_runs.
+ */
+int file_read_pid_run(void *parent, const char *path, int32_t **pids,
+			int *alloced_pids, int *nrpids)
 {
-	int i, j;
+	int start = *nrpids, ret;
 
-	/* TODO Switch this to binary */
-	i = find_ordered_pid(pids, pid, nrpids);
-	if (i < nrpids && pids[i] == pid)
-		return false;
-	for (j = nrpids; j > i; j--)
-		pids[j] = pids[j-1];
-	pids[i] = pid;
-	return true;
+	ret = file_append_pids(parent, path, pids, alloced_pids, nrpids);
+	if (ret < 0)
+		return ret;
+	*nrpids = start + pidlist_sort_run(*pids + start, *nrpids - start);
+	return 0;
 }
 
 /*
@@ -1953,33 +4166,13 @@ static bool insert_ordered_pid(int32_t *pids, int32_t pid, int nrpids)
 int file_read_pids(void *parent, const char *path, int32_t **pids,
 			int *alloced_pids, int *nrpids)
 {
-	int pid;
-	FILE *fin = fopen(path, "r");
-
-	if (!fin) {
-		nih_error("Error opening %s: %s", path, strerror(errno));
-		return -2;
-	}
+	int runs[2] = { 0, *nrpids };
+	int ret;
 
-	while (fscanf(fin, "%d", &pid) == 1) {
-		if (*nrpids + 1 >= *alloced_pids) {
-			int32_t *tmp;
-			*alloced_pids += 256;
-			tmp = nih_realloc(*pids, parent,
-					  *alloced_pids*sizeof(int32_t));
-			if (!tmp) {
-				nih_error("Out of memory getting pid list");
-				fclose(fin);
-				return -1;
-			}
-			*pids = tmp;
-			memset(&(tmp[*nrpids]), 0, 256);
-		}
-		if (insert_ordered_pid(*pids, (int32_t) pid, *nrpids))
-			(*nrpids)++;
-	}
-	fclose(fin);
-	return 0;
+	ret = file_read_pid_run(parent, path, pids, alloced_pids, nrpids);
+	if (ret < 0 || runs[1] == 0)
+		return ret;
+	return pidlist_merge_runs(parent, pids, alloced_pids, nrpids, runs, 2);
 }
 
 /*
@@ -2034,47 +4227,49 @@ void get_pid_creds(pid_t pid, uid_t *uid, gid_t *gid)
 bool chown_cgroup_path(const char *path, uid_t uid, gid_t gid,
 		       bool all_children, bool is_unified)
 {
+	int dfd;
+
 	nih_assert (path);
-	if (chown(path, uid, gid) < 0)
+	if ((dfd = cgfs_open(path, O_PATH | O_DIRECTORY)) < 0)
+		return false;
+	if (fchownat(dfd, "", uid, gid, AT_EMPTY_PATH) < 0) {
+		close(dfd);
 		return false;
+	}
 
 	if (all_children) {
 		// chown all the files in the directory
 		struct dirent dirent, *direntp;
-		DIR *d;
-
-		if (strlen(path) >= MAXPATHLEN)
-			return true;
+		DIR *d = NULL;
+		int rfd;
 
-		d = opendir(path);
+		if ((rfd = openat(dfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0 &&
+				(d = fdopendir(rfd)) == NULL)
+			close(rfd);
 		if (!d)
 			goto out;
 
 		while (readdir_r(d, &dirent, &direntp) == 0 && direntp) {
-			nih_local char *fpath = NULL;
 			if (!strcmp(direntp->d_name, ".") || !strcmp(direntp->d_name, ".."))
 				continue;
-			fpath = NIH_MUST( nih_sprintf(NULL, "%s/%s", path, direntp->d_name) );
-			if (chown(fpath, uid, gid) < 0)
-				nih_error("Failed to chown file %s to %u:%u",
-					fpath, uid, gid);
+			if (fchownat(dfd, direntp->d_name, uid, gid, 0) < 0)
+				nih_error("Failed to chown file %s/%s to %u:%u",
+					path, direntp->d_name, uid, gid);
 		}
 		closedir(d);
 	} else {
 		// chown only the tasks or procs file
-		nih_local char *fpath = NULL;
-
-		fpath = NIH_MUST( nih_sprintf(NULL, "%s/%s", path,
-					      is_unified ?
-					      "cgroup.procs" :
-					      "tasks") );
-		if (chown(fpath, uid, gid) < 0)
-			nih_error("%s: Failed to chown %s file %s: %s",
+		const char *fname = is_unified ? "cgroup.procs" : "tasks";
+
+		if (fchownat(dfd, fname, uid, gid, 0) < 0)
+			nih_error("%s: Failed to chown %s file %s/%s: %s",
 				  __func__, is_unified ? "procs" : "tasks",
-				  fpath, strerror(errno));
+				  path, fname, strerror(errno));
 	}
 
 out:
+	close(dfd);
+	mirror_refresh(path, true);
 	return true;
 }
 
@@ -2087,11 +4282,22 @@ out:
  */
 bool chmod_cgroup_path(const char *path, int mode)
 {
+	char leaf[NAME_MAX+1];
+	struct fd_cache_entry *dir;
+	int ret;
+
 	nih_assert (path);
-	if (chmod(path, mode) < 0) {
+	if ((dir = cgfs_parent(path, leaf)) == NULL) {
 		nih_error("Failed to chown tasks file %s", path);
 		return false;
 	}
+	ret = fchmodat(dir->fd, leaf, mode, 0);
+	fd_cache_put(dir);
+	if (ret < 0) {
+		nih_error("Failed to chown tasks file %s", path);
+		return false;
+	}
+	mirror_refresh(path, false);
 
 	return true;
 }
@@ -2108,8 +4314,8 @@ static size_t blacklist_len = sizeof(set_value_blacklist)/sizeof(char *);
 
 bool set_value_trusted(const char *path, const char *value)
 {
+	nih_local char *buf = NULL;
 	int len;
-	FILE *f;
 
 	nih_assert (path);
 
@@ -2117,45 +4323,62 @@ bool set_value_trusted(const char *path, const char *value)
 		value = "";
 
 	len = strlen(value);
-
-	if ((f = fopen(path, "w")) == NULL) {
-		nih_error("Error opening %s for writing", path);
-		return false;
+	if (*value && value[len-1] != '\n') {
+		buf = NIH_MUST( nih_sprintf(NULL, "%s\n", value) );
+		value = buf;
+		len++;
 	}
-	if (fprintf(f, "%s", value) < 0) {
+
+	if (cgfs_write(path, value, len) < 0) {
 		nih_error("Error writing %s to %s: %s", value, path,
 			  strerror(errno));
-		fclose(f);
-		return false;
-	}
-	if (*value && value[len-1] != '\n')
-		fprintf(f, "\n");
-	if (fclose(f) != 0) {
-		nih_error("Error closing %s: %s", path,
-			  strerror(errno));
 		return false;
 	}
 	return true;
 }
-bool set_value(const char *controller, const char *path, const char *value)
+
+/* Is the file @path (or a bare key) one which clients may not write? */
+bool set_value_blacklisted(const char *path)
 {
+	const char *p;
 	int i;
-	char *p;
-	nih_local char *upath = NULL, *file = NULL;
 
 	nih_assert (path);
 
+	p = strrchr(path, '/');
+	if (p)
+		p++;
+	else
+		p = path;
 	for (i = 0; i < blacklist_len; i++) {
-		const char *p = strrchr(path, '/');
-		if (p)
-			p++;
-		else
-			p = path;
 		if (strcmp(p, set_value_blacklist[i]) == 0) {
 			nih_error("attempted write to %s", set_value_blacklist[i]);
-			return false;
+			return true;
 		}
 	}
+	return false;
+}
+
+bool set_value(const char *controller, const char *path, const char *value)
+{
+	nih_assert (path);
+
+	if (set_value_blacklisted(path))
+		return false;
+	return set_value_unchecked(controller, path, value);
+}
+
+/*
+ * Write @value to @path, which the caller has checked against the
+ * blacklist, and to its copy in the unified leaf if there is one.
+ */
+bool set_value_unchecked(const char *controller, const char *path,
+		const char *value)
+{
+	char *p;
+	nih_local char *upath = NULL, *file = NULL;
+
+	nih_assert (path);
 
 	if (!set_value_trusted(path, value))
 		return false;
@@ -2209,14 +4432,83 @@ unsigned long read_user_ns_link(int pid)
 		nih_fatal("Error reading user ns link");
 		exit(1);
 	}
-	ret = stat(path, &sb);
+	if (stat(path, &sb) < 0)
+		return 0;
 	return sb.st_ino;
 }
 
+/*
+ * Open @path relative to a handle on @safety with openat2(), having the
+ * kernel refuse any resolution which leaves @safety, or which crosses
+ * a symlink (cgroupfs has none).  This is one syscall, where realpath(3)
+ * needs one per path component.
+ *
+ * Returns 1 if @path lies under @safety, 0 if it escapes or does not
+ * exist, or -1 if openat2() can't answer and the caller should fall
+ * back to realpath(3).
+ */
+static int openat2_beneath(const char *path, const char *safety)
+{
+#ifdef __NR_openat2
+	static bool unsupported;
+	struct cgm_open_how how = {
+		.flags = O_PATH | O_CLOEXEC,
+		.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS |
+			   RESOLVE_NO_MAGICLINKS,
+	};
+	size_t len = strlen(safety);
+	const char *rel;
+	int rootfd, fd, saved_errno;
+
+	if (unsupported)
+		return -1;
+	if (strncmp(path, safety, len) != 0 || (path[len] && path[len] != '/'))
+		return -1;
+	for (rel = path + len; *rel == '/'; rel++)
+		;
+	if (!*rel)
+		rel = ".";
+
+	if ((rootfd = cgfs_open(safety, O_PATH | O_DIRECTORY)) < 0)
+		return 0;
+	fd = syscall(__NR_openat2, rootfd, rel, &how, sizeof(how));
+	saved_errno = errno;
+	close(rootfd);
+	if (fd >= 0) {
+		close(fd);
+		return 1;
+	}
+
+	switch (saved_errno) {
+	case ENOSYS:  // kernel older than 5.6
+	case E2BIG:
+		unsupported = true;
+		return -1;
+	case EAGAIN:  // raced with a rename, let realpath retry
+	case EINVAL:
+		return -1;
+	default:
+		return 0;
+	}
+#else
+	return -1;
+#endif
+}
+
 bool realpath_escapes(char *path, char *safety)
 {
 		/* Make sure r doesn't try to escape his cgroup with .. */
 	char *tmppath;
+
+	switch (openat2_beneath(path, safety)) {
+	case 1:
+		return false;
+	case 0:
+		nih_error("Improper requested path %s escapes safety %s",
+			   path, safety);
+		return true;
+	}
+
 	if (!(tmppath = realpath(path, NULL))) {
 		nih_error("Invalid path %s", path);
 		return true;
@@ -2284,7 +4576,10 @@ int get_directory_children(void *parent, const char *path, char ***output)
 	struct dirent dirent, *direntp;
 
 	nih_assert(output);
-	d = opendir(path);
+	if ((used = mirror_children(parent, path, output)) >= 0)
+		return used;
+	used = 0;
+	d = cgfs_opendir(path);
 	if (!d) {
 		nih_error("%s: failed to open directory %s: %s",
 			__func__, path, strerror(errno));
@@ -2295,7 +4590,8 @@ int get_directory_children(void *parent, const char *path, char ***output)
 	while (readdir_r(d, &dirent, &direntp) == 0 && direntp) {
 		if (!strcmp(direntp->d_name, ".") || !strcmp(direntp->d_name, ".."))
 			continue;
-		if (!strcmp(direntp->d_name, U_LEAF_NAME))
+		if (!strcmp(direntp->d_name, U_LEAF_NAME) ||
+				!strncmp(direntp->d_name, POOL_PREFIX, strlen(POOL_PREFIX)))
 			continue;
 		if (direntp->d_type != DT_DIR)
 			continue;
@@ -2326,9 +4622,12 @@ int get_directory_contents(void *parent, const char *path,
 	DIR *d;
 	size_t entries = 0;
 	struct dirent dirent, *direntp;
+	int ret;
 
 	nih_assert(output);
-	d = opendir(path);
+	if ((ret = mirror_contents(parent, path, output)) >= 0)
+		return ret;
+	d = cgfs_opendir(path);
 	if (!d) {
 		nih_error("%s: failed to open directory %s: %s",
 			__func__, path, strerror(errno));
@@ -2340,7 +4639,6 @@ int get_directory_contents(void *parent, const char *path,
 		struct keys_return_type *tmp;
 		struct stat sb;
 		struct keys_return_type **r;
-		nih_local char *pathname = NULL;
 
 		if (!strcmp(direntp->d_name, ".") || !strcmp(direntp->d_name, ".."))
 			continue;
@@ -2353,8 +4651,7 @@ int get_directory_contents(void *parent, const char *path,
 		(*output)[entries+1] = NULL;
 		(*output)[entries] = tmp = NIH_MUST( nih_new(*output, struct keys_return_type));
 		tmp->name = NIH_MUST( nih_strdup(tmp, direntp->d_name) );
-		pathname = NIH_MUST( nih_sprintf(NULL, "%s/%s", path, direntp->d_name) );
-		if (stat(pathname, &sb) < 0) {
+		if (fstatat(dirfd(d), direntp->d_name, &sb, 0) < 0) {
 			tmp->uid = tmp->gid = -1;
 			tmp->perms = 0;
 		} else {
@@ -2370,38 +4667,26 @@ int get_directory_contents(void *parent, const char *path,
 
 void convert_directory_contents(struct keys_return_type **keys, struct ucred r)
 {
+	struct idmap_cache_entry tmp = { .nsfd = -1 }, *e;
 	int i = 0;
-	FILE *uidf, *gidf;
-	nih_local char *upath = NULL, *gpath = NULL;
-
-	upath = nih_sprintf(NULL, "/proc/%d/uid_map", r.pid);
-	uidf = fopen(upath, "r");
-	if (!uidf)
-		return;
-	gpath = nih_sprintf(NULL, "/proc/%d/gid_map", r.pid);
-	gidf = fopen(gpath, "r");
-	if (!gidf) {
-		fclose(uidf);
-		return;
-	}
 
-	while (keys[i]) {
-		keys[i]->uid = convert_id_to_ns(uidf, keys[i]->uid);
-		keys[i]->gid = convert_id_to_ns(gidf, keys[i]->gid);
+	pthread_mutex_lock(&idmap_lock);
+	e = idmap_get(r.pid, &tmp);
+	while (e && keys[i]) {
+		keys[i]->uid = idmap_lookup(e->uids, e->nr_uids, keys[i]->uid);
+		keys[i]->gid = idmap_lookup(e->gids, e->nr_gids, keys[i]->gid);
 		i++;
 	}
-	fclose(uidf);
-	fclose(gidf);
+	pthread_mutex_unlock(&idmap_lock);
+	idmap_cache_clear(&tmp);
 }
 
 
 bool was_premounted(const char *controller)
 {
-	bool found;
-	int i = find_controller_in_mounts(controller, &found);
-	if (!found)
-		return false;
-	return all_mounts[i].premounted;
+	struct controller_mounts *m = lookup_controller(controller);
+
+	return m && m->premounted;
 }
 
 /*
@@ -2453,7 +4738,10 @@ static bool do_copy_controllers(const char *from, const char *to)
 		tok = strtok_r(NULL, " ", &savetok);
 	}
 	free(line);
-	return write_string(dest, ctrlline);
+	if (!write_string(dest, ctrlline))
+		return false;
+	mirror_file_written(dest);
+	return true;
 }
 
 bool unified_copy_controllers(const char *controller, const char *path)
@@ -2479,12 +4767,13 @@ bool create_leaf(const char *controller, const char *path, uid_t u, gid_t g)
 		return true;
 
 	NIH_MUST( nih_strcat_sprintf(&p, NULL, "%s%s", path, U_LEAF) );
-	if (mkdir(p, 755) < 0 && errno != EEXIST)
+	if (cgfs_mkdir(p, 755) < 0 && errno != EEXIST)
 		return false;
-	if (mkdir(p, 755) < 0 && errno == EEXIST)
+	if (cgfs_mkdir(p, 755) < 0 && errno == EEXIST)
 		return true;
 	if (chown(p, u, g) < 0)
 		return false;
+	mirror_refresh(p, false);
 	return true;
 }
 
@@ -2493,43 +4782,46 @@ static bool copy_owner_perms_from_to(const char *from, const char *to)
 	struct stat sb;
 	struct dirent dirent, *direntp;
 	bool error = false;
+	int tofd;
 	DIR *d;
 
-	if (stat(from, &sb) < 0)
+	if (cgfs_stat(from, &sb) < 0)
 		return false;
-	if (chown(to, sb.st_uid, sb.st_gid) < 0)
+	if ((tofd = cgfs_open(to, O_PATH | O_DIRECTORY)) < 0)
 		return false;
-	if (chmod(to, sb.st_mode) < 0)
+	if (fchownat(tofd, "", sb.st_uid, sb.st_gid, AT_EMPTY_PATH) < 0 ||
+			fchmodat(tofd, ".", sb.st_mode, 0) < 0) {
+		close(tofd);
 		return false;
+	}
 
-	d = opendir(from);
-	if (!d)
+	d = cgfs_opendir(from);
+	if (!d) {
+		close(tofd);
 		return false;
+	}
 
 	while (readdir_r(d, &dirent, &direntp) == 0 && direntp) {
-		nih_local char  *srcp = NULL,
-			  *dstp = NULL;
-
 		if (!strcmp(direntp->d_name, ".") || !strcmp(direntp->d_name, ".."))
 			continue;
-		srcp = NIH_MUST( nih_sprintf(NULL, "%s/%s", from, direntp->d_name) );
-		dstp = NIH_MUST( nih_sprintf(NULL, "%s/%s", to, direntp->d_name) );
-		if (!file_exists(dstp))
+		if (fstatat(dirfd(d), direntp->d_name, &sb, 0) < 0)
 			continue;
-		if (stat(srcp, &sb) < 0)
+		if (faccessat(tofd, direntp->d_name, F_OK, 0) < 0)
 			continue;
-		if (chown(dstp, sb.st_uid, sb.st_gid) < 0) {
-			nih_error("Failed to chown file %s to %u:%u",
-					dstp, sb.st_uid, sb.st_gid);
+		if (fchownat(tofd, direntp->d_name, sb.st_uid, sb.st_gid, 0) < 0) {
+			nih_error("Failed to chown file %s/%s to %u:%u",
+					to, direntp->d_name, sb.st_uid, sb.st_gid);
 			error = true;
 		}
-		if (chmod(dstp, sb.st_mode) < 0) {
-			nih_error("Failed to chmod file %s to %o",
-					dstp, sb.st_mode);
+		if (fchmodat(tofd, direntp->d_name, sb.st_mode, 0) < 0) {
+			nih_error("Failed to chmod file %s/%s to %o",
+					to, direntp->d_name, sb.st_mode);
 			error = true;
 		}
 	}
 	closedir(d);
+	close(tofd);
+	mirror_refresh(to, true);
 
 	return !error;
 }
@@ -2538,14 +4830,14 @@ bool ensure_leafdir(const char *controller, const char *path)
 {
 	nih_local char *p = NIH_MUST( nih_sprintf(NULL, "%s%s", path, U_LEAF) );
 
-	if (mkdir(p, 0755) < 0) {
+	if (cgfs_mkdir(p, 0755) < 0) {
 		if (errno != EEXIST)
 			return false;
 		// existed, don't change perms
 		return true;
 	}
 	if (!copy_owner_perms_from_to(path, p)) {
-		rmdir(p);
+		cgfs_rmdir(p);
 		return false;
 	}
 	return true;
@@ -2571,3 +4863,50 @@ bool is_ro_mount(const char *path)
 
 	return sb.f_flag & MS_RDONLY;
 }
+
+/*
+ * Return a memfd holding a copy of @buf, sealed so that the client it
+ * is passed to can mmap it knowing it will not change underneath it.
+ * Returns -1 on error.
+ */
+int sealed_memfd(const char *name, const void *buf, size_t len)
+{
+#ifdef __NR_memfd_create
+	const char *p = buf;
+	ssize_t ret;
+	int fd;
+
+	fd = syscall(__NR_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		nih_error("%s: memfd_create failed: %s", __func__,
+			strerror(errno));
+		return -1;
+	}
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			nih_error("%s: write failed: %s", __func__,
+				strerror(errno));
+			goto err;
+		}
+		p += ret;
+		len -= ret;
+	}
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+				F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		nih_error("%s: failed to seal memfd: %s", __func__,
+			strerror(errno));
+		goto err;
+	}
+	return fd;
+
+err:
+	close(fd);
+	return -1;
+#else
+	nih_error("%s: memfd_create is not supported", __func__);
+	return -1;
+#endif
+}
@@ -28,11 +28,13 @@
 #define UNIFIED_PIN UNIFIED_DIR "/.cgpin"
 #define U_LEAF_NAME ".cgm_leaf"
 #define U_LEAF "/" U_LEAF_NAME
+#define POOL_PREFIX ".cgm_pool."  // spares kept by the warm pool
 
 extern char *all_controllers;
 extern char *allow_autoremove_premounted;
 extern int autoremove_premounted_set_release_agent;
 struct keys_return_type;
+struct resolved_cgroup;
 
 bool premounted_should_allow_autoremove(const char *controller);
 int collect_subsystems(char *extra_mounts, char *skip_mounts);
@@ -41,18 +43,27 @@ bool compute_pid_cgroup(pid_t pid, const char *controller, const char *cgroup,
 		char *path, int *depth);
 bool compute_proxy_cgroup(pid_t pid, const char *controller, const char *cgroup,
 		char *path, int *depth);
+int resolve_pid_cgroups(void *parent, pid_t pid, const char *controllers,
+		bool proxy, struct resolved_cgroup **out);
+bool resolved_cgroup_path(const struct resolved_cgroup *rcg, pid_t pid,
+		const char *cgroup, char *path);
 bool may_access(pid_t pid, uid_t uid, gid_t gid, const char *path, int mode);
 void get_pid_creds(pid_t pid, uid_t *uid, gid_t *gid);
 char *file_read_string(void *parent, const char *path);
 int file_read_pids(void *parent, const char *path, int32_t **pids,
 		int *alloced_pids, int *nrpids);
+int file_read_pid_run(void *parent, const char *path, int32_t **pids,
+		int *alloced_pids, int *nrpids);
 void get_pid_creds(pid_t pid, uid_t *uid, gid_t *gid);
 const char *get_controller_path(const char *controller);
 bool hostuid_to_ns(uid_t uid, pid_t pid, uid_t *answer);
 bool chown_cgroup_path(const char *path, uid_t uid, gid_t gid,
 		       bool all_children, bool is_unified);
 bool chmod_cgroup_path(const char *path, int mode);
+bool set_value_blacklisted(const char *path);
 bool set_value(const char *controller, const char *path, const char *value);
+bool set_value_unchecked(const char *controller, const char *path,
+		const char *value);
 bool set_value_trusted(const char *path, const char *value);
 unsigned long read_pid_ns_link(int pid);
 unsigned long read_user_ns_link(int pid);
@@ -61,6 +72,8 @@ bool file_exists(const char *path);
 bool dir_exists(const char *path);
 bool move_self_to_root(void);
 int get_directory_children(void *parent, const char *path, char ***output);
+bool pool_reserved(const char *cgroup);
+bool cgroup_pristine(const char *path, uid_t uid, gid_t gid);
 int get_directory_contents(void *parent, const char *path, struct keys_return_type ***output);
 bool setup_base_run_path(void);
 bool create_agent_symlinks(void);
@@ -76,3 +89,29 @@ bool create_leaf(const char *controller, const char *path, uid_t u, gid_t g);
 bool ensure_leafdir(const char *controller, const char *path);
 void turn_mount_rw(const char *path);
 bool is_ro_mount(const char *path);
+void setup_pid_cgroup_cache(void);
+bool setup_mirror(void);
+int mirror_resync(void);
+void mirror_get_stats(void *parent, char ***output, size_t *len);
+void pid_cgroup_cache_invalidate(pid_t pid);
+void pid_cgroup_cache_get_stats(void *parent, char ***output, size_t *len);
+char **pid_cgroup_keys(void *parent, pid_t pid, const char *controller,
+		const char *cgroup, bool under_pid);
+void add_stat(void *parent, char ***output, size_t *len, const char *name,
+		unsigned long value);
+void fd_caches_get_stats(void *parent, char ***output, size_t *len);
+int cgfs_open(const char *path, int flags);
+FILE *cgfs_fopen(const char *path, const char *mode);
+ssize_t cgfs_write(const char *path, const char *buf, size_t len);
+DIR *cgfs_opendir(const char *path);
+#define CGFS_WALK_SKIP 1
+typedef int (*CgfsWalkFunc)(void *data, const char *path, int parentfd,
+		const char *name, int depth);
+int cgfs_walk(const char *path, int depth, bool skip_leaf, CgfsWalkFunc pre,
+		CgfsWalkFunc post, void *data);
+int cgfs_mkdir(const char *path, mode_t mode);
+int cgfs_rmdir(const char *path);
+int cgfs_rename(const char *path, const char *newname);
+bool cgfs_realpath(const char *path, char *resolved);
+void idmap_cache_get_stats(void *parent, char ***output, size_t *len);
+int sealed_memfd(const char *name, const void *buf, size_t len);
@@ -0,0 +1,197 @@
+/*
+ *
+ * Copyright © 2013 Serge Hallyn
+ * Author: Serge Hallyn <serge.hallyn@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/logging.h>
+
+#include "pidlist.h"
+
+/*
+ * pidlist_grow: make sure @pids has room for @needed entries.  The
+ * array grows geometrically so that appending n pids costs O(n).
+ *
+ * Returns false on allocation failure, in which case @pids is
+ * untouched.
+ */
+bool pidlist_grow(void *parent, int32_t **pids, int *alloced_pids,
+		int needed)
+{
+	int32_t *tmp;
+	int n = *alloced_pids ? *alloced_pids : 256;
+
+	if (needed <= *alloced_pids)
+		return true;
+	while (n < needed)
+		n *= 2;
+	tmp = nih_realloc(*pids, parent, n * sizeof(int32_t));
+	if (!tmp) {
+		nih_error("Out of memory getting pid list");
+		return false;
+	}
+	*pids = tmp;
+	*alloced_pids = n;
+	return true;
+}
+
+static int cmp_pid(const void *a, const void *b)
+{
+	int32_t x = *(const int32_t *)a, y = *(const int32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * pidlist_sort_run: sort @pids and drop duplicates.  Tasks files are
+ * frequently already sorted, so check for that before calling qsort.
+ *
+ * Returns the number of unique pids left at the start of @pids.
+ */
+int pidlist_sort_run(int32_t *pids, int nrpids)
+{
+	int i, j;
+
+	for (i = 1; i < nrpids; i++)
+		if (pids[i-1] >= pids[i])
+			break;
+	if (i >= nrpids)
+		return nrpids;
+
+	qsort(pids, nrpids, sizeof(int32_t), cmp_pid);
+
+	for (i = 1, j = 1; i < nrpids; i++)
+		if (pids[i] != pids[j-1])
+			pids[j++] = pids[i];
+	return j;
+}
+
+/*
+ * pidlist_add_run: record that a new sorted run starts at index
+ * @start of the pid array.
+ */
+void pidlist_add_run(int **runs, int *nr_runs, int start)
+{
+	*runs = NIH_MUST( nih_realloc(*runs, NULL, (*nr_runs + 1) * sizeof(int)) );
+	(*runs)[(*nr_runs)++] = start;
+}
+
+/*
+ * Min-heap of run indexes, ordered by the pid at the head of each run.
+ */
+struct run_heap {
+	int32_t *pids;
+	int *pos;	// next unmerged index of each run
+	int *heap;
+	int nr;
+};
+
+static inline int32_t heap_key(struct run_heap *h, int i)
+{
+	return h->pids[h->pos[h->heap[i]]];
+}
+
+static void heap_sift_down(struct run_heap *h, int i)
+{
+	for (;;) {
+		int l = 2*i + 1, r = l + 1, min = i, tmp;
+
+		if (l < h->nr && heap_key(h, l) < heap_key(h, min))
+			min = l;
+		if (r < h->nr && heap_key(h, r) < heap_key(h, min))
+			min = r;
+		if (min == i)
+			return;
+		tmp = h->heap[i];
+		h->heap[i] = h->heap[min];
+		h->heap[min] = tmp;
+		i = min;
+	}
+}
+
+/*
+ * pidlist_merge_runs: k-way merge the @nr_runs sorted runs which make
+ * up the first @nrpids entries of @pids, dropping pids which appear in
+ * more than one run.  @runs holds the start index of each run, in
+ * increasing order.  On success @pids is replaced by a new, exactly
+ * sized array allocated under @parent.
+ *
+ * Returns 0 on success, -1 on allocation failure (in which case @pids
+ * is left untouched).
+ */
+int pidlist_merge_runs(void *parent, int32_t **pids, int *alloced_pids,
+		int *nrpids, const int *runs, int nr_runs)
+{
+	nih_local int *end = NULL;
+	nih_local int *pos = NULL;
+	nih_local int *heap = NULL;
+	struct run_heap h;
+	int32_t *out;
+	int i, n = 0;
+
+	if (nr_runs < 2 || *nrpids == 0)
+		return 0;
+
+	out = nih_alloc(parent, *nrpids * sizeof(int32_t));
+	end = nih_alloc(NULL, nr_runs * sizeof(int));
+	pos = nih_alloc(NULL, nr_runs * sizeof(int));
+	heap = nih_alloc(NULL, nr_runs * sizeof(int));
+	if (!out || !end || !pos || !heap) {
+		nih_error("Out of memory merging pid lists");
+		if (out)
+			nih_free(out);
+		return -1;
+	}
+
+	h.pids = *pids;
+	h.pos = pos;
+	h.heap = heap;
+	h.nr = 0;
+	for (i = 0; i < nr_runs; i++) {
+		pos[i] = runs[i];
+		end[i] = i + 1 < nr_runs ? runs[i+1] : *nrpids;
+		if (pos[i] < end[i])
+			heap[h.nr++] = i;
+	}
+	for (i = h.nr / 2 - 1; i >= 0; i--)
+		heap_sift_down(&h, i);
+
+	while (h.nr) {
+		int r = heap[0];
+		int32_t pid = (*pids)[pos[r]];
+
+		if (n == 0 || out[n-1] != pid)
+			out[n++] = pid;
+		if (++pos[r] >= end[r])
+			heap[0] = heap[--h.nr];
+		heap_sift_down(&h, 0);
+	}
+
+	nih_free(*pids);
+	*pids = out;
+	*alloced_pids = *nrpids;
+	*nrpids = n;
+	return 0;
+}
@@ -0,0 +1,32 @@
+/*
+ *
+ * Copyright © 2013 Serge Hallyn
+ * Author: Serge Hallyn <serge.hallyn@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Helpers for building sorted, duplicate-free pid lists.  Pids are
+ * appended unsorted as they are read, each file's pids are sorted
+ * once as a "run", and runs from several files are merged at the end.
+ */
+
+bool pidlist_grow(void *parent, int32_t **pids, int *alloced_pids,
+		int needed);
+int pidlist_sort_run(int32_t *pids, int nrpids);
+void pidlist_add_run(int **runs, int *nr_runs, int start);
+int pidlist_merge_runs(void *parent, int32_t **pids, int *alloced_pids,
+		int *nrpids, const int *runs, int nr_runs);
@@ -0,0 +1,280 @@
+/* pathbench.c
+ *
+ * Copyright © 2014 Serge Hallyn <serge.hallyn@ubuntu.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Microbenchmark for the filesystem side of MovePid: checking that the
+ * target cgroup is under the requestor's, then writing the pid to its
+ * tasks file.  Compares the old realpath(3) check with the
+ * openat2(RESOLVE_BENEATH) one which realpath_escapes() now makes,
+ * including the validation of the cached handle on the requestor's
+ * cgroup which cgfs_open() does.  The requestor's cgroup is made 1, 2,
+ * 4, ... up to max_depth levels down in a v1 hierarchy, and this
+ * process is moved into a child of it over and over.
+ *
+ * It first checks that both ways refuse paths which escape the
+ * requestor's cgroup, through '..' or through a symbolic link (made in
+ * a temporary directory, since cgroupfs has none), and fails if either
+ * does not.
+ *
+ * build with 'make TESTS_PATHBENCH', run as root as
+ *	tests/pathbench [-m mountpoint] [-d max_depth] [-n iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef __NR_openat2
+#define __NR_openat2 437
+#endif
+
+/* as in fs.c */
+struct cgm_open_how {
+	uint64_t flags;
+	uint64_t mode;
+	uint64_t resolve;
+};
+#define RESOLVE_NO_MAGICLINKS	0x02
+#define RESOLVE_NO_SYMLINKS	0x04
+#define RESOLVE_BENEATH		0x08
+
+/* The check which realpath_escapes() used to make: true if @path escapes */
+static bool escapes_realpath(const char *path, const char *safety)
+{
+	char *tmppath = realpath(path, NULL);
+	bool ret;
+
+	if (!tmppath)
+		return true;
+	ret = strncmp(safety, tmppath, strlen(safety)) != 0;
+	free(tmppath);
+	return ret;
+}
+
+/*
+ * The check which it makes now.  @parentfd is the handle on @safety's
+ * parent which cgdir_cache holds, and is checked as fd_still_valid()
+ * does before @safety is opened beneath it.
+ */
+static bool escapes_openat2(int parentfd, const char *parent,
+		const char *safety, const char *rel)
+{
+	struct cgm_open_how how = {
+		.flags = O_PATH | O_CLOEXEC,
+		.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS |
+			   RESOLVE_NO_MAGICLINKS,
+	};
+	char link[64], target[PATH_MAX];
+	ssize_t len;
+	int rootfd, fd;
+
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", parentfd);
+	len = readlink(link, target, sizeof(target) - 1);
+	if (len < 0)
+		return true;
+	target[len] = '\0';
+	if (strcmp(target, parent) != 0)
+		return true;
+
+	rootfd = openat(parentfd, strrchr(safety, '/') + 1,
+			O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (rootfd < 0)
+		return true;
+	fd = syscall(__NR_openat2, rootfd, rel, &how, sizeof(how));
+	close(rootfd);
+	if (fd < 0)
+		return true;
+	close(fd);
+	return false;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool move_self(const char *dir)
+{
+	char path[PATH_MAX], pid[20];
+	int fd, len;
+	bool ok;
+
+	snprintf(path, sizeof(path), "%s/tasks", dir);
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+		return false;
+	len = snprintf(pid, sizeof(pid), "%d\n", getpid());
+	ok = write(fd, pid, len) == len;
+	close(fd);
+	return ok;
+}
+
+static int fail(const char *what, const char *path)
+{
+	fprintf(stderr, "FAIL: %s accepted %s\n", what, path);
+	return 1;
+}
+
+/* Both checks must refuse escapes, and accept what stays beneath */
+static int check_escapes(void)
+{
+	char tmpl[] = "/tmp/pathbench.XXXXXX", safety[PATH_MAX];
+	char path[PATH_MAX], parent[PATH_MAX];
+	const char *bad[] = { "..", "c/../..", "link", "link/x", NULL };
+	const char *good[] = { "c", "c/..", "c/../c", NULL };
+	int i, pfd, failed = 0;
+
+	if (!mkdtemp(tmpl))
+		return 1;
+	strcpy(parent, tmpl);
+	snprintf(safety, sizeof(safety), "%s/safety", parent);
+	snprintf(path, sizeof(path), "%s/c", safety);
+	if (mkdir(safety, 0755) < 0 || mkdir(path, 0755) < 0 ||
+			mkdir(strcat(strcpy(path, parent), "/x"), 0755) < 0)
+		return 1;
+	snprintf(path, sizeof(path), "%s/link", safety);
+	if (symlink(parent, path) < 0)
+		return 1;
+	if ((pfd = open(parent, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return 1;
+
+	for (i = 0; bad[i]; i++) {
+		snprintf(path, sizeof(path), "%s/%s", safety, bad[i]);
+		if (!escapes_realpath(path, safety))
+			failed += fail("realpath check", path);
+		if (!escapes_openat2(pfd, parent, safety, bad[i]))
+			failed += fail("openat2 check", path);
+	}
+	for (i = 0; good[i]; i++) {
+		snprintf(path, sizeof(path), "%s/%s", safety, good[i]);
+		if (escapes_openat2(pfd, parent, safety, good[i])) {
+			fprintf(stderr, "FAIL: openat2 check refused %s\n", path);
+			failed++;
+		}
+	}
+
+	close(pfd);
+	snprintf(path, sizeof(path), "rm -rf %s", tmpl);
+	if (system(path) != 0)
+		fprintf(stderr, "failed to remove %s\n", tmpl);
+	if (!failed)
+		printf("escape checks: ok\n");
+	return failed;
+}
+
+static void usage(const char *me)
+{
+	printf("Usage: %s [-m mountpoint] [-d max_depth] [-n iterations]\n", me);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *mnt = "/sys/fs/cgroup/memory";
+	char base[PATH_MAX], parent[PATH_MAX], safety[PATH_MAX];
+	char target[PATH_MAX], root[PATH_MAX];
+	int maxdepth = 16, iters = 20000, depth, d, i, c, pfd;
+	double t0, t_real, t_at2, t_move;
+
+	while ((c = getopt(argc, argv, "m:d:n:h")) != -1) {
+		switch (c) {
+		case 'm': mnt = optarg; break;
+		case 'd': maxdepth = atoi(optarg); break;
+		case 'n': iters = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (check_escapes())
+		exit(1);
+
+	if (!realpath(mnt, root)) {
+		perror(mnt);
+		exit(1);
+	}
+	snprintf(base, sizeof(base), "%s/pathbench.%d", root, getpid());
+
+	printf("%6s %14s %14s %14s\n", "depth", "realpath(us)",
+		"openat2(us)", "tasks write(us)");
+	for (depth = 1; depth <= maxdepth; depth *= 2) {
+		/* the requestor's cgroup, and the child moved into */
+		strcpy(safety, base);
+		if (mkdir(safety, 0755) < 0 && errno != EEXIST)
+			goto err;
+		for (d = 1; d < depth; d++) {
+			strcat(safety, "/l");
+			if (mkdir(safety, 0755) < 0 && errno != EEXIST)
+				goto err;
+		}
+		snprintf(target, sizeof(target), "%s/c", safety);
+		if (mkdir(target, 0755) < 0 && errno != EEXIST)
+			goto err;
+		strcpy(parent, safety);
+		*strrchr(parent, '/') = '\0';
+		if ((pfd = open(parent, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+			goto err;
+
+		t0 = now();
+		for (i = 0; i < iters; i++)
+			if (escapes_realpath(target, safety))
+				goto err;
+		t_real = now() - t0;
+
+		t0 = now();
+		for (i = 0; i < iters; i++)
+			if (escapes_openat2(pfd, parent, safety, "c"))
+				goto err;
+		t_at2 = now() - t0;
+
+		t0 = now();
+		for (i = 0; i < iters; i++)
+			if (!move_self(target))
+				goto err;
+		t_move = now() - t0;
+		close(pfd);
+
+		printf("%6d %14.2f %14.2f %14.2f\n", depth,
+			t_real * 1e6 / iters, t_at2 * 1e6 / iters,
+			t_move * 1e6 / iters);
+
+		/* back out, and remove the tree */
+		move_self(root);
+		rmdir(target);
+		while (strcmp(safety, base) != 0) {
+			rmdir(safety);
+			*strrchr(safety, '/') = '\0';
+		}
+		rmdir(base);
+	}
+	exit(0);
+
+err:
+	perror("pathbench");
+	move_self(root);
+	exit(1);
+}
@@ -0,0 +1,184 @@
+/* pidbench.c
+ *
+ * Copyright © 2014 Serge Hallyn <serge.hallyn@ubuntu.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Microbenchmark for GetTasksRecursive pid collection.  Compares the
+ * old per-pid ordered insertion with appending, sorting each tasks
+ * file as a run and k-way merging the runs, for a growing number of
+ * tasks spread over cgroups of --per-cgroup tasks each.
+ *
+ * build with 'make TESTS_PIDBENCH', run as
+ *	tests/pidbench [-m max_tasks] [-p tasks_per_cgroup]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/logging.h>
+
+#include "pidlist.h"
+
+/* The insertion code which file_read_pids used to use, for reference. */
+static int find_ordered_pid(int32_t *pids, int32_t pid, int nrpids)
+{
+	int low = 0, mid = low, high = nrpids-1;
+
+	if (!nrpids)
+		return 0;
+
+	while (low <= high) {
+		if (high == low)
+			break;
+		if (high == low+1) {
+			if (pid <= pids[low]) {
+				mid = low;
+				break;
+			}
+			if (pid > pids[high]) {
+				mid = high + 1;
+				if (mid >= nrpids)
+					mid = nrpids-1;
+				break;
+			}
+			mid = high;
+			break;
+		}
+		mid = low + (high-low)/2;
+		if (pid == pids[mid])
+			break;
+		if (pid < pids[mid])
+			high = mid;
+		else
+			low = mid;
+	}
+
+	if (pid > pids[mid])
+		mid++;
+
+	return mid;
+}
+
+static bool insert_ordered_pid(int32_t *pids, int32_t pid, int nrpids)
+{
+	int i, j;
+
+	i = find_ordered_pid(pids, pid, nrpids);
+	if (i < nrpids && pids[i] == pid)
+		return false;
+	for (j = nrpids; j > i; j--)
+		pids[j] = pids[j-1];
+	pids[i] = pid;
+	return true;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int bench_insert(const int32_t *input, int n)
+{
+	int32_t *pids = NULL;
+	int i, alloced = 0, nr = 0;
+
+	for (i = 0; i < n; i++) {
+		if (nr + 1 >= alloced) {
+			alloced += 256;
+			pids = NIH_MUST( nih_realloc(pids, NULL, alloced * sizeof(int32_t)) );
+		}
+		if (insert_ordered_pid(pids, input[i], nr))
+			nr++;
+	}
+	nih_free(pids);
+	return nr;
+}
+
+static int bench_merge(const int32_t *input, int n, int per_cgroup)
+{
+	int32_t *pids = NULL;
+	nih_local int *runs = NULL;
+	int i, alloced = 0, nr = 0, nr_runs = 0;
+
+	for (i = 0; i < n; i += per_cgroup) {
+		int start = nr, len = n - i < per_cgroup ? n - i : per_cgroup;
+
+		NIH_MUST( pidlist_grow(NULL, &pids, &alloced, nr + len) );
+		memcpy(pids + nr, input + i, len * sizeof(int32_t));
+		nr = start + pidlist_sort_run(pids + start, len);
+		pidlist_add_run(&runs, &nr_runs, start);
+	}
+	NIH_MUST( pidlist_merge_runs(NULL, &pids, &alloced, &nr, runs,
+				nr_runs) == 0 );
+	nih_free(pids);
+	return nr;
+}
+
+static void usage(const char *me)
+{
+	fprintf(stderr, "Usage: %s [-m max_tasks] [-p tasks_per_cgroup]\n", me);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int max = 64000, per_cgroup = 100, n, c;
+	int32_t *input;
+
+	while ((c = getopt(argc, argv, "m:p:h")) != -1) {
+		switch (c) {
+		case 'm': max = atoi(optarg); break;
+		case 'p': per_cgroup = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (max < 1 || per_cgroup < 1)
+		usage(argv[0]);
+
+	input = NIH_MUST( nih_alloc(NULL, max * sizeof(int32_t)) );
+	srandom(1);
+	for (n = 0; n < max; n++)
+		input[n] = random() % (4 * max) + 1;
+
+	printf("%10s %14s %14s\n", "tasks", "insert (ms)", "merge (ms)");
+	for (n = 1000; n <= max; n *= 2) {
+		double t0, t1, t2;
+		int a, b;
+
+		t0 = now();
+		a = bench_insert(input, n);
+		t1 = now();
+		b = bench_merge(input, n, per_cgroup);
+		t2 = now();
+		if (a != b) {
+			fprintf(stderr, "mismatch at %d tasks: %d != %d\n", n, a, b);
+			exit(1);
+		}
+		printf("%10d %14.2f %14.2f\n", n, t1 - t0, t2 - t1);
+	}
+
+	nih_free(input);
+	return 0;
+}
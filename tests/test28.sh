@@ -0,0 +1,27 @@
+#!/bin/bash
+
+echo "Test 28: pid cgroup cache"
+
+cgm remove all cachetest || true
+
+before=`cgm stats | awk '/^pid_cgroup_cache_misses / { print $2 }'`
+if [ -z "$before" ]; then
+	echo "Fail: no pid_cgroup_cache_misses in stats"
+	exit 1
+fi
+
+# movepid on all looks up our cgroup once per controller
+cgm create all cachetest
+cgm movepid all cachetest $$
+
+hits=`cgm stats | awk '/^pid_cgroup_cache_hits / { print $2 }'`
+if [ -z "$hits" ] || [ "$hits" -eq 0 ]; then
+	echo "Fail: no pid cgroup cache hits after movepid all"
+	exit 1
+fi
+
+# we must see our new cgroup, not a stale cached one
+cg=`cgm getpidcgroup memory $$`
+echo $cg | grep -q "cachetest$" || { echo "Fail: stale cgroup $cg"; exit 1; }
+
+echo PASS
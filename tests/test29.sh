@@ -0,0 +1,62 @@
+#!/bin/bash
+
+echo "Test 29: concurrent and ordered requests on one cgroup"
+
+# cgmanager may run requests on worker threads (--threads); concurrent
+# requests on the same cgroup must not trip over each other.
+threads=`cgm stats | awk '/^work_threads / { print $2 }'`
+if [ -z "$threads" ]; then
+	echo "Fail: no work_threads in stats"
+	exit 1
+fi
+
+cgm remove memory ordertest || true
+
+for i in `seq 1 20`; do
+	cgm create memory ordertest/a$i &
+done
+wait
+
+for i in `seq 1 20`; do
+	cgm listchildren memory ordertest | grep -q "^a$i$" || {
+		echo "Fail: ordertest/a$i missing"
+		exit 1
+	}
+done
+
+for i in `seq 1 20`; do
+	cgm remove memory ordertest/a$i &
+done
+wait
+
+n=`cgm listchildren memory ordertest | wc -l`
+if [ "$n" -ne 0 ]; then
+	echo "Fail: $n children of ordertest left"
+	exit 1
+fi
+
+# Requests on a cgroup and on its parent must run in the order in which
+# they were sent, even when an unrelated request could slip past.  While
+# x/b's large subtree is being removed, remove x and then create x/c:
+# the create must wait for the remove of x, though it does not conflict
+# with x/b.
+for i in `seq 1 200`; do
+	cgm create memory ordertest/x/b/c$i &
+done
+wait
+cgm remove memory ordertest/x/b 1 &
+sleep 0.05
+cgm remove memory ordertest/x 1 &
+sleep 0.05
+cgm create memory ordertest/x/c &
+wait
+
+n=`cgm listchildren memory ordertest/x`
+if [ "$n" != "c" ]; then
+	echo "Fail: ordertest/x has children '$n' rather than c"
+	exit 1
+fi
+
+cgm remove memory ordertest 1
+
+echo PASS
@@ -0,0 +1,68 @@
+#!/bin/bash
+
+echo "Test 30: remove_on_empty on the unified hierarchy"
+
+getstat() {
+	cgm stats | awk "/^$1 / { print \$2 }"
+}
+
+if [ -z "`getstat autoremove_entries`" ]; then
+	echo "Fail: no autoremove_entries in stats"
+	exit 1
+fi
+
+# Find a controller on the unified hierarchy: only there does
+# removeonempty on a populated cgroup add an autoremove entry.
+sleep 200 &
+probe=$!
+ctrl=""
+for c in `cgm listcontrollers`; do
+	before=`getstat autoremove_entries`
+	cgm create $c test30 >/dev/null 2>&1 || continue
+	cgm movepid $c test30 $probe >/dev/null 2>&1
+	cgm removeonempty $c test30 >/dev/null 2>&1
+	if [ "`getstat autoremove_entries`" -gt "$before" ]; then
+		ctrl=$c
+		break
+	fi
+	cgm remove $c test30 >/dev/null 2>&1
+done
+kill $probe
+if [ -z "$ctrl" ]; then
+	echo "no unified controller;  skipping unified remove_on_empty test"
+	exit 0
+fi
+sleep 1
+
+# siblings share the watch on their parent, so each entry costs one
+# watch for its cgroup.events file, plus one for the parent
+entries=`getstat autoremove_entries`
+watches=`getstat autoremove_watches`
+pids=""
+for i in `seq 1 20`; do
+	cgm create $ctrl test30/a$i
+	sleep 200 &
+	pids="$pids $!"
+	cgm movepid $ctrl test30/a$i $!
+	cgm removeonempty $ctrl test30/a$i
+done
+n=$((`getstat autoremove_entries` - entries))
+w=$((`getstat autoremove_watches` - watches))
+if [ $n -ne 20 ] || [ $w -ne 21 ]; then
+	echo "Fail: expected 20 entries with 21 watches, got $n with $w"
+	exit 1
+fi
+
+kill $pids
+sleep 1
+if [ -n "`cgm listchildren $ctrl test30`" ]; then
+	echo "Fail: emptied cgroups were not removed"
+	exit 1
+fi
+if [ "`getstat autoremove_entries`" -ne "$entries" ]; then
+	echo "Fail: autoremove entries left behind"
+	exit 1
+fi
+cgm remove $ctrl test30
+
+echo PASS
@@ -0,0 +1,51 @@
+#!/bin/bash
+
+echo "Test 31: batched requests"
+
+cgm remove memory batchtest || true
+
+sleep 200 &
+pid=$!
+cgm batch create memory batchtest -- \
+	chown memory batchtest 1000 1000 -- \
+	setvalue memory batchtest memory.limit_in_bytes 100000000 -- \
+	movepid memory batchtest $pid
+if [ $? -ne 0 ]; then
+	echo "Fail: batch failed"
+	kill $pid
+	exit 1
+fi
+
+if ! cgm gettasks memory batchtest | grep -q "^$pid$"; then
+	echo "Fail: pid was not moved"
+	kill $pid
+	exit 1
+fi
+owner=`stat -c %u /sys/fs/cgroup/memory/batchtest/tasks 2>/dev/null`
+if [ -n "$owner" ] && [ "$owner" -ne 1000 ]; then
+	echo "Fail: batchtest was not chowned"
+	kill $pid
+	exit 1
+fi
+kill $pid
+
+# operations after a failure must not be run
+out=`cgm batch setvalue memory batchtest memory.nosuchfile 1 -- \
+	create memory batchtest/b 2>&1`
+if [ $? -eq 0 ]; then
+	echo "Fail: failed batch returned success"
+	exit 1
+fi
+echo "$out" | grep -q "operation 2 (Create) not run" || {
+	echo "Fail: operation after a failure was run"
+	exit 1
+}
+if cgm listchildren memory batchtest | grep -q "^b$"; then
+	echo "Fail: batchtest/b was created"
+	exit 1
+fi
+
+sleep 1
+cgm remove memory batchtest
+
+echo PASS
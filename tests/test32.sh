@@ -0,0 +1,34 @@
+#!/bin/bash
+
+echo "Test 32: cgroup directory handle cache"
+
+cgm remove memory dirtest || true
+
+hits() {
+	cgm stats | awk '/^cgdir_cache_hits / { print $2 }'
+}
+
+before=`hits`
+if [ -z "$before" ]; then
+	echo "Fail: no cgdir_cache_hits in stats"
+	exit 1
+fi
+
+cgm create memory dirtest/a/b
+cgm listchildren memory dirtest/a | grep -q "^b$" || { echo "Fail: b not created"; exit 1; }
+
+after=`hits`
+if [ "$after" -le "$before" ]; then
+	echo "Fail: no cgdir cache hits after create"
+	exit 1
+fi
+
+# removing and recreating a cgroup must not leave us using the old handle
+cgm remove memory dirtest/a
+cgm create memory dirtest/a/c
+children=`cgm listchildren memory dirtest/a`
+[ "$children" = "c" ] || { echo "Fail: children of new dirtest/a are $children"; exit 1; }
+
+cgm remove memory dirtest
+
+echo PASS
@@ -0,0 +1,35 @@
+#!/bin/bash
+
+echo "Test 33: cgroup file handle cache"
+
+cgm remove memory filetest || true
+
+stat() {
+	cgm stats | awk "/^$1 / { print \$2 }"
+}
+
+if [ -z "`stat cgfile_write_cache_hits`" ]; then
+	echo "Fail: no cgfile_write_cache_hits in stats"
+	exit 1
+fi
+
+cgm create memory filetest
+cgm setvalue memory filetest memory.limit_in_bytes 100000000
+before=`stat cgfile_write_cache_hits`
+cgm setvalue memory filetest memory.limit_in_bytes 200000000
+after=`stat cgfile_write_cache_hits`
+if [ "$after" -le "$before" ]; then
+	echo "Fail: second setvalue did not hit the cache"
+	exit 1
+fi
+
+# a recreated cgroup must not be written through the old cgroup's handle
+cgm remove memory filetest
+cgm create memory filetest
+cgm setvalue memory filetest memory.limit_in_bytes 100003840
+v=`cgm getvalue memory filetest memory.limit_in_bytes`
+[ "$v" = "100003840" ] || { echo "Fail: limit is $v after recreating"; exit 1; }
+
+cgm remove memory filetest
+
+echo PASS
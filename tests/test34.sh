@@ -0,0 +1,23 @@
+#!/bin/bash
+
+echo "Test 34: GetValues"
+
+cgm remove memory valuestest || true
+cgm create memory valuestest
+cgm setvalue memory valuestest memory.limit_in_bytes 100003840
+
+out=`cgm getvalues memory valuestest memory.limit_in_bytes memory valuestest tasks`
+[ "`echo "$out" | head -1`" = "100003840" ] || { echo "Fail: bad first value: $out"; exit 1; }
+[ "`echo "$out" | wc -l`" = "2" ] || { echo "Fail: expected two values: $out"; exit 1; }
+
+# one unreadable item must not fail the rest
+out=`cgm getvalues memory valuestest nosuchfile memory valuestest memory.limit_in_bytes`
+if [ $? -eq 0 ]; then
+	echo "Fail: reading a missing file succeeded"
+	exit 1
+fi
+[ "`echo "$out" | tail -1`" = "100003840" ] || { echo "Fail: bad value after failed item: $out"; exit 1; }
+
+cgm remove memory valuestest
+
+echo PASS
@@ -0,0 +1,35 @@
+#!/bin/bash
+
+echo "Test 35: SetValues"
+
+for i in 1 2 3; do
+	cgm remove memory setvalues$i || true
+	cgm create memory setvalues$i
+done
+
+cgm setvalues memory setvalues1 memory.limit_in_bytes 100003840 \
+	memory setvalues2 memory.limit_in_bytes 200003584 \
+	memory setvalues3 memory.limit_in_bytes 300003328 \
+	memory setvalues1 memory.soft_limit_in_bytes 50003968
+[ $? -eq 0 ] || { echo "Fail: setvalues failed"; exit 1; }
+
+out=`cgm getvalues memory setvalues1 memory.limit_in_bytes \
+	memory setvalues2 memory.limit_in_bytes \
+	memory setvalues3 memory.limit_in_bytes \
+	memory setvalues1 memory.soft_limit_in_bytes | tr '\n' ' '`
+[ "$out" = "100003840 200003584 300003328 50003968 " ] || { echo "Fail: values are $out"; exit 1; }
+
+# blacklisted and missing keys fail without stopping the rest
+if cgm setvalues memory setvalues1 tasks $$ memory setvalues2 memory.limit_in_bytes 100003840; then
+	echo "Fail: write to tasks succeeded"
+	exit 1
+fi
+v=`cgm getvalue memory setvalues2 memory.limit_in_bytes`
+[ "$v" = "100003840" ] || { echo "Fail: limit is $v"; exit 1; }
+cgm gettasks memory setvalues1 | grep -q . && { echo "Fail: tasks was written"; exit 1; }
+
+for i in 1 2 3; do
+	cgm remove memory setvalues$i
+done
+
+echo PASS
@@ -0,0 +1,27 @@
+#!/bin/bash
+
+echo "Test 36: GetTasksFd"
+
+cgm remove memory tasksfd || true
+cgm create memory tasksfd
+
+sleep 200 &
+p1=$!
+sleep 200 &
+p2=$!
+cgm movepid memory tasksfd $p1
+cgm movepid memory tasksfd $p2
+
+a=`cgm gettasks memory tasksfd | tr '\n' ' '`
+b=`cgm gettasksfd memory tasksfd | tr '\n' ' '`
+kill $p1 $p2
+if [ "$a" != "$b" ]; then
+	echo "Fail: gettasksfd gave '$b', gettasks '$a'"
+	exit 1
+fi
+[ `echo $b | wc -w` -eq 2 ] || { echo "Fail: expected two tasks, got '$b'"; exit 1; }
+
+wait 2>/dev/null
+cgm remove memory tasksfd
+
+echo PASS
@@ -0,0 +1,57 @@
+#!/bin/bash
+
+echo "Test 37: WaitEmpty and PopulatedChanged on the unified hierarchy"
+
+# Find a controller on the unified hierarchy: only there does
+# waitempty accept a cgroup.
+ctrl=""
+for c in `cgm listcontrollers`; do
+	cgm create $c test37 >/dev/null 2>&1 || continue
+	if cgm waitempty $c test37 0 >/dev/null 2>&1; then
+		ctrl=$c
+		break
+	fi
+	cgm remove $c test37 >/dev/null 2>&1
+done
+if [ -z "$ctrl" ]; then
+	echo "no unified controller;  skipping populated test"
+	exit 0
+fi
+
+sleep 200 &
+pid=$!
+cgm movepid $ctrl test37 $pid
+
+if cgm waitempty $ctrl test37 0; then
+	echo "Fail: populated cgroup reported empty"
+	exit 1
+fi
+if cgm waitempty $ctrl test37 1; then
+	echo "Fail: waitempty did not time out"
+	exit 1
+fi
+
+out=`mktemp`
+cgm watchpopulated $ctrl test37 > $out &
+watcher=$!
+cgm waitempty $ctrl test37 &
+waiter=$!
+sleep 1
+kill $pid
+if ! wait $waiter; then
+	echo "Fail: waitempty did not see the cgroup empty"
+	exit 1
+fi
+sleep 1
+kill $watcher
+if [ "`cat $out`" != "$ctrl test37 populated
+$ctrl test37 empty" ]; then
+	echo "Fail: watchpopulated printed `cat $out`"
+	rm -f $out
+	exit 1
+fi
+rm -f $out
+
+cgm remove $ctrl test37
+
+echo PASS
@@ -0,0 +1,46 @@
+#!/bin/bash
+
+echo "Test 38: Watch and KeyChanged"
+
+cgm create memory test38
+
+out=`mktemp`
+# waitempty only accepts cgroups on the unified hierarchy
+if cgm waitempty memory test38 0 >/dev/null 2>&1; then
+	if cgm watch memory test38 memory.max low >/dev/null 2>&1; then
+		echo "Fail: event_control args accepted on the unified hierarchy"
+		exit 1
+	fi
+	cgm watch memory test38 memory.max > $out &
+	watcher=$!
+	sleep 1
+	cgm setvalue memory test38 memory.max 100000000
+	sleep 1
+	kill $watcher
+	if ! grep -q "^memory test38 memory.max:$" $out; then
+		echo "Fail: watch printed `cat $out`"
+		rm -f $out
+		exit 1
+	fi
+else
+	# an oom notification cannot be provoked here, but registering
+	# it through cgroup.event_control must succeed
+	cgm watch memory test38 memory.oom_control > $out &
+	watcher=$!
+	sleep 1
+	if ! kill $watcher; then
+		echo "Fail: could not watch memory.oom_control"
+		rm -f $out
+		exit 1
+	fi
+fi
+rm -f $out
+
+if cgm watch memory test38 nonexistent >/dev/null 2>&1; then
+	echo "Fail: watched a nonexistent file"
+	exit 1
+fi
+
+cgm remove memory test38
+
+echo PASS
@@ -0,0 +1,79 @@
+#!/bin/bash
+
+echo "Test 39: WatchPressure"
+
+cgm create memory test39
+
+# PSI triggers need the unified hierarchy, where waitempty works
+if ! cgm waitempty memory test39 0 >/dev/null 2>&1; then
+	echo "memory is not on the unified hierarchy;  skipping pressure test"
+	cgm remove memory test39
+	exit 0
+fi
+if ! cgm getvalue memory test39 memory.pressure >/dev/null 2>&1; then
+	echo "no PSI support;  skipping pressure test"
+	cgm remove memory test39
+	exit 0
+fi
+
+for t in "bogus 1 2" "some 150000" "some 150000 1000000 x"; do
+	if cgm watchpressure memory test39 memory "$t" >/dev/null 2>&1; then
+		echo "Fail: accepted trigger \"$t\""
+		exit 1
+	fi
+done
+if cgm watchpressure memory test39 disk "some 150000 1000000" >/dev/null 2>&1; then
+	echo "Fail: accepted resource disk"
+	exit 1
+fi
+
+# unprivileged callers are held to the kernel's limits on triggers
+if [ -n "$SUDO_USER" ]; then
+	gid=$SUDO_GID
+	uid=$SUDO_UID
+else
+	gid=1000
+	uid=1000
+fi
+if sudo -u \#$uid cgm watchpressure memory test39 memory "some 150000 2000000" >/dev/null 2>&1; then
+	echo "Fail: unprivileged user set a trigger without write access"
+	exit 1
+fi
+cgm chown memory test39 $uid $gid
+if sudo -u \#$uid cgm watchpressure memory test39 memory "some 150000 1000000" >/dev/null 2>&1; then
+	echo "Fail: unprivileged user set a trigger with a 1s window"
+	exit 1
+fi
+sudo -u \#$uid cgm watchpressure memory test39 memory "some 150000 2000000" >/dev/null 2>&1 &
+w1=$!
+sleep 1
+if ! kill $w1 2>/dev/null; then
+	echo "Fail: unprivileged user could not set a trigger with a 2s window"
+	exit 1
+fi
+
+# two subscribers share one trigger
+before=`cgm stats | awk '/^key_watches / { print $2 }'`
+cgm watchpressure memory test39 memory "some 150000 1000000" >/dev/null &
+w1=$!
+cgm watchpressure memory test39 memory "some  150000 1000000" >/dev/null &
+w2=$!
+sleep 1
+if [ `cgm stats | awk '/^key_watches / { print $2 }'` -ne $((before+1)) ]; then
+	echo "Fail: subscribers did not share the trigger"
+	kill $w1 $w2
+	exit 1
+fi
+if ! kill $w1 $w2; then
+	echo "Fail: could not watch memory pressure"
+	exit 1
+fi
+sleep 1
+if [ `cgm stats | awk '/^key_watches / { print $2 }'` -ne $before ]; then
+	echo "Fail: trigger was not dropped on disconnect"
+	exit 1
+fi
+
+cgm remove memory test39
+
+echo PASS
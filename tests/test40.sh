@@ -0,0 +1,46 @@
+#!/bin/bash
+
+echo "Test 40: hierarchy mirror"
+
+if ! cgm stats | grep -q '^mirror_dirs '; then
+	echo "cgmanager was not started with --mirror;  skipping mirror test"
+	exit 0
+fi
+
+dirs=`cgm stats | awk '/^mirror_dirs / { print $2 }'`
+cgm create memory test40
+cgm create memory test40/a
+cgm create memory test40/b
+if [ `cgm stats | awk '/^mirror_dirs / { print $2 }'` -lt $((dirs+3)) ]; then
+	echo "Fail: new cgroups were not mirrored"
+	exit 1
+fi
+
+children=`cgm listchildren memory test40 | sort | xargs`
+if [ "$children" != "a b" ]; then
+	echo "Fail: listchildren gave $children"
+	exit 1
+fi
+
+# changes made behind cgmanager's back reach the mirror through inotify
+dir=`cgm getpidcgroupabs memory $$ 2>/dev/null`
+mnt=`awk '$3 == "cgroup" && $4 ~ /memory/ { print $2 }' /proc/self/mounts | head -1`
+if [ -n "$mnt" ] && [ -d "$mnt$dir/test40" ]; then
+	rmdir "$mnt$dir/test40/b"
+	sleep 1
+	children=`cgm listchildren memory test40 | sort | xargs`
+	if [ "$children" != "a" ]; then
+		echo "Fail: listchildren gave $children after an rmdir"
+		exit 1
+	fi
+fi
+
+differences=`cgm mirrorresync`
+if [ "$differences" != "0" ]; then
+	echo "Fail: mirror had $differences differences"
+	exit 1
+fi
+
+cgm remove memory test40
+
+echo PASS
@@ -0,0 +1,35 @@
+#!/bin/bash
+
+echo "Test 41: deferred remove"
+
+out=`cgm removedeferred memory test41-nonexistent`
+if [ "$out" != "Path did not exist" ]; then
+	echo "Fail: removedeferred of a missing cgroup gave $out"
+	exit 1
+fi
+
+cgm create memory test41
+cgm create memory test41/a
+sleep 100 &
+pid=$!
+cgm movepid memory test41/a $pid
+kill -9 $pid
+cgm removedeferred memory test41
+wait $pid 2>/dev/null
+
+i=0
+while cgm listchildren memory '' | grep -q '^test41$'; do
+	i=$((i+1))
+	if [ $i -gt 50 ]; then
+		echo "Fail: test41 was not removed"
+		exit 1
+	fi
+	sleep 0.2
+done
+
+if [ `cgm stats | awk '/^deferred_remove_succeeded / { print $2 }'` -lt 1 ]; then
+	echo "Fail: deferred removal was not counted"
+	exit 1
+fi
+
+echo PASS
@@ -0,0 +1,67 @@
+#!/bin/bash
+
+echo "Test 42: claiming cgroups from the pool"
+
+if ! cgm stats | grep -q '^pool_spares '; then
+	echo "cgmanager does not report a pool;  skipping pool test"
+	exit 0
+fi
+
+# claim works like create whether or not a spare is used
+cgm claim memory test42
+out=`cgm claim memory test42`
+if [ "$out" != "Path existed" ]; then
+	echo "Fail: second claim gave $out"
+	exit 1
+fi
+if ! cgm listchildren memory '' | grep -q '^test42$'; then
+	echo "Fail: test42 was not claimed"
+	exit 1
+fi
+cgm remove memory test42
+
+if [ `cgm stats | awk '/^pool_spares / { print $2 }'` -eq 0 ]; then
+	echo "cgmanager was not started with --pool;  skipping the rest"
+	echo PASS
+	exit 0
+fi
+# with the default pool parent, spares are only used for root's children
+if [ "`cgm getpidcgroup memory $$`" != "/" ]; then
+	echo "not in the root memory cgroup;  skipping the rest"
+	echo PASS
+	exit 0
+fi
+
+if cgm claim memory .cgm_pool.test42 2>/dev/null; then
+	echo "Fail: claimed a reserved name"
+	exit 1
+fi
+# spares are hidden from, and out of reach of, everything but claim
+if cgm listchildren memory '' | grep -q '^\.cgm_pool\.'; then
+	echo "Fail: listchildren shows the pool's spares"
+	exit 1
+fi
+for spare in .cgm_pool.0 .cgm_pool.1; do
+	if cgm movepid memory $spare $$ 2>/dev/null; then
+		echo "Fail: moved a task into spare $spare"
+		exit 1
+	fi
+	if cgm remove memory $spare 2>/dev/null; then
+		echo "Fail: removed spare $spare"
+		exit 1
+	fi
+done
+
+claimed=`cgm stats | awk '/^pool_claimed / { print $2 }'`
+cgm claim memory test42b
+if [ `cgm stats | awk '/^pool_claimed / { print $2 }'` -le $claimed ]; then
+	echo "Fail: test42b was not taken from the pool"
+	exit 1
+fi
+if cgm gettasks memory test42b | grep -q .; then
+	echo "Fail: claimed cgroup has tasks"
+	exit 1
+fi
+cgm remove memory test42b
+
+echo PASS
@@ -0,0 +1,48 @@
+#!/bin/bash
+
+echo "Test 43: paths escaping the requestor's cgroup"
+
+mnt=`mktemp -d`
+
+cleanup() {
+	umount $mnt 2>/dev/null || true
+	rmdir $mnt
+}
+
+trap cleanup EXIT
+
+cgm create memory test43
+cgm create memory test43/b
+
+# We can't readily verify if we can't mount cgroups
+cantmount=0
+mount -t cgroup -o memory cgroup $mnt || cantmount=1
+myc=`cat /proc/$$/cgroup | grep memory | awk -F: '{ print $3 }'`
+before=`stat -c "%a" ${mnt}/${myc} 2>/dev/null`
+
+# chmodfile's file is not checked for '..', so the containment check
+# is all that keeps a requestor in test43 out of its parent
+bash -c "cgm movepid memory test43 \$\$ && cgm chmodfile memory '' .. 0777" 2>/dev/null
+if [ $? -eq 0 ]; then
+	echo "Fail: chmod escaped test43 through '..'"
+	exit 1
+fi
+if [ $cantmount -eq 0 ] && [ "`stat -c "%a" ${mnt}/${myc}`" != "$before" ]; then
+	echo "Fail: mode of test43's parent changed"
+	exit 1
+fi
+
+# '..' which stays under the requestor's cgroup is fine
+bash -c "cgm movepid memory test43 \$\$ && cgm chmodfile memory b .. 0775"
+if [ $? -ne 0 ]; then
+	echo "Fail: chmod of test43 through b/.. was refused"
+	exit 1
+fi
+if [ $cantmount -eq 0 ] && [ "`stat -c "%a" ${mnt}/${myc}/test43`" != "775" ]; then
+	echo "Fail: mode of test43 was not changed"
+	exit 1
+fi
+
+cgm remove memory test43 1
+
+echo PASS
@@ -0,0 +1,83 @@
+#!/bin/bash
+
+echo "Test 44: requests forwarded by cgproxy over its channel"
+
+proxystat() {
+	cgm stats | awk "/^$1 / { print \$2 }"
+}
+
+dotest() {
+    mount --move /sys/fs/cgroup /mnt || { echo "move mount not allowed;  aborting test"; exit 0; }
+    mount -t tmpfs none /sys/fs/cgroup
+    mkdir /sys/fs/cgroup/cgmanager
+    touch /sys/fs/cgroup/cgmanager/sock
+    mount --bind /mnt/cgmanager/sock /sys/fs/cgroup/cgmanager/sock
+    # few in-flight slots, so that most requests wait in the proxy's queue
+    cgproxy --max-inflight 2 --query-timeout 5 --update-timeout 0 &
+    ppid=$!
+    trap "kill -9 $ppid" EXIT
+    for i in `seq 50`; do
+        cgm ping 2>/dev/null && break
+        sleep 0.1
+    done
+
+    if [ "`proxystat upstream_channel`" != "1" ]; then
+        echo "cgmanager has no proxy channel;  skipping channel test"
+        exit 0
+    fi
+    if [ "`proxystat upstream_query_timeout`" != "5" ] ||
+            [ "`proxystat upstream_update_timeout`" != "0" ]; then
+        echo "Fail: timeouts were not set"
+        exit 1
+    fi
+
+    # many clients at once, each answered with its own reply
+    cgm create memory test44
+    before=`proxystat upstream_forwarded`
+    timeouts=`proxystat upstream_timeouts`
+    pids=""
+    for i in `seq 20`; do
+        ( cgm create memory test44/c$i && \
+          cgm setvalue memory test44/c$i memory.limit_in_bytes $((i * 1048576)) ) &
+        pids="$pids $!"
+    done
+    for p in $pids; do
+        wait $p || { echo "Fail: a forwarded request failed"; exit 1; }
+    done
+    pids=""
+    for i in `seq 20`; do
+        ( v=`cgm getvalue memory test44/c$i memory.limit_in_bytes` && \
+          [ "$v" = "$((i * 1048576))" ] ) &
+        pids="$pids $!"
+    done
+    for p in $pids; do
+        wait $p || { echo "Fail: a reply went to the wrong client"; exit 1; }
+    done
+    if [ `cgm listchildren memory test44 | wc -l` -ne 20 ]; then
+        echo "Fail: children of test44 were not all created"
+        exit 1
+    fi
+
+    # recursive remove is an update: no timeout with --update-timeout 0
+    cgm remove memory test44 1 || { echo "Fail: recursive remove failed"; exit 1; }
+
+    if [ `proxystat upstream_forwarded` -lt $((before + 63)) ]; then
+        echo "Fail: requests were not forwarded over the channel"
+        exit 1
+    fi
+    if [ `proxystat upstream_timeouts` -ne $timeouts ]; then
+        echo "Fail: requests timed out"
+        exit 1
+    fi
+    if [ `proxystat upstream_inflight` -ne 0 ] || [ `proxystat upstream_queued` -ne 0 ]; then
+        echo "Fail: requests were left in flight"
+        exit 1
+    fi
+}
+
+if [ $# -eq 1 ]; then
+    dotest
+    echo PASS
+else
+    unshare -m $0 unshared
+fi
@@ -0,0 +1,20 @@
+#!/bin/bash
+
+echo "Test 45: requests naming no controller"
+
+# "" names no hierarchy at all, and must be refused rather than
+# handled as a single controller
+for args in "create '' test45" "chown '' test45 0 0" \
+		"chmodfile '' test45 tasks 0755" "remove '' test45" \
+		"movepid '' test45 $$" "removeonempty '' test45" \
+		"prune '' test45" "gettasksrecursive '' test45"; do
+	eval cgm $args 2>/dev/null
+	if [ $? -eq 0 ]; then
+		echo "Fail: cgm $args succeeded"
+		exit 1
+	fi
+done
+
+cgm ping || { echo "Fail: cgmanager died"; exit 1; }
+
+echo PASS
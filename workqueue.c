@@ -0,0 +1,401 @@
+/*
+ *
+ * Copyright © 2013 Serge Hallyn
+ * Author: Serge Hallyn <serge.hallyn@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <dirent.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/io.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "fs.h"
+#include "workqueue.h"
+
+/*
+ * A request moves from pending to running when a worker picks it up,
+ * to done when the worker has run it, and to completing while the main
+ * loop completes it (sends its reply and frees the request).  Until
+ * that has finished its keys stay busy: a request is only picked up if
+ * none of its keys conflicts with one of a request which is running,
+ * done or completing, or which is pending ahead of it.  So requests
+ * with conflicting keys are run in the order in which they were
+ * submitted, while others may overtake them.
+ *
+ * Requests which must touch main loop state (i.e. add an NihIo) are
+ * marked main_only.  A worker passes such a request straight to done,
+ * still holding its keys, and the main loop runs it while completing
+ * it.
+ */
+struct work {
+	NihList entry;
+	char **keys;      // cgroupfs paths, or NULL to run in any order
+	bool main_only;
+	WorkFunc run, done;
+	void *data;
+};
+
+static int nr_workers;
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static NihList work_pending, work_running, work_done, work_completing;
+static int work_pipe[2] = { -1, -1 };
+static unsigned long work_submitted, work_inline, work_waits;
+static unsigned long work_par_runs, work_par_helped;
+
+/*
+ * Do @a and @b name the same cgroup, or is one of them under the
+ * other?
+ */
+static bool keys_conflict(const char *a, const char *b)
+{
+	size_t la = strlen(a), lb = strlen(b);
+
+	if (la > lb)
+		return keys_conflict(b, a);
+	if (strncmp(a, b, la) != 0)
+		return false;
+	return b[la] == '\0' || b[la] == '/' || (la && a[la-1] == '/');
+}
+
+/*
+ * Does one of @keys conflict with those of a request on @list?  If
+ * @end is not NULL, only the requests ahead of it are checked.
+ */
+static bool key_busy(NihList *list, NihList *end, char **keys)
+{
+	char **a, **b;
+
+	NIH_LIST_FOREACH(list, iter) {
+		struct work *w = (struct work *)iter;
+
+		if (iter == end)
+			break;
+		if (!w->keys)
+			continue;
+		for (a = w->keys; *a; a++)
+			for (b = keys; *b; b++)
+				if (keys_conflict(*a, *b))
+					return true;
+	}
+	return false;
+}
+
+/* Called with work_lock held */
+static struct work *work_pick(void)
+{
+	NIH_LIST_FOREACH(&work_pending, iter) {
+		struct work *w = (struct work *)iter;
+
+		if (!w->keys)
+			return w;
+		if (!key_busy(&work_pending, iter, w->keys) &&
+				!key_busy(&work_running, NULL, w->keys) &&
+				!key_busy(&work_done, NULL, w->keys) &&
+				!key_busy(&work_completing, NULL, w->keys))
+			return w;
+		work_waits++;
+	}
+	return NULL;
+}
+
+static void *work_thread(void *arg)
+{
+	char c = 0;
+
+	pthread_mutex_lock(&work_lock);
+	for (;;) {
+		struct work *w;
+
+		while (!(w = work_pick()))
+			pthread_cond_wait(&work_cond, &work_lock);
+		nih_list_add(&work_running, &w->entry);
+		pthread_mutex_unlock(&work_lock);
+
+		if (!w->main_only)
+			w->run(w->data);
+
+		pthread_mutex_lock(&work_lock);
+		nih_list_add(&work_done, &w->entry);
+		if (write(work_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+			nih_error("%s: failed to wake main loop: %s",
+				__func__, strerror(errno));
+	}
+	return NULL;
+}
+
+/*
+ * Complete the requests which the workers have run.  They stay on
+ * work_completing, holding their keys, until they have been completed,
+ * so that no conflicting request is picked up while a main_only
+ * request runs or a reply is being sent.  Only the main loop changes
+ * work_completing, so it may walk the list without work_lock.
+ */
+static void work_reap(void *data, NihIoWatch *watch, NihIoEvents events)
+{
+	char buf[64];
+
+	while (read(work_pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&work_lock);
+	NIH_LIST_FOREACH_SAFE(&work_done, iter)
+		nih_list_add(&work_completing, iter);
+	pthread_mutex_unlock(&work_lock);
+
+	NIH_LIST_FOREACH(&work_completing, iter) {
+		struct work *w = (struct work *)iter;
+
+		if (w->main_only)
+			w->run(w->data);
+		w->done(w->data);
+	}
+
+	pthread_mutex_lock(&work_lock);
+	while (!NIH_LIST_EMPTY(&work_completing))
+		nih_free(work_completing.next);
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&work_lock);
+}
+
+/*
+ * Start @nr_threads workers.  With none, requests are run by
+ * work_submit() itself, as they always were.
+ */
+bool workqueue_init(int nr_threads)
+{
+	sigset_t mask, oldmask;
+	int i;
+
+	nih_list_init(&work_pending);
+	nih_list_init(&work_running);
+	nih_list_init(&work_done);
+	nih_list_init(&work_completing);
+
+	if (nr_threads <= 0)
+		return true;
+
+	if (pipe2(work_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+		nih_error("%s: failed to create pipe: %s", __func__,
+			strerror(errno));
+		return false;
+	}
+	if (!nih_io_add_watch(NULL, work_pipe[0], NIH_IO_READ, work_reap, NULL)) {
+		NihError *error = nih_error_get();
+		nih_error("%s: %s", __func__, error->message);
+		nih_free(error);
+		return false;
+	}
+
+	/* signals are for the main loop */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+	for (i = 0; i < nr_threads; i++) {
+		pthread_t thread;
+		int ret;
+
+		ret = pthread_create(&thread, NULL, work_thread, NULL);
+		if (ret) {
+			nih_error("%s: failed to start worker: %s", __func__,
+				strerror(ret));
+			break;
+		}
+		pthread_detach(thread);
+		nr_workers++;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+	return nr_workers > 0;
+}
+
+bool workqueue_enabled(void)
+{
+	return nr_workers > 0;
+}
+
+/*
+ * Run @run(@data) on a worker, then @done(@data) from the main loop.
+ * @keys are the cgroupfs paths which the request acts on, one for each
+ * hierarchy, in a NULL-terminated array; see struct work.
+ */
+void work_submit(char * const *keys, bool main_only, WorkFunc run,
+		WorkFunc done, void *data)
+{
+	struct work *w;
+
+	if (!nr_workers) {
+		work_inline++;
+		run(data);
+		done(data);
+		return;
+	}
+
+	w = NIH_MUST( nih_new(NULL, struct work) );
+	nih_list_init(&w->entry);
+	nih_alloc_set_destructor(w, nih_list_destroy);
+	w->keys = keys ? NIH_MUST( nih_str_array_copy(w, NULL, keys) ) : NULL;
+	w->main_only = main_only;
+	w->run = run;
+	w->done = done;
+	w->data = data;
+
+	pthread_mutex_lock(&work_lock);
+	nih_list_add(&work_pending, &w->entry);
+	work_submitted++;
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&work_lock);
+}
+
+/*
+ * A work_parallel() call.  The caller and its helpers claim calls by
+ * index until none are left; the last of them to finish frees it.
+ */
+struct work_par {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int n, next, finished, refs;
+	void (*func)(void *data, int i);
+	void *data;
+};
+
+static void work_par_put(struct work_par *par)
+{
+	bool last;
+
+	pthread_mutex_lock(&par->lock);
+	last = --par->refs == 0;
+	pthread_mutex_unlock(&par->lock);
+	if (last) {
+		pthread_mutex_destroy(&par->lock);
+		pthread_cond_destroy(&par->cond);
+		nih_free(par);
+	}
+}
+
+/* Make calls until none are left; returns how many were made */
+static int work_par_run(struct work_par *par)
+{
+	int i, made = 0;
+
+	pthread_mutex_lock(&par->lock);
+	while (par->next < par->n) {
+		i = par->next++;
+		pthread_mutex_unlock(&par->lock);
+		par->func(par->data, i);
+		made++;
+		pthread_mutex_lock(&par->lock);
+		if (++par->finished == par->n)
+			pthread_cond_broadcast(&par->cond);
+	}
+	pthread_mutex_unlock(&par->lock);
+	return made;
+}
+
+static void work_par_helper(void *data)
+{
+	struct work_par *par = data;
+
+	if (work_par_run(par) > 0) {
+		pthread_mutex_lock(&work_lock);
+		work_par_helped++;
+		pthread_mutex_unlock(&work_lock);
+	}
+	work_par_put(par);
+}
+
+static void work_par_done(void *data)
+{
+}
+
+/*
+ * Call @func(@data, i) for each i below @n, spread over idle workers,
+ * and return once all the calls have finished.  Called from a request
+ * running on a worker, which holds that request's keys throughout.
+ * The caller makes calls itself, so it only ever waits for calls
+ * which a helper has already started, and a helper which is not
+ * picked up until all have been claimed does nothing.
+ */
+void work_parallel(int n, void (*func)(void *data, int i), void *data)
+{
+	struct work_par *par;
+	int i, helpers;
+
+	helpers = (n < nr_workers ? n : nr_workers) - 1;
+	if (helpers <= 0) {
+		for (i = 0; i < n; i++)
+			func(data, i);
+		return;
+	}
+
+	par = NIH_MUST( nih_new(NULL, struct work_par) );
+	pthread_mutex_init(&par->lock, NULL);
+	pthread_cond_init(&par->cond, NULL);
+	par->n = n;
+	par->next = par->finished = 0;
+	par->refs = helpers + 1;
+	par->func = func;
+	par->data = data;
+
+	pthread_mutex_lock(&work_lock);
+	work_par_runs++;
+	pthread_mutex_unlock(&work_lock);
+	for (i = 0; i < helpers; i++)
+		work_submit(NULL, false, work_par_helper, work_par_done, par);
+
+	work_par_run(par);
+	pthread_mutex_lock(&par->lock);
+	while (par->finished < par->n)
+		pthread_cond_wait(&par->cond, &par->lock);
+	pthread_mutex_unlock(&par->lock);
+	work_par_put(par);
+}
+
+void workqueue_get_stats(void *parent, char ***output, size_t *len)
+{
+	unsigned long pending = 0, running = 0;
+
+	pthread_mutex_lock(&work_lock);
+	NIH_LIST_FOREACH(&work_pending, iter)
+		pending++;
+	NIH_LIST_FOREACH(&work_running, iter)
+		running++;
+	pthread_mutex_unlock(&work_lock);
+
+	add_stat(parent, output, len, "work_threads", nr_workers);
+	add_stat(parent, output, len, "work_pending", pending);
+	add_stat(parent, output, len, "work_running", running);
+	add_stat(parent, output, len, "work_submitted", work_submitted);
+	add_stat(parent, output, len, "work_inline", work_inline);
+	add_stat(parent, output, len, "work_key_waits", work_waits);
+	add_stat(parent, output, len, "work_parallel_runs", work_par_runs);
+	add_stat(parent, output, len, "work_parallel_helped", work_par_helped);
+}
@@ -0,0 +1,34 @@
+/*
+ *
+ * Copyright © 2013 Serge Hallyn
+ * Author: Serge Hallyn <serge.hallyn@ubuntu.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * A pool of worker threads which run requests off the main loop.
+ * Requests naming the same cgroup, or one above or below it, run one
+ * at a time in the order in which they were submitted.
+ */
+
+typedef void (*WorkFunc)(void *data);
+
+bool workqueue_init(int nr_threads);
+bool workqueue_enabled(void);
+void work_submit(char * const *keys, bool main_only, WorkFunc run,
+		WorkFunc done, void *data);
+void work_parallel(int n, void (*func)(void *data, int i), void *data);
+void workqueue_get_stats(void *parent, char ***output, size_t *len);